@@ -0,0 +1,182 @@
+#ifndef ASYNC_READER_H_U8K3RB6D
+#define ASYNC_READER_H_U8K3RB6D
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// AsyncPageReader reads pages of a file without blocking the calling
+// thread, through an io_uring instance owned by that thread. It talks to
+// the kernel with the raw io_uring_setup/io_uring_enter syscalls and the
+// mmap'ed rings (no liburing). When io_uring is not available (old kernel,
+// seccomp), every read is done synchronously with pread at submission and
+// completes at the next reap, so the callers work the same either way.
+//
+// Not thread safe: one reader per event loop thread.
+
+struct ReadCompletion {
+    uint64_t user_data;
+    int32_t result;  // bytes read, or -errno
+};
+
+class AsyncPageReader {
+   public:
+    AsyncPageReader() = default;
+    AsyncPageReader(const AsyncPageReader &) = delete;
+    AsyncPageReader &operator=(const AsyncPageReader &) = delete;
+
+    ~AsyncPageReader() {
+        if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+        if (cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+        if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+        if (ring_fd >= 0) close(ring_fd);
+    }
+
+    // init sets the reader up for at most `depth` reads in flight. It
+    // returns true when io_uring is used, false for the pread fallback.
+    bool init(int file_fd, unsigned depth) {
+        fd = file_fd;
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        ring_fd = syscall(__NR_io_uring_setup, depth, &p);
+        if (ring_fd < 0) {
+            capacity = depth;
+            return false;
+        }
+
+        sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+        cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        }
+        sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        cq_ring = single_mmap ? sq_ring
+                              : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, ring_fd,
+                                     IORING_OFF_CQ_RING);
+        sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+        sqes = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+            close(ring_fd);
+            ring_fd = -1;
+            capacity = depth;
+            return false;
+        }
+
+        char *sq = (char *)sq_ring;
+        sq_head = (unsigned *)(sq + p.sq_off.head);
+        sq_tail = (unsigned *)(sq + p.sq_off.tail);
+        sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+        sq_array = (unsigned *)(sq + p.sq_off.array);
+        char *cq = (char *)cq_ring;
+        cq_head = (unsigned *)(cq + p.cq_off.head);
+        cq_tail = (unsigned *)(cq + p.cq_off.tail);
+        cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+        cqe_array = (io_uring_cqe *)(cq + p.cq_off.cqes);
+        sq_entries = p.sq_entries;
+        // the completion ring holds at least sq_entries completions
+        capacity = p.sq_entries;
+        return true;
+    }
+
+    bool uses_io_uring() const { return ring_fd >= 0; }
+
+    // room tells how many more reads can be submitted now.
+    unsigned room() const { return capacity - in_flight; }
+    unsigned pending() const { return in_flight; }
+
+    // submit queues a read of len bytes at offset into buf, from the file
+    // of init or from file_fd; the caller checks room() first. The reads
+    // are handed to the kernel by reap().
+    void submit(char *buf, size_t len, uint64_t offset, uint64_t user_data,
+                int file_fd = -1) {
+        if (file_fd < 0) file_fd = fd;
+        in_flight++;
+        if (ring_fd < 0) {
+            ssize_t n = pread(file_fd, buf, len, offset);
+            done.push_back({user_data, n < 0 ? -errno : (int32_t)n});
+            return;
+        }
+        unsigned tail = *sq_tail;
+        unsigned index = tail & sq_mask;
+        io_uring_sqe *sqe = (io_uring_sqe *)sqes + index;
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = file_fd;
+        sqe->addr = (uint64_t)buf;
+        sqe->len = len;
+        sqe->off = offset;
+        sqe->user_data = user_data;
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        to_submit++;
+    }
+
+    // reap submits the queued reads and collects the finished ones into
+    // out, waiting for at least one when wait is set and reads are in
+    // flight. It returns the number of completions.
+    size_t reap(std::vector<ReadCompletion> *out, bool wait) {
+        out->clear();
+        if (ring_fd < 0) {
+            out->swap(done);
+            in_flight -= out->size();
+            return out->size();
+        }
+
+        unsigned min_complete = wait && in_flight > 0 && !has_completion() ? 1 : 0;
+        if (to_submit > 0 || min_complete > 0) {
+            int ret;
+            do {
+                ret = syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                              min_complete,
+                              min_complete ? IORING_ENTER_GETEVENTS : 0,
+                              nullptr, 0);
+            } while (ret < 0 && errno == EINTR);
+            if (ret >= 0) to_submit -= std::min<unsigned>(to_submit, ret);
+        }
+
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const io_uring_cqe &cqe = cqe_array[head & cq_mask];
+            out->push_back({cqe.user_data, cqe.res});
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        in_flight -= out->size();
+        return out->size();
+    }
+
+   private:
+    bool has_completion() const {
+        return *cq_head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    int fd = -1;
+    int ring_fd = -1;
+    unsigned capacity = 0;
+    unsigned in_flight = 0;
+    unsigned to_submit = 0;
+
+    void *sq_ring = MAP_FAILED;
+    void *cq_ring = MAP_FAILED;
+    void *sqes = MAP_FAILED;
+    size_t sq_ring_size = 0, cq_ring_size = 0, sqes_size = 0;
+    unsigned *sq_head, *sq_tail, *sq_array, sq_mask, sq_entries;
+    unsigned *cq_head, *cq_tail, cq_mask;
+    io_uring_cqe *cqe_array;
+
+    // completions of the pread fallback
+    std::vector<ReadCompletion> done;
+};
+
+#endif
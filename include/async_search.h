@@ -0,0 +1,344 @@
+#ifndef ASYNC_SEARCH_H_E5M2QZ7W
+#define ASYNC_SEARCH_H_E5M2QZ7W
+
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <limits>
+#include <vector>
+
+#include "async_reader.h"
+#include "collection.h"
+#include "latency.h"
+#include "router.h"
+#include "search.h"
+#include "topk.h"
+
+// Query execution as C++20 coroutines: a query runs until it needs a page
+// that is not read yet, then suspends and lets the thread run other
+// queries. A QueryEventLoop per thread submits the page reads to an
+// AsyncPageReader and resumes each query when its page arrives, so a single
+// thread keeps many queries, and their reads, in flight without any thread
+// switch.
+
+// QueryCoroutine is the coroutine of one query. It starts suspended; the
+// event loop resumes it and destroys it when it is done.
+struct QueryCoroutine {
+    struct promise_type {
+        QueryCoroutine get_return_object() {
+            return {std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+// PageSlot is a page buffer of a query and the awaitable of its read:
+// `co_await slot` suspends until the page is read and returns whether the
+// read succeeded.
+struct PageSlot {
+    char *buffer = nullptr;
+    size_t length = 0;  // bytes read into the buffer
+    bool done = false;
+    bool ok = false;
+    std::coroutine_handle<> waiter;
+
+    bool await_ready() const noexcept { return done; }
+    void await_suspend(std::coroutine_handle<> h) noexcept { waiter = h; }
+    bool await_resume() noexcept {
+        waiter = nullptr;
+        return ok;
+    }
+};
+
+class QueryEventLoop {
+   public:
+    // queue_depth bounds the reads in flight of the thread.
+    QueryEventLoop(const Collection &collection, unsigned queue_depth)
+        : collection(collection), page_size(collection.meta.page_size) {
+        reader.init(collection.file_descriptor(), queue_depth);
+    }
+
+    ~QueryEventLoop() {
+        for (char *b : free_buffers) free(b);
+    }
+
+    bool uses_io_uring() const { return reader.uses_io_uring(); }
+
+    char *get_buffer() {
+        if (free_buffers.empty()) return (char *)aligned_alloc(4096, page_size);
+        char *b = free_buffers.back();
+        free_buffers.pop_back();
+        return b;
+    }
+    void put_buffer(char *b) { free_buffers.push_back(b); }
+
+    // read starts reading page pid into the slot buffer; it is queued when
+    // the reader is full.
+    void read(uint64_t pid, PageSlot *slot) {
+        read_at(collection.file_descriptor(), pid * page_size, page_size, slot);
+    }
+
+    // read_at starts reading length bytes at offset of the file fd (of the
+    // collection, or one of its side files) into the slot buffer.
+    void read_at(int fd, uint64_t offset, size_t length, PageSlot *slot) {
+        slot->done = false;
+        slot->length = length;
+        if (reader.room() > 0)
+            reader.submit(slot->buffer, length, offset, (uint64_t)slot, fd);
+        else
+            waiting.push_back({fd, offset, slot});
+    }
+
+    // run starts make(i) for every i in [0, n), with at most max_in_flight
+    // queries alive at once, and returns when they are all done.
+    template <class Make>
+    void run(size_t n, size_t max_in_flight, Make make) {
+        size_t next = 0, alive = 0;
+        std::vector<ReadCompletion> completions;
+        while (next < n || alive > 0) {
+            while (next < n && alive < max_in_flight) {
+                QueryCoroutine query = make(next++);
+                alive++;
+                if (resume(query.handle)) alive--;
+            }
+
+            reader.reap(&completions, true);
+            for (auto &c : completions) {
+                PageSlot *slot = (PageSlot *)c.user_data;
+                slot->done = true;
+                slot->ok = c.result == (int32_t)slot->length;
+                // the room freed by the completion goes to the queued reads;
+                // a query resumed before may have taken it already
+                while (!waiting.empty() && reader.room() > 0) {
+                    QueuedRead r = waiting.front();
+                    waiting.pop_front();
+                    reader.submit(r.slot->buffer, r.slot->length, r.offset,
+                                  (uint64_t)r.slot, r.fd);
+                }
+                if (slot->waiter && resume(slot->waiter)) alive--;
+            }
+        }
+    }
+
+   private:
+    // resume runs the coroutine until it suspends again; it returns true
+    // (and frees it) when the coroutine is done.
+    static bool resume(std::coroutine_handle<> h) {
+        h.resume();
+        if (!h.done()) return false;
+        h.destroy();
+        return true;
+    }
+
+    struct QueuedRead {
+        int fd;
+        uint64_t offset;
+        PageSlot *slot;
+    };
+
+    const Collection &collection;
+    size_t page_size;
+    AsyncPageReader reader;
+    std::deque<QueuedRead> waiting;
+    std::vector<char *> free_buffers;
+};
+
+// search_coroutine answers one query on the event loop of the thread. The
+// pages of the probed clusters are read `window` at a time, in probe order,
+// and scored as they arrive in that order, until the probing stops early
+// (see ProbeTermination). The full vectors of the candidates of a reduced
+// collection are then read all at once and re-ranked. The results are
+// written to out_ids and out_dists; *ok is cleared when a page can not be
+// read. The stats and latency (if not null) are those of the thread.
+inline QueryCoroutine search_coroutine(QueryEventLoop *loop,
+                                       const Collection *collection,
+                                       const std::vector<uint32_t> *ids,
+                                       const CentroidRouter *router,
+                                       SearchOptions opt, size_t window,
+                                       const float *query, uint32_t *out_ids,
+                                       float *out_dists, bool *ok,
+                                       QueryStats *stats,
+                                       StageHistograms *latency) {
+    using clock = std::chrono::steady_clock;
+    const CollectionMeta &meta = collection->meta;
+    clock::time_point start, t0, t1;
+    uint64_t io_ns = 0, distance_ns = 0, topk_ns = 0;
+    if (latency) start = clock::now();
+
+    size_t nprobe = std::min(opt.nprobe, meta.clusters.size());
+    std::vector<uint32_t> cluster_ids(nprobe);
+    std::vector<float> cluster_dists(nprobe);
+    router->route(1, query, nprobe, cluster_ids.data(), cluster_dists.data(),
+                  opt.route_mode);
+    if (latency) {
+        t0 = clock::now();
+        latency->record(Stage::routing, elapsed_ns(start, t0));
+    }
+
+    std::vector<uint64_t> pids;
+    std::vector<uint32_t> rank;
+    std::vector<uint32_t> cluster_of_page;
+    for (size_t r = 0; r < nprobe; r++) {
+        uint32_t cid = cluster_ids[r];
+        if (cid >= meta.clusters.size()) continue;
+        const ClusterInfo &c = meta.clusters[cid];
+        for (uint64_t p = 0; p < c.num_pages; p++) {
+            pids.push_back(c.first_page + p);
+            rank.push_back(r);
+            cluster_of_page.push_back(cid);
+        }
+    }
+
+    Reranker reranker(*collection, opt);
+    reranker.prepare(query);
+    const size_t candidates = reranker.candidates(opt.k);
+
+    // the query in the form of the pages (dimension order, norm,
+    // projection)
+    std::vector<float> prepared_query;
+    if (collection->query_needs_preparing()) {
+        prepared_query.resize(meta.dimension);
+        collection->prepare_query(query, prepared_query.data());
+        query = prepared_query.data();
+    }
+
+    DistanceKernel kernel =
+        select_kernel(meta.metric, meta.dimension, opt.use_simd, meta.tile,
+                      meta.encoding);
+    TopK topk(candidates, collection->has_replicas);
+    std::vector<float> bounds;
+    bool prune = opt.prune_pages && !collection->page_bounds.empty();
+    if (prune) bound_pages(*collection, kernel, query, pids, cluster_of_page, bounds);
+
+    window = std::min(std::max<size_t>(1, window), pids.size());
+    std::vector<PageSlot> slots(window);
+    // issue reads page j into its slot, unless its bound can not beat the
+    // top-k anymore; the slot is then done without a read
+    auto issue = [&](size_t j) {
+        PageSlot &slot = slots[j % window];
+        if (prune && bounds[j] >= topk.threshold()) {
+            slot.done = slot.ok = true;
+            return;
+        }
+        loop->read(pids[j], &slot);
+    };
+    for (size_t i = 0; i < window; i++) {
+        slots[i].buffer = loop->get_buffer();
+        issue(i);
+    }
+
+    ProbeTermination termination(opt, meta.metric, cluster_dists.data());
+    bool changed = false;
+    std::vector<float> distances(meta.vectors_per_page);
+    for (size_t i = 0; i < pids.size(); i++) {
+        PageSlot &slot = slots[i % window];
+        if (i == 0 || rank[i] != rank[i - 1]) {
+            if (i > 0 && termination.enabled() &&
+                termination.stop(rank[i], changed, topk)) {
+                // the reads in flight must land before the buffers are reused
+                // (awaited by reference, gcc copies an indexed awaitable)
+                for (size_t j = i; j < pids.size() && j < i + window; j++) {
+                    PageSlot &pending = slots[j % window];
+                    co_await pending;
+                }
+                break;
+            }
+            changed = false;
+            stats->clusters_probed++;
+        }
+        if (latency) t0 = clock::now();
+        bool read_ok = co_await slot;
+        if (latency) {
+            t1 = clock::now();
+            io_ns += elapsed_ns(t0, t1);
+        }
+        if (!read_ok) {
+            *ok = false;
+            // the reads in flight must land before the buffers are reused
+            // (awaited by reference, gcc copies an indexed awaitable)
+            for (size_t j = i + 1; j < pids.size() && j < i + window; j++) {
+                PageSlot &pending = slots[j % window];
+                co_await pending;
+            }
+            break;
+        }
+
+        if (prune && bounds[i] >= topk.threshold()) {
+            stats->pages_skipped++;
+            if (i + window < pids.size()) issue(i + window);
+            continue;
+        }
+
+        uint64_t pid = pids[i];
+        uint32_t n = collection->vectors_in_page(cluster_of_page[i], pid);
+        const uint32_t *page_ids = ids->data() + pid * meta.vectors_per_page;
+        stats->vectors_abandoned += compute_distances(
+            kernel, slot.buffer, n, meta.dimension, query,
+            distances.data(),
+            opt.early_abandon ? topk.threshold()
+                              : std::numeric_limits<float>::max());
+        if (latency) {
+            t0 = clock::now();
+            distance_ns += elapsed_ns(t1, t0);
+        }
+        for (uint32_t j = 0; j < n; j++)
+            changed |= topk.push(distances[j], page_ids[j]);
+        if (latency) topk_ns += elapsed_ns(t0, clock::now());
+        stats->pages_scanned++;
+        stats->vectors_scored += n;
+
+        if (i + window < pids.size()) issue(i + window);
+    }
+    for (auto &slot : slots) loop->put_buffer(slot.buffer);
+
+    if (latency) t0 = clock::now();
+    std::vector<uint32_t> candidate_ids;
+    if (!reranker.enabled()) {
+        topk.write_sorted(out_ids, out_dists);
+    } else {
+        candidate_ids.resize(candidates);
+        topk.write_sorted(candidate_ids.data(), nullptr);
+    }
+    if (latency) {
+        t1 = clock::now();
+        latency->record(Stage::io_wait, io_ns);
+        latency->record(Stage::distance, distance_ns);
+        latency->record(Stage::topk_merge, topk_ns + elapsed_ns(t0, t1));
+    }
+
+    if (reranker.enabled() && *ok) {
+        // the full vectors of the candidates, read together
+        const size_t n = topk.size(), dim = reranker.dimension();
+        std::vector<float> full(n * dim);
+        std::vector<PageSlot> reads(n);
+        for (size_t i = 0; i < n; i++) {
+            reads[i].buffer = (char *)(full.data() + i * dim);
+            loop->read_at(collection->full_file_descriptor(),
+                          (uint64_t)candidate_ids[i] * dim * sizeof(float),
+                          dim * sizeof(float), &reads[i]);
+        }
+        for (size_t i = 0; i < n; i++) {
+            PageSlot &read = reads[i];
+            if (!co_await read) *ok = false;
+        }
+        reranker.select(candidate_ids.data(), full.data(), n, opt.k, out_ids,
+                        out_dists);
+        stats->vectors_reranked += n;
+        if (latency) {
+            t0 = clock::now();
+            latency->record(Stage::rerank, elapsed_ns(t1, t0));
+            t1 = t0;
+        }
+    }
+    if (latency) latency->record(Stage::total, elapsed_ns(start, t1));
+}
+
+#endif
@@ -0,0 +1,327 @@
+#ifndef BUFFER_POOL_H_Z6R1KQ4M
+#define BUFFER_POOL_H_Z6R1KQ4M
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "collection.h"
+#include "numa.h"
+
+// BufferPool caches the pages of a collection in a fixed number of frames.
+//
+// The frames are split into partitions by page id, each with its own lock,
+// so concurrent workers rarely contend. Every partition runs the 2Q policy
+// (Johnson and Shasha, VLDB'94), which resists scans:
+// - a page seen for the first time enters A1in, a small FIFO;
+// - a page evicted from A1in leaves its id in A1out, a queue of ghosts;
+// - a page accessed again while in A1out is promoted to Am, an LRU.
+// A long scan over cold pages thus only cycles through A1in and can not
+// flush the hot pages in Am.
+//
+// get() returns a PageHandle that pins the page: a pinned frame is never
+// evicted, so the page stays valid while the handle is alive. Concurrent
+// misses on the same page are read once, the other callers wait for it.
+//
+// With a NUMA node, the frames are allocated on that node (see numa.h).
+
+struct BufferPoolStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t ghost_hits = 0;  // misses on a page remembered in A1out
+    uint64_t pin_waits = 0;   // requests that waited for a pinned frame
+
+    double hit_rate() const {
+        return hits + misses ? (double)hits / (hits + misses) : 0.0;
+    }
+
+    void add(const BufferPoolStats &o) {
+        hits += o.hits;
+        misses += o.misses;
+        evictions += o.evictions;
+        ghost_hits += o.ghost_hits;
+        pin_waits += o.pin_waits;
+    }
+};
+
+class BufferPool {
+   private:
+    struct Partition;
+
+   public:
+    class PageHandle {
+       public:
+        PageHandle() = default;
+        PageHandle(Partition *partition, uint32_t frame, const char *data)
+            : partition(partition), frame(frame), page(data) {}
+        PageHandle(PageHandle &&o) noexcept { *this = std::move(o); }
+        PageHandle &operator=(PageHandle &&o) noexcept {
+            release();
+            partition = o.partition;
+            frame = o.frame;
+            page = o.page;
+            o.partition = nullptr;
+            o.page = nullptr;
+            return *this;
+        }
+        PageHandle(const PageHandle &) = delete;
+        PageHandle &operator=(const PageHandle &) = delete;
+        ~PageHandle() { release(); }
+
+        const char *data() const { return page; }
+        explicit operator bool() const { return page != nullptr; }
+
+        void release() {
+            if (partition) partition->unpin(frame);
+            partition = nullptr;
+            page = nullptr;
+        }
+
+       private:
+        Partition *partition = nullptr;
+        uint32_t frame = 0;
+        const char *page = nullptr;
+    };
+
+    // capacity_bytes is rounded down to whole pages, at least one frame per
+    // partition. num_partitions defaults to 16, fewer for small pools. The
+    // frames are bound to the NUMA node, if not -1.
+    BufferPool(const Collection &collection, size_t capacity_bytes,
+               size_t num_partitions = 0, int node = -1)
+        : collection(collection), page_size(collection.meta.page_size) {
+        size_t num_frames = std::max<size_t>(1, capacity_bytes / page_size);
+        if (num_partitions == 0)
+            num_partitions = std::max<size_t>(1, std::min<size_t>(16, num_frames / 64));
+        num_frames = std::max(num_frames, num_partitions);
+        for (size_t i = 0; i < num_partitions; i++) {
+            size_t frames = num_frames / num_partitions +
+                            (i < num_frames % num_partitions ? 1 : 0);
+            partitions.emplace_back(new Partition(frames, page_size, node));
+        }
+        capacity_frames = num_frames;
+    }
+
+    // get pins the page, reading it from the collection on a miss. An empty
+    // handle is returned when the read fails.
+    PageHandle get(uint64_t pid) {
+        Partition &p = *partitions[pid % partitions.size()];
+        return p.get(pid, collection);
+    }
+
+    BufferPoolStats stats() const {
+        BufferPoolStats total;
+        for (auto &p : partitions) {
+            std::lock_guard<std::mutex> lock(p->mu);
+            total.add(p->stats);
+        }
+        return total;
+    }
+
+    size_t capacity() const { return capacity_frames; }
+    size_t num_partitions() const { return partitions.size(); }
+
+    // partition_capacity is the frame count of the smallest partition: the
+    // pages pinned at once may all map to it.
+    size_t partition_capacity() const {
+        size_t frames = SIZE_MAX;
+        for (auto &p : partitions) frames = std::min(frames, p->frames.size());
+        return frames;
+    }
+
+   private:
+    enum class Queue : uint8_t { none, a1in, am };
+
+    struct Frame {
+        uint64_t pid = UINT64_MAX;
+        uint32_t pins = 0;
+        bool loading = false;
+        Queue queue = Queue::none;
+        std::list<uint32_t>::iterator pos;
+    };
+
+    struct Partition {
+        std::mutex mu;
+        std::condition_variable cv;
+        std::vector<Frame> frames;
+        char *memory;
+        size_t page_size;
+
+        std::unordered_map<uint64_t, uint32_t> page_table;
+        std::vector<uint32_t> free_frames;
+        std::list<uint32_t> a1in, am;  // front is the most recent
+        std::list<uint64_t> a1out;
+        std::unordered_map<uint64_t, std::list<uint64_t>::iterator> ghosts;
+        size_t max_a1in, max_a1out;  // 2Q tuning: Kin = 25%, Kout = 50%
+
+        BufferPoolStats stats;
+
+        Partition(size_t num_frames, size_t page_size, int node)
+            : frames(num_frames), page_size(page_size) {
+            memory = numa_alloc(num_frames * page_size, node);
+            for (size_t i = 0; i < num_frames; i++)
+                free_frames.push_back(num_frames - 1 - i);
+            max_a1in = std::max<size_t>(1, num_frames / 4);
+            max_a1out = std::max<size_t>(1, num_frames / 2);
+        }
+        ~Partition() { numa_free(memory, frames.size() * page_size); }
+
+        char *frame_data(uint32_t f) { return memory + (size_t)f * page_size; }
+
+        PageHandle get(uint64_t pid, const Collection &collection) {
+            std::unique_lock<std::mutex> lock(mu);
+            auto it = page_table.find(pid);
+            if (it != page_table.end()) {
+                uint32_t f = it->second;
+                Frame &frame = frames[f];
+                frame.pins++;
+                stats.hits++;
+                if (frame.queue == Queue::am)
+                    am.splice(am.begin(), am, frame.pos);
+                // a hit in A1in does not promote, the page may be part of a
+                // scan; it goes to Am only if it comes back after leaving
+                cv.wait(lock, [&]() { return !frames[f].loading; });
+                if (frames[f].pid != pid) {
+                    // the read failed, the frame was given back
+                    unpin_locked(f);
+                    return PageHandle();
+                }
+                return PageHandle(this, f, frame_data(f));
+            }
+
+            stats.misses++;
+            bool hot = false;
+            auto ghost = ghosts.find(pid);
+            if (ghost != ghosts.end()) {
+                hot = true;
+                stats.ghost_hits++;
+                a1out.erase(ghost->second);
+                ghosts.erase(ghost);
+            }
+
+            uint32_t f;
+            while (!reclaim(&f)) {
+                stats.pin_waits++;
+                cv.wait(lock);
+                // another thread may have loaded the page meanwhile
+                auto again = page_table.find(pid);
+                if (again != page_table.end()) {
+                    lock.unlock();
+                    stats_undo_miss();
+                    return get(pid, collection);
+                }
+            }
+
+            Frame &frame = frames[f];
+            frame.pid = pid;
+            frame.pins = 1;
+            frame.loading = true;
+            if (hot) {
+                am.push_front(f);
+                frame.queue = Queue::am;
+                frame.pos = am.begin();
+            } else {
+                a1in.push_front(f);
+                frame.queue = Queue::a1in;
+                frame.pos = a1in.begin();
+            }
+            page_table[pid] = f;
+
+            // read without holding the lock, the frame is pinned and marked
+            // as loading so nobody else touches it
+            lock.unlock();
+            bool ok = collection.read_page(pid, frame_data(f));
+            lock.lock();
+            frame.loading = false;
+            if (!ok) {
+                page_table.erase(pid);
+                remove_from_queue(f);
+                frame.pid = UINT64_MAX;
+                frame.pins--;
+                if (frame.pins == 0) free_frames.push_back(f);
+                cv.notify_all();
+                return PageHandle();
+            }
+            cv.notify_all();
+            return PageHandle(this, f, frame_data(f));
+        }
+
+        void stats_undo_miss() {
+            std::lock_guard<std::mutex> lock(mu);
+            stats.misses--;
+        }
+
+        void unpin(uint32_t f) {
+            std::lock_guard<std::mutex> lock(mu);
+            unpin_locked(f);
+        }
+
+        void unpin_locked(uint32_t f) {
+            Frame &frame = frames[f];
+            frame.pins--;
+            if (frame.pins == 0) {
+                // a frame whose read failed is released by its last user
+                if (frame.pid == UINT64_MAX && frame.queue == Queue::none)
+                    free_frames.push_back(f);
+                cv.notify_all();
+            }
+        }
+
+        void remove_from_queue(uint32_t f) {
+            Frame &frame = frames[f];
+            if (frame.queue == Queue::a1in) a1in.erase(frame.pos);
+            if (frame.queue == Queue::am) am.erase(frame.pos);
+            frame.queue = Queue::none;
+        }
+
+        // evict_from takes the least recent unpinned frame of the queue.
+        bool evict_from(std::list<uint32_t> &queue, uint32_t *out) {
+            for (auto it = queue.rbegin(); it != queue.rend(); ++it) {
+                uint32_t f = *it;
+                if (frames[f].pins > 0) continue;
+                Frame &frame = frames[f];
+                if (frame.queue == Queue::a1in) {
+                    // remember the evicted page, a second access promotes it
+                    a1out.push_front(frame.pid);
+                    ghosts[frame.pid] = a1out.begin();
+                    if (a1out.size() > max_a1out) {
+                        ghosts.erase(a1out.back());
+                        a1out.pop_back();
+                    }
+                }
+                remove_from_queue(f);
+                page_table.erase(frame.pid);
+                frame.pid = UINT64_MAX;
+                stats.evictions++;
+                *out = f;
+                return true;
+            }
+            return false;
+        }
+
+        // reclaim finds a frame for a new page: a free one, else the 2Q
+        // victim, A1in when it is over its share, else the LRU end of Am.
+        bool reclaim(uint32_t *out) {
+            if (!free_frames.empty()) {
+                *out = free_frames.back();
+                free_frames.pop_back();
+                return true;
+            }
+            if (a1in.size() > max_a1in && evict_from(a1in, out)) return true;
+            if (evict_from(am, out)) return true;
+            return evict_from(a1in, out);
+        }
+    };
+
+    const Collection &collection;
+    size_t page_size;
+    size_t capacity_frames;
+    std::vector<std::unique_ptr<Partition>> partitions;
+};
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef CENTROID_INDEX_H_P4V9LC2E
+#define CENTROID_INDEX_H_P4V9LC2E
+
+#include <omp.h>
+
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <faiss/Index.h>
+#include <faiss/IndexNSG.h>
+#include <faiss/index_io.h>
+
+// The centroid graph (faiss IndexNSGFlat over the cluster centroids) is built
+// once by tools_build_centroid_index and stored next to the centroid file,
+// e.g. centroids_10k_sift10m.fvecs -> centroids_10k_sift10m.nsg. The search
+// process only loads it, so restarts do not pay for the graph construction.
+
+inline std::string centroid_index_filename(const std::string &centroids_filename) {
+    size_t dot = centroids_filename.rfind('.');
+    return centroids_filename.substr(0, dot) + ".nsg";
+}
+
+// load_centroid_index reads the serialized centroid graph. With faiss >= 1.11
+// the flat storage of the centroids is mmap-ed instead of copied, the graph
+// itself is always read into memory.
+inline faiss::IndexNSGFlat *load_centroid_index(const std::string &filename) {
+    int io_flags = 0;
+#if defined(FAISS_VERSION_MAJOR) && \
+    (FAISS_VERSION_MAJOR > 1 || FAISS_VERSION_MINOR >= 11)
+    io_flags |= faiss::IO_FLAG_MMAP_IFC;
+#endif
+    faiss::Index *index = nullptr;
+    try {
+        index = faiss::read_index(filename.c_str(), io_flags);
+    } catch (std::exception &e) {
+        std::cerr << "failed to load centroid index " << filename << ": "
+                  << e.what() << std::endl;
+        return nullptr;
+    }
+
+    auto *nsg = dynamic_cast<faiss::IndexNSGFlat *>(index);
+    if (!nsg) {
+        std::cerr << "not a centroid NSG index: " << filename << std::endl;
+        delete index;
+        return nullptr;
+    }
+    return nsg;
+}
+
+inline bool save_centroid_index(const faiss::IndexNSGFlat &index,
+                                const std::string &filename) {
+    try {
+        faiss::write_index(&index, filename.c_str());
+    } catch (std::exception &e) {
+        std::cerr << "failed to save centroid index " << filename << ": "
+                  << e.what() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// search_centroids finds the nprobe closest centroids of each of the nq
+// queries. The batch is split evenly over num_thread threads, each searching
+// its part with a single-threaded faiss call, so the caller decides the
+// parallelism instead of OpenMP. cluster_ids and distances hold nq * nprobe
+// entries, ordered from the closest centroid.
+inline void search_centroids(const faiss::IndexNSGFlat &index, size_t nq,
+                             const float *queries, size_t nprobe,
+                             uint32_t num_thread, faiss::idx_t *cluster_ids,
+                             float *distances) {
+    if (num_thread < 1) num_thread = 1;
+    size_t queries_per_thread = (nq + num_thread - 1) / num_thread;
+    const size_t d = index.d;
+
+    auto thread_run = [&](size_t q_start, size_t q_end) {
+        omp_set_num_threads(1);
+        if (q_start >= q_end) return;
+        index.search(q_end - q_start, queries + q_start * d, nprobe,
+                     distances + q_start * nprobe,
+                     cluster_ids + q_start * nprobe);
+    };
+
+    std::vector<std::thread> workers;
+    for (uint32_t t = 0; t < num_thread; t++) {
+        size_t q_start = std::min(nq, t * queries_per_thread);
+        size_t q_end = std::min(nq, q_start + queries_per_thread);
+        workers.emplace_back(thread_run, q_start, q_end);
+    }
+    for (auto &t : workers) t.join();
+}
+
+#endif
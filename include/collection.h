@@ -0,0 +1,805 @@
+#ifndef COLLECTION_H_W5M2JX7D
+#define COLLECTION_H_W5M2JX7D
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "kernels.h"
+#include "pca.h"
+#include "vecs.h"
+
+// A paged collection stores the vectors as float in fixed-size pages. Each
+// page holds vectors of a single cluster back to back, padded with zeros up
+// to the page size, and the pages of a cluster are contiguous in the file.
+// Next to the collection file there are small side files:
+// - <collection>.meta : the dimension, page size and the cluster directory
+//                       (first page, number of pages and vectors per cluster)
+// - <collection>.ids  : the vector id (uint32) of every slot in every page,
+//                       empty slots hold COLLECTION_EMPTY_SLOT.
+// - <collection>.perm : optional, the dimension permutation of the pages:
+//                       page dimension j holds the original dimension
+//                       perm[j] (uint32 each). The highest-variance
+//                       dimensions come first, so the early-abandoning
+//                       kernels reach the top-k bound sooner.
+// - <collection>.bounds : a summary of every page, the centroid of its
+//                       vectors (dimension floats, in the form of the
+//                       pages) and the radius of the ball around it that
+//                       holds them (a float). The search skips the pages
+//                       whose ball can not reach the current top-k.
+// A collection written without cluster assignment has a single cluster with
+// all the vectors in the original order. An assignment with several ids per
+// vector (see tools_assign) replicates the vector in each of its clusters;
+// the copies keep the vector id, and the search drops the repeated ids. The
+// meta also records the metric of the collection (see kernels.h); the
+// vectors of a cosine collection are normalized in the pages.
+//
+// A transposed collection (tile 8 or 16) stores the vectors of a page in
+// tiles of that many vectors, interleaved by dimension: dimension j of the
+// l-th vector of a tile is float j * tile + l of the tile, and a tile takes
+// tile * dimension floats. The tile kernels of kernels.h score a whole tile
+// at once. The vectors per page are then a multiple of the tile, and the
+// empty slots of the last tile are zeros like the rest of the padding.
+//
+// An encoded collection (f16 or bf16, see kernels.h) stores the elements of
+// the pages in 16 bits, in the same row-major or tile layout; a page holds
+// twice the vectors. The page bounds and the rest of the side files stay
+// f32, the bounds computed from the encoded values.
+//
+// A reduced collection (written with a PCA projection, see pca.h) stores the
+// projected vectors in its pages, the dimension of the meta is the reduced
+// one; two more side files keep what the projection drops:
+// - <collection>.pca  : the projection, the queries are projected like the
+//                       pages by prepare_query.
+// - <collection>.full : the full vectors in f32, by vector id (normalized
+//                       for cosine), to re-rank the candidates of the pages.
+
+const uint32_t COLLECTION_MAGIC = 0x434e4453;  // "SDNC"
+// version 2 adds the metric (version 1 collections are l2), version 3 the
+// tile (older collections are row-major), version 4 the encoding (older
+// collections are f32)
+const uint32_t COLLECTION_VERSION = 4;
+const uint32_t COLLECTION_EMPTY_SLOT = UINT32_MAX;
+
+struct ClusterInfo {
+    uint64_t first_page;
+    uint64_t num_pages;
+    uint64_t num_vectors;
+};
+
+struct CollectionMeta {
+    uint32_t dimension = 0;
+    uint32_t page_size = 0;
+    uint32_t vectors_per_page = 0;
+    Metric metric = Metric::l2;
+    uint32_t tile = 0;  // vectors per tile of a transposed page, 0: row-major
+    Encoding encoding = Encoding::f32;
+    uint64_t num_vectors = 0;
+    uint64_t num_pages = 0;
+    std::vector<ClusterInfo> clusters;
+
+    // num_copies is the number of vectors stored in the clusters, more than
+    // num_vectors when vectors are replicated in several clusters.
+    uint64_t num_copies() const {
+        uint64_t copies = 0;
+        for (auto &c : clusters) copies += c.num_vectors;
+        return copies;
+    }
+    bool replicated() const { return num_copies() > num_vectors; }
+};
+
+inline std::string collection_meta_filename(const std::string &collection) {
+    return collection + ".meta";
+}
+
+inline std::string collection_ids_filename(const std::string &collection) {
+    return collection + ".ids";
+}
+
+inline std::string collection_perm_filename(const std::string &collection) {
+    return collection + ".perm";
+}
+
+inline std::string collection_bounds_filename(const std::string &collection) {
+    return collection + ".bounds";
+}
+
+inline std::string collection_pca_filename(const std::string &collection) {
+    return collection + ".pca";
+}
+
+inline std::string collection_full_filename(const std::string &collection) {
+    return collection + ".full";
+}
+
+// remove_collection deletes the collection file and every side file it may
+// have (the replicas are in the .ids, there is no file per copy).
+inline void remove_collection(const std::string &collection) {
+    for (const std::string &filename :
+         {collection, collection_meta_filename(collection),
+          collection_ids_filename(collection), collection_perm_filename(collection),
+          collection_bounds_filename(collection), collection_pca_filename(collection),
+          collection_full_filename(collection)})
+        unlink(filename.c_str());
+}
+
+// page_bound summarizes the n vectors of a page (the layout of the tile) in
+// out: their centroid, then the largest distance from it to one of them.
+inline void page_bound(const float *page, size_t n, size_t dim, size_t tile,
+                       float *out) {
+    auto at = [&](size_t s, size_t j) {
+        return tile ? page[s / tile * tile * dim + s % tile + j * tile]
+                    : page[s * dim + j];
+    };
+    std::vector<double> sum(dim, 0.0);
+    for (size_t s = 0; s < n; s++)
+        for (size_t j = 0; j < dim; j++) sum[j] += at(s, j);
+    for (size_t j = 0; j < dim; j++) out[j] = sum[j] / std::max<size_t>(1, n);
+    double radius = 0;
+    for (size_t s = 0; s < n; s++) {
+        double d = 0;
+        for (size_t j = 0; j < dim; j++) {
+            double diff = at(s, j) - out[j];
+            d += diff * diff;
+        }
+        radius = std::max(radius, d);
+    }
+    out[dim] = std::sqrt(radius);
+}
+
+inline bool write_collection_meta(const std::string &collection,
+                                  const CollectionMeta &meta) {
+    std::string filename = collection_meta_filename(collection);
+    FILE *f = fopen(filename.c_str(), "w");
+    if (!f) {
+        std::cerr << "failed to open collection metadata: " << filename
+                  << std::endl;
+        return false;
+    }
+    uint64_t num_clusters = meta.clusters.size();
+    fwrite(&COLLECTION_MAGIC, sizeof(uint32_t), 1, f);
+    fwrite(&COLLECTION_VERSION, sizeof(uint32_t), 1, f);
+    fwrite(&meta.dimension, sizeof(uint32_t), 1, f);
+    fwrite(&meta.page_size, sizeof(uint32_t), 1, f);
+    fwrite(&meta.vectors_per_page, sizeof(uint32_t), 1, f);
+    fwrite(&meta.metric, sizeof(uint32_t), 1, f);
+    fwrite(&meta.tile, sizeof(uint32_t), 1, f);
+    fwrite(&meta.encoding, sizeof(uint32_t), 1, f);
+    fwrite(&meta.num_vectors, sizeof(uint64_t), 1, f);
+    fwrite(&meta.num_pages, sizeof(uint64_t), 1, f);
+    fwrite(&num_clusters, sizeof(uint64_t), 1, f);
+    fwrite(meta.clusters.data(), sizeof(ClusterInfo), num_clusters, f);
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok;
+}
+
+inline bool read_collection_meta(const std::string &collection,
+                                 CollectionMeta *meta) {
+    std::string filename = collection_meta_filename(collection);
+    FILE *f = fopen(filename.c_str(), "r");
+    if (!f) {
+        std::cerr << "failed to open collection metadata: " << filename
+                  << std::endl;
+        return false;
+    }
+    uint32_t magic = 0, version = 0;
+    uint64_t num_clusters = 0;
+    fread(&magic, sizeof(uint32_t), 1, f);
+    fread(&version, sizeof(uint32_t), 1, f);
+    if (magic != COLLECTION_MAGIC || version < 1 || version > COLLECTION_VERSION) {
+        std::cerr << "unsupported collection metadata (magic=" << magic
+                  << ", version=" << version << "), rewrite the pages: "
+                  << filename << std::endl;
+        fclose(f);
+        return false;
+    }
+    fread(&meta->dimension, sizeof(uint32_t), 1, f);
+    fread(&meta->page_size, sizeof(uint32_t), 1, f);
+    fread(&meta->vectors_per_page, sizeof(uint32_t), 1, f);
+    meta->metric = Metric::l2;
+    if (version >= 2) fread(&meta->metric, sizeof(uint32_t), 1, f);
+    meta->tile = 0;
+    if (version >= 3) fread(&meta->tile, sizeof(uint32_t), 1, f);
+    meta->encoding = Encoding::f32;
+    if (version >= 4) fread(&meta->encoding, sizeof(uint32_t), 1, f);
+    fread(&meta->num_vectors, sizeof(uint64_t), 1, f);
+    fread(&meta->num_pages, sizeof(uint64_t), 1, f);
+    fread(&num_clusters, sizeof(uint64_t), 1, f);
+    meta->clusters.resize(num_clusters);
+    size_t n = fread(meta->clusters.data(), sizeof(ClusterInfo), num_clusters, f);
+    fclose(f);
+    if (n != num_clusters) {
+        std::cerr << "truncated collection metadata: " << filename << std::endl;
+        return false;
+    }
+    if (!valid_tile(meta->tile)) {
+        std::cerr << "unsupported tile of " << meta->tile
+                  << " vectors: " << filename << std::endl;
+        return false;
+    }
+    if (!valid_encoding(meta->encoding)) {
+        std::cerr << "unsupported page encoding " << (uint32_t)meta->encoding
+                  << ": " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// =============================================================================
+
+struct CollectionWriteOptions {
+    std::string base_filename;      // bvecs, fvecs, ivecs or npy
+    std::string clusters_filename;  // optional ivecs/npy, the cluster ids of
+                                    // every vector in the same order as the
+                                    // base; the first id, then the clusters
+                                    // it is replicated in, up to a negative id
+    std::string collection_filename;
+    size_t page_size = 4096;
+    size_t chunk_size = 64 << 20;   // bytes read from the base per chunk
+    bool permute_dims = false;      // highest-variance dimensions first
+    Metric metric = Metric::l2;     // cosine normalizes the vectors
+    size_t tile = 0;                // transposed pages, 8 or 16 vectors per
+                                    // tile; 0 keeps the vectors row-major
+    Encoding encoding = Encoding::f32;  // f16 or bf16 halves the vectors
+    std::string pca_filename;       // optional trained projection (see
+                                    // pca.h): the pages hold the projected
+                                    // vectors, <collection>.full the full ones
+};
+
+// collection_vectors_per_page returns the vectors that fit in a page, whole
+// tiles of them in a transposed page.
+inline size_t collection_vectors_per_page(size_t page_size, size_t dim,
+                                          size_t tile = 0,
+                                          Encoding encoding = Encoding::f32) {
+    const size_t slot_group = std::max<size_t>(1, tile);
+    return page_size / (slot_group * dim * encoding_size(encoding)) * slot_group;
+}
+
+// record_clusters writes the clusters of a record of a cluster file to out
+// (dimension ids at most) and returns how many there are, 0 when the first
+// one is negative. A negative id ends the list, a repeated id is skipped.
+inline size_t record_clusters(const VecsInfo &info, const char *record,
+                              uint32_t *out) {
+    const size_t es = elem_size(info.elem_type);
+    size_t n = 0;
+    for (size_t j = 0; j < info.dimension; j++) {
+        double id = load_elem(info.elem_type, record + info.prefix_size + j * es);
+        if (id < 0) break;
+        if (std::find(out, out + n, (uint32_t)id) == out + n) out[n++] = id;
+    }
+    return n;
+}
+
+// write_collection streams the base vectors into a paged collection. The
+// memory used is two chunks of the base file plus one staging page for each
+// cluster: a vector is appended to the staging page of its cluster, and the
+// page is written to its final place as soon as it is full.
+inline bool write_collection(const CollectionWriteOptions &opt,
+                             CollectionMeta *out_meta = nullptr) {
+    VecsReader base;
+    if (!base.open(opt.base_filename.c_str())) return false;
+    const size_t in_dim = base.info.dimension;
+    const size_t num_vectors = base.info.num_vectors;
+
+    // a reduced collection pages the projected vectors
+    PcaProjection pca;
+    if (!opt.pca_filename.empty()) {
+        if (!pca.load(opt.pca_filename)) return false;
+        if (pca.input_dim != in_dim) {
+            std::cerr << "the projection is for dimension " << pca.input_dim
+                      << ", the base vectors have " << in_dim << std::endl;
+            return false;
+        }
+        if (opt.permute_dims) {
+            std::cerr << "the projected dimensions are already sorted by "
+                         "variance, do not permute them" << std::endl;
+            return false;
+        }
+    }
+    const size_t dim = pca.empty() ? in_dim : pca.output_dim;
+
+    CollectionMeta meta;
+    meta.dimension = dim;
+    meta.page_size = opt.page_size;
+    if (!valid_tile(opt.tile)) {
+        std::cerr << "the tiles hold 8 or 16 vectors, not " << opt.tile
+                  << std::endl;
+        return false;
+    }
+    meta.vectors_per_page =
+        collection_vectors_per_page(opt.page_size, dim, opt.tile, opt.encoding);
+    meta.metric = opt.metric;
+    meta.tile = opt.tile;
+    meta.encoding = opt.encoding;
+    meta.num_vectors = num_vectors;
+    const size_t vpp = meta.vectors_per_page;
+    if (vpp == 0) {
+        std::cerr << "page size " << opt.page_size
+                  << " is too small for dimension " << dim;
+        if (opt.tile) std::cerr << " and tiles of " << opt.tile << " vectors";
+        std::cerr << std::endl;
+        return false;
+    }
+
+    // the vectors of a chunk, and their cluster ids
+    size_t per_chunk = std::min<size_t>(
+        std::max<size_t>(1, num_vectors),
+        std::max<size_t>(1, opt.chunk_size / base.info.record_size));
+    size_t num_chunks = (num_vectors + per_chunk - 1) / per_chunk;
+    auto chunk_vecs = [&](size_t i) {
+        return std::min(per_chunk, num_vectors - i * per_chunk);
+    };
+
+    const VecsInfo &in = base.info;
+    VecsInfo as_float = vecs_info(VecsFormat::npy, ElemType::f32, in_dim, 1);
+
+    // the dimension permutation takes a pass over the base to get the
+    // variance of every dimension
+    std::vector<uint32_t> perm;
+    std::string perm_filename = collection_perm_filename(opt.collection_filename);
+    if (opt.permute_dims) {
+        std::vector<double> sum(dim, 0.0), sum_sq(dim, 0.0);
+        std::vector<float> v(dim);
+        bool ok = pipeline_chunks(
+            num_chunks, per_chunk * in.record_size,
+            [&](size_t i, char *buf) {
+                return base.read_raw(i * per_chunk, chunk_vecs(i), buf);
+            },
+            [&](size_t i, char *buf) {
+                for (size_t r = 0; r < chunk_vecs(i); r++) {
+                    vecs_convert_records(in, buf + r * in.record_size, 1,
+                                         as_float, (char *)v.data());
+                    for (size_t j = 0; j < dim; j++) {
+                        sum[j] += v[j];
+                        sum_sq[j] += (double)v[j] * v[j];
+                    }
+                }
+                return true;
+            });
+        if (!ok) return false;
+        std::vector<double> variance(dim);
+        for (size_t j = 0; j < dim; j++) {
+            double mean = sum[j] / std::max<size_t>(1, num_vectors);
+            variance[j] = sum_sq[j] / std::max<size_t>(1, num_vectors) - mean * mean;
+        }
+        perm.resize(dim);
+        for (size_t j = 0; j < dim; j++) perm[j] = j;
+        std::stable_sort(perm.begin(), perm.end(), [&](uint32_t a, uint32_t b) {
+            return variance[a] > variance[b];
+        });
+    }
+
+    // first pass over the cluster ids to size every cluster
+    VecsReader clusters;
+    bool has_clusters = !opt.clusters_filename.empty();
+    std::vector<uint64_t> cluster_sizes(1, num_vectors);
+    std::vector<uint32_t> record_cids(1, 0);
+    if (has_clusters) {
+        if (!clusters.open(opt.clusters_filename.c_str())) return false;
+        if (clusters.info.num_vectors != num_vectors ||
+            clusters.info.dimension < 1 ||
+            clusters.info.elem_type == ElemType::u8 ||
+            clusters.info.elem_type == ElemType::f32) {
+            std::cerr << "cluster file must have one integer id per base vector: "
+                      << opt.clusters_filename << std::endl;
+            return false;
+        }
+        cluster_sizes.clear();
+        record_cids.resize(clusters.info.dimension);
+        bool ok = pipeline_chunks(
+            num_chunks, per_chunk * clusters.info.record_size,
+            [&](size_t i, char *buf) {
+                return clusters.read_raw(i * per_chunk, chunk_vecs(i), buf);
+            },
+            [&](size_t i, char *buf) {
+                for (size_t v = 0; v < chunk_vecs(i); v++) {
+                    size_t n = record_clusters(
+                        clusters.info, buf + v * clusters.info.record_size,
+                        record_cids.data());
+                    if (n == 0) {
+                        std::cerr << "negative cluster id for vector "
+                                  << i * per_chunk + v << std::endl;
+                        return false;
+                    }
+                    for (size_t r = 0; r < n; r++) {
+                        uint32_t cid = record_cids[r];
+                        if (cid >= cluster_sizes.size())
+                            cluster_sizes.resize(cid + 1, 0);
+                        cluster_sizes[cid]++;
+                    }
+                }
+                return true;
+            });
+        if (!ok) return false;
+    }
+
+    meta.clusters.resize(cluster_sizes.size());
+    for (size_t c = 0; c < cluster_sizes.size(); c++) {
+        meta.clusters[c].first_page = meta.num_pages;
+        meta.clusters[c].num_vectors = cluster_sizes[c];
+        meta.clusters[c].num_pages = (cluster_sizes[c] + vpp - 1) / vpp;
+        meta.num_pages += meta.clusters[c].num_pages;
+    }
+
+    int pages_fd = open(opt.collection_filename.c_str(),
+                        O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    std::string ids_filename = collection_ids_filename(opt.collection_filename);
+    int ids_fd = open(ids_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    std::string bounds_filename = collection_bounds_filename(opt.collection_filename);
+    int bounds_fd = open(bounds_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    std::string full_filename = collection_full_filename(opt.collection_filename);
+    int full_fd = -1;
+    if (!pca.empty())
+        full_fd = open(full_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (pages_fd < 0 || ids_fd < 0 || bounds_fd < 0 ||
+        (!pca.empty() && full_fd < 0)) {
+        std::cerr << "failed to open collection file: "
+                  << opt.collection_filename << std::endl;
+        if (pages_fd >= 0) close(pages_fd);
+        if (ids_fd >= 0) close(ids_fd);
+        if (bounds_fd >= 0) close(bounds_fd);
+        if (full_fd >= 0) close(full_fd);
+        return false;
+    }
+
+    // one staging page (and its ids) per cluster, in f32; the pages of an
+    // encoded collection are encoded when flushed
+    const size_t num_clusters = meta.clusters.size();
+    const bool encoded = opt.encoding != Encoding::f32;
+    const size_t floats_per_page = encoded ? vpp * dim : opt.page_size / sizeof(float);
+    std::vector<float> staging(num_clusters * floats_per_page, 0.0f);
+    std::vector<char> encoded_page(encoded ? opt.page_size : 0, 0);
+    std::vector<uint32_t> staging_ids(num_clusters * vpp, COLLECTION_EMPTY_SLOT);
+    std::vector<uint32_t> staged(num_clusters, 0);
+    std::vector<uint64_t> pages_written(num_clusters, 0);
+    std::vector<float> bound(dim + 1);
+
+    auto flush_page = [&](size_t c) {
+        float *page = staging.data() + c * floats_per_page;
+        uint32_t *ids = staging_ids.data() + c * vpp;
+        uint64_t pid = meta.clusters[c].first_page + pages_written[c];
+        page_bound(page, staged[c], dim, opt.tile, bound.data());
+        const void *out = page;
+        if (encoded) {
+            encode_vector(page, vpp * dim, opt.encoding, encoded_page.data());
+            out = encoded_page.data();
+        }
+        bool ok = pwrite_full(pages_fd, out, opt.page_size, pid * opt.page_size) &&
+                  pwrite_full(ids_fd, ids, vpp * sizeof(uint32_t),
+                              pid * vpp * sizeof(uint32_t)) &&
+                  pwrite_full(bounds_fd, bound.data(), (dim + 1) * sizeof(float),
+                              pid * (dim + 1) * sizeof(float));
+        std::fill(page, page + floats_per_page, 0.0f);
+        std::fill(ids, ids + vpp, COLLECTION_EMPTY_SLOT);
+        staged[c] = 0;
+        pages_written[c]++;
+        return ok;
+    };
+
+    size_t base_chunk_bytes = per_chunk * in.record_size;
+    size_t cluster_chunk_bytes = has_clusters ? per_chunk * clusters.info.record_size : 0;
+    std::vector<float> original(in_dim), reduced(dim);
+    // the full vectors of a chunk, written to <collection>.full at once
+    std::vector<float> full(pca.empty() ? 0 : per_chunk * in_dim);
+
+    bool ok = pipeline_chunks(
+        num_chunks, base_chunk_bytes + cluster_chunk_bytes,
+        [&](size_t i, char *buf) {
+            size_t first = i * per_chunk, n = chunk_vecs(i);
+            return base.read_raw(first, n, buf) &&
+                   (!has_clusters ||
+                    clusters.read_raw(first, n, buf + base_chunk_bytes));
+        },
+        [&](size_t i, char *buf) {
+            for (size_t v = 0; v < chunk_vecs(i); v++) {
+                size_t num_cids = 1;
+                if (has_clusters)
+                    num_cids = record_clusters(clusters.info,
+                                               buf + base_chunk_bytes +
+                                                   v * clusters.info.record_size,
+                                               record_cids.data());
+                vecs_convert_records(in, buf + v * in.record_size, 1, as_float,
+                                     (char *)original.data());
+                if (opt.metric == Metric::cosine)
+                    normalize_vector(original.data(), in_dim);
+                float *vec = original.data();
+                if (!pca.empty()) {
+                    std::copy(original.begin(), original.end(),
+                              full.begin() + v * in_dim);
+                    pca.project(original.data(), reduced.data());
+                    vec = reduced.data();
+                }
+                // the pages (and their bounds) hold the encoded values
+                if (!round_to_encoding(vec, dim, opt.encoding)) {
+                    std::cerr << "vector " << i * per_chunk + v
+                              << " does not fit " << encoding_name(opt.encoding)
+                              << std::endl;
+                    return false;
+                }
+                // the vector goes in every one of its clusters
+                for (size_t r = 0; r < num_cids; r++) {
+                    size_t c = record_cids[r];
+                    float *page = staging.data() + c * floats_per_page;
+                    if (perm.empty() && opt.tile == 0) {
+                        std::copy(vec, vec + dim, page + staged[c] * dim);
+                    } else {
+                        // dimension j of the slot, row-major or in its tile
+                        size_t s = staged[c], first = s * dim, stride = 1;
+                        if (opt.tile) {
+                            first = s / opt.tile * opt.tile * dim + s % opt.tile;
+                            stride = opt.tile;
+                        }
+                        for (size_t j = 0; j < dim; j++)
+                            page[first + j * stride] = vec[perm.empty() ? j : perm[j]];
+                    }
+                    staging_ids[c * vpp + staged[c]] = i * per_chunk + v;
+                    if (++staged[c] == vpp && !flush_page(c)) return false;
+                }
+            }
+            return pca.empty() ||
+                   pwrite_full(full_fd, full.data(),
+                               chunk_vecs(i) * in_dim * sizeof(float),
+                               i * per_chunk * in_dim * sizeof(float));
+        });
+
+    for (size_t c = 0; ok && c < num_clusters; c++)
+        if (staged[c] > 0) ok = flush_page(c);
+
+    close(pages_fd);
+    close(ids_fd);
+    close(bounds_fd);
+    if (full_fd >= 0) close(full_fd);
+    if (!ok) {
+        std::cerr << "failed to write collection: " << opt.collection_filename
+                  << std::endl;
+        return false;
+    }
+    if (!write_collection_meta(opt.collection_filename, meta)) return false;
+    // a permutation left by a previous write would not match the pages
+    if (perm.empty()) {
+        unlink(perm_filename.c_str());
+    } else {
+        FILE *f = fopen(perm_filename.c_str(), "w");
+        bool written = f && fwrite(perm.data(), sizeof(uint32_t), dim, f) == dim;
+        if (f) fclose(f);
+        if (!written) {
+            std::cerr << "failed to write the dimension permutation: "
+                      << perm_filename << std::endl;
+            return false;
+        }
+    }
+    // and so would a projection
+    std::string pca_filename = collection_pca_filename(opt.collection_filename);
+    if (pca.empty()) {
+        unlink(pca_filename.c_str());
+        unlink(full_filename.c_str());
+    } else {
+        FILE *f = fopen(pca_filename.c_str(), "w");
+        bool written = f && pca.write_raw(f);
+        if (f) fclose(f);
+        if (!written) {
+            std::cerr << "failed to write the projection: " << pca_filename
+                      << std::endl;
+            return false;
+        }
+    }
+    if (out_meta) *out_meta = meta;
+    return true;
+}
+
+// =============================================================================
+
+// Collection gives page-level access to a paged collection.
+class Collection {
+   public:
+    CollectionMeta meta;
+    // page dimension j is the original dimension permutation[j], empty
+    // when the pages keep the original order
+    std::vector<uint32_t> permutation;
+    // some vectors are in several clusters, the searches drop repeated ids
+    bool has_replicas = false;
+    // the centroid and radius of every page (see collection_bounds_filename),
+    // empty until load_page_bounds
+    std::vector<float> page_bounds;
+    // the projection of a reduced collection, empty otherwise
+    PcaProjection projection;
+
+    ~Collection() {
+        if (fd >= 0) close(fd);
+        if (full_fd >= 0) close(full_fd);
+    }
+
+    bool open(const std::string &collection) {
+        filename = collection;
+        if (!read_collection_meta(collection, &meta)) return false;
+        has_replicas = meta.replicated();
+        fd = ::open(collection.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "failed to open collection file: " << collection
+                      << std::endl;
+            return false;
+        }
+        return load_permutation() && load_projection();
+    }
+
+    // reduced tells whether the pages hold projected vectors, whose
+    // candidates are re-ranked with the full ones.
+    bool reduced() const { return !projection.empty(); }
+
+    // query_dimension is the dimension of the queries (and of the
+    // centroids), the full one of a reduced collection.
+    size_t query_dimension() const {
+        return reduced() ? projection.input_dim : meta.dimension;
+    }
+
+    // prepare_query turns a query into the form of the pages: normalized
+    // for a cosine collection, in the dimension order of the pages or
+    // projected.
+    void prepare_query(const float *in, float *out) const {
+        if (reduced()) {
+            // the projection is linear, the projected query is scaled
+            // instead of the query
+            projection.project(in, out);
+            if (meta.metric == Metric::cosine) {
+                double norm = 0;
+                for (size_t j = 0; j < projection.input_dim; j++)
+                    norm += (double)in[j] * in[j];
+                if (norm == 0) return;
+                float scale = 1.0 / std::sqrt(norm);
+                for (size_t j = 0; j < meta.dimension; j++) out[j] *= scale;
+            }
+            return;
+        }
+        if (permutation.empty()) {
+            std::copy(in, in + meta.dimension, out);
+        } else {
+            for (size_t j = 0; j < meta.dimension; j++) out[j] = in[permutation[j]];
+        }
+        if (meta.metric == Metric::cosine) normalize_vector(out, meta.dimension);
+    }
+
+    // query_needs_preparing tells whether prepare_query changes the query.
+    bool query_needs_preparing() const {
+        return !permutation.empty() || meta.metric == Metric::cosine || reduced();
+    }
+
+    // prepare_full_query turns a query into the form of the full vectors of
+    // a reduced collection: normalized for cosine.
+    void prepare_full_query(const float *in, float *out) const {
+        std::copy(in, in + projection.input_dim, out);
+        if (meta.metric == Metric::cosine) normalize_vector(out, projection.input_dim);
+    }
+
+    // read_full_vector copies the full vector of the id of a reduced
+    // collection into out (query_dimension floats).
+    bool read_full_vector(uint32_t id, float *out) const {
+        size_t bytes = projection.input_dim * sizeof(float);
+        return pread_full(full_fd, out, bytes, (uint64_t)id * bytes);
+    }
+
+    // read_page copies the page into buf, which must hold page_size bytes.
+    bool read_page(uint64_t pid, char *buf) const {
+        return pread_full(fd, buf, meta.page_size, pid * meta.page_size);
+    }
+
+    // load_ids reads the id of every page slot, see collection_ids_filename.
+    bool load_ids(std::vector<uint32_t> *ids) const {
+        std::string ids_filename = collection_ids_filename(filename);
+        int ids_fd = ::open(ids_filename.c_str(), O_RDONLY);
+        if (ids_fd < 0) {
+            std::cerr << "failed to open collection ids: " << ids_filename
+                      << std::endl;
+            return false;
+        }
+        ids->resize(meta.num_pages * meta.vectors_per_page);
+        bool ok = pread_full(ids_fd, ids->data(), ids->size() * sizeof(uint32_t), 0);
+        close(ids_fd);
+        return ok;
+    }
+
+    // load_page_bounds reads the page summaries into page_bounds. It returns
+    // false when the collection has none (written before they were), the
+    // pages are then all scanned.
+    bool load_page_bounds() {
+        std::string bounds_filename = collection_bounds_filename(filename);
+        int bounds_fd = ::open(bounds_filename.c_str(), O_RDONLY);
+        if (bounds_fd < 0) return false;
+        page_bounds.resize(meta.num_pages * (meta.dimension + 1));
+        bool ok = pread_full(bounds_fd, page_bounds.data(),
+                             page_bounds.size() * sizeof(float), 0);
+        close(bounds_fd);
+        if (!ok) {
+            std::cerr << "bad page bounds: " << bounds_filename << std::endl;
+            page_bounds.clear();
+        }
+        return ok;
+    }
+
+    // page_lower_bound returns a lower bound of the distance (the one of the
+    // kernel) between the prepared query and any vector of the page: with a
+    // vector x within radius r of the page centroid c, |q - x| >= |q - c| - r
+    // and q.x <= q.c + |q| r. It is slightly lowered, so that float rounding
+    // never skips a page holding a closer vector.
+    float page_lower_bound(const DistanceKernel &kernel, const float *query,
+                           float query_norm, uint64_t pid) const {
+        const size_t dim = meta.dimension;
+        const float *centroid = page_bounds.data() + pid * (dim + 1);
+        float radius = centroid[dim];
+        float d = kernel.distance(query, centroid, dim);
+        if (meta.metric == Metric::l2) {
+            float gap = std::max(0.0f, std::sqrt(d) - radius);
+            return gap * gap * (1.0f - 1e-5f);
+        }
+        float spread = query_norm * radius;
+        return d - spread - 1e-5f * (std::fabs(d) + spread);
+    }
+
+    // number of vectors stored in the given page of cluster cid
+    uint32_t vectors_in_page(uint32_t cid, uint64_t pid) const {
+        const ClusterInfo &c = meta.clusters[cid];
+        uint64_t last = c.first_page + c.num_pages - 1;
+        if (pid != last) return meta.vectors_per_page;
+        return c.num_vectors - (c.num_pages - 1) * meta.vectors_per_page;
+    }
+
+    int file_descriptor() const { return fd; }
+    int full_file_descriptor() const { return full_fd; }
+
+   private:
+    bool load_permutation() {
+        permutation.clear();
+        std::string perm_filename = collection_perm_filename(filename);
+        FILE *f = fopen(perm_filename.c_str(), "r");
+        if (!f) return true;  // the pages are in the original order
+        permutation.resize(meta.dimension);
+        size_t n = fread(permutation.data(), sizeof(uint32_t), meta.dimension, f);
+        fclose(f);
+        for (uint32_t j : permutation) {
+            if (j >= meta.dimension) n = 0;
+        }
+        if (n != meta.dimension) {
+            std::cerr << "bad dimension permutation: " << perm_filename
+                      << std::endl;
+            permutation.clear();
+            return false;
+        }
+        return true;
+    }
+
+    // load_projection reads the projection and opens the full vectors of a
+    // reduced collection.
+    bool load_projection() {
+        projection = PcaProjection();
+        std::string pca_filename = collection_pca_filename(filename);
+        FILE *f = fopen(pca_filename.c_str(), "r");
+        if (!f) return true;  // the pages hold the full vectors
+        bool ok = projection.read_raw(f) && projection.output_dim == meta.dimension;
+        fclose(f);
+        if (!ok) {
+            std::cerr << "bad projection: " << pca_filename << std::endl;
+            projection = PcaProjection();
+            return false;
+        }
+        std::string full_filename = collection_full_filename(filename);
+        full_fd = ::open(full_filename.c_str(), O_RDONLY);
+        if (full_fd < 0) {
+            std::cerr << "failed to open the full vectors: " << full_filename
+                      << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    std::string filename;
+    int fd = -1;
+    int full_fd = -1;
+};
+
+#endif
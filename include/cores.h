@@ -22,16 +22,18 @@
 // * total time elapsed : 0.0017932280s
 // * average time elapsed : 0.0000000945s
 #ifdef __linux__
+#include "topology.h"
+
+// On Linux the count comes from the CPU topology instead of `nproc --all`:
+// the physical cores the process may run on (affinity mask, cpuset), capped
+// by its cgroup CPU quota.
 int cores() {
   static int corecount = 0;
 
   if (corecount == 0) {
-    FILE *fp;
-    char var[5] = {0};
-
-    fp = popen("nproc --all", "r");
-    while (fgets(var,sizeof(var),fp) != NULL) sscanf(var,"%d",&corecount);
-    pclose(fp);
+    Topology topology;
+    topology.load();
+    corecount = topology.usable_cores();
   }
 
   return corecount;
@@ -1,15 +1,23 @@
+#ifndef DISTANCES_H_F7Q2MX9A
+#define DISTANCES_H_F7Q2MX9A
+
 #include <x86intrin.h>
 
+#include <algorithm>
 #include <cassert>
 #include <chrono>
 #include <iostream>
 #include <random>
+#include <vector>
 
 // Runtime evaluation for squared Eucliden distance functions
 // - fvec_L2_sqr_ref: naive reference impl from Faiss
 // - fvec_L2_sqr_sse: SSE impl from Faiss
 // - fvec_L2_sqr_avx: AVX impl from Faiss
 // - fvec_L2_sqr_avx512: AVX512 impl
+// - fvec_L2sqr_*_bounded: the same, stopping early past a bound
+// - fvec_inner_product_{ref, avx}: inner products
+// kernels.h specializes them by dimension and metric.
 
 // Note that fvec_L2_sqr_{ref, sse, avx} are from Faiss:
 // https://github.com/facebookresearch/faiss/blob/master/utils.cpp
@@ -142,6 +150,162 @@ float fvec_L2sqr_avx(const float *x, const float *y, size_t d) {
     return _mm_cvtss_f32(msum2);
 }
 
+static inline float horizontal_sum_8(__m256 v) {
+    __m128 s = _mm256_extractf128_ps(v, 1);
+    s += _mm256_extractf128_ps(v, 0);
+    s = _mm_hadd_ps(s, s);
+    s = _mm_hadd_ps(s, s);
+    return _mm_cvtss_f32(s);
+}
+
+// fvec_L2sqr_batch_4 computes the distances between x and y0..y3 at once,
+// each block of x is loaded once and reused for the four vectors. This is
+// the building block of the cache-blocked many-vs-many scans.
+void fvec_L2sqr_batch_4(const float *x, const float *y0, const float *y1,
+                        const float *y2, const float *y3, size_t d,
+                        float *dis) {
+    __m256 msum0 = _mm256_setzero_ps();
+    __m256 msum1 = _mm256_setzero_ps();
+    __m256 msum2 = _mm256_setzero_ps();
+    __m256 msum3 = _mm256_setzero_ps();
+
+    size_t i = 0;
+    for (; i + 8 <= d; i += 8) {
+        const __m256 mx = _mm256_loadu_ps(x + i);
+        const __m256 a_m_b0 = mx - _mm256_loadu_ps(y0 + i);
+        const __m256 a_m_b1 = mx - _mm256_loadu_ps(y1 + i);
+        const __m256 a_m_b2 = mx - _mm256_loadu_ps(y2 + i);
+        const __m256 a_m_b3 = mx - _mm256_loadu_ps(y3 + i);
+        msum0 += a_m_b0 * a_m_b0;
+        msum1 += a_m_b1 * a_m_b1;
+        msum2 += a_m_b2 * a_m_b2;
+        msum3 += a_m_b3 * a_m_b3;
+    }
+
+    if (i < d) {
+        const __m256 mx = masked_read_8(d - i, x + i);
+        const __m256 a_m_b0 = mx - masked_read_8(d - i, y0 + i);
+        const __m256 a_m_b1 = mx - masked_read_8(d - i, y1 + i);
+        const __m256 a_m_b2 = mx - masked_read_8(d - i, y2 + i);
+        const __m256 a_m_b3 = mx - masked_read_8(d - i, y3 + i);
+        msum0 += a_m_b0 * a_m_b0;
+        msum1 += a_m_b1 * a_m_b1;
+        msum2 += a_m_b2 * a_m_b2;
+        msum3 += a_m_b3 * a_m_b3;
+    }
+
+    dis[0] = horizontal_sum_8(msum0);
+    dis[1] = horizontal_sum_8(msum1);
+    dis[2] = horizontal_sum_8(msum2);
+    dis[3] = horizontal_sum_8(msum3);
+}
+
+// Inner products, for the inner product and cosine collections.
+float fvec_inner_product_ref(const float *x, const float *y, size_t d) {
+    float res_ = 0;
+    for (size_t i = 0; i < d; i++) res_ += x[i] * y[i];
+    return res_;
+}
+
+float fvec_inner_product_avx(const float *x, const float *y, size_t d) {
+    __m256 msum1 = _mm256_setzero_ps();
+
+    while (d >= 8) {
+        __m256 mx = _mm256_loadu_ps(x);
+        x += 8;
+        __m256 my = _mm256_loadu_ps(y);
+        y += 8;
+        msum1 += mx * my;
+        d -= 8;
+    }
+
+    if (d > 0) {
+        __m256 mx = masked_read_8(d, x);
+        __m256 my = masked_read_8(d, y);
+        msum1 += mx * my;
+    }
+    return horizontal_sum_8(msum1);
+}
+
+// Threshold-aware kernels: a search only needs the distances below its
+// current k-th best one, the bound. These kernels check the partial sum
+// every L2SQR_CHECK_DIMS dimensions and stop once it reaches the bound,
+// returning that partial sum (>= bound). A distance below the bound is
+// computed in full, in the same order as the unbounded kernel, so it is the
+// same value.
+const size_t L2SQR_CHECK_DIMS = 32;
+
+float fvec_L2sqr_ref_bounded(const float *x, const float *y, size_t d,
+                             float bound) {
+    size_t i = 0;
+    float res_ = 0;
+    while (i < d) {
+        size_t end = std::min(d, i + L2SQR_CHECK_DIMS);
+        for (; i < end; i++) {
+            const float tmp = x[i] - y[i];
+            res_ += tmp * tmp;
+        }
+        if (i < d && res_ >= bound) return res_;
+    }
+    return res_;
+}
+
+float fvec_L2sqr_avx_bounded(const float *x, const float *y, size_t d,
+                             float bound) {
+    __m256 msum1 = _mm256_setzero_ps();
+
+    while (d >= L2SQR_CHECK_DIMS) {
+        for (size_t j = 0; j < L2SQR_CHECK_DIMS / 8; j++) {
+            __m256 mx = _mm256_loadu_ps(x);
+            x += 8;
+            __m256 my = _mm256_loadu_ps(y);
+            y += 8;
+            const __m256 a_m_b1 = mx - my;
+            msum1 += a_m_b1 * a_m_b1;
+        }
+        d -= L2SQR_CHECK_DIMS;
+        // the lanes only grow, so does their sum
+        if (d > 0) {
+            float partial = horizontal_sum_8(msum1);
+            if (partial >= bound) return partial;
+        }
+    }
+
+    while (d >= 8) {
+        __m256 mx = _mm256_loadu_ps(x);
+        x += 8;
+        __m256 my = _mm256_loadu_ps(y);
+        y += 8;
+        const __m256 a_m_b1 = mx - my;
+        msum1 += a_m_b1 * a_m_b1;
+        d -= 8;
+    }
+
+    __m128 msum2 = _mm256_extractf128_ps(msum1, 1);
+    msum2 += _mm256_extractf128_ps(msum1, 0);
+
+    if (d >= 4) {
+        __m128 mx = _mm_loadu_ps(x);
+        x += 4;
+        __m128 my = _mm_loadu_ps(y);
+        y += 4;
+        const __m128 a_m_b1 = mx - my;
+        msum2 += a_m_b1 * a_m_b1;
+        d -= 4;
+    }
+
+    if (d > 0) {
+        __m128 mx = masked_read(d, x);
+        __m128 my = masked_read(d, y);
+        __m128 a_m_b1 = mx - my;
+        msum2 += a_m_b1 * a_m_b1;
+    }
+
+    msum2 = _mm_hadd_ps(msum2, msum2);
+    msum2 = _mm_hadd_ps(msum2, msum2);
+    return _mm_cvtss_f32(msum2);
+}
+
 #ifdef __AVX512F__
 // reads 0 <= d < 16 floats as __m512
 static inline __m512 masked_read_16(int d, const float *x) {
@@ -208,6 +372,77 @@ float fvec_L2sqr_avx512(const float *x, const float *y, size_t d) {
     msum3 = _mm_hadd_ps(msum3, msum3);
     return _mm_cvtss_f32(msum3);
 }
+
+// fvec_L2sqr_avx512_bounded is fvec_L2sqr_avx512 with the early exit of
+// fvec_L2sqr_avx_bounded.
+float fvec_L2sqr_avx512_bounded(const float *x, const float *y, size_t d,
+                                float bound) {
+    __m512 msum1 = _mm512_setzero_ps();
+
+    while (d >= L2SQR_CHECK_DIMS) {
+        for (size_t j = 0; j < L2SQR_CHECK_DIMS / 16; j++) {
+            __m512 mx = _mm512_loadu_ps(x);
+            x += 16;
+            __m512 my = _mm512_loadu_ps(y);
+            y += 16;
+            const __m512 a_m_b1 = mx - my;
+            msum1 += a_m_b1 * a_m_b1;
+        }
+        d -= L2SQR_CHECK_DIMS;
+        if (d > 0) {
+            float partial = horizontal_sum_8(_mm512_extractf32x8_ps(msum1, 1) +
+                                             _mm512_extractf32x8_ps(msum1, 0));
+            if (partial >= bound) return partial;
+        }
+    }
+
+    while (d >= 16) {
+        __m512 mx = _mm512_loadu_ps(x);
+        x += 16;
+        __m512 my = _mm512_loadu_ps(y);
+        y += 16;
+        const __m512 a_m_b1 = mx - my;
+        msum1 += a_m_b1 * a_m_b1;
+        d -= 16;
+    }
+
+    __m256 msum2 = _mm512_extractf32x8_ps(msum1, 1);
+    msum2 += _mm512_extractf32x8_ps(msum1, 0);
+
+    while (d >= 8) {
+        __m256 mx = _mm256_loadu_ps(x);
+        x += 8;
+        __m256 my = _mm256_loadu_ps(y);
+        y += 8;
+        const __m256 a_m_b1 = mx - my;
+        msum2 += a_m_b1 * a_m_b1;
+        d -= 8;
+    }
+
+    __m128 msum3 = _mm256_extractf128_ps(msum2, 1);
+    msum3 += _mm256_extractf128_ps(msum2, 0);
+
+    if (d >= 4) {
+        __m128 mx = _mm_loadu_ps(x);
+        x += 4;
+        __m128 my = _mm_loadu_ps(y);
+        y += 4;
+        const __m128 a_m_b1 = mx - my;
+        msum3 += a_m_b1 * a_m_b1;
+        d -= 4;
+    }
+
+    if (d > 0) {
+        __m128 mx = masked_read(d, x);
+        __m128 my = masked_read(d, y);
+        __m128 a_m_b1 = mx - my;
+        msum3 += a_m_b1 * a_m_b1;
+    }
+
+    msum3 = _mm_hadd_ps(msum3, msum3);
+    msum3 = _mm_hadd_ps(msum3, msum3);
+    return _mm_cvtss_f32(msum3);
+}
 #endif
 
 #ifdef __ARM__
@@ -226,4 +461,6 @@ double vector_distance_neon(float *a, float *b, uint32_t dim) {
 
     return dist;
 }
-#endif
\ No newline at end of file
+#endif
+
+#endif
@@ -0,0 +1,639 @@
+#ifndef KERNELS_H_Q4V7TD2N
+#define KERNELS_H_Q4V7TD2N
+
+#include <x86intrin.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "distances.h"
+
+// Distance kernels specialized by metric and by dimension. The kernels of
+// distances.h take the dimension at runtime, loop over it and mask the
+// tail; for the common dimensions (96, 128, 384, 768, 960, all multiples of
+// 32) the templates below are fully unrolled, with several accumulators and
+// no tail. select_kernel picks the kernel of a collection once, falling
+// back to the generic loops for the other dimensions. The tile kernels score
+// the transposed pages, 8 or 16 vectors at once.
+//
+// Every kernel returns a distance, smaller is closer:
+// - l2            : the squared euclidean distance;
+// - inner_product : the negated inner product;
+// - cosine        : the negated inner product of vectors normalized when
+//                   the pages are written (and of the normalized query).
+
+enum class Metric : uint32_t { l2 = 0, inner_product = 1, cosine = 2 };
+
+inline const char *metric_name(Metric metric) {
+    switch (metric) {
+        case Metric::l2:
+            return "l2";
+        case Metric::inner_product:
+            return "ip";
+        case Metric::cosine:
+            return "cosine";
+    }
+    return "unknown";
+}
+
+inline bool parse_metric(const std::string &name, Metric *metric) {
+    if (name == "l2") *metric = Metric::l2;
+    else if (name == "ip") *metric = Metric::inner_product;
+    else if (name == "cosine") *metric = Metric::cosine;
+    else return false;
+    return true;
+}
+
+// normalize_vector scales the vector to unit length (a zero vector stays).
+inline void normalize_vector(float *x, size_t d) {
+    double norm = 0;
+    for (size_t i = 0; i < d; i++) norm += (double)x[i] * x[i];
+    if (norm == 0) return;
+    float scale = 1.0 / std::sqrt(norm);
+    for (size_t i = 0; i < d; i++) x[i] *= scale;
+}
+
+// =============================================================================
+
+// Page encodings: the pages hold the vectors as f32, or as 16-bit floats,
+// twice the vectors per page for half the bytes read:
+// - f16  : IEEE half precision (11-bit mantissa, up to 65504), widened with
+//          the F16C conversions;
+// - bf16 : the high half of an f32 (8-bit mantissa, the f32 range), widened
+//          with a shift.
+// The kernels widen the page elements in registers and keep the query, and
+// the sums, in f32; no f32 copy of a page is made.
+
+enum class Encoding : uint32_t { f32 = 0, f16 = 1, bf16 = 2 };
+
+inline const char *encoding_name(Encoding encoding) {
+    switch (encoding) {
+        case Encoding::f32:
+            return "f32";
+        case Encoding::f16:
+            return "f16";
+        case Encoding::bf16:
+            return "bf16";
+    }
+    return "unknown";
+}
+
+inline bool parse_encoding(const std::string &name, Encoding *encoding) {
+    if (name == "f32") *encoding = Encoding::f32;
+    else if (name == "f16") *encoding = Encoding::f16;
+    else if (name == "bf16") *encoding = Encoding::bf16;
+    else return false;
+    return true;
+}
+
+inline bool valid_encoding(Encoding encoding) {
+    return encoding == Encoding::f32 || encoding == Encoding::f16 ||
+           encoding == Encoding::bf16;
+}
+
+// bytes per vector element
+inline size_t encoding_size(Encoding encoding) {
+    return encoding == Encoding::f32 ? sizeof(float) : sizeof(uint16_t);
+}
+
+// the element types of the encoded pages
+struct f16_t {
+    uint16_t bits;
+};
+struct bf16_t {
+    uint16_t bits;
+};
+
+// the largest finite f16
+const float F16_MAX = 65504.0f;
+
+inline f16_t float_to_f16(float x) {
+    return {(uint16_t)_cvtss_sh(x, _MM_FROUND_TO_NEAREST_INT)};
+}
+
+inline bf16_t float_to_bf16(float x) {
+    uint32_t u;
+    memcpy(&u, &x, sizeof(u));
+    if ((u & 0x7fffffff) > 0x7f800000) return {(uint16_t)((u >> 16) | 0x40)};
+    u += 0x7fff + ((u >> 16) & 1);  // round to nearest, ties to even
+    return {(uint16_t)(u >> 16)};
+}
+
+inline float to_float(float x) { return x; }
+inline float to_float(f16_t x) { return _cvtsh_ss(x.bits); }
+inline float to_float(bf16_t x) {
+    uint32_t u = (uint32_t)x.bits << 16;
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+// encode_vector writes the n floats in the encoding to out.
+inline void encode_vector(const float *x, size_t n, Encoding encoding, void *out) {
+    if (encoding == Encoding::f16) {
+        for (size_t i = 0; i < n; i++) ((f16_t *)out)[i] = float_to_f16(x[i]);
+    } else if (encoding == Encoding::bf16) {
+        for (size_t i = 0; i < n; i++) ((bf16_t *)out)[i] = float_to_bf16(x[i]);
+    } else {
+        memcpy(out, x, n * sizeof(float));
+    }
+}
+
+// round_to_encoding replaces the n floats by their encoded value, the one
+// the kernels will see. It returns false when one does not fit (f16).
+inline bool round_to_encoding(float *x, size_t n, Encoding encoding) {
+    bool fits = true;
+    for (size_t i = 0; i < n; i++) {
+        if (encoding == Encoding::f16) {
+            fits &= std::fabs(x[i]) <= F16_MAX;
+            x[i] = to_float(float_to_f16(x[i]));
+        } else if (encoding == Encoding::bf16) {
+            x[i] = to_float(float_to_bf16(x[i]));
+        }
+    }
+    return fits;
+}
+
+// widen_8 loads 8 consecutive elements as f32.
+static inline __m256 widen_8(const float *p) { return _mm256_loadu_ps(p); }
+static inline __m256 widen_8(const f16_t *p) {
+    return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)p));
+}
+static inline __m256 widen_8(const bf16_t *p) {
+    const __m256i x = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)p));
+    return _mm256_castsi256_ps(_mm256_slli_epi32(x, 16));
+}
+
+#ifdef __AVX512F__
+// widen_16 loads 16 consecutive elements as f32.
+static inline __m512 widen_16(const float *p) { return _mm512_loadu_ps(p); }
+static inline __m512 widen_16(const f16_t *p) {
+    return _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)p));
+}
+static inline __m512 widen_16(const bf16_t *p) {
+#ifdef __AVX512BF16__
+    return _mm512_cvtpbh_ps((__m256bh)_mm256_loadu_si256((const __m256i *)p));
+#else
+    const __m512i x = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)p));
+    return _mm512_castsi512_ps(_mm512_slli_epi32(x, 16));
+#endif
+}
+#endif
+
+#ifdef __AVX512F__
+static inline float horizontal_sum_16(__m512 v) {
+    return horizontal_sum_8(_mm512_extractf32x8_ps(v, 1) +
+                            _mm512_extractf32x8_ps(v, 0));
+}
+
+// D floats per vector, two 16-float accumulators
+template <size_t D, bool Bounded>
+inline float l2sqr_fixed_impl(const float *x, const float *y, float bound) {
+    static_assert(D % 32 == 0, "the fixed kernels work on blocks of 32");
+    __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+#pragma GCC unroll 32
+    for (size_t i = 0; i < D; i += 32) {
+        const __m512 d0 = _mm512_loadu_ps(x + i) - _mm512_loadu_ps(y + i);
+        const __m512 d1 = _mm512_loadu_ps(x + i + 16) - _mm512_loadu_ps(y + i + 16);
+        s0 = _mm512_fmadd_ps(d0, d0, s0);
+        s1 = _mm512_fmadd_ps(d1, d1, s1);
+        if (Bounded && i + 32 < D) {
+            float partial = horizontal_sum_16(s0 + s1);
+            if (partial >= bound) return partial;
+        }
+    }
+    return horizontal_sum_16(s0 + s1);
+}
+
+template <size_t D>
+inline float inner_product_fixed_impl(const float *x, const float *y) {
+    static_assert(D % 32 == 0, "the fixed kernels work on blocks of 32");
+    __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+#pragma GCC unroll 32
+    for (size_t i = 0; i < D; i += 32) {
+        s0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), s0);
+        s1 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 16),
+                             _mm512_loadu_ps(y + i + 16), s1);
+    }
+    return horizontal_sum_16(s0 + s1);
+}
+#else
+// D floats per vector, four 8-float accumulators
+template <size_t D, bool Bounded>
+inline float l2sqr_fixed_impl(const float *x, const float *y, float bound) {
+    static_assert(D % 32 == 0, "the fixed kernels work on blocks of 32");
+    __m256 s[4] = {_mm256_setzero_ps(), _mm256_setzero_ps(),
+                   _mm256_setzero_ps(), _mm256_setzero_ps()};
+#pragma GCC unroll 32
+    for (size_t i = 0; i < D; i += 32) {
+        for (size_t j = 0; j < 4; j++) {
+            const __m256 diff =
+                _mm256_loadu_ps(x + i + 8 * j) - _mm256_loadu_ps(y + i + 8 * j);
+            s[j] += diff * diff;
+        }
+        if (Bounded && i + 32 < D) {
+            float partial = horizontal_sum_8((s[0] + s[1]) + (s[2] + s[3]));
+            if (partial >= bound) return partial;
+        }
+    }
+    return horizontal_sum_8((s[0] + s[1]) + (s[2] + s[3]));
+}
+
+template <size_t D>
+inline float inner_product_fixed_impl(const float *x, const float *y) {
+    static_assert(D % 32 == 0, "the fixed kernels work on blocks of 32");
+    __m256 s[4] = {_mm256_setzero_ps(), _mm256_setzero_ps(),
+                   _mm256_setzero_ps(), _mm256_setzero_ps()};
+#pragma GCC unroll 32
+    for (size_t i = 0; i < D; i += 32)
+        for (size_t j = 0; j < 4; j++)
+            s[j] += _mm256_loadu_ps(x + i + 8 * j) * _mm256_loadu_ps(y + i + 8 * j);
+    return horizontal_sum_8((s[0] + s[1]) + (s[2] + s[3]));
+}
+#endif
+
+template <size_t D>
+float fvec_L2sqr_fixed(const float *x, const float *y, size_t) {
+    return l2sqr_fixed_impl<D, false>(x, y, 0);
+}
+
+template <size_t D>
+float fvec_L2sqr_fixed_bounded(const float *x, const float *y, size_t,
+                               float bound) {
+    return l2sqr_fixed_impl<D, true>(x, y, bound);
+}
+
+template <size_t D>
+float negative_inner_product_fixed(const float *x, const float *y, size_t) {
+    return -inner_product_fixed_impl<D>(x, y);
+}
+
+inline float negative_inner_product_avx(const float *x, const float *y, size_t d) {
+    return -fvec_inner_product_avx(x, y, d);
+}
+
+inline float negative_inner_product_ref(const float *x, const float *y, size_t d) {
+    return -fvec_inner_product_ref(x, y, d);
+}
+
+// =============================================================================
+
+// Encoded row kernels: the distance between an f32 query and a vector of an
+// encoded page (T is f16_t or bf16_t), widened 16 (avx512) or 8 elements at
+// a time. The bounded one checks its partial sum every 32 dimensions.
+
+template <class T, bool InnerProduct, bool Bounded>
+inline float encoded_row_impl(const float *query, const T *x, size_t d,
+                              float bound) {
+    size_t i = 0;
+#ifdef __AVX512F__
+    __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+    auto step = [&](__m512 &s, size_t j) {
+        const __m512 v = widen_16(x + j), q = _mm512_loadu_ps(query + j);
+        if (InnerProduct) {
+            s = _mm512_fmadd_ps(v, q, s);
+        } else {
+            const __m512 diff = v - q;
+            s = _mm512_fmadd_ps(diff, diff, s);
+        }
+    };
+    for (; i + 32 <= d; i += 32) {
+        step(s0, i);
+        step(s1, i + 16);
+        if (Bounded && i + 32 < d) {
+            float partial = horizontal_sum_16(s0 + s1);
+            if (partial >= bound) return partial;
+        }
+    }
+    for (; i + 16 <= d; i += 16) step(s0, i);
+    float sum = horizontal_sum_16(s0 + s1);
+#else
+    __m256 s[4] = {_mm256_setzero_ps(), _mm256_setzero_ps(),
+                   _mm256_setzero_ps(), _mm256_setzero_ps()};
+    auto step = [&](__m256 &acc, size_t j) {
+        const __m256 v = widen_8(x + j), q = _mm256_loadu_ps(query + j);
+        if (InnerProduct) {
+            acc += v * q;
+        } else {
+            const __m256 diff = v - q;
+            acc += diff * diff;
+        }
+    };
+    for (; i + 32 <= d; i += 32) {
+        for (size_t j = 0; j < 4; j++) step(s[j], i + 8 * j);
+        if (Bounded && i + 32 < d) {
+            float partial = horizontal_sum_8((s[0] + s[1]) + (s[2] + s[3]));
+            if (partial >= bound) return partial;
+        }
+    }
+    for (; i + 8 <= d; i += 8) step(s[0], i);
+    float sum = horizontal_sum_8((s[0] + s[1]) + (s[2] + s[3]));
+#endif
+    for (; i < d; i++) {
+        float v = to_float(x[i]);
+        if (InnerProduct) {
+            sum += v * query[i];
+        } else {
+            float diff = v - query[i];
+            sum += diff * diff;
+        }
+    }
+    return InnerProduct ? -sum : sum;
+}
+
+template <class T, bool InnerProduct>
+float encoded_ref(const float *query, const void *x, size_t d) {
+    float sum = 0;
+    for (size_t i = 0; i < d; i++) {
+        float v = to_float(((const T *)x)[i]);
+        if (InnerProduct) {
+            sum -= v * query[i];
+        } else {
+            float diff = v - query[i];
+            sum += diff * diff;
+        }
+    }
+    return sum;
+}
+
+template <class T, bool InnerProduct>
+float encoded_distance(const float *query, const void *x, size_t d) {
+    return encoded_row_impl<T, InnerProduct, false>(query, (const T *)x, d, 0);
+}
+
+template <class T>
+float encoded_L2sqr_bounded(const float *query, const void *x, size_t d,
+                            float bound) {
+    return encoded_row_impl<T, false, true>(query, (const T *)x, d, bound);
+}
+
+// =============================================================================
+
+// Tile kernels, for the transposed pages (see collection.h): the vectors of
+// a page are stored in tiles of B, dimension by dimension, so tile[j * B + l]
+// is dimension j of vector l. The B distances of a tile are accumulated side
+// by side, one lane per vector, from a broadcast of query[j] and vertical
+// multiply-adds only; there is no horizontal sum. Each tile kernel writes B
+// distances to out. The bounded ones stop once the partial sum of every
+// lane reaches the bound (checked every L2SQR_CHECK_DIMS dimensions). The
+// tiles of an encoded page hold T (f16_t or bf16_t), widened as loaded.
+
+template <size_t B, bool InnerProduct, class T = float>
+inline void tile_ref(const float *query, const void *tile_data, size_t d,
+                     float *out) {
+    const T *tile = (const T *)tile_data;
+    for (size_t l = 0; l < B; l++) out[l] = 0;
+    for (size_t j = 0; j < d; j++) {
+        for (size_t l = 0; l < B; l++) {
+            float v = to_float(tile[j * B + l]);
+            if (InnerProduct) {
+                out[l] -= v * query[j];
+            } else {
+                float diff = v - query[j];
+                out[l] += diff * diff;
+            }
+        }
+    }
+}
+
+// B / 8 ymm per dimension, 8 of them in flight (8 dimensions of a tile of 8,
+// 4 of a tile of 16) to cover the latency of the multiply-adds
+template <size_t B, bool InnerProduct, bool Bounded, class T>
+inline void tile_avx_impl(const float *query, const T *tile, size_t d,
+                          float *out, float bound) {
+    static_assert(B % 8 == 0, "the avx tiles hold multiples of 8 vectors");
+    constexpr size_t W = B / 8, U = std::max<size_t>(1, 8 / W);
+    __m256 s[U][W];
+    for (size_t u = 0; u < U; u++)
+        for (size_t w = 0; w < W; w++) s[u][w] = _mm256_setzero_ps();
+    const __m256 mbound = _mm256_set1_ps(bound);
+
+    auto step = [&](size_t u, size_t j) {
+        const __m256 mq = _mm256_broadcast_ss(query + j);
+        for (size_t w = 0; w < W; w++) {
+            const __m256 v = widen_8(tile + j * B + 8 * w);
+            if (InnerProduct) {
+                s[u][w] += v * mq;
+            } else {
+                const __m256 diff = v - mq;
+                s[u][w] += diff * diff;
+            }
+        }
+    };
+    auto sum = [&](size_t w) {
+        __m256 total = s[0][w];
+        for (size_t u = 1; u < U; u++) total += s[u][w];
+        return total;
+    };
+
+    size_t j = 0;
+    for (; j + U <= d; j += U) {
+        for (size_t u = 0; u < U; u++) step(u, j + u);
+        if (Bounded && (j + U) % L2SQR_CHECK_DIMS == 0 && j + U < d) {
+            bool all_reached = true;
+            for (size_t w = 0; w < W && all_reached; w++)
+                all_reached = _mm256_movemask_ps(_mm256_cmp_ps(
+                                  sum(w), mbound, _CMP_GE_OQ)) == 0xff;
+            if (all_reached) break;
+        }
+    }
+    if (!Bounded || j + U > d)
+        for (; j < d; j++) step(0, j);
+    for (size_t w = 0; w < W; w++) {
+        __m256 result = sum(w);
+        if (InnerProduct) result = _mm256_setzero_ps() - result;
+        _mm256_storeu_ps(out + 8 * w, result);
+    }
+}
+
+#ifdef __AVX512F__
+// one zmm per dimension, 8 dimensions in flight
+template <bool InnerProduct, bool Bounded, class T>
+inline void tile16_avx512_impl(const float *query, const T *tile, size_t d,
+                               float *out, float bound) {
+    constexpr size_t U = 8;
+    __m512 s[U];
+    for (size_t u = 0; u < U; u++) s[u] = _mm512_setzero_ps();
+    const __m512 mbound = _mm512_set1_ps(bound);
+
+    auto step = [&](size_t u, size_t j) {
+        const __m512 mq = _mm512_set1_ps(query[j]);
+        const __m512 v = widen_16(tile + j * 16);
+        if (InnerProduct) {
+            s[u] = _mm512_fmadd_ps(v, mq, s[u]);
+        } else {
+            const __m512 diff = v - mq;
+            s[u] = _mm512_fmadd_ps(diff, diff, s[u]);
+        }
+    };
+    auto sum = [&]() {
+        return ((s[0] + s[1]) + (s[2] + s[3])) + ((s[4] + s[5]) + (s[6] + s[7]));
+    };
+
+    size_t j = 0;
+    for (; j + U <= d; j += U) {
+        for (size_t u = 0; u < U; u++) step(u, j + u);
+        if (Bounded && (j + U) % L2SQR_CHECK_DIMS == 0 && j + U < d &&
+            _mm512_cmp_ps_mask(sum(), mbound, _CMP_GE_OQ) == 0xffff)
+            break;
+    }
+    if (!Bounded || j + U > d)
+        for (; j < d; j++) step(0, j);
+    __m512 result = sum();
+    if (InnerProduct) result = _mm512_setzero_ps() - result;
+    _mm512_storeu_ps(out, result);
+}
+#endif
+
+template <size_t B, bool InnerProduct, class T = float>
+void tile_distances(const float *query, const void *tile_data, size_t d,
+                    float *out) {
+    const T *tile = (const T *)tile_data;
+#ifdef __AVX512F__
+    if (B == 16) return tile16_avx512_impl<InnerProduct, false>(query, tile, d, out, 0);
+#endif
+    tile_avx_impl<B, InnerProduct, false>(query, tile, d, out, 0);
+}
+
+template <size_t B, class T = float>
+void tile_L2sqr_bounded(const float *query, const void *tile_data, size_t d,
+                        float *out, float bound) {
+    const T *tile = (const T *)tile_data;
+#ifdef __AVX512F__
+    if (B == 16) return tile16_avx512_impl<false, true>(query, tile, d, out, bound);
+#endif
+    tile_avx_impl<B, false, true>(query, tile, d, out, bound);
+}
+
+// the vectors per tile of the transposed pages
+inline bool valid_tile(size_t tile) { return tile == 0 || tile == 8 || tile == 16; }
+
+// =============================================================================
+
+// DistanceKernel is the distance function of a collection.
+struct DistanceKernel {
+    Metric metric = Metric::l2;
+    size_t dim = 0;  // the specialized dimension, 0 for the generic loop
+    float (*distance)(const float *x, const float *y, size_t d) = fvec_L2sqr_avx;
+    // the early-abandoning version (see fvec_L2sqr_avx_bounded), null when
+    // the partial sums of the metric are not monotone
+    float (*bounded)(const float *x, const float *y, size_t d, float bound) =
+        fvec_L2sqr_avx_bounded;
+
+    // the encoding of the pages: the row-major vectors of f16 or bf16 pages
+    // are scored with encoded (and encoded_bounded, null when distance has
+    // no bounded version); distance stays the f32 one (page bounds)
+    Encoding encoding = Encoding::f32;
+    float (*encoded)(const float *query, const void *x, size_t d) = nullptr;
+    float (*encoded_bounded)(const float *query, const void *x, size_t d,
+                             float bound) = nullptr;
+
+    // vectors per tile of transposed pages, 0 when the pages are row-major;
+    // the pages are then scored a tile at a time with these (tiles of the
+    // elements of the encoding)
+    size_t tile = 0;
+    void (*tile_distance)(const float *query, const void *tile, size_t d,
+                          float *out) = nullptr;
+    void (*tile_bounded)(const float *query, const void *tile, size_t d,
+                         float *out, float bound) = nullptr;
+};
+
+template <class T>
+inline void set_encoded_kernel(DistanceKernel *kernel, bool use_simd) {
+    bool ip = kernel->metric != Metric::l2;
+    if (!use_simd) {
+        kernel->encoded = ip ? encoded_ref<T, true> : encoded_ref<T, false>;
+        kernel->encoded_bounded = nullptr;
+        return;
+    }
+    kernel->encoded = ip ? encoded_distance<T, true> : encoded_distance<T, false>;
+    kernel->encoded_bounded = ip ? nullptr : encoded_L2sqr_bounded<T>;
+}
+
+template <size_t B, class T>
+inline void set_tile_kernel(DistanceKernel *kernel, bool use_simd) {
+    bool ip = kernel->metric != Metric::l2;
+    kernel->tile = B;
+    if (!use_simd) {
+        kernel->tile_distance = ip ? tile_ref<B, true, T> : tile_ref<B, false, T>;
+        kernel->tile_bounded = nullptr;
+        return;
+    }
+    kernel->tile_distance =
+        ip ? tile_distances<B, true, T> : tile_distances<B, false, T>;
+    kernel->tile_bounded = ip ? nullptr : tile_L2sqr_bounded<B, T>;
+}
+
+template <size_t B>
+inline void set_tile_kernel(DistanceKernel *kernel, bool use_simd,
+                            Encoding encoding) {
+    if (encoding == Encoding::f16) set_tile_kernel<B, f16_t>(kernel, use_simd);
+    else if (encoding == Encoding::bf16) set_tile_kernel<B, bf16_t>(kernel, use_simd);
+    else set_tile_kernel<B, float>(kernel, use_simd);
+}
+
+template <size_t D>
+inline DistanceKernel fixed_kernel(Metric metric) {
+    DistanceKernel kernel;
+    kernel.metric = metric;
+    kernel.dim = D;
+    if (metric == Metric::l2) {
+        kernel.distance = fvec_L2sqr_fixed<D>;
+        kernel.bounded = fvec_L2sqr_fixed_bounded<D>;
+    } else {
+        kernel.distance = negative_inner_product_fixed<D>;
+        kernel.bounded = nullptr;
+    }
+    return kernel;
+}
+
+// select_row_kernel is the kernel of row-major vectors: unrolled for the
+// common dimensions (with use_simd), the generic loop otherwise.
+inline DistanceKernel select_row_kernel(Metric metric, size_t dim, bool use_simd) {
+    if (use_simd) {
+        switch (dim) {
+            case 96:
+                return fixed_kernel<96>(metric);
+            case 128:
+                return fixed_kernel<128>(metric);
+            case 384:
+                return fixed_kernel<384>(metric);
+            case 768:
+                return fixed_kernel<768>(metric);
+            case 960:
+                return fixed_kernel<960>(metric);
+        }
+    }
+    DistanceKernel kernel;
+    kernel.metric = metric;
+    if (metric == Metric::l2) {
+        kernel.distance = use_simd ? fvec_L2sqr_avx : fvec_L2sqr_ref;
+        kernel.bounded = use_simd ? fvec_L2sqr_avx_bounded : fvec_L2sqr_ref_bounded;
+    } else {
+        kernel.distance = use_simd ? negative_inner_product_avx
+                                   : negative_inner_product_ref;
+        kernel.bounded = nullptr;
+    }
+    return kernel;
+}
+
+// select_kernel returns the kernel of the metric and dimension: a fixed
+// dimension one when there is one (and use_simd), the generic loop
+// otherwise. With tile (8 or 16), the kernel also scores transposed pages,
+// and with an f16 or bf16 encoding the pages of that encoding.
+inline DistanceKernel select_kernel(Metric metric, size_t dim, bool use_simd,
+                                    size_t tile = 0,
+                                    Encoding encoding = Encoding::f32) {
+    DistanceKernel kernel = select_row_kernel(metric, dim, use_simd);
+    kernel.encoding = encoding;
+    if (encoding == Encoding::f16) set_encoded_kernel<f16_t>(&kernel, use_simd);
+    else if (encoding == Encoding::bf16) set_encoded_kernel<bf16_t>(&kernel, use_simd);
+    if (tile == 8) set_tile_kernel<8>(&kernel, use_simd, encoding);
+    else if (tile == 16) set_tile_kernel<16>(&kernel, use_simd, encoding);
+    return kernel;
+}
+
+#endif
@@ -0,0 +1,212 @@
+#ifndef LATENCY_H_H3V8TC6L
+#define LATENCY_H_H3V8TC6L
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Latency histograms of the query stages, one set per worker thread.
+//
+// LatencyHistogram uses HDR-style log-linear buckets: values below 128 ns
+// have a bucket each, above that every power of two is split into 64
+// buckets, so a percentile is off by at most 1/64 (1.6%) of its value, up
+// to 2^48 ns (3 days). A histogram has a single writer, its owner thread,
+// which updates the counters with plain relaxed loads and stores (no lock,
+// no read-modify-write); any thread may merge the histograms at any time
+// and sees counts that are at most a few records behind.
+
+class LatencyHistogram {
+   public:
+    static constexpr int sub_bits = 6;  // 64 buckets per power of two
+    static constexpr int max_bits = 48;
+    static constexpr size_t linear = 2u << sub_bits;  // exact below 128
+    static constexpr size_t num_buckets =
+        linear + (max_bits - sub_bits - 1) * (1u << sub_bits);
+
+    LatencyHistogram() : counts(num_buckets) {
+        for (auto &c : counts) c.store(0, std::memory_order_relaxed);
+    }
+
+    static size_t bucket_of(uint64_t ns) {
+        if (ns < linear) return ns;
+        int e = 63 - __builtin_clzll(ns);  // >= sub_bits + 1
+        if (e >= max_bits) return num_buckets - 1;
+        int shift = e - sub_bits;
+        return linear + (size_t)(e - sub_bits - 1) * (1u << sub_bits) +
+               ((ns >> shift) - (1u << sub_bits));
+    }
+
+    // highest value of a bucket
+    static uint64_t bucket_value(size_t b) {
+        if (b < linear) return b;
+        size_t octave = (b - linear) >> sub_bits;
+        size_t sub = (b - linear) & ((1u << sub_bits) - 1);
+        int shift = octave + 1;
+        return (((1u << sub_bits) + sub + 1) << shift) - 1;
+    }
+
+    // record is called by the owner thread only.
+    void record(uint64_t ns) {
+        bump(counts[bucket_of(ns)], 1);
+        bump(total_count, 1);
+        bump(total_ns, ns);
+        if (ns > max_ns.load(std::memory_order_relaxed))
+            max_ns.store(ns, std::memory_order_relaxed);
+    }
+
+    void add(const LatencyHistogram &o) {
+        for (size_t b = 0; b < num_buckets; b++)
+            bump(counts[b], o.counts[b].load(std::memory_order_relaxed));
+        bump(total_count, o.count());
+        bump(total_ns, o.total_ns.load(std::memory_order_relaxed));
+        if (o.max() > max()) max_ns.store(o.max(), std::memory_order_relaxed);
+    }
+
+    uint64_t count() const { return total_count.load(std::memory_order_relaxed); }
+    uint64_t max() const { return max_ns.load(std::memory_order_relaxed); }
+    double mean() const {
+        uint64_t n = count();
+        return n ? (double)total_ns.load(std::memory_order_relaxed) / n : 0.0;
+    }
+
+    // percentile returns the value under which p percent of the records
+    // fall (p in [0, 100]), 0 when empty.
+    uint64_t percentile(double p) const {
+        uint64_t n = count();
+        if (n == 0) return 0;
+        uint64_t rank = (uint64_t)(p / 100.0 * n + 0.5);
+        if (rank < 1) rank = 1;
+        uint64_t seen = 0;
+        for (size_t b = 0; b < num_buckets; b++) {
+            seen += counts[b].load(std::memory_order_relaxed);
+            if (seen >= rank) return std::min(bucket_value(b), max());
+        }
+        return max();
+    }
+
+   private:
+    static void bump(std::atomic<uint64_t> &c, uint64_t v) {
+        c.store(c.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+    }
+
+    std::vector<std::atomic<uint64_t>> counts;
+    std::atomic<uint64_t> total_count{0};
+    std::atomic<uint64_t> total_ns{0};
+    std::atomic<uint64_t> max_ns{0};
+};
+
+// The stages of a query:
+// - routing: finding the nprobe closest centroids;
+// - queue_wait: from the query arrival until a worker picks it;
+// - io_wait: waiting for pages that are not read yet;
+// - distance: computing the distances of the scanned vectors;
+// - topk_merge: pushing the distances into the top-k and sorting it;
+// - rerank: reading the full vectors of the candidates of a reduced
+//   collection and scoring them again;
+// - total: the whole query, as seen by the worker.
+enum class Stage { routing, queue_wait, io_wait, distance, topk_merge, rerank, total };
+constexpr size_t num_stages = 7;
+
+inline const char *stage_name(Stage s) {
+    static const char *names[num_stages] = {"routing",  "queue_wait",
+                                            "io_wait",  "distance",
+                                            "topk_merge", "rerank", "total"};
+    return names[(size_t)s];
+}
+
+struct StageHistograms {
+    LatencyHistogram stages[num_stages];
+
+    void record(Stage s, uint64_t ns) { stages[(size_t)s].record(ns); }
+    const LatencyHistogram &operator[](Stage s) const { return stages[(size_t)s]; }
+
+    void add(const StageHistograms &o) {
+        for (size_t i = 0; i < num_stages; i++) stages[i].add(o.stages[i]);
+    }
+};
+
+inline uint64_t elapsed_ns(std::chrono::steady_clock::time_point start,
+                           std::chrono::steady_clock::time_point end) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+        .count();
+}
+
+// LatencyRecorder hands out one StageHistograms per worker thread and
+// merges them on demand.
+class LatencyRecorder {
+   public:
+    // thread_histograms registers a new set of histograms, to be written by
+    // the calling thread only.
+    StageHistograms *thread_histograms() {
+        std::lock_guard<std::mutex> lock(mu);
+        threads.emplace_back(new StageHistograms());
+        return threads.back().get();
+    }
+
+    std::unique_ptr<StageHistograms> merged() const {
+        std::unique_ptr<StageHistograms> total(new StageHistograms());
+        std::lock_guard<std::mutex> lock(mu);
+        for (auto &h : threads) total->add(*h);
+        return total;
+    }
+
+    // print writes p50/p99/p999 of every stage that has records.
+    void print() const {
+        std::unique_ptr<StageHistograms> h = merged();
+        printf("   %-11s %10s %10s %10s %10s %10s %10s\n", "stage (us)", "count",
+               "mean", "p50", "p99", "p999", "max");
+        for (size_t i = 0; i < num_stages; i++) {
+            const LatencyHistogram &s = h->stages[i];
+            if (s.count() == 0) continue;
+            printf("   %-11s %10lu %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+                   stage_name((Stage)i), s.count(), s.mean() * 1e-3,
+                   s.percentile(50) * 1e-3, s.percentile(99) * 1e-3,
+                   s.percentile(99.9) * 1e-3, s.max() * 1e-3);
+        }
+    }
+
+    // to_json exports the merged histograms: for every stage the count,
+    // mean, p50, p90, p99, p999 and max in microseconds.
+    std::string to_json() const {
+        std::unique_ptr<StageHistograms> h = merged();
+        std::string out = "{\n  \"unit\": \"us\",\n  \"stages\": {";
+        char buf[512];
+        for (size_t i = 0; i < num_stages; i++) {
+            const LatencyHistogram &s = h->stages[i];
+            snprintf(buf, sizeof(buf),
+                     "%s\n    \"%s\": {\"count\": %lu, \"mean\": %.3f, "
+                     "\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, "
+                     "\"p999\": %.3f, \"max\": %.3f}",
+                     i ? "," : "", stage_name((Stage)i), s.count(),
+                     s.mean() * 1e-3, s.percentile(50) * 1e-3,
+                     s.percentile(90) * 1e-3, s.percentile(99) * 1e-3,
+                     s.percentile(99.9) * 1e-3, s.max() * 1e-3);
+            out += buf;
+        }
+        out += "\n  }\n}\n";
+        return out;
+    }
+
+    bool write_json(const std::string &filename) const {
+        FILE *f = fopen(filename.c_str(), "w");
+        if (!f) {
+            fprintf(stderr, "failed to open latency file: %s\n", filename.c_str());
+            return false;
+        }
+        std::string json = to_json();
+        bool ok = fwrite(json.data(), 1, json.size(), f) == json.size();
+        fclose(f);
+        return ok;
+    }
+
+   private:
+    mutable std::mutex mu;
+    std::vector<std::unique_ptr<StageHistograms>> threads;
+};
+
+#endif
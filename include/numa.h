@@ -0,0 +1,171 @@
+#ifndef NUMA_H_P3X8LC5V
+#define NUMA_H_P3X8LC5V
+
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <numeric>
+#include <vector>
+
+#include "collection.h"
+
+// NUMA placement of a collection: the clusters are split into one partition
+// per node, the pages of a partition live in the memory of its node, and
+// the probes of a query go to the workers of the nodes owning its clusters,
+// so no worker streams pages over the interconnect.
+//
+// The memory policy is set with the raw mbind syscall (no libnuma). On a
+// single node, or when the kernel has no NUMA support, there is one
+// partition and the memory is plain anonymous memory.
+
+// numa_bind asks for the pages of [addr, addr + len) to be allocated on the
+// node when first touched; addr is page aligned. The policy is "preferred":
+// a full node falls back to the others instead of failing. It returns false
+// when the kernel refuses.
+inline bool numa_bind(void *addr, size_t len, int node) {
+    const size_t max_nodes = 1024;
+    if (node < 0 || (size_t)node >= max_nodes || len == 0) return false;
+    unsigned long mask[max_nodes / (8 * sizeof(unsigned long))] = {0};
+    mask[node / (8 * sizeof(unsigned long))] |=
+        1UL << (node % (8 * sizeof(unsigned long)));
+    return syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask, max_nodes, 0) == 0;
+}
+
+// numa_alloc maps size bytes, page aligned, bound to the node (-1: no
+// binding). It returns nullptr when the mapping fails; a refused binding
+// is reported and leaves the memory unbound.
+inline char *numa_alloc(size_t size, int node) {
+    void *p = mmap(nullptr, std::max<size_t>(1, size), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return nullptr;
+    if (node >= 0 && size > 0 && !numa_bind(p, size, node))
+        std::cerr << "failed to bind " << size << " bytes to NUMA node " << node
+                  << std::endl;
+    return (char *)p;
+}
+
+inline void numa_free(char *p, size_t size) {
+    if (p) munmap(p, std::max<size_t>(1, size));
+}
+
+class NumaPartitioning {
+   public:
+    // plan assigns every cluster to a partition, one per node, the largest
+    // clusters first to the partition with the fewest pages so far.
+    void plan(const CollectionMeta &meta, const std::vector<int> &node_list) {
+        nodes = node_list.empty() ? std::vector<int>{0} : node_list;
+        cluster_partition.assign(meta.clusters.size(), 0);
+        partition_pages.assign(nodes.size(), 0);
+        partition_clusters.assign(nodes.size(), 0);
+
+        std::vector<uint32_t> order(meta.clusters.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            return meta.clusters[a].num_pages > meta.clusters[b].num_pages;
+        });
+        for (uint32_t cid : order) {
+            size_t p = std::min_element(partition_pages.begin(),
+                                        partition_pages.end()) -
+                       partition_pages.begin();
+            cluster_partition[cid] = p;
+            partition_pages[p] += meta.clusters[cid].num_pages;
+            partition_clusters[p]++;
+        }
+    }
+
+    size_t num_partitions() const { return nodes.size(); }
+    int node(size_t partition) const { return nodes[partition]; }
+    uint32_t partition_of(uint32_t cid) const { return cluster_partition[cid]; }
+
+    // partition_of_node is the partition of the node, or 0 when the node
+    // owns none.
+    size_t partition_of_node(int node) const {
+        for (size_t p = 0; p < nodes.size(); p++)
+            if (nodes[p] == node) return p;
+        return 0;
+    }
+
+    // alloc_pages allocates the memory of the whole collection. With
+    // several partitions the pages of a partition are contiguous, its
+    // clusters one after the other (pages outside of any cluster go to the
+    // first one), and the range is aligned to the system page and bound to
+    // its node as a whole: one mbind and one mapping per node, whatever the
+    // number of clusters. page_offset then tells where every page is. The
+    // pages land on their node when they are first written, whichever
+    // thread does it.
+    char *alloc_pages(const CollectionMeta &meta) {
+        page_offsets.clear();
+        if (nodes.size() < 2) {
+            alloc_size = meta.num_pages * meta.page_size;
+            return numa_alloc(alloc_size, -1);
+        }
+
+        std::vector<std::vector<uint64_t>> pages(nodes.size());
+        std::vector<bool> placed(meta.num_pages, false);
+        for (size_t cid = 0; cid < meta.clusters.size(); cid++) {
+            const ClusterInfo &c = meta.clusters[cid];
+            for (uint64_t pid = c.first_page;
+                 pid < c.first_page + c.num_pages && pid < meta.num_pages; pid++) {
+                if (placed[pid]) continue;
+                placed[pid] = true;
+                pages[cluster_partition[cid]].push_back(pid);
+            }
+        }
+        for (uint64_t pid = 0; pid < meta.num_pages; pid++)
+            if (!placed[pid]) pages[0].push_back(pid);
+
+        const size_t align = std::max<long>(4096, sysconf(_SC_PAGESIZE));
+        std::vector<size_t> start(nodes.size() + 1, 0);
+        for (size_t p = 0; p < nodes.size(); p++) {
+            size_t bytes = pages[p].size() * meta.page_size;
+            start[p + 1] = start[p] + (bytes + align - 1) / align * align;
+        }
+        alloc_size = start.back();
+        char *memory = numa_alloc(alloc_size, -1);
+        if (!memory) return nullptr;
+
+        page_offsets.assign(meta.num_pages, 0);
+        for (size_t p = 0; p < nodes.size(); p++) {
+            for (size_t i = 0; i < pages[p].size(); i++)
+                page_offsets[pages[p][i]] = start[p] + i * meta.page_size;
+            size_t len = start[p + 1] - start[p];
+            if (len > 0 && !numa_bind(memory + start[p], len, nodes[p]))
+                std::cerr << "failed to bind the pages of partition " << p
+                          << " to NUMA node " << nodes[p] << std::endl;
+        }
+        return memory;
+    }
+
+    // page_offset is the position of page pid in the memory of alloc_pages.
+    size_t page_offset(uint64_t pid, size_t page_size) const {
+        return page_offsets.empty() ? pid * page_size : page_offsets[pid];
+    }
+
+    void free_pages(char *memory) const { numa_free(memory, alloc_size); }
+
+    // split groups the probed clusters by partition, in probe order.
+    void split(const uint32_t *clusters, size_t nprobe,
+               std::vector<std::vector<uint32_t>> *parts) const {
+        parts->resize(nodes.size());
+        for (auto &part : *parts) part.clear();
+        for (size_t i = 0; i < nprobe; i++) {
+            uint32_t cid = clusters[i];
+            uint32_t p = cid < cluster_partition.size() ? cluster_partition[cid] : 0;
+            (*parts)[p].push_back(cid);
+        }
+    }
+
+    std::vector<int> nodes;                    // node of every partition
+    std::vector<uint32_t> cluster_partition;   // partition of every cluster
+    std::vector<uint64_t> partition_pages;
+    std::vector<uint64_t> partition_clusters;
+    std::vector<uint64_t> page_offsets;  // of every page, set by alloc_pages
+    size_t alloc_size = 0;
+};
+
+#endif
@@ -0,0 +1,282 @@
+#ifndef PCA_H_N4T7XK2Q
+#define PCA_H_N4T7XK2Q
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "vecs.h"
+
+// A PCA projection maps the vectors to their coordinates along the top
+// principal components of a sample of the base: out = P x, P the r x d
+// matrix of the components (orthonormal rows, the highest variance first).
+// The mean is not subtracted, the projection is linear: P x - P y = P (x - y),
+// so the l2 distance of two projected vectors is that of the vectors along
+// the components, a lower bound of their full distance, and the inner
+// product is that of the projected parts. A reduced collection (see
+// collection.h) stores the projected vectors in its pages and re-ranks the
+// candidates with the full vectors.
+//
+// The components come from a subspace iteration over the covariance of the
+// sample, with a Rayleigh-Ritz step to sort them by variance. The trained
+// projection is a vector file of r rows of d floats, next to the centroids.
+
+class PcaProjection {
+   public:
+    size_t input_dim = 0;
+    size_t output_dim = 0;
+    std::vector<float> components;  // output_dim rows of input_dim floats
+    double explained_variance = 0;  // of the sample, set by train
+
+    bool empty() const { return output_dim == 0; }
+
+    // project writes the output_dim coordinates of the input_dim vector x.
+    void project(const float *x, float *out) const {
+        for (size_t r = 0; r < output_dim; r++) {
+            const float *c = components.data() + r * input_dim;
+            float sum = 0;
+            for (size_t j = 0; j < input_dim; j++) sum += c[j] * x[j];
+            out[r] = sum;
+        }
+    }
+
+    // train computes the top r components of the n vectors of dimension d
+    // in x (the sample) with num_thread threads.
+    void train(const float *x, size_t n, size_t d, size_t r,
+               size_t iterations = 30, uint32_t num_thread = 1) {
+        input_dim = d;
+        output_dim = r = std::min(r, d);
+        num_thread = std::max<uint32_t>(1, num_thread);
+        std::vector<double> cov = covariance(x, n, d, num_thread);
+        double trace = 0;
+        for (size_t j = 0; j < d; j++) trace += cov[j * d + j];
+
+        // orthogonal iteration: Q <- orth(C Q), from a random Q
+        std::vector<double> q(r * d), z(r * d);
+        std::mt19937 rng(1234);
+        std::normal_distribution<double> normal;
+        for (auto &v : q) v = normal(rng);
+        orthonormalize(q.data(), r, d);
+        for (size_t it = 0; it < iterations; it++) {
+            multiply(cov, q, z, r, d, num_thread);
+            q.swap(z);
+            orthonormalize(q.data(), r, d);
+        }
+
+        // Rayleigh-Ritz: the eigenvectors of H = Q C Q^T rotate Q into the
+        // components, H's eigenvalues are their variances
+        multiply(cov, q, z, r, d, num_thread);
+        std::vector<double> h(r * r), v;
+        for (size_t a = 0; a < r; a++)
+            for (size_t b = 0; b < r; b++) {
+                double s = 0;
+                for (size_t j = 0; j < d; j++) s += q[a * d + j] * z[b * d + j];
+                h[a * r + b] = s;
+            }
+        for (size_t a = 0; a < r; a++)
+            for (size_t b = a + 1; b < r; b++)
+                h[a * r + b] = h[b * r + a] = 0.5 * (h[a * r + b] + h[b * r + a]);
+        jacobi_eigen(h, v, r);
+        std::vector<size_t> order(r);
+        for (size_t a = 0; a < r; a++) order[a] = a;
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return h[a * r + a] > h[b * r + b];
+        });
+
+        components.assign(r * d, 0.0f);
+        double kept = 0;
+        for (size_t a = 0; a < r; a++) {
+            size_t e = order[a];
+            kept += h[e * r + e];
+            float *c = components.data() + a * d;
+            for (size_t j = 0; j < d; j++) {
+                double s = 0;
+                for (size_t b = 0; b < r; b++) s += v[b * r + e] * q[b * d + j];
+                c[j] = s;
+            }
+        }
+        explained_variance = trace > 0 ? kept / trace : 0;
+    }
+
+    // load reads a trained projection (fvecs or npy, one row per component).
+    bool load(const std::string &filename) {
+        VecsReader reader;
+        if (!reader.open(filename.c_str())) return false;
+        input_dim = reader.info.dimension;
+        output_dim = reader.info.num_vectors;
+        components.resize(output_dim * input_dim);
+        if (output_dim == 0 || output_dim > input_dim ||
+            !reader.read_float(0, output_dim, components.data())) {
+            std::cerr << "bad pca projection: " << filename << std::endl;
+            output_dim = 0;
+            return false;
+        }
+        return true;
+    }
+
+    // save writes the projection as a vector file (fvecs or npy).
+    bool save(const std::string &filename) const {
+        VecsWriter writer;
+        return writer.open(filename.c_str(), input_dim, output_dim) &&
+               writer.write_float(0, output_dim, components.data());
+    }
+
+    // write_raw and read_raw keep the projection in a side file of a
+    // collection: the input and output dimension (uint32 each), then the
+    // components.
+    bool write_raw(FILE *f) const {
+        uint32_t dims[2] = {(uint32_t)input_dim, (uint32_t)output_dim};
+        return fwrite(dims, sizeof(uint32_t), 2, f) == 2 &&
+               fwrite(components.data(), sizeof(float), components.size(), f) ==
+                   components.size();
+    }
+    bool read_raw(FILE *f) {
+        uint32_t dims[2] = {0, 0};
+        if (fread(dims, sizeof(uint32_t), 2, f) != 2 || dims[1] == 0 ||
+            dims[1] > dims[0])
+            return false;
+        input_dim = dims[0];
+        output_dim = dims[1];
+        components.resize(output_dim * input_dim);
+        return fread(components.data(), sizeof(float), components.size(), f) ==
+               components.size();
+    }
+
+   private:
+    // covariance returns the d x d covariance of the n vectors of x. The
+    // rows of the matrix are split over the threads, which go over the
+    // vectors a block at a time so the block stays in cache.
+    static std::vector<double> covariance(const float *x, size_t n, size_t d,
+                                          uint32_t num_thread) {
+        std::vector<double> mean(d, 0.0);
+        for (size_t s = 0; s < n; s++)
+            for (size_t j = 0; j < d; j++) mean[j] += x[s * d + j];
+        for (auto &m : mean) m /= std::max<size_t>(1, n);
+
+        std::vector<double> cov(d * d, 0.0);
+        const size_t block = 256;
+        auto rows = [&](size_t t) {
+            std::vector<float> centered(block * d);
+            for (size_t first = 0; first < n; first += block) {
+                size_t m = std::min(block, n - first);
+                for (size_t s = 0; s < m; s++)
+                    for (size_t j = 0; j < d; j++)
+                        centered[s * d + j] = x[(first + s) * d + j] - mean[j];
+                // rows t, t + num_thread, ... balance the triangle
+                for (size_t i = t; i < d; i += num_thread) {
+                    double *c = cov.data() + i * d;
+                    for (size_t s = 0; s < m; s++) {
+                        const float *v = centered.data() + s * d;
+                        float xi = v[i];
+                        for (size_t j = i; j < d; j++) c[j] += xi * v[j];
+                    }
+                }
+            }
+        };
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < num_thread; t++) workers.emplace_back(rows, t);
+        for (auto &w : workers) w.join();
+
+        for (size_t i = 0; i < d; i++)
+            for (size_t j = i; j < d; j++) {
+                cov[i * d + j] /= std::max<size_t>(1, n);
+                cov[j * d + i] = cov[i * d + j];
+            }
+        return cov;
+    }
+
+    // multiply writes z = q C (r rows of d, C symmetric).
+    static void multiply(const std::vector<double> &cov,
+                         const std::vector<double> &q, std::vector<double> &z,
+                         size_t r, size_t d, uint32_t num_thread) {
+        auto rows = [&](size_t t) {
+            for (size_t a = t; a < r; a += num_thread) {
+                const double *in = q.data() + a * d;
+                double *out = z.data() + a * d;
+                std::fill(out, out + d, 0.0);
+                for (size_t i = 0; i < d; i++) {
+                    const double *c = cov.data() + i * d;
+                    double qi = in[i];
+                    for (size_t j = 0; j < d; j++) out[j] += qi * c[j];
+                }
+            }
+        };
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < std::min<size_t>(num_thread, r); t++)
+            workers.emplace_back(rows, t);
+        for (auto &w : workers) w.join();
+    }
+
+    // orthonormalize runs a modified Gram-Schmidt over the r rows of q; a
+    // row that vanishes is replaced by a unit vector orthogonal enough to
+    // the others.
+    static void orthonormalize(double *q, size_t r, size_t d) {
+        for (size_t a = 0; a < r; a++) {
+            double *u = q + a * d;
+            for (size_t b = 0; b < a; b++) {
+                const double *w = q + b * d;
+                double dot = 0;
+                for (size_t j = 0; j < d; j++) dot += u[j] * w[j];
+                for (size_t j = 0; j < d; j++) u[j] -= dot * w[j];
+            }
+            double norm = 0;
+            for (size_t j = 0; j < d; j++) norm += u[j] * u[j];
+            norm = std::sqrt(norm);
+            if (norm < 1e-30) {
+                std::fill(u, u + d, 0.0);
+                u[a % d] = 1.0;
+                norm = 1.0;
+            }
+            for (size_t j = 0; j < d; j++) u[j] /= norm;
+        }
+    }
+
+    // jacobi_eigen diagonalizes the symmetric r x r matrix a with cyclic
+    // Jacobi rotations: a ends with the eigenvalues on its diagonal, and v
+    // (r x r) holds the matching eigenvectors in its columns.
+    static void jacobi_eigen(std::vector<double> &a, std::vector<double> &v,
+                             size_t r) {
+        v.assign(r * r, 0.0);
+        for (size_t i = 0; i < r; i++) v[i * r + i] = 1.0;
+        double total = 0;
+        for (double x : a) total += x * x;
+        for (int sweep = 0; sweep < 100; sweep++) {
+            double off = 0;
+            for (size_t p = 0; p < r; p++)
+                for (size_t q = p + 1; q < r; q++) off += a[p * r + q] * a[p * r + q];
+            if (off <= 1e-24 * total) break;
+            for (size_t p = 0; p < r; p++)
+                for (size_t q = p + 1; q < r; q++) {
+                    double apq = a[p * r + q];
+                    if (std::fabs(apq) < 1e-300) continue;
+                    double theta = (a[q * r + q] - a[p * r + p]) / (2 * apq);
+                    double t = (theta >= 0 ? 1.0 : -1.0) /
+                               (std::fabs(theta) + std::sqrt(theta * theta + 1));
+                    double c = 1 / std::sqrt(t * t + 1), s = t * c;
+                    for (size_t k = 0; k < r; k++) {
+                        double akp = a[k * r + p], akq = a[k * r + q];
+                        a[k * r + p] = c * akp - s * akq;
+                        a[k * r + q] = s * akp + c * akq;
+                    }
+                    for (size_t k = 0; k < r; k++) {
+                        double apk = a[p * r + k], aqk = a[q * r + k];
+                        a[p * r + k] = c * apk - s * aqk;
+                        a[q * r + k] = s * apk + c * aqk;
+                    }
+                    for (size_t k = 0; k < r; k++) {
+                        double vkp = v[k * r + p], vkq = v[k * r + q];
+                        v[k * r + p] = c * vkp - s * vkq;
+                        v[k * r + q] = s * vkp + c * vkq;
+                    }
+                }
+        }
+    }
+};
+
+#endif
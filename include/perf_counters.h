@@ -0,0 +1,149 @@
+#ifndef PERF_COUNTERS_H_C2W9LU5E
+#define PERF_COUNTERS_H_C2W9LU5E
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+// Hardware performance counters of the calling thread, through
+// perf_event_open(2): cycles, instructions, LLC misses, dTLB load misses and
+// branch misses, user space only. Every event is opened on its own, so a
+// counter the CPU (or the hypervisor) does not expose is only reported as
+// unavailable. When the kernel multiplexes the counters, the counts are
+// scaled by time_enabled / time_running.
+
+enum PerfEvent {
+    perf_cycles,
+    perf_instructions,
+    perf_llc_misses,
+    perf_dtlb_misses,
+    perf_branch_misses,
+    num_perf_events
+};
+
+inline const char *perf_event_name(int e) {
+    static const char *names[num_perf_events] = {
+        "cycles", "instructions", "LLC misses", "dTLB misses", "branch misses"};
+    return names[e];
+}
+
+struct PerfCounts {
+    uint64_t value[num_perf_events] = {};
+    bool valid[num_perf_events] = {};
+
+    void add(const PerfCounts &o) {
+        for (int e = 0; e < num_perf_events; e++) {
+            value[e] += o.value[e];
+            valid[e] |= o.valid[e];
+        }
+    }
+
+    bool any_valid() const {
+        for (int e = 0; e < num_perf_events; e++)
+            if (valid[e]) return true;
+        return false;
+    }
+};
+
+class PerfCounters {
+   public:
+    // open the counters of the calling thread, disabled. It returns false
+    // when none of them can be opened (no PMU, perf_event_paranoid, ...).
+    bool open() {
+        static const struct {
+            uint32_t type;
+            uint64_t config;
+        } events[num_perf_events] = {
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+            {PERF_TYPE_HW_CACHE,
+             PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        };
+
+        bool any = false;
+        for (int e = 0; e < num_perf_events; e++) {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = events[e].type;
+            attr.config = events[e].config;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format =
+                PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds[e] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+            any |= fds[e] >= 0;
+        }
+        return any;
+    }
+
+    ~PerfCounters() {
+        for (int e = 0; e < num_perf_events; e++)
+            if (fds[e] >= 0) close(fds[e]);
+    }
+
+    void start() {
+        for (int e = 0; e < num_perf_events; e++)
+            if (fds[e] >= 0) ioctl(fds[e], PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    void stop() {
+        for (int e = 0; e < num_perf_events; e++)
+            if (fds[e] >= 0) ioctl(fds[e], PERF_EVENT_IOC_DISABLE, 0);
+    }
+
+    // read the counts accumulated while started
+    PerfCounts read_counts() const {
+        PerfCounts counts;
+        for (int e = 0; e < num_perf_events; e++) {
+            uint64_t data[3];  // value, time enabled, time running
+            if (fds[e] < 0 || read(fds[e], data, sizeof(data)) != sizeof(data))
+                continue;
+            counts.valid[e] = true;
+            if (data[2] > 0 && data[2] < data[1])
+                counts.value[e] = (uint64_t)((double)data[0] * data[1] / data[2]);
+            else
+                counts.value[e] = data[0];
+        }
+        return counts;
+    }
+
+   private:
+    int fds[num_perf_events] = {-1, -1, -1, -1, -1};
+};
+
+// print_perf_counts writes the totals, per page and per vector ratios, and
+// the instructions per cycle.
+inline void print_perf_counts(const PerfCounts &c, uint64_t pages,
+                              uint64_t vectors) {
+    if (!c.any_valid()) {
+        printf(" > perf counters     : not available\n");
+        return;
+    }
+    printf(" > perf counters     :\n");
+    printf("   %-14s %16s %12s %12s\n", "counter", "total", "per page",
+           "per vector");
+    for (int e = 0; e < num_perf_events; e++) {
+        if (!c.valid[e]) {
+            printf("   %-14s %16s\n", perf_event_name(e), "n/a");
+            continue;
+        }
+        printf("   %-14s %16lu %12.2f %12.3f\n", perf_event_name(e), c.value[e],
+               pages ? (double)c.value[e] / pages : 0.0,
+               vectors ? (double)c.value[e] / vectors : 0.0);
+    }
+    if (c.valid[perf_cycles] && c.valid[perf_instructions] && c.value[perf_cycles])
+        printf("   %-14s %16.3f\n", "IPC",
+               (double)c.value[perf_instructions] / c.value[perf_cycles]);
+}
+
+#endif
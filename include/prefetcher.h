@@ -0,0 +1,233 @@
+#ifndef PREFETCHER_H_N7D4YB3S
+#define PREFETCHER_H_N7D4YB3S
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "buffer_pool.h"
+#include "collection.h"
+#include "topology.h"
+
+// ClusterPrefetcher overlaps the page reads of a query with its distance
+// computation. A query hands over the pages of its probed clusters, in probe
+// order; background I/O threads read them into a bounded ring of staging
+// slots while the worker scores the pages that are already there.
+//
+// Two limits bound the read-ahead:
+// - the staging ring: at most staging_pages pages are read but not yet
+//   released by the worker;
+// - the prefetch depth: only the pages of the next `depth` clusters after
+//   the one being scored are read ahead, so pages of clusters the query
+//   may never need are not fetched too early.
+//
+// With page bounds (see bound_pages), a page whose bound can not beat the
+// current top-k of the query (set_bound) is not read, the worker skips it.
+//
+// With a buffer pool the slots hold pinned pool pages instead of copies.
+// The I/O threads run on io_cpus when given (see topology.h), away from the
+// cores of the scan workers.
+
+// max_staging_pages bounds the staging ring of each of the num_workers
+// workers pinning pages of the pool: if their pinned pages fill a partition,
+// the I/O threads wait for a frame that no worker can release. It is 0 when
+// the partitions can not hold even one page per worker.
+inline size_t max_staging_pages(const BufferPool &pool, size_t num_workers) {
+    return pool.partition_capacity() / std::max<size_t>(1, num_workers);
+}
+
+class ClusterPrefetcher {
+   public:
+    ClusterPrefetcher(const Collection &collection, BufferPool *pool,
+                      size_t depth, size_t staging_pages, size_t io_threads,
+                      const std::vector<int> &io_cpus = {})
+        : collection(collection), pool(pool), depth(depth),
+          slots(std::max<size_t>(1, staging_pages)), io_cpus(io_cpus) {
+        page_size = collection.meta.page_size;
+        for (auto &slot : slots)
+            if (!pool)
+                slot.buffer = (char *)aligned_alloc(4096, page_size);
+        for (size_t i = 0; i < std::max<size_t>(1, io_threads); i++)
+            io_workers.emplace_back(&ClusterPrefetcher::io_run, this);
+    }
+
+    ~ClusterPrefetcher() {
+        end();
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            stop = true;
+        }
+        cv.notify_all();
+        for (auto &t : io_workers) t.join();
+        for (auto &slot : slots) free(slot.buffer);
+    }
+
+    ClusterPrefetcher(const ClusterPrefetcher &) = delete;
+    ClusterPrefetcher &operator=(const ClusterPrefetcher &) = delete;
+
+    // begin starts the read-ahead of the query pages, rank[i] is the probe
+    // position of the cluster of page pids[i] (non decreasing), bounds (if
+    // not null) the lower bound of the distance to each page.
+    void begin(const std::vector<uint64_t> &pids, const std::vector<uint32_t> &rank,
+               const std::vector<float> *bounds = nullptr) {
+        std::lock_guard<std::mutex> lock(mu);
+        this->pids = pids;
+        this->rank = rank;
+        if (bounds)
+            this->bounds = *bounds;
+        else
+            this->bounds.clear();
+        bound = std::numeric_limits<float>::max();
+        next_issue = 0;
+        consumed = 0;
+        active = true;
+        cv.notify_all();
+    }
+
+    // wait blocks until page i of the sequence is read, and returns it (or
+    // nullptr if the read failed). The time spent waiting is accumulated in
+    // io_wait_ns.
+    const char *wait(size_t i) {
+        std::unique_lock<std::mutex> lock(mu);
+        Slot &slot = slots[i % slots.size()];
+        if (!(slot.index == i && slot.state == SlotState::ready)) {
+            auto start = std::chrono::steady_clock::now();
+            cv.wait(lock, [&]() {
+                return slot.index == i && slot.state == SlotState::ready;
+            });
+            io_wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              std::chrono::steady_clock::now() - start)
+                              .count();
+        }
+        return slot.ok ? slot.data : nullptr;
+    }
+
+    // release hands back the slot of page i, which must be the oldest page
+    // not yet released.
+    void release(size_t i) {
+        std::lock_guard<std::mutex> lock(mu);
+        Slot &slot = slots[i % slots.size()];
+        slot.handle.release();
+        slot.state = SlotState::empty;
+        consumed = i + 1;
+        cv.notify_all();
+    }
+
+    // set_bound gives the k-th distance of the query so far, the pages not
+    // issued yet with a lower bound above it are not read.
+    void set_bound(float new_bound) {
+        std::lock_guard<std::mutex> lock(mu);
+        bound = new_bound;
+    }
+
+    // end stops the read-ahead of the current query (e.g. when it
+    // terminates early) and waits for the reads in flight.
+    void end() {
+        std::unique_lock<std::mutex> lock(mu);
+        active = false;
+        cv.wait(lock, [&]() { return in_flight == 0; });
+        for (auto &slot : slots) {
+            slot.handle.release();
+            slot.state = SlotState::empty;
+            slot.index = SIZE_MAX;
+        }
+    }
+
+    // total time the worker waited for a page that was not read yet
+    uint64_t io_wait_ns = 0;
+    // pages read by the I/O threads
+    uint64_t pages_read = 0;
+    // pages not read, as their bound could not beat the top-k
+    uint64_t pages_skipped = 0;
+
+   private:
+    enum class SlotState { empty, loading, ready };
+
+    struct Slot {
+        char *buffer = nullptr;
+        BufferPool::PageHandle handle;
+        const char *data = nullptr;
+        size_t index = SIZE_MAX;
+        SlotState state = SlotState::empty;
+        bool ok = false;
+    };
+
+    // can_issue tells whether the next page is within the staging ring and
+    // within the prefetch depth of the cluster being scored.
+    bool can_issue() const {
+        if (!active || next_issue >= pids.size()) return false;
+        if (next_issue >= consumed + slots.size()) return false;
+        size_t current = std::min(consumed, pids.size() - 1);
+        return rank[next_issue] <= rank[current] + depth;
+    }
+
+    void io_run() {
+        if (!io_cpus.empty()) pin_thread(io_cpus);
+        std::unique_lock<std::mutex> lock(mu);
+        while (true) {
+            cv.wait(lock, [&]() { return stop || can_issue(); });
+            if (stop) return;
+
+            size_t i = next_issue++;
+            uint64_t pid = pids[i];
+            Slot &slot = slots[i % slots.size()];
+            slot.index = i;
+            if (!bounds.empty() && bounds[i] >= bound) {
+                slot.ok = false;
+                slot.state = SlotState::ready;
+                pages_skipped++;
+                cv.notify_all();
+                continue;
+            }
+            slot.state = SlotState::loading;
+            in_flight++;
+            lock.unlock();
+
+            bool ok;
+            if (pool) {
+                BufferPool::PageHandle handle = pool->get(pid);
+                ok = (bool)handle;
+                slot.data = handle.data();
+                slot.handle = std::move(handle);
+            } else {
+                ok = collection.read_page(pid, slot.buffer);
+                slot.data = slot.buffer;
+            }
+
+            lock.lock();
+            slot.ok = ok;
+            slot.state = SlotState::ready;
+            pages_read++;
+            in_flight--;
+            cv.notify_all();
+        }
+    }
+
+    const Collection &collection;
+    BufferPool *pool;
+    size_t depth;
+    size_t page_size;
+
+    std::mutex mu;
+    std::condition_variable cv;
+    std::vector<Slot> slots;
+    std::vector<std::thread> io_workers;
+    std::vector<int> io_cpus;
+
+    std::vector<uint64_t> pids;
+    std::vector<uint32_t> rank;
+    std::vector<float> bounds;
+    float bound = std::numeric_limits<float>::max();
+    size_t next_issue = 0;
+    size_t consumed = 0;
+    size_t in_flight = 0;
+    bool active = false;
+    bool stop = false;
+};
+
+#endif
@@ -0,0 +1,189 @@
+#ifndef PROTOCOL_H_P4X7NA2G
+#define PROTOCOL_H_P4X7NA2G
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+// Binary query protocol of sedann_server, over a Unix domain socket or a
+// localhost TCP connection. All fields are little endian.
+//
+// A request is a QueryRequestHeader followed by num_queries * dimension
+// floats. The server answers every request with a QueryResponseHeader
+// followed by num_queries * k uint32 ids, then num_queries * k float
+// distances, each query closest first (missing neighbors are UINT32_MAX and
+// FLT_MAX). A client may send several requests without waiting: responses
+// carry the request_id and may come back in any order. On an error status
+// the response has no payload. A request whose dimension is not the
+// collection's is answered without reading its queries, then the server
+// closes the connection.
+
+const uint32_t QUERY_REQUEST_MAGIC = 0x51444e53;   // "SNDQ"
+const uint32_t QUERY_RESPONSE_MAGIC = 0x52444e53;  // "SNDR"
+const uint32_t QUERY_MAX_K = 1024;
+const uint32_t QUERY_MAX_BATCH = 65536;
+
+enum QueryStatus : int32_t {
+    query_ok = 0,
+    query_bad_request = 1,  // wrong dimension, k or batch size
+    query_io_error = 2,     // a page could not be read
+};
+
+#pragma pack(push, 1)
+struct QueryRequestHeader {
+    uint32_t magic = QUERY_REQUEST_MAGIC;
+    uint32_t num_queries = 0;
+    uint32_t dimension = 0;
+    uint32_t k = 0;
+    uint32_t nprobe = 0;
+    uint32_t reserved = 0;
+    uint64_t request_id = 0;
+};
+
+struct QueryResponseHeader {
+    uint32_t magic = QUERY_RESPONSE_MAGIC;
+    int32_t status = query_ok;
+    uint64_t request_id = 0;
+    uint32_t num_queries = 0;
+    uint32_t k = 0;
+};
+#pragma pack(pop)
+
+inline size_t request_payload_size(const QueryRequestHeader &h) {
+    return (size_t)h.num_queries * h.dimension * sizeof(float);
+}
+
+inline size_t response_payload_size(const QueryResponseHeader &h) {
+    if (h.status != query_ok) return 0;
+    return (size_t)h.num_queries * h.k * (sizeof(uint32_t) + sizeof(float));
+}
+
+// Server addresses are either "unix:<path>" or "<port>" / "tcp:<port>" for
+// a TCP socket on 127.0.0.1.
+inline bool parse_server_address(const std::string &address, bool *is_unix,
+                                 std::string *path, uint16_t *port) {
+    if (address.rfind("unix:", 0) == 0) {
+        *is_unix = true;
+        *path = address.substr(5);
+        return !path->empty() && path->size() < sizeof(sockaddr_un::sun_path);
+    }
+    std::string p = address.rfind("tcp:", 0) == 0 ? address.substr(4) : address;
+    char *end = nullptr;
+    unsigned long v = strtoul(p.c_str(), &end, 10);
+    *is_unix = false;
+    *port = v;
+    return !p.empty() && *end == '\0' && v > 0 && v < 65536;
+}
+
+// listen_socket returns a listening socket on the address, or -1.
+inline int listen_socket(const std::string &address) {
+    bool is_unix;
+    std::string path;
+    uint16_t port;
+    if (!parse_server_address(address, &is_unix, &path, &port)) {
+        std::cerr << "invalid server address: " << address << std::endl;
+        return -1;
+    }
+
+    int fd = socket(is_unix ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    int ret;
+    if (is_unix) {
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path.c_str());
+        unlink(path.c_str());
+        ret = bind(fd, (sockaddr *)&addr, sizeof(addr));
+    } else {
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        ret = bind(fd, (sockaddr *)&addr, sizeof(addr));
+    }
+    if (ret < 0 || listen(fd, 128) < 0) {
+        std::cerr << "failed to listen on " << address << ": " << strerror(errno)
+                  << std::endl;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// connect_socket returns a connected socket to the address, or -1.
+inline int connect_socket(const std::string &address) {
+    bool is_unix;
+    std::string path;
+    uint16_t port;
+    if (!parse_server_address(address, &is_unix, &path, &port)) {
+        std::cerr << "invalid server address: " << address << std::endl;
+        return -1;
+    }
+
+    int fd = socket(is_unix ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    int ret;
+    if (is_unix) {
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path.c_str());
+        ret = connect(fd, (sockaddr *)&addr, sizeof(addr));
+    } else {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        ret = connect(fd, (sockaddr *)&addr, sizeof(addr));
+    }
+    if (ret < 0) {
+        std::cerr << "failed to connect to " << address << ": "
+                  << strerror(errno) << std::endl;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// send_all and recv_all move exactly len bytes over a blocking socket.
+inline bool send_all(int fd, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+inline bool recv_all(int fd, void *buf, size_t len) {
+    char *p = (char *)buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,556 @@
+#ifndef ROUTER_H_H2C6TD8V
+#define ROUTER_H_H2C6TD8V
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "distances.h"
+#include "topk.h"
+#include "vecs.h"
+
+// CentroidRouter sends each query to its nprobe closest clusters without
+// faiss. It offers two strategies over the same centroid matrix:
+// - flat  : a brute-force scan blocked for the cache, a tile of centroids is
+//           kept in L2 while a block of queries is scored against it, four
+//           queries per load of a centroid (fvec_L2sqr_batch_4).
+// - graph : a beam search over a small proximity graph (exact kNN graph
+//           pruned with the relative neighborhood rule, as in NSG/HNSW),
+//           with every adjacency list aligned to a cache line. The beam is
+//           seeded from a flat scan of ~sqrt(n) sampled centroids.
+// With RouteMode::automatic the cheaper one is picked from the number of
+// centroids and the batch size, see select_mode().
+//
+// The graph is an exact kNN, O(n^2 d) to build (seconds for 10k centroids),
+// so it is saved next to the centroid file, e.g. centroids_10k.fvecs ->
+// centroids_10k.graph, and open_graph() loads it at the next start. It is
+// rebuilt when the centroids (count, dimension, contents) or the degree no
+// longer match.
+
+enum class RouteMode { automatic, flat, graph };
+
+inline const char *route_mode_name(RouteMode mode) {
+    switch (mode) {
+        case RouteMode::flat:
+            return "flat";
+        case RouteMode::graph:
+            return "graph";
+        default:
+            return "auto";
+    }
+}
+
+inline std::string router_graph_filename(const std::string &centroids_filename) {
+    size_t dot = centroids_filename.rfind('.');
+    size_t slash = centroids_filename.rfind('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return centroids_filename + ".graph";
+    return centroids_filename.substr(0, dot) + ".graph";
+}
+
+constexpr uint32_t ROUTER_GRAPH_MAGIC = 0x48505247;  // "GRPH"
+constexpr uint32_t ROUTER_GRAPH_VERSION = 1;
+
+class CentroidRouter {
+   public:
+    // maximum out-degree of the graph, R+1 uint32 fill whole cache lines
+    size_t graph_degree = 31;
+    // nearest neighbors considered per node when building the graph
+    size_t build_candidates = 64;
+    // a candidate is pruned when it is prune_alpha times closer to a kept
+    // neighbor than to the node, > 1 keeps more long edges (as in Vamana)
+    float prune_alpha = 1.2f;
+    // beam width (ef) of the graph search, at least nprobe
+    size_t search_width = 48;
+    // queries scored together against a tile of centroids, multiple of 4
+    size_t query_block = 8;
+    // bytes of centroids per tile in the flat scan, about half of L2
+    size_t tile_bytes = 256 * 1024;
+
+    // relative cost of a graph hop vs a sequential distance in the flat
+    // scan (random access, heap work), and the flat scan speed up when a
+    // batch shares each tile.
+    double graph_hop_cost = 1.2;
+    double flat_batch_speedup = 2.5;
+
+    CentroidRouter() = default;
+    CentroidRouter(const CentroidRouter &) = delete;
+    CentroidRouter &operator=(const CentroidRouter &) = delete;
+
+    ~CentroidRouter() {
+        free(centroids);
+        free(adjacency);
+    }
+
+    // init copies the n x d centroid matrix, each row padded to a cache line.
+    void init(const float *data, size_t n, size_t d) {
+        num_centroids = n;
+        dim = d;
+        stride = (d + 15) / 16 * 16;
+        free(centroids);
+        centroids = (float *)aligned_alloc(64, n * stride * sizeof(float) + 64);
+        memset(centroids, 0, n * stride * sizeof(float));
+        for (size_t i = 0; i < n; i++)
+            memcpy(centroids + i * stride, data + i * d, d * sizeof(float));
+        free(adjacency);
+        adjacency = nullptr;
+    }
+
+    // load reads the centroids from a bvecs/fvecs/npy file.
+    bool load(const std::string &filename) {
+        VecsReader reader;
+        if (!reader.open(filename.c_str())) return false;
+        std::vector<float> data(reader.info.num_vectors * reader.info.dimension);
+        if (!reader.read_float(0, reader.info.num_vectors, data.data()))
+            return false;
+        init(data.data(), reader.info.num_vectors, reader.info.dimension);
+        return true;
+    }
+
+    size_t size() const { return num_centroids; }
+    size_t dimension() const { return dim; }
+    bool has_graph() const { return adjacency != nullptr; }
+    const float *centroid(size_t i) const { return centroids + i * stride; }
+
+    // select_mode estimates the distance computations per query of both
+    // strategies: the flat scan computes all n, cheaper per distance in a
+    // batch, the graph search visits about ef * degree nodes at random.
+    RouteMode select_mode(size_t nq, size_t nprobe) const {
+        if (!has_graph()) return RouteMode::flat;
+        double flat_cost = num_centroids;
+        if (nq >= 4) flat_cost /= flat_batch_speedup;
+        double ef = std::max(search_width, nprobe);
+        double graph_cost = seeds.size() + ef * average_degree * graph_hop_cost;
+        return flat_cost <= graph_cost ? RouteMode::flat : RouteMode::graph;
+    }
+
+    // route writes the nprobe closest clusters of each query (and their
+    // squared distances, if distances is not null), from the closest. The
+    // queries are split over num_thread threads.
+    void route(size_t nq, const float *queries, size_t nprobe,
+               uint32_t *cluster_ids, float *distances,
+               RouteMode mode = RouteMode::automatic,
+               uint32_t num_thread = 1) const {
+        if (mode == RouteMode::automatic) mode = select_mode(nq, nprobe);
+        if (mode == RouteMode::graph && !has_graph()) mode = RouteMode::flat;
+        nprobe = std::min(nprobe, num_centroids);
+
+        auto run = [&](size_t q_start, size_t q_end) {
+            if (mode == RouteMode::flat) {
+                route_flat(q_end - q_start, queries + q_start * dim, nprobe,
+                           cluster_ids + q_start * nprobe,
+                           distances ? distances + q_start * nprobe : nullptr);
+                return;
+            }
+            for (size_t q = q_start; q < q_end; q++)
+                route_graph(queries + q * dim, nprobe,
+                            cluster_ids + q * nprobe,
+                            distances ? distances + q * nprobe : nullptr);
+        };
+
+        if (num_thread <= 1 || nq < 2 * query_block) {
+            run(0, nq);
+            return;
+        }
+        // whole query blocks per thread
+        size_t blocks = (nq + query_block - 1) / query_block;
+        size_t blocks_per_thread = (blocks + num_thread - 1) / num_thread;
+        std::vector<std::thread> workers;
+        for (size_t start = 0; start < nq;
+             start += blocks_per_thread * query_block) {
+            size_t end = std::min(nq, start + blocks_per_thread * query_block);
+            workers.emplace_back(run, start, end);
+        }
+        for (auto &t : workers) t.join();
+    }
+
+    // route_flat scans every centroid, tile by tile, for blocks of queries.
+    void route_flat(size_t nq, const float *queries, size_t nprobe,
+                    uint32_t *cluster_ids, float *distances) const {
+        const size_t tile =
+            std::max<size_t>(16, tile_bytes / (stride * sizeof(float)));
+        std::vector<TopK> results(query_block, TopK(nprobe));
+        float dis[4];
+
+        for (size_t q0 = 0; q0 < nq; q0 += query_block) {
+            size_t qn = std::min(query_block, nq - q0);
+            for (size_t i = 0; i < qn; i++) results[i].reset(nprobe);
+
+            for (size_t c0 = 0; c0 < num_centroids; c0 += tile) {
+                size_t c1 = std::min(num_centroids, c0 + tile);
+                if (qn == 1) {
+                    for (size_t c = c0; c < c1; c++)
+                        results[0].push(
+                            fvec_L2sqr_avx(queries + q0 * dim, centroid(c), dim), c);
+                    continue;
+                }
+                for (size_t g = 0; g < qn; g += 4) {
+                    // the last group repeats its last query when qn % 4 != 0
+                    const float *q[4];
+                    for (size_t j = 0; j < 4; j++)
+                        q[j] = queries + (q0 + std::min(g + j, qn - 1)) * dim;
+                    size_t gn = std::min<size_t>(4, qn - g);
+                    for (size_t c = c0; c < c1; c++) {
+                        fvec_L2sqr_batch_4(centroid(c), q[0], q[1], q[2], q[3],
+                                           dim, dis);
+                        for (size_t j = 0; j < gn; j++)
+                            results[g + j].push(dis[j], c);
+                    }
+                }
+            }
+
+            for (size_t i = 0; i < qn; i++)
+                results[i].write_sorted(cluster_ids + (q0 + i) * nprobe,
+                                        distances ? distances + (q0 + i) * nprobe
+                                                  : nullptr);
+        }
+    }
+
+    // route_graph is a best-first beam search over the graph.
+    void route_graph(const float *query, size_t nprobe, uint32_t *cluster_ids,
+                     float *distances) const {
+        SearchScratch &scratch = search_scratch();
+        if (scratch.visited.size() < num_centroids) {
+            scratch.visited.assign(num_centroids, 0);
+            scratch.epoch = 0;
+        }
+        if (++scratch.epoch == 0) {
+            std::fill(scratch.visited.begin(), scratch.visited.end(), 0);
+            scratch.epoch = 1;
+        }
+        const uint32_t epoch = scratch.epoch;
+        uint32_t *visited = scratch.visited.data();
+
+        size_t ef = std::max(search_width, nprobe);
+        TopK results(ef);
+        using Candidate = std::pair<float, uint32_t>;
+        std::priority_queue<Candidate, std::vector<Candidate>,
+                            std::greater<Candidate>>
+            candidates;
+
+        // the beam starts from the closest seeds, a coarse sample of the
+        // centroids scanned in full, so well separated groups of centroids
+        // are still reached
+        for (uint32_t s : seeds) {
+            float dist = fvec_L2sqr_avx(query, centroid(s), dim);
+            visited[s] = epoch;
+            if (results.push(dist, s)) candidates.emplace(dist, s);
+        }
+
+        while (!candidates.empty()) {
+            Candidate cur = candidates.top();
+            if (results.full() && cur.first > results.threshold()) break;
+            candidates.pop();
+
+            const uint32_t *adj = neighbors(cur.second);
+            uint32_t degree = adj[0];
+            for (uint32_t i = 1; i <= degree; i++)
+                _mm_prefetch((const char *)centroid(adj[i]), _MM_HINT_T0);
+            for (uint32_t i = 1; i <= degree; i++) {
+                uint32_t nb = adj[i];
+                if (visited[nb] == epoch) continue;
+                visited[nb] = epoch;
+                float dist = fvec_L2sqr_avx(query, centroid(nb), dim);
+                if (results.push(dist, nb)) candidates.emplace(dist, nb);
+            }
+        }
+
+        auto best = results.sorted();
+        for (size_t i = 0; i < nprobe; i++) {
+            cluster_ids[i] = i < best.size() ? best[i].second : UINT32_MAX;
+            if (distances)
+                distances[i] = i < best.size() ? best[i].first
+                                               : std::numeric_limits<float>::max();
+        }
+    }
+
+    // build_graph builds the proximity graph over the centroids: the exact
+    // nearest neighbors of every centroid (with the flat scan), pruned so a
+    // neighbor is kept only if it is closer to the node than to any kept
+    // neighbor, then completed with reverse edges and made reachable from
+    // the entry point.
+    void build_graph(uint32_t num_thread = std::thread::hardware_concurrency()) {
+        const size_t n = num_centroids;
+        const size_t R = std::min(graph_degree, n > 0 ? n - 1 : 0);
+        const size_t K = std::min(std::max(build_candidates, R), n);
+        adjacency_stride = (graph_degree + 1 + 15) / 16 * 16;
+        free(adjacency);
+        adjacency = (uint32_t *)aligned_alloc(
+            64, n * adjacency_stride * sizeof(uint32_t) + 64);
+        memset(adjacency, 0, n * adjacency_stride * sizeof(uint32_t));
+
+        // exact kNN of every centroid, the first one is the centroid itself
+        std::vector<uint32_t> knn(n * K);
+        std::vector<float> knn_dist(n * K);
+        std::vector<float> flat(n * dim);
+        for (size_t i = 0; i < n; i++)
+            memcpy(flat.data() + i * dim, centroid(i), dim * sizeof(float));
+        route(n, flat.data(), K, knn.data(), knn_dist.data(), RouteMode::flat,
+              std::max<uint32_t>(1, num_thread));
+
+        // relative neighborhood pruning, on squared distances
+        const float alpha2 = prune_alpha * prune_alpha;
+        auto prune = [&](size_t start, size_t end) {
+            for (size_t p = start; p < end; p++) {
+                uint32_t *adj = neighbors_mut(p);
+                for (size_t j = 0; j < K && adj[0] < R; j++) {
+                    uint32_t c = knn[p * K + j];
+                    if (c == p || c == UINT32_MAX) continue;
+                    bool keep = true;
+                    for (uint32_t k = 1; k <= adj[0] && keep; k++)
+                        keep = alpha2 * fvec_L2sqr_avx(centroid(c),
+                                                       centroid(adj[k]), dim) >=
+                               knn_dist[p * K + j];
+                    if (keep) adj[++adj[0]] = c;
+                }
+            }
+        };
+        size_t per_thread = (n + num_thread - 1) / std::max<uint32_t>(1, num_thread);
+        std::vector<std::thread> workers;
+        for (size_t s = 0; s < n; s += per_thread)
+            workers.emplace_back(prune, s, std::min(n, s + per_thread));
+        for (auto &t : workers) t.join();
+
+        // reverse edges, while there is room
+        std::vector<std::pair<uint32_t, uint32_t>> edges;
+        for (size_t p = 0; p < n; p++) {
+            const uint32_t *adj = neighbors(p);
+            for (uint32_t i = 1; i <= adj[0]; i++) edges.emplace_back(adj[i], p);
+        }
+        for (auto &e : edges) {
+            uint32_t *adj = neighbors_mut(e.first);
+            if (adj[0] >= R || std::find(adj + 1, adj + 1 + adj[0], e.second) !=
+                                   adj + 1 + adj[0])
+                continue;
+            adj[++adj[0]] = e.second;
+        }
+
+        // the entry point is the centroid closest to the mean
+        std::vector<float> mean(dim, 0.0f);
+        for (size_t i = 0; i < n; i++)
+            for (size_t j = 0; j < dim; j++) mean[j] += centroid(i)[j] / n;
+        float best = std::numeric_limits<float>::max();
+        for (size_t i = 0; i < n; i++) {
+            float dist = fvec_L2sqr_avx(mean.data(), centroid(i), dim);
+            if (dist < best) best = dist, entry_point = i;
+        }
+
+        // link every node that is not reachable from the entry point to its
+        // closest reachable neighbor
+        std::vector<bool> reached(n, false);
+        std::vector<uint32_t> frontier;
+        auto expand = [&](uint32_t from) {
+            frontier.push_back(from);
+            reached[from] = true;
+            while (!frontier.empty()) {
+                uint32_t p = frontier.back();
+                frontier.pop_back();
+                const uint32_t *adj = neighbors(p);
+                for (uint32_t i = 1; i <= adj[0]; i++)
+                    if (!reached[adj[i]]) {
+                        reached[adj[i]] = true;
+                        frontier.push_back(adj[i]);
+                    }
+            }
+        };
+        if (n > 0) expand(entry_point);
+        for (size_t p = 0; p < n; p++) {
+            if (reached[p]) continue;
+            uint32_t from = entry_point;
+            for (size_t j = 0; j < K; j++) {
+                uint32_t c = knn[p * K + j];
+                if (c != UINT32_MAX && reached[c]) {
+                    from = c;
+                    break;
+                }
+            }
+            uint32_t *adj = neighbors_mut(from);
+            if (adj[0] < R) adj[++adj[0]] = p;
+            else adj[R] = p;  // drop the farthest kept neighbor
+            expand(p);
+        }
+
+        // seeds: about sqrt(n) centroids spread over the matrix, starting
+        // with the entry point
+        size_t num_seeds = std::min<size_t>(n, std::max<size_t>(1, std::sqrt(n)));
+        seeds.clear();
+        if (n > 0) seeds.push_back(entry_point);
+        for (size_t i = 0; i < n && seeds.size() < num_seeds; i += n / num_seeds)
+            if (i != entry_point) seeds.push_back(i);
+
+        size_t total_degree = 0;
+        for (size_t p = 0; p < n; p++) total_degree += neighbors(p)[0];
+        average_degree = n ? (double)total_degree / n : 0;
+    }
+
+    double graph_average_degree() const { return average_degree; }
+
+    // save_graph writes the graph with the shape and a checksum of the
+    // centroids it was built on. The file is written aside and renamed, so
+    // processes starting together never read a partial one.
+    bool save_graph(const std::string &filename) const {
+        if (!has_graph()) return false;
+        std::string tmp_filename = filename + ".tmp";
+        FILE *f = fopen(tmp_filename.c_str(), "w");
+        if (!f) {
+            std::cerr << "failed to open the router graph: " << tmp_filename
+                      << std::endl;
+            return false;
+        }
+        uint64_t n = num_centroids, num_seeds = seeds.size();
+        uint32_t d = dim, degree = graph_degree;
+        uint64_t checksum = centroid_checksum();
+        fwrite(&ROUTER_GRAPH_MAGIC, sizeof(uint32_t), 1, f);
+        fwrite(&ROUTER_GRAPH_VERSION, sizeof(uint32_t), 1, f);
+        fwrite(&n, sizeof(uint64_t), 1, f);
+        fwrite(&d, sizeof(uint32_t), 1, f);
+        fwrite(&degree, sizeof(uint32_t), 1, f);
+        fwrite(&checksum, sizeof(uint64_t), 1, f);
+        fwrite(&entry_point, sizeof(uint32_t), 1, f);
+        fwrite(&num_seeds, sizeof(uint64_t), 1, f);
+        fwrite(seeds.data(), sizeof(uint32_t), num_seeds, f);
+        // the degree and the neighbors of every node, without the padding
+        for (size_t p = 0; p < n; p++)
+            fwrite(neighbors(p), sizeof(uint32_t), graph_degree + 1, f);
+        bool ok = !ferror(f);
+        ok = fclose(f) == 0 && ok;
+        if (ok) ok = rename(tmp_filename.c_str(), filename.c_str()) == 0;
+        if (!ok) {
+            std::cerr << "failed to write the router graph: " << filename
+                      << std::endl;
+            unlink(tmp_filename.c_str());
+        }
+        return ok;
+    }
+
+    // load_graph reads a graph written by save_graph. It returns false when
+    // the file is missing, or was built on other centroids or with another
+    // degree (and reports why).
+    bool load_graph(const std::string &filename) {
+        FILE *f = fopen(filename.c_str(), "r");
+        if (!f) return false;
+        uint32_t magic = 0, version = 0, d = 0, degree = 0, entry = 0;
+        uint64_t n = 0, checksum = 0, num_seeds = 0;
+        bool ok = fread(&magic, sizeof(uint32_t), 1, f) == 1 &&
+                  fread(&version, sizeof(uint32_t), 1, f) == 1 &&
+                  fread(&n, sizeof(uint64_t), 1, f) == 1 &&
+                  fread(&d, sizeof(uint32_t), 1, f) == 1 &&
+                  fread(&degree, sizeof(uint32_t), 1, f) == 1 &&
+                  fread(&checksum, sizeof(uint64_t), 1, f) == 1 &&
+                  fread(&entry, sizeof(uint32_t), 1, f) == 1 &&
+                  fread(&num_seeds, sizeof(uint64_t), 1, f) == 1;
+        if (!ok || magic != ROUTER_GRAPH_MAGIC || version != ROUTER_GRAPH_VERSION) {
+            std::cerr << "unsupported router graph, rebuilding it: " << filename
+                      << std::endl;
+            fclose(f);
+            return false;
+        }
+        if (n != num_centroids || d != dim || degree != graph_degree ||
+            checksum != centroid_checksum() || entry >= n || num_seeds > n) {
+            std::cerr << "stale router graph (" << n << " x " << d
+                      << ", degree " << degree << "), rebuilding it: "
+                      << filename << std::endl;
+            fclose(f);
+            return false;
+        }
+
+        std::vector<uint32_t> loaded_seeds(num_seeds);
+        const size_t row = graph_degree + 1;
+        const size_t loaded_stride = (graph_degree + 1 + 15) / 16 * 16;
+        uint32_t *loaded = (uint32_t *)aligned_alloc(
+            64, n * loaded_stride * sizeof(uint32_t) + 64);
+        memset(loaded, 0, n * loaded_stride * sizeof(uint32_t));
+        ok = fread(loaded_seeds.data(), sizeof(uint32_t), num_seeds, f) ==
+             num_seeds;
+        for (size_t p = 0; p < n && ok; p++)
+            ok = fread(loaded + p * loaded_stride, sizeof(uint32_t), row, f) ==
+                 row;
+        fclose(f);
+        // every id must be a node, a corrupt file is rebuilt as well
+        for (size_t p = 0; p < n && ok; p++) {
+            const uint32_t *adj = loaded + p * loaded_stride;
+            ok = adj[0] <= graph_degree;
+            for (uint32_t i = 1; i <= adj[0] && ok; i++) ok = adj[i] < n;
+        }
+        for (uint32_t s : loaded_seeds) ok = ok && s < n;
+        if (!ok) {
+            std::cerr << "bad router graph, rebuilding it: " << filename
+                      << std::endl;
+            free(loaded);
+            return false;
+        }
+
+        free(adjacency);
+        adjacency = loaded;
+        adjacency_stride = loaded_stride;
+        entry_point = entry;
+        seeds = std::move(loaded_seeds);
+        size_t total_degree = 0;
+        for (size_t p = 0; p < n; p++) total_degree += neighbors(p)[0];
+        average_degree = n ? (double)total_degree / n : 0;
+        return true;
+    }
+
+    // open_graph loads the graph saved next to the centroid file, or builds
+    // it and saves it for the next start. It returns true if it was loaded.
+    bool open_graph(const std::string &centroids_filename,
+                    uint32_t num_thread = std::thread::hardware_concurrency()) {
+        std::string filename = router_graph_filename(centroids_filename);
+        if (load_graph(filename)) return true;
+        build_graph(num_thread);
+        // a read-only data directory only costs the rebuild at every start
+        save_graph(filename);
+        return false;
+    }
+
+   private:
+    struct SearchScratch {
+        std::vector<uint32_t> visited;
+        uint32_t epoch = 0;
+    };
+
+    static SearchScratch &search_scratch() {
+        static thread_local SearchScratch scratch;
+        return scratch;
+    }
+
+    // adjacency list of node p: the degree followed by the neighbor ids
+    const uint32_t *neighbors(size_t p) const {
+        return adjacency + p * adjacency_stride;
+    }
+    uint32_t *neighbors_mut(size_t p) { return adjacency + p * adjacency_stride; }
+
+    // FNV-1a over the centroids, a graph built on other centroids of the
+    // same shape is stale
+    uint64_t centroid_checksum() const {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (size_t i = 0; i < num_centroids; i++) {
+            const unsigned char *bytes = (const unsigned char *)centroid(i);
+            for (size_t j = 0; j < dim * sizeof(float); j++)
+                hash = (hash ^ bytes[j]) * 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    float *centroids = nullptr;
+    size_t num_centroids = 0;
+    size_t dim = 0;
+    size_t stride = 0;
+
+    uint32_t *adjacency = nullptr;
+    size_t adjacency_stride = 0;
+    uint32_t entry_point = 0;
+    std::vector<uint32_t> seeds;
+    double average_degree = 0;
+};
+
+#endif
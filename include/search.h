@@ -0,0 +1,469 @@
+#ifndef SEARCH_H_Q5J8WE2P
+#define SEARCH_H_Q5J8WE2P
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <tuple>
+#include <vector>
+
+#include "buffer_pool.h"
+#include "collection.h"
+#include "kernels.h"
+#include "latency.h"
+#include "prefetcher.h"
+#include "router.h"
+#include "topk.h"
+
+// Query search over a clustered collection: the router gives the nprobe
+// closest clusters, their pages are read (from memory, through the buffer
+// pool, or from the file) and every vector is scored into a top-k heap. The
+// candidates of a reduced collection are then re-ranked with their full
+// vectors (see Reranker).
+
+struct SearchOptions {
+    size_t k = 10;
+    size_t nprobe = 8;
+    RouteMode route_mode = RouteMode::automatic;
+    bool use_simd = true;
+    // stop a distance once it can not enter the top-k anymore
+    bool early_abandon = true;
+    // skip the pages whose summary shows they can not enter the top-k (with
+    // the page bounds of the collection loaded)
+    bool prune_pages = true;
+
+    // adaptive probing: nprobe becomes the most clusters a query probes, it
+    // stops before the next cluster (see ProbeTermination) when
+    // - its centroid is farther than probe_ratio times the k-th distance so
+    //   far (l2 collections only, 0: off),
+    // - the top-k has not changed in the last probe_patience clusters (0: off)
+    float probe_ratio = 0;
+    size_t probe_patience = 0;
+
+    // candidates kept from the pages of a reduced collection and re-ranked
+    // with their full vectors, at least k (0: 4 k)
+    size_t rerank = 0;
+
+    // clusters read ahead of the one being scored, 0 reads each page right
+    // before scoring it (no overlap of I/O and computation)
+    size_t prefetch_depth = 2;
+    size_t staging_pages = 64;  // pages read but not scored yet, at most
+    size_t io_threads = 2;      // concurrent reads per worker
+
+    // thread placement (see topology.h), empty: not pinned
+    std::vector<int> worker_cpus;  // CPU of worker i
+    std::vector<int> io_cpus;      // CPUs of the I/O threads
+
+    // queries in flight per worker with the coroutine execution (see
+    // async_search.h), 0 runs one query at a time; each query reads
+    // read_window pages ahead
+    size_t in_flight = 0;
+    size_t read_window = 4;
+};
+
+// compute_distances computes the distance between the query and the n
+// vectors of a page with the kernel of the collection. With a bound (the
+// k-th best distance so far) and a kernel that supports it, the distances
+// reaching the bound are abandoned early and only known to be >= bound; it
+// returns how many were. The pages of a transposed collection are scored a
+// tile at a time, and out must hold n rounded up to the tile. The page
+// holds the elements of the encoding of the kernel.
+inline uint32_t compute_distances(const DistanceKernel &kernel,
+                                  const void *page_data, uint32_t n, uint32_t dim,
+                                  const float *query, float *out,
+                                  float bound = std::numeric_limits<float>::max()) {
+    const char *page = (const char *)page_data;
+    const size_t vector_bytes = (size_t)dim * encoding_size(kernel.encoding);
+    if (kernel.tile) {
+        bool bounded = bound != std::numeric_limits<float>::max() && kernel.tile_bounded;
+        for (uint32_t i = 0; i < n; i += kernel.tile) {
+            // the tile of vector i (a multiple of the tile) starts at element i * dim
+            if (bounded)
+                kernel.tile_bounded(query, page + i * vector_bytes, dim, out + i, bound);
+            else
+                kernel.tile_distance(query, page + i * vector_bytes, dim, out + i);
+        }
+        uint32_t abandoned = 0;
+        if (bounded)
+            for (uint32_t i = 0; i < n; i++) abandoned += out[i] >= bound;
+        return abandoned;
+    }
+    if (kernel.encoding != Encoding::f32) {
+        if (bound == std::numeric_limits<float>::max() || !kernel.encoded_bounded) {
+            for (uint32_t i = 0; i < n; i++)
+                out[i] = kernel.encoded(query, page + i * vector_bytes, dim);
+            return 0;
+        }
+        uint32_t abandoned = 0;
+        for (uint32_t i = 0; i < n; i++) {
+            out[i] = kernel.encoded_bounded(query, page + i * vector_bytes, dim, bound);
+            abandoned += out[i] >= bound;
+        }
+        return abandoned;
+    }
+    const float *vectors = (const float *)page;
+    if (bound == std::numeric_limits<float>::max() || !kernel.bounded) {
+        for (uint32_t i = 0; i < n; i++)
+            out[i] = kernel.distance(query, vectors + (size_t)i * dim, dim);
+        return 0;
+    }
+    uint32_t abandoned = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        out[i] = kernel.bounded(query, vectors + (size_t)i * dim, dim, bound);
+        abandoned += out[i] >= bound;
+    }
+    return abandoned;
+}
+
+struct QueryStats {
+    uint64_t pages_scanned = 0;
+    uint64_t vectors_scored = 0;
+    uint64_t vectors_abandoned = 0;  // rejected by the bound (early abandon)
+    uint64_t pages_skipped = 0;      // rejected by their page bound
+    uint64_t clusters_probed = 0;
+    uint64_t vectors_reranked = 0;   // full vectors read (reduced collections)
+};
+
+// ProbeTermination decides when a query stops probing clusters, from the
+// squared distances of the probed centroids (the router's) and the top-k.
+// The clusters are visited in centroid distance order: once the next
+// centroid is farther than the ratio times the k-th distance (both squared
+// l2, the ratio is squared too), the clusters left are unlikely to hold a
+// closer vector; a top-k unchanged over the last clusters has converged.
+class ProbeTermination {
+   public:
+    ProbeTermination(const SearchOptions &opt, Metric metric,
+                     const float *cluster_dists)
+        : patience(opt.probe_patience), cluster_dists(cluster_dists) {
+        if (opt.probe_ratio > 0 && metric == Metric::l2 && cluster_dists)
+            ratio_sq = opt.probe_ratio * opt.probe_ratio;
+    }
+
+    bool enabled() const { return ratio_sq > 0 || patience > 0; }
+
+    // stop is called before the first page of every probed cluster but the
+    // first one (the r-th of the probe), changed tells whether the top-k
+    // changed in the previous cluster; it returns true to stop there.
+    bool stop(size_t r, bool changed, const TopK &topk) {
+        unchanged = changed ? 0 : unchanged + 1;
+        if (patience > 0 && unchanged >= patience) return true;
+        return ratio_sq > 0 && topk.full() &&
+               cluster_dists[r] > ratio_sq * topk.threshold();
+    }
+
+   private:
+    float ratio_sq = 0;
+    size_t patience;
+    const float *cluster_dists;
+    size_t unchanged = 0;
+};
+
+// Reranker scores the candidates of a reduced collection again, with their
+// full vectors: the scan keeps the best candidates(k) by the distance of the
+// projected pages, and the full distances pick the k nearest of them. It is
+// disabled on the other collections, the pages are exact.
+class Reranker {
+   public:
+    Reranker(const Collection &collection, const SearchOptions &opt)
+        : collection(collection), rerank_candidates(opt.rerank) {
+        if (!enabled()) return;
+        dim = collection.query_dimension();
+        kernel = select_kernel(collection.meta.metric, dim, opt.use_simd);
+        full_query.resize(dim);
+        vectors.resize(dim);
+    }
+
+    bool enabled() const { return collection.reduced(); }
+
+    // candidates is the size of the top-k of the scan for k results.
+    size_t candidates(size_t k) const {
+        if (!enabled()) return k;
+        return std::max(k, rerank_candidates ? rerank_candidates : 4 * k);
+    }
+
+    // prepare sets the query, as given (not prepared for the pages).
+    void prepare(const float *query) {
+        if (enabled()) collection.prepare_full_query(query, full_query.data());
+    }
+
+    // select scores the n candidate ids with their full vectors (n rows of
+    // the query dimension) and writes the k nearest, closest first.
+    void select(const uint32_t *ids, const float *full, size_t n, size_t k,
+                uint32_t *out_ids, float *out_dists) {
+        topk.reset(k);
+        for (size_t i = 0; i < n; i++)
+            topk.push(kernel.distance(full_query.data(), full + i * dim, dim), ids[i]);
+        topk.write_sorted(out_ids, out_dists);
+    }
+
+    // rerank reads the full vectors of the n candidate ids and selects the
+    // k nearest. It returns false when a vector can not be read.
+    bool rerank(const uint32_t *ids, size_t n, size_t k, uint32_t *out_ids,
+                float *out_dists) {
+        vectors.resize(n * dim);
+        for (size_t i = 0; i < n; i++)
+            if (!collection.read_full_vector(ids[i], vectors.data() + i * dim))
+                return false;
+        select(ids, vectors.data(), n, k, out_ids, out_dists);
+        return true;
+    }
+
+    size_t dimension() const { return dim; }
+
+   private:
+    const Collection &collection;
+    size_t rerank_candidates;  // SearchOptions::rerank
+    size_t dim = 0;
+    DistanceKernel kernel;
+    TopK topk;
+    std::vector<float> full_query;
+    std::vector<float> vectors;
+};
+
+// bound_pages computes the lower bound of the distance to every page of a
+// query (see Collection::page_lower_bound), and sorts the pages of each
+// probed cluster by it, so the closest pages tighten the top-k first and
+// more of the others are skipped. The query is in the form of the pages.
+inline void bound_pages(const Collection &collection, const DistanceKernel &kernel,
+                        const float *query, std::vector<uint64_t> &pids,
+                        std::vector<uint32_t> &cluster_of_page,
+                        std::vector<float> &bounds) {
+    const size_t dim = collection.meta.dimension;
+    float query_norm = 0;
+    if (collection.meta.metric != Metric::l2) {
+        for (size_t j = 0; j < dim; j++) query_norm += query[j] * query[j];
+        query_norm = std::sqrt(query_norm);
+    }
+    std::vector<std::pair<float, uint64_t>> cluster_pages;
+    bounds.resize(pids.size());
+    for (size_t first = 0, last; first < pids.size(); first = last) {
+        for (last = first; last < pids.size() && cluster_of_page[last] == cluster_of_page[first];)
+            last++;
+        cluster_pages.clear();
+        for (size_t i = first; i < last; i++)
+            cluster_pages.emplace_back(
+                collection.page_lower_bound(kernel, query, query_norm, pids[i]), pids[i]);
+        std::sort(cluster_pages.begin(), cluster_pages.end());
+        for (size_t i = first; i < last; i++)
+            std::tie(bounds[i], pids[i]) = cluster_pages[i - first];
+    }
+}
+
+// Searcher runs the queries of one worker thread, it owns the worker's
+// prefetcher and scratch space.
+class Searcher {
+   public:
+    // memory, when not null, holds the whole collection file; otherwise the
+    // pages come from the pool (if any) or the file.
+    Searcher(const Collection &collection, const std::vector<uint32_t> &ids,
+             const CentroidRouter &router, const SearchOptions &opt,
+             BufferPool *pool = nullptr, const char *memory = nullptr)
+        : collection(collection), ids(ids), router(router), opt(opt),
+          pool(pool), memory(memory), topk(opt.k), reranker(collection, opt) {
+        const CollectionMeta &meta = collection.meta;
+        kernel = select_kernel(meta.metric, meta.dimension, opt.use_simd,
+                               meta.tile, meta.encoding);
+        if (!memory && opt.prefetch_depth > 0)
+            prefetcher.reset(new ClusterPrefetcher(collection, pool,
+                                                   opt.prefetch_depth,
+                                                   opt.staging_pages,
+                                                   opt.io_threads,
+                                                   opt.io_cpus));
+        if (!memory && !pool)
+            page_buffer = (char *)aligned_alloc(4096, meta.page_size);
+        cluster_ids.resize(opt.nprobe);
+        cluster_dists.resize(opt.nprobe);
+        distances.resize(meta.vectors_per_page);
+    }
+
+    ~Searcher() { free(page_buffer); }
+
+    // search writes the k nearest ids and distances of the query, closest
+    // first. It returns false when a page can not be read.
+    bool search(const float *query, uint32_t *out_ids, float *out_dists) {
+        using clock = std::chrono::steady_clock;
+        clock::time_point start, t0;
+        if (latency) start = clock::now();
+
+        size_t nprobe = std::min(opt.nprobe, collection.meta.clusters.size());
+        router.route(1, query, nprobe, cluster_ids.data(), cluster_dists.data(),
+                     opt.route_mode);
+        if (latency) {
+            t0 = clock::now();
+            latency->record(Stage::routing, elapsed_ns(start, t0));
+        }
+
+        bool ok = scan(query, cluster_ids.data(), nprobe, opt.k, out_ids,
+                       out_dists, cluster_dists.data());
+        if (latency) latency->record(Stage::total, elapsed_ns(start, clock::now()));
+        return ok;
+    }
+
+    // scan searches the given clusters of an already routed query, and
+    // writes its k nearest ids and distances, closest first. With the
+    // squared distances of the centroids, the probing is adaptive (see
+    // SearchOptions::probe_ratio).
+    bool scan(const float *query, const uint32_t *clusters, size_t nprobe,
+              size_t k, uint32_t *out_ids, float *out_dists,
+              const float *cluster_dists = nullptr) {
+        using clock = std::chrono::steady_clock;
+        const CollectionMeta &meta = collection.meta;
+        clock::time_point t0, t1;
+        uint64_t io_ns = 0, distance_ns = 0, topk_ns = 0;
+        const float no_bound = std::numeric_limits<float>::max();
+        const size_t candidates = reranker.candidates(k);
+        topk.reset(candidates, collection.has_replicas);
+        reranker.prepare(query);
+        // the query in the form of the pages (dimension order, norm,
+        // projection)
+        if (collection.query_needs_preparing()) {
+            prepared_query.resize(meta.dimension);
+            collection.prepare_query(query, prepared_query.data());
+            query = prepared_query.data();
+        }
+
+        // the pages of the probed clusters, in probe order
+        pids.clear();
+        rank.clear();
+        cluster_of_page.clear();
+        for (size_t r = 0; r < nprobe; r++) {
+            uint32_t cid = clusters[r];
+            if (cid >= meta.clusters.size()) continue;
+            const ClusterInfo &c = meta.clusters[cid];
+            for (uint64_t p = 0; p < c.num_pages; p++) {
+                pids.push_back(c.first_page + p);
+                rank.push_back(r);
+                cluster_of_page.push_back(cid);
+            }
+        }
+
+        bool prune = opt.prune_pages && !collection.page_bounds.empty();
+        if (prune) bound_pages(collection, kernel, query, pids, cluster_of_page, bounds);
+
+        ProbeTermination termination(opt, meta.metric, cluster_dists);
+        bool changed = false;
+
+        bool ok = true;
+        if (prefetcher) prefetcher->begin(pids, rank, prune ? &bounds : nullptr);
+        for (size_t i = 0; i < pids.size() && ok; i++) {
+            uint64_t pid = pids[i];
+            const char *page = nullptr;
+            BufferPool::PageHandle handle;
+            if (i == 0 || rank[i] != rank[i - 1]) {
+                if (i > 0 && termination.enabled() &&
+                    termination.stop(rank[i], changed, topk))
+                    break;
+                changed = false;
+                stats.clusters_probed++;
+            }
+            if (prune && bounds[i] >= topk.threshold()) {
+                // the prefetcher may have skipped the read already
+                if (prefetcher) {
+                    prefetcher->wait(i);
+                    prefetcher->release(i);
+                }
+                stats.pages_skipped++;
+                continue;
+            }
+            if (latency) t0 = clock::now();
+            if (memory) {
+                page = memory + (page_offsets ? page_offsets[pid]
+                                              : pid * meta.page_size);
+            } else if (prefetcher) {
+                page = prefetcher->wait(i);
+            } else if (pool) {
+                handle = pool->get(pid);
+                page = handle.data();
+            } else if (collection.read_page(pid, page_buffer)) {
+                page = page_buffer;
+            }
+            if (!page) {
+                ok = false;
+                break;
+            }
+
+            uint32_t n = collection.vectors_in_page(cluster_of_page[i], pid);
+            const uint32_t *page_ids = ids.data() + pid * meta.vectors_per_page;
+            if (latency) t1 = clock::now();
+            stats.vectors_abandoned += compute_distances(
+                kernel, page, n, meta.dimension, query,
+                distances.data(), opt.early_abandon ? topk.threshold() : no_bound);
+            if (latency) {
+                clock::time_point t2 = clock::now();
+                io_ns += elapsed_ns(t0, t1);
+                distance_ns += elapsed_ns(t1, t2);
+                t1 = t2;
+            }
+            for (uint32_t j = 0; j < n; j++)
+                changed |= topk.push(distances[j], page_ids[j]);
+            if (latency) topk_ns += elapsed_ns(t1, clock::now());
+            stats.pages_scanned++;
+            stats.vectors_scored += n;
+
+            if (prefetcher) {
+                prefetcher->release(i);
+                if (prune) prefetcher->set_bound(topk.threshold());
+            }
+        }
+        if (prefetcher) prefetcher->end();
+
+        if (latency) t0 = clock::now();
+        if (!reranker.enabled()) {
+            topk.write_sorted(out_ids, out_dists);
+        } else {
+            candidate_ids.resize(candidates);
+            topk.write_sorted(candidate_ids.data(), nullptr);
+        }
+        if (latency) {
+            t1 = clock::now();
+            // I/O from memory is not I/O, it is not recorded
+            if (!memory) latency->record(Stage::io_wait, io_ns);
+            latency->record(Stage::distance, distance_ns);
+            latency->record(Stage::topk_merge, topk_ns + elapsed_ns(t0, t1));
+        }
+        if (reranker.enabled() && ok) {
+            size_t n = topk.size();
+            ok = reranker.rerank(candidate_ids.data(), n, k, out_ids, out_dists);
+            stats.vectors_reranked += n;
+            if (latency) latency->record(Stage::rerank, elapsed_ns(t1, clock::now()));
+        }
+        return ok;
+    }
+
+    uint64_t io_wait_ns() const { return prefetcher ? prefetcher->io_wait_ns : 0; }
+
+    QueryStats stats;
+    // per-stage latencies of the queries, not recorded when null
+    StageHistograms *latency = nullptr;
+    // offset of every page in memory when they are not in file order (see
+    // NumaPartitioning::alloc_pages), null otherwise
+    const uint64_t *page_offsets = nullptr;
+
+   private:
+    const Collection &collection;
+    const std::vector<uint32_t> &ids;
+    const CentroidRouter &router;
+    SearchOptions opt;
+    BufferPool *pool;
+    const char *memory;
+
+    std::unique_ptr<ClusterPrefetcher> prefetcher;
+    DistanceKernel kernel;
+    char *page_buffer = nullptr;
+    TopK topk;
+    Reranker reranker;
+    std::vector<uint32_t> candidate_ids;
+    std::vector<float> distances;
+    std::vector<float> bounds;
+    std::vector<float> prepared_query;
+    std::vector<uint32_t> cluster_ids;
+    std::vector<float> cluster_dists;
+    std::vector<uint64_t> pids;
+    std::vector<uint32_t> rank;
+    std::vector<uint32_t> cluster_of_page;
+};
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef TOPK_H_B8N3RW5K
+#define TOPK_H_B8N3RW5K
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+// TopK keeps the k smallest (distance, id) pairs seen so far in a max-heap,
+// so the current k-th distance, the bound a candidate has to beat, is always
+// at the top. A unique TopK keeps an id once: the vectors replicated in
+// several clusters (see tools_assign) are met once per probed copy.
+class TopK {
+   public:
+    explicit TopK(size_t k = 0, bool unique = false) : k(k), unique(unique) {
+        heap.reserve(k);
+    }
+
+    void reset(size_t new_k, bool new_unique = false) {
+        k = new_k;
+        unique = new_unique;
+        heap.clear();
+        heap.reserve(k);
+    }
+
+    // threshold is the distance a new candidate has to be below to enter.
+    float threshold() const {
+        return heap.size() < k ? std::numeric_limits<float>::max()
+                               : heap.front().first;
+    }
+
+    bool full() const { return heap.size() >= k; }
+    size_t size() const { return heap.size(); }
+
+    // push returns true when the candidate entered the top-k. The ids of a
+    // unique TopK are only compared for the candidates passing the bound, a
+    // copy has the same distance as the entry it would duplicate.
+    bool push(float dist, uint32_t id) {
+        if (unique && dist < threshold() && contains(id)) return false;
+        if (heap.size() < k) {
+            heap.emplace_back(dist, id);
+            std::push_heap(heap.begin(), heap.end());
+            return true;
+        }
+        if (k == 0 || dist >= heap.front().first) return false;
+        std::pop_heap(heap.begin(), heap.end());
+        heap.back() = {dist, id};
+        std::push_heap(heap.begin(), heap.end());
+        return true;
+    }
+
+    // sorted returns the entries from the closest, the heap is left intact.
+    std::vector<std::pair<float, uint32_t>> sorted() const {
+        std::vector<std::pair<float, uint32_t>> res = heap;
+        std::sort(res.begin(), res.end());
+        return res;
+    }
+
+    // write_sorted fills k ids and distances, from the closest. Missing
+    // entries get UINT32_MAX as id and the max float as distance.
+    void write_sorted(uint32_t *ids, float *dists) const {
+        auto res = sorted();
+        for (size_t i = 0; i < k; i++) {
+            ids[i] = i < res.size() ? res[i].second : UINT32_MAX;
+            if (dists)
+                dists[i] = i < res.size() ? res[i].first
+                                          : std::numeric_limits<float>::max();
+        }
+    }
+
+   private:
+    bool contains(uint32_t id) const {
+        for (auto &e : heap)
+            if (e.second == id) return true;
+        return false;
+    }
+
+    size_t k;
+    bool unique;
+    std::vector<std::pair<float, uint32_t>> heap;
+};
+
+#endif
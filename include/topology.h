@@ -0,0 +1,279 @@
+#ifndef TOPOLOGY_H_B6T1NW8J
+#define TOPOLOGY_H_B6T1NW8J
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// CPU topology of the process, as Linux exposes it:
+// - the CPUs it may run on (sched_getaffinity, which includes the cgroup
+//   cpuset of a container);
+// - for each of them, its physical core (SMT siblings), its L3 cache and
+//   its NUMA node, from /sys/devices/system/cpu;
+// - the cgroup CPU quota (cpu.max for cgroup v2, cfs_quota_us for v1),
+//   which caps how many CPUs worth of time the process gets.
+// plan_threads places the scan workers one per physical core and the I/O
+// threads away from them.
+
+struct CpuInfo {
+    int cpu;
+    int core;     // first CPU of its SMT siblings, identifies the core
+    int package;
+    int l3;       // first CPU sharing its L3 cache, -1 when unknown
+    int node;     // NUMA node, 0 when unknown
+};
+
+// parse_cpu_list reads a cpulist such as "0-3,8,10-11".
+inline std::vector<int> parse_cpu_list(const std::string &list) {
+    std::vector<int> cpus;
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos) end = list.size();
+        std::string range = list.substr(pos, end - pos);
+        int first, last;
+        if (sscanf(range.c_str(), "%d-%d", &first, &last) == 2) {
+            for (int c = first; c <= last; c++) cpus.push_back(c);
+        } else if (sscanf(range.c_str(), "%d", &first) == 1) {
+            cpus.push_back(first);
+        }
+        pos = end + 1;
+    }
+    return cpus;
+}
+
+inline bool read_first_line(const std::string &filename, std::string *line) {
+    std::ifstream f(filename);
+    return f && std::getline(f, *line);
+}
+
+struct ThreadPlacement {
+    std::vector<int> worker_cpus;  // one CPU per worker
+    std::vector<int> io_cpus;      // the CPUs shared by the I/O threads
+};
+
+class Topology {
+   public:
+    // load reads the topology; it never fails, missing files are taken
+    // as one core per CPU on a single node.
+    void load() {
+        cpus.clear();
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        if (sched_getaffinity(0, sizeof(mask), &mask) != 0) {
+            for (int c = 0; c < CPU_SETSIZE; c++) CPU_SET(c, &mask);
+        }
+        std::string online_list;
+        std::vector<int> online;
+        if (read_first_line("/sys/devices/system/cpu/online", &online_list))
+            online = parse_cpu_list(online_list);
+        else
+            for (int c = 0; c < CPU_SETSIZE && CPU_ISSET(c, &mask); c++) online.push_back(c);
+
+        std::map<int, int> node_of_cpu = read_nodes();
+        for (int c : online) {
+            if (!CPU_ISSET(c, &mask)) continue;
+            std::string base = "/sys/devices/system/cpu/cpu" + std::to_string(c);
+            CpuInfo info{c, c, 0, -1, 0};
+            std::string line;
+            if (read_first_line(base + "/topology/thread_siblings_list", &line)) {
+                std::vector<int> siblings = parse_cpu_list(line);
+                if (!siblings.empty()) info.core = siblings.front();
+            }
+            if (read_first_line(base + "/topology/physical_package_id", &line))
+                info.package = atoi(line.c_str());
+            for (int index = 0; index < 8; index++) {
+                std::string cache = base + "/cache/index" + std::to_string(index);
+                std::string level;
+                if (!read_first_line(cache + "/level", &level)) break;
+                if (atoi(level.c_str()) == 3 &&
+                    read_first_line(cache + "/shared_cpu_list", &line)) {
+                    std::vector<int> shared = parse_cpu_list(line);
+                    if (!shared.empty()) info.l3 = shared.front();
+                }
+            }
+            auto node = node_of_cpu.find(c);
+            if (node != node_of_cpu.end()) info.node = node->second;
+            cpus.push_back(info);
+        }
+        if (cpus.empty()) cpus.push_back({0, 0, 0, -1, 0});
+        cpu_quota = read_cpu_quota();
+    }
+
+    // the CPUs the process may run on
+    size_t num_cpus() const { return cpus.size(); }
+
+    size_t num_cores() const {
+        std::set<std::pair<int, int>> cores;
+        for (auto &c : cpus) cores.insert({c.package, c.core});
+        return cores.size();
+    }
+
+    size_t num_nodes() const {
+        std::set<int> nodes;
+        for (auto &c : cpus) nodes.insert(c.node);
+        return nodes.size();
+    }
+
+    std::vector<int> nodes() const {
+        std::set<int> nodes;
+        for (auto &c : cpus) nodes.insert(c.node);
+        return std::vector<int>(nodes.begin(), nodes.end());
+    }
+
+    // node_of is the NUMA node of the CPU, 0 when unknown.
+    int node_of(int cpu) const {
+        for (auto &c : cpus)
+            if (c.cpu == cpu) return c.node;
+        return 0;
+    }
+
+    // the cgroup CPU quota in CPUs, 0 when unlimited
+    double quota() const { return cpu_quota; }
+
+    // usable_cores is the number of physical cores the process can keep
+    // busy: its cores, capped by the cgroup quota (rounded up).
+    size_t usable_cores() const {
+        size_t n = num_cores();
+        if (cpu_quota > 0) n = std::min(n, (size_t)std::ceil(cpu_quota));
+        return std::max<size_t>(1, n);
+    }
+
+    // usable_cpus is the same with every SMT thread.
+    size_t usable_cpus() const {
+        size_t n = num_cpus();
+        if (cpu_quota > 0) n = std::min(n, (size_t)std::ceil(cpu_quota));
+        return std::max<size_t>(1, n);
+    }
+
+    // plan_threads places num_workers scan workers (0: one per usable core,
+    // or per usable CPU with use_smt) one per physical core, spread over the
+    // NUMA nodes and L3 caches, and uses the second SMT thread of a core
+    // only with use_smt or once every core has a worker. The I/O threads get the cores without a worker,
+    // else the idle SMT siblings of the worker cores, else no pinning.
+    ThreadPlacement plan_threads(size_t num_workers, bool use_smt) const {
+        // cores in (node, L3, core) order, each with its SMT siblings
+        std::map<std::tuple<int, int, int, int>, std::vector<int>> cores;
+        for (auto &c : cpus)
+            cores[std::make_tuple(c.node, c.l3, c.package, c.core)].push_back(c.cpu);
+        if (num_workers == 0) num_workers = use_smt ? usable_cpus() : usable_cores();
+
+        // round-robin over the nodes so the workers spread over them
+        std::map<int, std::vector<std::vector<int>>> by_node;
+        for (auto &core : cores) by_node[std::get<0>(core.first)].push_back(core.second);
+        std::vector<std::vector<int>> ordered;
+        for (size_t i = 0; ordered.size() < cores.size(); i++)
+            for (auto &node : by_node)
+                if (i < node.second.size()) ordered.push_back(node.second[i]);
+
+        ThreadPlacement placement;
+        std::vector<bool> core_used(ordered.size(), false);
+        std::set<int> cpu_used;
+        auto add_worker = [&](size_t i, size_t thread) {
+            placement.worker_cpus.push_back(ordered[i][thread]);
+            cpu_used.insert(ordered[i][thread]);
+            core_used[i] = true;
+        };
+        for (size_t i = 0; i < ordered.size() && placement.worker_cpus.size() < num_workers; i++)
+            add_worker(i, 0);
+        if (use_smt || num_workers > ordered.size()) {
+            size_t max_smt = 1;
+            for (auto &core : ordered) max_smt = std::max(max_smt, core.size());
+            for (size_t thread = 1; thread < max_smt; thread++)
+                for (size_t i = 0; i < ordered.size(); i++)
+                    if (placement.worker_cpus.size() < num_workers &&
+                        thread < ordered[i].size())
+                        add_worker(i, thread);
+        }
+        // more workers than CPUs: wrap around
+        for (size_t i = 0; placement.worker_cpus.size() < num_workers; i++)
+            placement.worker_cpus.push_back(placement.worker_cpus[i]);
+
+        for (size_t i = 0; i < ordered.size(); i++)
+            if (!core_used[i])
+                placement.io_cpus.insert(placement.io_cpus.end(),
+                                         ordered[i].begin(), ordered[i].end());
+        if (placement.io_cpus.empty())
+            for (auto &c : cpus)
+                if (!cpu_used.count(c.cpu)) placement.io_cpus.push_back(c.cpu);
+        return placement;
+    }
+
+    std::vector<CpuInfo> cpus;
+
+   private:
+    static std::map<int, int> read_nodes() {
+        std::map<int, int> node_of_cpu;
+        DIR *dir = opendir("/sys/devices/system/node");
+        if (!dir) return node_of_cpu;
+        while (dirent *entry = readdir(dir)) {
+            int node;
+            if (sscanf(entry->d_name, "node%d", &node) != 1) continue;
+            std::string list;
+            if (!read_first_line("/sys/devices/system/node/" +
+                                     std::string(entry->d_name) + "/cpulist",
+                                 &list))
+                continue;
+            for (int c : parse_cpu_list(list)) node_of_cpu[c] = node;
+        }
+        closedir(dir);
+        return node_of_cpu;
+    }
+
+    static double read_cpu_quota() {
+        std::string line;
+        // cgroup v2: "<quota> <period>" or "max <period>"
+        if (read_first_line("/sys/fs/cgroup/cpu.max", &line)) {
+            char quota[32];
+            long period;
+            if (sscanf(line.c_str(), "%31s %ld", quota, &period) == 2 &&
+                std::string(quota) != "max" && period > 0)
+                return atof(quota) / period;
+            return 0;
+        }
+        // cgroup v1
+        std::string quota, period;
+        if (read_first_line("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", &quota) &&
+            read_first_line("/sys/fs/cgroup/cpu/cpu.cfs_period_us", &period)) {
+            long q = atol(quota.c_str()), p = atol(period.c_str());
+            if (q > 0 && p > 0) return (double)q / p;
+        }
+        return 0;
+    }
+
+    double cpu_quota = 0;
+};
+
+// pin_thread binds the calling thread to the CPUs, it returns false when
+// the kernel refuses (or the list is empty).
+inline bool pin_thread(const std::vector<int> &cpu_list) {
+    if (cpu_list.empty()) return false;
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (int c : cpu_list) CPU_SET(c, &mask);
+    return pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) == 0;
+}
+
+inline bool pin_thread(int cpu) { return pin_thread(std::vector<int>{cpu}); }
+
+inline std::string cpu_list_string(const std::vector<int> &cpu_list) {
+    std::string out;
+    for (size_t i = 0; i < cpu_list.size(); i++) {
+        if (i) out += ",";
+        out += std::to_string(cpu_list[i]);
+    }
+    return out.empty() ? "-" : out;
+}
+
+#endif
@@ -0,0 +1,597 @@
+#ifndef VECS_H_K3T8QZ1N
+#define VECS_H_K3T8QZ1N
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Streaming helpers for the vector files used across SeDANN:
+// - *.bvecs, *.fvecs, *.ivecs (texmex format): each vector is a record of
+//   [int32 dim][dim elements], the element is uint8, float, or int32.
+// - *.npy: a 2-D, C-ordered, little-endian numpy array of uint8, float32,
+//   int32 or int64 (the cluster ids produced by faiss are int64).
+//
+// Everything here works on a range of vectors at a time, so billion-scale
+// files can be sliced, converted and paged with a fixed amount of memory.
+
+enum class VecsFormat { bvecs, fvecs, ivecs, npy };
+enum class ElemType { u8, f32, i32, i64 };
+
+struct VecsInfo {
+    VecsFormat format;
+    ElemType elem_type;
+    size_t dimension;
+    size_t num_vectors;
+    size_t header_size;  // bytes before the first vector (npy header only)
+    size_t prefix_size;  // bytes before the elements of a vector (the dim)
+    size_t record_size;  // bytes per vector, including the prefix
+};
+
+inline size_t elem_size(ElemType t) {
+    switch (t) {
+        case ElemType::u8:
+            return 1;
+        case ElemType::f32:
+        case ElemType::i32:
+            return 4;
+        case ElemType::i64:
+            return 8;
+    }
+    return 0;
+}
+
+inline const char *vecs_format_name(VecsFormat f) {
+    switch (f) {
+        case VecsFormat::bvecs:
+            return "bvecs";
+        case VecsFormat::fvecs:
+            return "fvecs";
+        case VecsFormat::ivecs:
+            return "ivecs";
+        case VecsFormat::npy:
+            return "npy";
+    }
+    return "unknown";
+}
+
+inline bool parse_vecs_format(const std::string &name, VecsFormat *format) {
+    if (name == "bvecs") *format = VecsFormat::bvecs;
+    else if (name == "fvecs") *format = VecsFormat::fvecs;
+    else if (name == "ivecs") *format = VecsFormat::ivecs;
+    else if (name == "npy") *format = VecsFormat::npy;
+    else return false;
+    return true;
+}
+
+inline bool parse_elem_type(const std::string &name, ElemType *type) {
+    if (name == "u8" || name == "uint8") *type = ElemType::u8;
+    else if (name == "f32" || name == "float32") *type = ElemType::f32;
+    else if (name == "i32" || name == "int32") *type = ElemType::i32;
+    else if (name == "i64" || name == "int64") *type = ElemType::i64;
+    else return false;
+    return true;
+}
+
+// vecs_format_from_filename guesses the format from the file extension.
+inline bool vecs_format_from_filename(const std::string &filename,
+                                      VecsFormat *format) {
+    size_t dot = filename.rfind('.');
+    if (dot == std::string::npos) return false;
+    return parse_vecs_format(filename.substr(dot + 1), format);
+}
+
+// the element type that is implied by a texmex format
+inline ElemType vecs_default_elem_type(VecsFormat f) {
+    switch (f) {
+        case VecsFormat::bvecs:
+            return ElemType::u8;
+        case VecsFormat::ivecs:
+            return ElemType::i32;
+        default:
+            return ElemType::f32;
+    }
+}
+
+// =============================================================================
+
+// pread_full and pwrite_full retry short reads/writes until len bytes are
+// transferred, they return false on error or on unexpected end of file.
+inline bool pread_full(int fd, void *buf, size_t len, off_t offset) {
+    char *p = (char *)buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+inline bool pwrite_full(int fd, const void *buf, size_t len, off_t offset) {
+    const char *p = (const char *)buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+// =============================================================================
+
+// npy_header builds a version 1.0 header for a 2-D array of n x d elements,
+// padded so the data starts at a multiple of 64 bytes.
+inline std::string npy_header(ElemType t, size_t n, size_t d) {
+    const char *descr = "<f4";
+    if (t == ElemType::u8) descr = "|u1";
+    if (t == ElemType::i32) descr = "<i4";
+    if (t == ElemType::i64) descr = "<i8";
+    std::string dict = std::string("{'descr': '") + descr +
+                       "', 'fortran_order': False, 'shape': (" +
+                       std::to_string(n) + ", " + std::to_string(d) + "), }";
+    size_t total = 10 + dict.size() + 1;
+    size_t padding = (64 - total % 64) % 64;
+    dict.append(padding, ' ');
+    dict.push_back('\n');
+
+    std::string header("\x93NUMPY\x01\x00", 8);
+    uint16_t len = dict.size();
+    header.append((const char *)&len, sizeof(len));
+    header += dict;
+    return header;
+}
+
+inline bool parse_npy_header(int fd, VecsInfo *info) {
+    char magic[8];
+    if (!pread_full(fd, magic, 8, 0) || memcmp(magic, "\x93NUMPY", 6) != 0)
+        return false;
+
+    size_t dict_len = 0, dict_offset = 0;
+    if (magic[6] == 1) {
+        uint16_t len;
+        if (!pread_full(fd, &len, 2, 8)) return false;
+        dict_len = len;
+        dict_offset = 10;
+    } else {
+        uint32_t len;
+        if (!pread_full(fd, &len, 4, 8)) return false;
+        dict_len = len;
+        dict_offset = 12;
+    }
+    std::string dict(dict_len, '\0');
+    if (!pread_full(fd, dict.data(), dict_len, dict_offset)) return false;
+
+    if (dict.find("'fortran_order': False") == std::string::npos) return false;
+    if (dict.find("'<f4'") != std::string::npos) info->elem_type = ElemType::f32;
+    else if (dict.find("'|u1'") != std::string::npos) info->elem_type = ElemType::u8;
+    else if (dict.find("'<i4'") != std::string::npos) info->elem_type = ElemType::i32;
+    else if (dict.find("'<i8'") != std::string::npos) info->elem_type = ElemType::i64;
+    else return false;
+
+    size_t shape = dict.find("'shape': (");
+    if (shape == std::string::npos) return false;
+    size_t n = 0, d = 1;
+    const char *p = dict.c_str() + shape + 10;
+    char *end;
+    n = strtoull(p, &end, 10);
+    if (*end == ',') {
+        while (*end == ',' || *end == ' ') end++;
+        if (*end != ')') d = strtoull(end, &end, 10);
+    }
+
+    info->format = VecsFormat::npy;
+    info->dimension = d;
+    info->num_vectors = n;
+    info->header_size = dict_offset + dict_len;
+    info->prefix_size = 0;
+    info->record_size = d * elem_size(info->elem_type);
+    return true;
+}
+
+// vecs_info builds the description of a file with n vectors of d dimension.
+inline VecsInfo vecs_info(VecsFormat f, ElemType t, size_t d, size_t n) {
+    VecsInfo info{};
+    info.format = f;
+    info.elem_type = f == VecsFormat::npy ? t : vecs_default_elem_type(f);
+    info.dimension = d;
+    info.num_vectors = n;
+    info.header_size =
+        f == VecsFormat::npy ? npy_header(info.elem_type, n, d).size() : 0;
+    info.prefix_size = f == VecsFormat::npy ? 0 : sizeof(int32_t);
+    info.record_size = info.prefix_size + d * elem_size(info.elem_type);
+    return info;
+}
+
+// vecs_probe reads the header of a vector file, the format is guessed from
+// the file extension.
+inline bool vecs_probe(const char *filename, VecsInfo *info) {
+    VecsFormat format;
+    if (!vecs_format_from_filename(filename, &format)) {
+        std::cerr << "unknown vector file extension: " << filename << std::endl;
+        return false;
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "failed to open vector file: " << filename << std::endl;
+        return false;
+    }
+    struct stat st {};
+    fstat(fd, &st);
+    size_t filesize = st.st_size;
+
+    bool ok = true;
+    if (format == VecsFormat::npy) {
+        ok = parse_npy_header(fd, info);
+    } else {
+        int32_t dimension = 0;
+        ok = pread_full(fd, &dimension, sizeof(int32_t), 0) && dimension > 0;
+        if (ok) {
+            *info = vecs_info(format, ElemType::f32, dimension, 0);
+            ok = filesize % info->record_size == 0;
+            info->num_vectors = filesize / info->record_size;
+        }
+    }
+    close(fd);
+
+    if (!ok) {
+        std::cerr << "invalid " << vecs_format_name(format)
+                  << " file: " << filename << std::endl;
+    }
+    return ok;
+}
+
+// =============================================================================
+
+// VecsReader reads raw vectors (as stored in the file, including the dim
+// prefix) by their index.
+class VecsReader {
+   public:
+    VecsInfo info{};
+
+    ~VecsReader() {
+        if (fd >= 0) close(fd);
+    }
+
+    bool open(const char *filename) {
+        if (!vecs_probe(filename, &info)) return false;
+        fd = ::open(filename, O_RDONLY);
+        if (fd < 0) return false;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        return true;
+    }
+
+    // read_raw copies the records of vectors [first, first+n) into buf.
+    bool read_raw(size_t first, size_t n, char *buf) const {
+        return pread_full(fd, buf, n * info.record_size,
+                          info.header_size + first * info.record_size);
+    }
+
+    // read_float reads vectors [first, first+n) into buf as n*dim floats.
+    bool read_float(size_t first, size_t n, float *buf) const;
+
+    int file_descriptor() const { return fd; }
+
+   private:
+    int fd = -1;
+};
+
+template <typename T>
+inline double load_elem(const char *p) {
+    T v;
+    memcpy(&v, p, sizeof(T));
+    return (double)v;
+}
+
+inline double load_elem(ElemType t, const char *p) {
+    switch (t) {
+        case ElemType::u8:
+            return *(const uint8_t *)p;
+        case ElemType::f32:
+            return load_elem<float>(p);
+        case ElemType::i32:
+            return load_elem<int32_t>(p);
+        case ElemType::i64:
+            return load_elem<int64_t>(p);
+    }
+    return 0;
+}
+
+inline void store_elem(ElemType t, double v, char *p) {
+    switch (t) {
+        case ElemType::u8: {
+            double r = std::round(v);
+            *(uint8_t *)p = r < 0 ? 0 : (r > 255 ? 255 : (uint8_t)r);
+            break;
+        }
+        case ElemType::f32: {
+            float f = v;
+            memcpy(p, &f, sizeof(f));
+            break;
+        }
+        case ElemType::i32: {
+            int32_t i = std::llround(v);
+            memcpy(p, &i, sizeof(i));
+            break;
+        }
+        case ElemType::i64: {
+            int64_t i = std::llround(v);
+            memcpy(p, &i, sizeof(i));
+            break;
+        }
+    }
+}
+
+// vecs_convert_records converts n raw records from the in layout into the out
+// layout, adding or stripping the dim prefix and converting the elements.
+// Elements of the same type are copied as is.
+inline void vecs_convert_records(const VecsInfo &in, const char *src, size_t n,
+                                 const VecsInfo &out, char *dst) {
+    const size_t d = in.dimension;
+    const size_t in_es = elem_size(in.elem_type);
+    const size_t out_es = elem_size(out.elem_type);
+    const int32_t dim = d;
+
+    for (size_t i = 0; i < n; i++) {
+        const char *s = src + i * in.record_size + in.prefix_size;
+        char *t = dst + i * out.record_size;
+        if (out.prefix_size) memcpy(t, &dim, sizeof(dim));
+        t += out.prefix_size;
+
+        if (in.elem_type == out.elem_type) {
+            memcpy(t, s, d * in_es);
+            continue;
+        }
+        for (size_t j = 0; j < d; j++)
+            store_elem(out.elem_type, load_elem(in.elem_type, s + j * in_es),
+                       t + j * out_es);
+    }
+}
+
+inline bool VecsReader::read_float(size_t first, size_t n, float *buf) const {
+    std::vector<char> raw(n * info.record_size);
+    if (!read_raw(first, n, raw.data())) return false;
+    VecsInfo out = vecs_info(VecsFormat::npy, ElemType::f32, info.dimension, n);
+    vecs_convert_records(info, raw.data(), n, out, (char *)buf);
+    return true;
+}
+
+// VecsWriter writes a vector file of a known size, a range of vectors at a
+// time and in any order, from floats (or int32 ids); the format comes from
+// the file extension, the element type of npy files is given.
+class VecsWriter {
+   public:
+    VecsInfo info{};
+
+    ~VecsWriter() { close(); }
+
+    bool open(const char *filename, size_t dimension, size_t num_vectors,
+              ElemType npy_type = ElemType::f32) {
+        VecsFormat format;
+        if (!vecs_format_from_filename(filename, &format)) {
+            std::cerr << "unknown vector file extension: " << filename << std::endl;
+            return false;
+        }
+        info = vecs_info(format, npy_type, dimension, num_vectors);
+        fd = ::open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            std::cerr << "failed to open output file: " << filename << std::endl;
+            return false;
+        }
+        if (format == VecsFormat::npy) {
+            std::string header = npy_header(info.elem_type, num_vectors, dimension);
+            if (!pwrite_full(fd, header.data(), header.size(), 0)) return false;
+        }
+        return true;
+    }
+
+    // write_float writes vectors [first, first+n) from n*dim floats.
+    bool write_float(size_t first, size_t n, const float *buf) const {
+        return write_as(ElemType::f32, first, n, buf);
+    }
+
+    // write_int writes vectors [first, first+n) from n*dim int32.
+    bool write_int(size_t first, size_t n, const int32_t *buf) const {
+        return write_as(ElemType::i32, first, n, buf);
+    }
+
+    void close() {
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+    }
+
+   private:
+    bool write_as(ElemType type, size_t first, size_t n, const void *buf) const {
+        VecsInfo in = vecs_info(VecsFormat::npy, type, info.dimension, n);
+        std::vector<char> raw(n * info.record_size);
+        vecs_convert_records(in, (const char *)buf, n, info, raw.data());
+        return pwrite_full(fd, raw.data(), raw.size(),
+                           info.header_size + first * info.record_size);
+    }
+
+    int fd = -1;
+};
+
+// =============================================================================
+
+// pipeline_chunks is a double-buffered loop: produce() fills chunk i+1 in a
+// background thread while consume() converts and writes chunk i. produce
+// returns false to abort, and so does consume.
+inline bool pipeline_chunks(
+    size_t num_chunks, size_t buffer_size,
+    const std::function<bool(size_t, char *)> &produce,
+    const std::function<bool(size_t, char *)> &consume) {
+    std::vector<char> buffers[2] = {std::vector<char>(buffer_size),
+                                    std::vector<char>(buffer_size)};
+    bool full[2] = {false, false};
+    bool failed = false;
+    std::mutex mu;
+    std::condition_variable cv;
+
+    std::thread reader([&]() {
+        for (size_t i = 0; i < num_chunks; i++) {
+            int slot = i % 2;
+            {
+                std::unique_lock<std::mutex> lock(mu);
+                cv.wait(lock, [&]() { return !full[slot] || failed; });
+                if (failed) return;
+            }
+            bool ok = produce(i, buffers[slot].data());
+            {
+                std::lock_guard<std::mutex> lock(mu);
+                if (!ok) failed = true;
+                full[slot] = true;
+            }
+            cv.notify_all();
+            if (!ok) return;
+        }
+    });
+
+    for (size_t i = 0; i < num_chunks; i++) {
+        int slot = i % 2;
+        {
+            std::unique_lock<std::mutex> lock(mu);
+            cv.wait(lock, [&]() { return full[slot] || failed; });
+            if (failed) break;
+        }
+        bool ok = consume(i, buffers[slot].data());
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            if (!ok) failed = true;
+            full[slot] = false;
+        }
+        cv.notify_all();
+        if (!ok) break;
+    }
+
+    reader.join();
+    return !failed;
+}
+
+// copy_range copies len bytes between two files with copy_file_range, so the
+// data does not pass through user space. It falls back to a buffered
+// pread/pwrite loop when the kernel or the filesystem can not do it.
+inline bool copy_range(int in_fd, off_t in_offset, int out_fd,
+                       off_t out_offset, size_t len, size_t chunk_size) {
+    bool fallback = false;
+    while (len > 0) {
+        ssize_t n = copy_file_range(in_fd, &in_offset, out_fd, &out_offset,
+                                    len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                      errno == EOPNOTSUPP)) {
+            fallback = true;
+            break;
+        }
+        if (n <= 0) return false;
+        len -= n;
+    }
+    if (!fallback || len == 0) return true;
+
+    chunk_size = std::min(chunk_size, len);
+    size_t num_chunks = (len + chunk_size - 1) / chunk_size;
+    auto chunk_len = [&](size_t i) {
+        return std::min(chunk_size, len - i * chunk_size);
+    };
+    return pipeline_chunks(
+        num_chunks, chunk_size,
+        [&](size_t i, char *buf) {
+            return pread_full(in_fd, buf, chunk_len(i),
+                              in_offset + i * chunk_size);
+        },
+        [&](size_t i, char *buf) {
+            return pwrite_full(out_fd, buf, chunk_len(i),
+                               out_offset + i * chunk_size);
+        });
+}
+
+// vecs_convert writes vectors [first, first+count) of the input file into
+// the output file with the given format and element type (the element type
+// is only used by npy, the texmex formats imply it). Only two chunks of
+// chunk_size bytes are held in memory at any time.
+inline bool vecs_convert(const char *input_filename,
+                         const char *output_filename, VecsFormat out_format,
+                         ElemType out_elem, size_t first, size_t count,
+                         size_t chunk_size) {
+    VecsReader reader;
+    if (!reader.open(input_filename)) return false;
+    const VecsInfo &in = reader.info;
+
+    if (first > in.num_vectors) first = in.num_vectors;
+    if (count > in.num_vectors - first) count = in.num_vectors - first;
+    if (count == 0) {
+        std::cerr << "no vectors to convert in " << input_filename
+                  << " from index " << first << std::endl;
+        return false;
+    }
+
+    VecsInfo out = vecs_info(out_format, out_elem, in.dimension, count);
+    int out_fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        std::cerr << "failed to open output file: " << output_filename
+                  << std::endl;
+        return false;
+    }
+
+    bool ok = true;
+    if (out.format == VecsFormat::npy) {
+        std::string header = npy_header(out.elem_type, count, out.dimension);
+        ok = pwrite_full(out_fd, header.data(), header.size(), 0);
+    }
+
+    if (ok && in.record_size == out.record_size &&
+        in.elem_type == out.elem_type && in.prefix_size == out.prefix_size) {
+        // same on-disk layout: prefix and slice without touching the data
+        ok = copy_range(reader.file_descriptor(),
+                        in.header_size + first * in.record_size, out_fd,
+                        out.header_size, count * in.record_size, chunk_size);
+    } else if (ok) {
+        size_t per_chunk = std::min(
+            count, std::max<size_t>(1, chunk_size / std::max(in.record_size,
+                                                             out.record_size)));
+        size_t num_chunks = (count + per_chunk - 1) / per_chunk;
+        std::vector<char> converted(per_chunk * out.record_size);
+        auto chunk_vecs = [&](size_t i) {
+            return std::min(per_chunk, count - i * per_chunk);
+        };
+        ok = pipeline_chunks(
+            num_chunks, per_chunk * in.record_size,
+            [&](size_t i, char *buf) {
+                return reader.read_raw(first + i * per_chunk, chunk_vecs(i),
+                                       buf);
+            },
+            [&](size_t i, char *buf) {
+                size_t n = chunk_vecs(i);
+                vecs_convert_records(in, buf, n, out, converted.data());
+                return pwrite_full(
+                    out_fd, converted.data(), n * out.record_size,
+                    out.header_size + i * per_chunk * out.record_size);
+            });
+    }
+
+    close(out_fd);
+    if (!ok) {
+        std::cerr << "failed to convert " << input_filename << " into "
+                  << output_filename << std::endl;
+    }
+    return ok;
+}
+
+#endif
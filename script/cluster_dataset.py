@@ -32,6 +32,11 @@ print(">>> get the first 10M of vectors")
 D = 128
 N = 100000010
 C = 10000
+# closure assignment: each vector is also stored in up to R clusters whose
+# centroid is within (1 + EPSILON) times the distance of its nearest one,
+# R = 1 keeps a single cluster per vector
+R = 1
+EPSILON = 0.1
 dataset = dataset[:N]
 
 kmeans = faiss.Kmeans(d=D, k=C, niter=50, nredo=3, verbose=True, seed=354)
@@ -45,7 +50,14 @@ print(">>> saving the centroids")
 np.save(centroids_save_loc, kmeans.centroids)
 
 print(">>> assigning all vectors to a cluster")
-dists, ids = kmeans.index.search(dataset, 1)
+dists, ids = kmeans.index.search(dataset, R)
+if R > 1:
+    # the distances are squared, the replicas past the factor become -1
+    far = dists > dists[:, :1] * (1 + EPSILON) ** 2
+    far = np.logical_or.accumulate(far, axis=1)
+    ids[far] = -1
+    copies = (ids >= 0).sum()
+    print("      copies per vector:", copies / len(ids))
 print("     ", ids.shape)
 print(">>> saving the clusters")
 np.save(clusters_save_loc, ids)
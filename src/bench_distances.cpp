@@ -0,0 +1,280 @@
+#include <unistd.h>
+#include <x86intrin.h>
+
+#include <algorithm>
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "kernels.h"
+
+namespace po = boost::program_options;
+
+// bench_distances measures the distance kernels of distances.h and
+// kernels.h, one query against many vectors, over
+// - dimensions (96, 128 and 960 by default),
+// - aligned (64 bytes) and unaligned (off by one float) inputs,
+// - working sets sized to stay in L1, L2, L3 or to spill to DRAM,
+// - two layouts: the vectors back to back in memory (a page scan), or the
+//   same vectors visited in a random order (a scattered gather). The tile
+//   kernels read the vectors transposed (see collection.h) and visit whole
+//   tiles in that order.
+// It reports ns/vector, GB/s of vector data and TSC cycles per dimension.
+//
+//   ./bench_distances --dims 128 --kernels avx,avx512 --csv baseline.csv
+
+// A kernel scores one query against n vectors.
+struct Kernel {
+    const char *name;
+    void (*scan)(const float *query, const float *const *vecs, size_t n,
+                 size_t d, float *out);
+};
+
+template <float (*dist)(const float *, const float *, size_t)>
+static void scan_one_by_one(const float *query, const float *const *vecs,
+                            size_t n, size_t d, float *out) {
+    for (size_t i = 0; i < n; i++) out[i] = dist(query, vecs[i], d);
+}
+
+static void scan_batch_4(const float *query, const float *const *vecs,
+                         size_t n, size_t d, float *out) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        fvec_L2sqr_batch_4(query, vecs[i], vecs[i + 1], vecs[i + 2],
+                           vecs[i + 3], d, out + i);
+    for (; i < n; i++) out[i] = fvec_L2sqr_avx(query, vecs[i], d);
+}
+
+// the kernels of kernels.h, picked once for the dimension: unrolled for
+// the common dimensions, the generic loop otherwise
+template <Metric metric>
+static void scan_selected(const float *query, const float *const *vecs,
+                          size_t n, size_t d, float *out) {
+    DistanceKernel kernel = select_kernel(metric, d, true);
+    for (size_t i = 0; i < n; i++) out[i] = kernel.distance(query, vecs[i], d);
+}
+
+// the tile kernels, reading the working set as transposed tiles of B
+// vectors (B * d floats each): tile t is the tile of vecs[t * B], so the
+// random layout visits the tiles in a random order
+template <size_t B, Metric metric>
+static void scan_tiles(const float *query, const float *const *vecs, size_t n,
+                       size_t d, float *out) {
+    DistanceKernel kernel = select_kernel(metric, d, true, B);
+    // the vectors are d floats apart, padded to 16 when 64-byte aligned
+    const float *base = *std::min_element(vecs, vecs + n);
+    size_t stride = (uintptr_t)base % 64 == 0 ? (d + 15) / 16 * 16 : d;
+    size_t num_tiles = n / B;
+    for (size_t t = 0; t < num_tiles; t++) {
+        size_t tile = std::min<size_t>((vecs[t * B] - base) / stride / B,
+                                       num_tiles - 1);
+        kernel.tile_distance(query, base + tile * B * stride, d, out + t * B);
+    }
+    for (size_t i = num_tiles * B; i < n; i++)
+        out[i] = kernel.distance(query, vecs[i], d);
+}
+
+static const Kernel kernels[] = {
+    {"ref", scan_one_by_one<fvec_L2sqr_ref>},
+    {"sse", scan_one_by_one<fvec_L2sqr_sse>},
+    {"avx", scan_one_by_one<fvec_L2sqr_avx>},
+#ifdef __AVX512F__
+    {"avx512", scan_one_by_one<fvec_L2sqr_avx512>},
+#endif
+    {"batch_4", scan_batch_4},
+    {"fixed", scan_selected<Metric::l2>},
+    {"ip", scan_one_by_one<negative_inner_product_avx>},
+    {"ip_fixed", scan_selected<Metric::inner_product>},
+    {"tile_8", scan_tiles<8, Metric::l2>},
+    {"tile_16", scan_tiles<16, Metric::l2>},
+    {"ip_tile_16", scan_tiles<16, Metric::inner_product>},
+};
+
+struct WorkingSet {
+    const char *name;
+    size_t bytes;
+};
+
+// cache_size returns the size of a cache level from sysconf, or the
+// fallback when the system does not tell.
+static size_t cache_size(int name, size_t fallback) {
+    long size = sysconf(name);
+    return size > 0 ? (size_t)size : fallback;
+}
+
+static std::vector<std::string> split(const std::string &s) {
+    std::vector<std::string> out;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, ',')) out.push_back(item);
+    return out;
+}
+
+int main(int argc, char **argv) {
+    std::string args_dims = "96,128,960";
+    std::string args_kernels;
+    std::string args_csv;
+    uint32_t args_min_time_ms = 100;
+    uint32_t args_dram_mb = 512;
+
+    {
+        po::options_description desc("Available arguments");
+        desc.add_options()("help,h", "print usage message");
+        desc.add_options()("dims", po::value<std::string>(&args_dims),
+                           "comma separated dimensions (default: 96,128,960)");
+        desc.add_options()("kernels", po::value<std::string>(&args_kernels),
+                           "comma separated kernels (default: all)");
+        desc.add_options()("min_time", po::value<uint32_t>(&args_min_time_ms),
+                           "time spent per measurement in ms (default: 100)");
+        desc.add_options()("dram_mb", po::value<uint32_t>(&args_dram_mb),
+                           "working set of the DRAM case in mb (default: 512)");
+        desc.add_options()("csv", po::value<std::string>(&args_csv),
+                           "also write the results to this csv file");
+        po::variables_map vm;
+        try {
+            po::store(po::parse_command_line(argc, argv, desc), vm);
+            if (vm.count("help")) {
+                std::cout << desc << "\n";
+                return 0;
+            }
+            po::notify(vm);
+        } catch (std::exception &e) {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+    }
+
+    std::vector<size_t> dims;
+    for (auto &s : split(args_dims)) dims.push_back(std::stoul(s));
+    std::vector<const Kernel *> selected;
+    for (auto &k : kernels) {
+        auto names = split(args_kernels);
+        if (names.empty() || std::find(names.begin(), names.end(), k.name) != names.end())
+            selected.push_back(&k);
+    }
+    if (dims.empty() || selected.empty()) {
+        std::cerr << "Error: no dimension or no known kernel selected\n";
+        return 1;
+    }
+
+    // half of each cache level, so the query and the outputs fit as well
+    size_t l1 = cache_size(_SC_LEVEL1_DCACHE_SIZE, 32 << 10);
+    size_t l2 = cache_size(_SC_LEVEL2_CACHE_SIZE, 1 << 20);
+    size_t l3 = cache_size(_SC_LEVEL3_CACHE_SIZE, 16 << 20);
+    size_t dram = (size_t)args_dram_mb << 20;
+    if (dram < 2 * l3)
+        std::cerr << "warning: the DRAM working set is smaller than twice the "
+                     "L3 cache, see --dram_mb\n";
+    WorkingSet sets[] = {{"L1", l1 / 2}, {"L2", l2 / 2}, {"L3", l3 / 2},
+                         {"DRAM", dram}};
+
+    // the TSC ticks at a fixed rate, close to the nominal frequency
+    double tsc_per_ns;
+    {
+        auto t0 = std::chrono::steady_clock::now();
+        uint64_t c0 = __rdtsc();
+        usleep(50000);
+        uint64_t c1 = __rdtsc();
+        auto t1 = std::chrono::steady_clock::now();
+        tsc_per_ns = (c1 - c0) /
+                     (double)std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
+    }
+
+    printf("L1/L2/L3     : %zu KB / %zu KB / %zu KB\n", l1 >> 10, l2 >> 10,
+           l3 >> 10);
+    printf("TSC          : %.2f GHz\n", tsc_per_ns);
+    printf("min time     : %u ms per measurement\n\n", args_min_time_ms);
+
+    FILE *csv = nullptr;
+    if (!args_csv.empty()) {
+        csv = fopen(args_csv.c_str(), "w");
+        if (!csv) {
+            std::cerr << "failed to open csv file: " << args_csv << std::endl;
+            return -1;
+        }
+        fprintf(csv, "kernel,dim,aligned,working_set,working_set_bytes,layout,"
+                     "ns_per_vector,gb_per_s,cycles_per_dim\n");
+    }
+
+    // one buffer for the largest working set, filled once; a 64 bytes
+    // aligned start, plus one float for the unaligned case
+    size_t max_bytes = 0;
+    for (auto &set : sets) max_bytes = std::max(max_bytes, set.bytes);
+    size_t max_floats = max_bytes / sizeof(float) + 16;
+    float *memory = (float *)aligned_alloc(64, max_floats * sizeof(float));
+    for (size_t i = 0; i < max_floats; i++) memory[i] = (float)mt() / uint32_max;
+    std::vector<std::vector<float>> query_source = gen_random_fvectors(1, 1024);
+
+    printf("%-8s %5s %-9s %-4s %-9s %12s %9s %11s\n", "kernel", "dim", "aligned",
+           "set", "layout", "ns/vector", "GB/s", "cycles/dim");
+    float sink = 0;
+    for (size_t d : dims) {
+        // the query is aligned like the vectors
+        float *query_memory = (float *)aligned_alloc(64, (d + 16) * sizeof(float));
+
+        for (bool aligned : {true, false}) {
+            // aligned vectors start every multiple of 16 floats
+            size_t stride = aligned ? (d + 15) / 16 * 16 : d;
+            const float *base = memory + (aligned ? 0 : 1);
+            float *query = query_memory + (aligned ? 0 : 1);
+            for (size_t j = 0; j < d; j++) query[j] = query_source[0][j % 1024];
+
+            for (auto &set : sets) {
+                size_t n = std::max<size_t>(4, set.bytes / (stride * sizeof(float)));
+                std::vector<float> out(n);
+
+                for (const char *layout : {"seq", "random"}) {
+                    std::vector<const float *> vecs(n);
+                    for (size_t i = 0; i < n; i++) vecs[i] = base + i * stride;
+                    if (strcmp(layout, "random") == 0)
+                        std::shuffle(vecs.begin(), vecs.end(), mt);
+
+                    for (const Kernel *kernel : selected) {
+                        // warm up, then repeat full passes for min_time
+                        kernel->scan(query, vecs.data(), n, d, out.data());
+                        size_t passes = 0;
+                        auto start = std::chrono::steady_clock::now();
+                        uint64_t c0 = __rdtsc();
+                        double elapsed_ns = 0;
+                        do {
+                            kernel->scan(query, vecs.data(), n, d, out.data());
+                            sink += out[passes % n];
+                            passes++;
+                            elapsed_ns = std::chrono::duration<double, std::nano>(
+                                             std::chrono::steady_clock::now() - start)
+                                             .count();
+                        } while (elapsed_ns < args_min_time_ms * 1e6);
+                        uint64_t cycles = __rdtsc() - c0;
+
+                        double scored = (double)passes * n;
+                        double ns_per_vector = elapsed_ns / scored;
+                        double gb_per_s = scored * d * sizeof(float) / elapsed_ns;
+                        double cycles_per_dim = cycles / (scored * d);
+                        printf("%-8s %5zu %-9s %-4s %-9s %12.2f %9.2f %11.3f\n",
+                               kernel->name, d, aligned ? "aligned" : "unaligned",
+                               set.name, layout, ns_per_vector, gb_per_s,
+                               cycles_per_dim);
+                        if (csv)
+                            fprintf(csv, "%s,%zu,%d,%s,%zu,%s,%.3f,%.3f,%.4f\n",
+                                    kernel->name, d, aligned, set.name,
+                                    n * stride * sizeof(float), layout,
+                                    ns_per_vector, gb_per_s, cycles_per_dim);
+                    }
+                }
+            }
+        }
+        free(query_memory);
+    }
+
+    if (csv) fclose(csv);
+    free(memory);
+    // keeps the distances alive
+    if (sink == -1.0f) printf("%f\n", sink);
+    return 0;
+}
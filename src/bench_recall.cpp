@@ -0,0 +1,530 @@
+#include <algorithm>
+#include <atomic>
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "collection.h"
+#include "latency.h"
+#include "router.h"
+#include "search.h"
+#include "vecs.h"
+
+namespace po = boost::program_options;
+
+// bench_recall measures the search quality against its cost: it answers a
+// query set over a grid of
+// - page sizes and page formats (f32 row-major, or transposed in tiles of
+//   8 or 16 vectors, and the same with f16 or bf16 elements), one
+//   collection each, written from --data or reused,
+// - worker threads,
+// - nprobe,
+// - pruning on or off (early abandoning of the distances),
+// - the adaptive probing ratio (0 probes all the nprobe clusters),
+// - the candidates re-ranked with the full vectors, when the collections
+//   are reduced by a PCA projection (--pca, the formats get a _pca suffix),
+// and reports recall@1, @10 and @100 against a ground-truth ivecs (the
+// bigann *_groundtruth.ivecs, or any file with the exact neighbors of every
+// query, closest first), with the QPS and the query latencies. The rows go
+// to stdout and optionally to a csv and a json file, one point of the
+// recall-QPS curves each.
+//
+//   ./bench_recall -w true --data sift_base.fvecs --clusters clusters.ivecs
+//       --centroids centroids.fvecs -q sift_query.fvecs
+//       -g sift_groundtruth.ivecs -c collection --page_sizes 4,8
+//       --formats f32,tile8 --nprobe 1,4,16,64 --threads 1,4 --csv recall.csv
+//
+// recall@R is the share of the R true nearest neighbors found in the first
+// R results, averaged over the queries.
+
+struct PageFormat {
+    const char *name;
+    size_t tile;
+    Encoding encoding;
+};
+
+static const PageFormat formats[] = {
+    {"f32", 0, Encoding::f32},        {"tile8", 8, Encoding::f32},
+    {"tile16", 16, Encoding::f32},    {"f16", 0, Encoding::f16},
+    {"tile8_f16", 8, Encoding::f16},  {"tile16_f16", 16, Encoding::f16},
+    {"bf16", 0, Encoding::bf16},      {"tile8_bf16", 8, Encoding::bf16},
+    {"tile16_bf16", 16, Encoding::bf16},
+};
+
+struct BenchPoint {
+    size_t page_kb;
+    std::string format;
+    size_t threads;
+    size_t nprobe;
+    bool prune;
+    float probe_ratio;
+    size_t rerank;  // candidates re-ranked, 0 when the pages are exact
+    double recall[3];  // at 1, 10 and 100, negative when not measured
+    double qps;
+    double clusters_per_query;
+    double pages_per_query;
+    double mean_us, p50_us, p99_us;
+};
+
+static const size_t recall_at[3] = {1, 10, 100};
+
+static std::vector<std::string> split(const std::string &s) {
+    std::vector<std::string> out;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, ',')) out.push_back(item);
+    return out;
+}
+
+static std::vector<size_t> split_sizes(const std::string &s) {
+    std::vector<size_t> out;
+    for (auto &item : split(s)) out.push_back(std::stoul(item));
+    return out;
+}
+
+static std::vector<float> split_floats(const std::string &s) {
+    std::vector<float> out;
+    for (auto &item : split(s)) out.push_back(std::stof(item));
+    return out;
+}
+
+// recall returns recall@r of the results (k per query) against the ground
+// truth (gt_k per query), negative when r exceeds either.
+static double recall(const std::vector<uint32_t> &results, size_t k,
+                     const std::vector<uint32_t> &gt, size_t gt_k, size_t nq,
+                     size_t r) {
+    if (r > k || r > gt_k) return -1;
+    size_t found = 0;
+    std::unordered_set<uint32_t> truth;
+    for (size_t q = 0; q < nq; q++) {
+        truth.clear();
+        truth.insert(gt.begin() + q * gt_k, gt.begin() + q * gt_k + r);
+        for (size_t i = 0; i < r; i++)
+            found += truth.count(results[q * k + i]);
+    }
+    return (double)found / (nq * r);
+}
+
+// run_queries answers all the queries with num_thread workers, each one
+// with its own Searcher on a contiguous range of queries.
+static bool run_queries(const Collection &collection,
+                        const std::vector<uint32_t> &ids,
+                        const CentroidRouter &router, const char *memory,
+                        const std::vector<float> &queries, size_t nq,
+                        size_t num_thread, const SearchOptions &opt,
+                        std::vector<uint32_t> *result_ids, BenchPoint *point) {
+    const size_t dim = collection.query_dimension();
+    std::vector<float> result_dists(nq * opt.k);
+    result_ids->assign(nq * opt.k, COLLECTION_EMPTY_SLOT);
+    std::vector<QueryStats> worker_stats(num_thread);
+    LatencyRecorder latency;
+    std::atomic<bool> failed{false};
+
+    auto worker = [&](size_t thread_id, size_t q_start, size_t q_end) {
+        Searcher searcher(collection, ids, router, opt, nullptr, memory);
+        searcher.latency = latency.thread_histograms();
+        for (size_t q = q_start; q < q_end; q++) {
+            if (!searcher.search(queries.data() + q * dim,
+                                 result_ids->data() + q * opt.k,
+                                 result_dists.data() + q * opt.k)) {
+                failed = true;
+                return;
+            }
+        }
+        worker_stats[thread_id] = searcher.stats;
+    };
+
+    std::vector<std::thread *> workers;
+    size_t queries_per_worker = (nq + num_thread - 1) / num_thread;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t t = 0; t < num_thread; t++) {
+        size_t q_start = std::min(nq, t * queries_per_worker);
+        size_t q_end = std::min(nq, q_start + queries_per_worker);
+        workers.push_back(new std::thread(worker, t, q_start, q_end));
+    }
+    for (auto t : workers) {
+        t->join();
+        delete t;
+    }
+    double time_taken = elapsed_ns(start, std::chrono::steady_clock::now());
+    if (failed) {
+        std::cerr << "failed to read the pages of a query" << std::endl;
+        return false;
+    }
+
+    uint64_t pages = 0, clusters = 0;
+    for (auto &s : worker_stats) {
+        pages += s.pages_scanned;
+        clusters += s.clusters_probed;
+    }
+    std::unique_ptr<StageHistograms> h = latency.merged();
+    const LatencyHistogram &total = (*h)[Stage::total];
+    point->qps = nq / (time_taken * 1e-9);
+    point->clusters_per_query = (double)clusters / nq;
+    point->pages_per_query = (double)pages / nq;
+    point->mean_us = total.mean() * 1e-3;
+    point->p50_us = total.percentile(50) * 1e-3;
+    point->p99_us = total.percentile(99) * 1e-3;
+    return true;
+}
+
+static void print_recall(FILE *f, double r, const char *missing) {
+    if (r < 0) fprintf(f, "%s", missing);
+    else fprintf(f, "%.4f", r);
+}
+
+static bool write_csv(const std::string &filename,
+                      const std::vector<BenchPoint> &points) {
+    FILE *f = fopen(filename.c_str(), "w");
+    if (!f) {
+        std::cerr << "failed to open csv file: " << filename << std::endl;
+        return false;
+    }
+    fprintf(f, "page_kb,format,threads,nprobe,prune,probe_ratio,rerank,"
+               "recall_1,recall_10,recall_100,qps,clusters_per_query,"
+               "pages_per_query,mean_us,p50_us,p99_us\n");
+    for (auto &p : points) {
+        fprintf(f, "%zu,%s,%zu,%zu,%d,%.2f,%zu", p.page_kb, p.format.c_str(),
+                p.threads, p.nprobe, p.prune, p.probe_ratio, p.rerank);
+        for (double r : p.recall) {
+            fprintf(f, ",");
+            print_recall(f, r, "");
+        }
+        fprintf(f, ",%.2f,%.2f,%.2f,%.2f,%.2f,%.2f\n", p.qps,
+                p.clusters_per_query, p.pages_per_query, p.mean_us, p.p50_us,
+                p.p99_us);
+    }
+    fclose(f);
+    return true;
+}
+
+static bool write_json(const std::string &filename,
+                       const std::vector<BenchPoint> &points) {
+    FILE *f = fopen(filename.c_str(), "w");
+    if (!f) {
+        std::cerr << "failed to open json file: " << filename << std::endl;
+        return false;
+    }
+    fprintf(f, "{\n  \"latency_unit\": \"us\",\n  \"points\": [");
+    for (size_t i = 0; i < points.size(); i++) {
+        const BenchPoint &p = points[i];
+        fprintf(f,
+                "%s\n    {\"page_kb\": %zu, \"format\": \"%s\", \"threads\": %zu, "
+                "\"nprobe\": %zu, \"prune\": %s, \"probe_ratio\": %.2f, "
+                "\"rerank\": %zu",
+                i ? "," : "", p.page_kb, p.format.c_str(), p.threads, p.nprobe,
+                p.prune ? "true" : "false", p.probe_ratio, p.rerank);
+        for (size_t r = 0; r < 3; r++) {
+            fprintf(f, ", \"recall_%zu\": ", recall_at[r]);
+            print_recall(f, p.recall[r], "null");
+        }
+        fprintf(f,
+                ", \"qps\": %.2f, \"clusters_per_query\": %.2f, "
+                "\"pages_per_query\": %.2f, \"mean\": %.2f, \"p50\": %.2f, "
+                "\"p99\": %.2f}",
+                p.qps, p.clusters_per_query, p.pages_per_query, p.mean_us,
+                p.p50_us, p.p99_us);
+    }
+    fprintf(f, "\n  ]\n}\n");
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    std::string args_data;
+    std::string args_clusters;
+    std::string args_collection = "../data/sift1m/collection";
+    std::string args_centroids;
+    std::string args_queries;
+    std::string args_groundtruth;
+    std::string args_page_sizes = "4";
+    std::string args_formats = "f32";
+    std::string args_threads = "1";
+    std::string args_nprobe = "1,2,4,8,16,32,64";
+    std::string args_prune = "1";
+    std::string args_probe_ratio = "0";
+    size_t args_probe_patience = 0;
+    std::string args_pca;
+    std::string args_rerank = "0";
+    std::string args_csv;
+    std::string args_json;
+    bool args_write_pages = false;
+    bool args_memory_only = true;
+    uint32_t args_num_query = 0;
+    uint32_t args_k = 100;
+
+    {
+        po::options_description desc("Available arguments");
+        desc.add_options()("help,h", "print usage message");
+        desc.add_options()("data", po::value<std::string>(&args_data),
+                           "base vectors to write the collections from");
+        desc.add_options()("clusters", po::value<std::string>(&args_clusters),
+                           "cluster id of every base vector");
+        desc.add_options()("collection,c",
+                           po::value<std::string>(&args_collection),
+                           "prefix of the collections, one per page size and "
+                           "format: <prefix>.<kb>k.<format>");
+        desc.add_options()("write_pages,w", po::value<bool>(&args_write_pages),
+                           "write the collections from --data first, or reuse "
+                           "them (default: false)");
+        desc.add_options()("centroids",
+                           po::value<std::string>(&args_centroids)->required(),
+                           "cluster centroids, to route the queries");
+        desc.add_options()("queries,q",
+                           po::value<std::string>(&args_queries)->required(),
+                           "query vectors");
+        desc.add_options()("groundtruth,g",
+                           po::value<std::string>(&args_groundtruth)->required(),
+                           "the exact nearest neighbors of every query (ivecs)");
+        desc.add_options()("num_query", po::value<uint32_t>(&args_num_query),
+                           "only answer the first queries (default: all)");
+        desc.add_options()("k,k", po::value<uint32_t>(&args_k),
+                           "results per query (default: 100)");
+        desc.add_options()("page_sizes,p", po::value<std::string>(&args_page_sizes),
+                           "comma separated page sizes in kb (default: 4)");
+        desc.add_options()("formats", po::value<std::string>(&args_formats),
+                           "comma separated page formats: f32, tile8, "
+                           "tile16, and f16, tile8_f16, ... bf16, ... with "
+                           "16-bit elements (default: f32)");
+        desc.add_options()("threads,t", po::value<std::string>(&args_threads),
+                           "comma separated worker counts (default: 1)");
+        desc.add_options()("nprobe,n", po::value<std::string>(&args_nprobe),
+                           "comma separated nprobe (default: 1,2,...,64)");
+        desc.add_options()("prune", po::value<std::string>(&args_prune),
+                           "comma separated pruning settings (early abandoning "
+                           "and page bounds), 1 on and 0 off (default: 1)");
+        desc.add_options()("probe_ratio", po::value<std::string>(&args_probe_ratio),
+                           "comma separated adaptive probing ratios, the "
+                           "nprobe becomes the most clusters probed (default: "
+                           "0, off)");
+        desc.add_options()("probe_patience",
+                           po::value<size_t>(&args_probe_patience),
+                           "stop probing after this many clusters without a "
+                           "change of the top-k (default: 0, off)");
+        desc.add_options()("pca", po::value<std::string>(&args_pca),
+                           "reduce the pages with this PCA projection (see "
+                           "tools_train_pca), the collections are "
+                           "<prefix>.<kb>k.<format>_pca");
+        desc.add_options()("rerank", po::value<std::string>(&args_rerank),
+                           "comma separated candidates re-ranked with the "
+                           "full vectors, with --pca (default: 0, 4 k)");
+        desc.add_options()("memory_only,m", po::value<bool>(&args_memory_only),
+                           "load the collections in memory, or read the "
+                           "pages from the files (default: true)");
+        desc.add_options()("csv", po::value<std::string>(&args_csv),
+                           "also write the results to this csv file");
+        desc.add_options()("json", po::value<std::string>(&args_json),
+                           "also write the results to this json file");
+        po::variables_map vm;
+        try {
+            po::store(po::parse_command_line(argc, argv, desc), vm);
+            if (vm.count("help")) {
+                std::cout << desc << "\n";
+                return 0;
+            }
+            po::notify(vm);
+        } catch (std::exception &e) {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+        if (args_write_pages && args_data.empty()) {
+            std::cerr << "Error: --write_pages needs the --data\n";
+            return 1;
+        }
+    }
+
+    std::vector<size_t> page_sizes, thread_counts, nprobes, prunes, reranks;
+    std::vector<float> probe_ratios;
+    std::vector<const PageFormat *> selected;
+    try {
+        page_sizes = split_sizes(args_page_sizes);
+        thread_counts = split_sizes(args_threads);
+        nprobes = split_sizes(args_nprobe);
+        prunes = split_sizes(args_prune);
+        probe_ratios = split_floats(args_probe_ratio);
+        reranks = split_sizes(args_rerank);
+    } catch (std::exception &e) {
+        std::cerr << "Error: bad list of numbers\n";
+        return 1;
+    }
+    for (auto &name : split(args_formats)) {
+        auto f = std::find_if(std::begin(formats), std::end(formats),
+                              [&](const PageFormat &f) { return name == f.name; });
+        if (f == std::end(formats)) {
+            std::cerr << "Error: unknown page format " << name << "\n";
+            return 1;
+        }
+        selected.push_back(f);
+    }
+    if (page_sizes.empty() || selected.empty() || thread_counts.empty() ||
+        nprobes.empty() || prunes.empty() || probe_ratios.empty() ||
+        reranks.empty()) {
+        std::cerr << "Error: every grid axis needs at least one value\n";
+        return 1;
+    }
+
+    CentroidRouter router;
+    if (!router.load(args_centroids)) return -1;
+    router.open_graph(args_centroids);
+
+    VecsReader query_reader, gt_reader;
+    if (!query_reader.open(args_queries.c_str()) ||
+        !gt_reader.open(args_groundtruth.c_str()))
+        return -1;
+    size_t nq = std::min(query_reader.info.num_vectors, gt_reader.info.num_vectors);
+    if (args_num_query > 0 && args_num_query < nq) nq = args_num_query;
+    const size_t dim = query_reader.info.dimension;
+    const size_t gt_k = gt_reader.info.dimension;
+    const VecsInfo &gi = gt_reader.info;
+    if (gi.elem_type == ElemType::u8 || gi.elem_type == ElemType::f32) {
+        std::cerr << "ground truth must hold integer ids: " << args_groundtruth
+                  << std::endl;
+        return -1;
+    }
+    // the ids are read as integers, a float loses the ids past 2^24
+    std::vector<float> queries(nq * dim);
+    std::vector<char> gt_records(nq * gi.record_size);
+    if (router.dimension() != dim || !query_reader.read_float(0, nq, queries.data()) ||
+        !gt_reader.read_raw(0, nq, gt_records.data())) {
+        std::cerr << "failed to read the queries or the ground truth" << std::endl;
+        return -1;
+    }
+    std::vector<uint32_t> gt(nq * gt_k);
+    for (size_t q = 0; q < nq; q++) {
+        const char *record = gt_records.data() + q * gi.record_size + gi.prefix_size;
+        for (size_t j = 0; j < gt_k; j++) {
+            if (gi.elem_type == ElemType::i64) {
+                int64_t id;
+                memcpy(&id, record + j * sizeof(int64_t), sizeof(id));
+                gt[q * gt_k + j] = id;
+            } else {
+                int32_t id;
+                memcpy(&id, record + j * sizeof(int32_t), sizeof(id));
+                gt[q * gt_k + j] = id;
+            }
+        }
+    }
+
+    printf("num queries  : %zu\n", nq);
+    printf("ground truth : %zu neighbors per query\n", gt_k);
+    printf("k            : %u\n", args_k);
+    printf("pages        : %s\n\n", args_memory_only ? "in memory" : "read from the file");
+    if (args_pca.empty()) reranks = {0};
+    printf("%7s %-15s %7s %6s %5s %5s %6s %8s %8s %8s %10s %10s %10s %10s %10s\n",
+           "page_kb", "format", "threads", "nprobe", "prune", "ratio", "rerank",
+           "R@1", "R@10", "R@100", "qps", "clusters/q", "pages/q", "p50_us",
+           "p99_us");
+
+    std::vector<BenchPoint> points;
+    std::vector<uint32_t> result_ids;
+    for (size_t page_kb : page_sizes) {
+        for (const PageFormat *format : selected) {
+            std::string format_name = format->name;
+            if (!args_pca.empty()) format_name += "_pca";
+            std::string filename = args_collection + "." +
+                                   std::to_string(page_kb) + "k." + format_name;
+            if (args_write_pages) {
+                CollectionWriteOptions opt;
+                opt.base_filename = args_data;
+                opt.clusters_filename = args_clusters;
+                opt.collection_filename = filename;
+                opt.page_size = page_kb * 1024;
+                opt.tile = format->tile;
+                opt.encoding = format->encoding;
+                opt.pca_filename = args_pca;
+                if (!write_collection(opt)) {
+                    std::cerr << "skipping " << page_kb << "KB pages in "
+                              << format_name << std::endl;
+                    continue;
+                }
+            }
+
+            Collection collection;
+            std::vector<uint32_t> ids;
+            if (!collection.open(filename) || !collection.load_ids(&ids))
+                return -1;
+            collection.load_page_bounds();
+            const CollectionMeta &meta = collection.meta;
+            if (collection.query_dimension() != dim ||
+                meta.clusters.size() != router.size()) {
+                std::cerr << "the collection " << filename
+                          << " does not match the queries and the centroids"
+                          << std::endl;
+                return -1;
+            }
+            std::unique_ptr<char[]> memory;
+            if (args_memory_only) {
+                memory.reset(new char[meta.num_pages * meta.page_size]);
+                for (uint64_t pid = 0; pid < meta.num_pages; pid++) {
+                    if (!collection.read_page(pid, memory.get() + pid * meta.page_size)) {
+                        std::cerr << "failed to read page " << pid << " of "
+                                  << filename << std::endl;
+                        return -1;
+                    }
+                }
+            }
+
+            // one point of the grid
+            auto measure = [&](size_t threads, size_t prune, float ratio,
+                               size_t rerank, size_t nprobe) {
+                SearchOptions opt;
+                opt.k = args_k;
+                opt.nprobe = nprobe;
+                opt.early_abandon = prune != 0;
+                opt.prune_pages = prune != 0;
+                opt.probe_ratio = ratio;
+                opt.probe_patience = args_probe_patience;
+                opt.rerank = rerank;
+                BenchPoint p;
+                p.page_kb = page_kb;
+                p.format = format_name;
+                p.threads = std::max<size_t>(1, threads);
+                p.nprobe = nprobe;
+                p.prune = prune != 0;
+                p.probe_ratio = ratio;
+                p.rerank = collection.reduced()
+                               ? Reranker(collection, opt).candidates(opt.k)
+                               : 0;
+                if (!run_queries(collection, ids, router, memory.get(), queries,
+                                 nq, p.threads, opt, &result_ids, &p))
+                    return false;
+                for (size_t r = 0; r < 3; r++)
+                    p.recall[r] = recall(result_ids, opt.k, gt, gt_k, nq, recall_at[r]);
+                printf("%7zu %-15s %7zu %6zu %5d %5.2f %6zu", p.page_kb,
+                       p.format.c_str(), p.threads, p.nprobe, p.prune,
+                       p.probe_ratio, p.rerank);
+                for (double r : p.recall) {
+                    if (r < 0) printf(" %8s", "-");
+                    else printf(" %8.4f", r);
+                }
+                printf(" %10.1f %10.1f %10.1f %10.1f %10.1f\n", p.qps,
+                       p.clusters_per_query, p.pages_per_query, p.p50_us,
+                       p.p99_us);
+                fflush(stdout);
+                points.push_back(p);
+                return true;
+            };
+            for (size_t threads : thread_counts)
+                for (size_t prune : prunes)
+                    for (float ratio : probe_ratios)
+                        for (size_t rerank : reranks)
+                            for (size_t nprobe : nprobes)
+                                if (!measure(threads, prune, ratio, rerank, nprobe))
+                                    return -1;
+        }
+    }
+
+    if (!args_csv.empty() && !write_csv(args_csv, points)) return -1;
+    if (!args_json.empty() && !write_json(args_json, points)) return -1;
+    return 0;
+}
@@ -2,6 +2,7 @@
 // key is a float (PCD, distance to the centroid), and value is uint32_t (the vector's ID)
 
 #include <bits/stdc++.h>
+#include <immintrin.h>
 #include <iostream>
 #include <random>
 #include <utility>
@@ -106,7 +107,7 @@ class Node {
     }
   }
 
-  tuple<uint32_t, Node *, Node *> splitLeaf() {
+  tuple<float, Node *, Node *> splitLeaf() {
     Node *left = new Node(parent, true, prev, this);
     int mid = keys.size() / 2;
 
@@ -144,6 +145,40 @@ class BPlusTree {
 
   int get(float key) { return findLeaf(key)->get(key); }
 
+  // lowerBound returns the leaf and the slot of the first key >= key, or a
+  // null leaf when every key is smaller.
+  pair<Node *, int> lowerBound(float key) {
+    Node *leaf = findLeaf(key);
+    int i = lower_bound(leaf->keys.begin(), leaf->keys.end(), key) -
+            leaf->keys.begin();
+    while (leaf && i == leaf->keys.size()) {
+      leaf = leaf->next;
+      i = 0;
+    }
+    return make_pair(leaf, i);
+  }
+
+  // rangeScan appends the values of the keys in [lo, hi], by key.
+  void rangeScan(float lo, float hi, vector<uint32_t> &out) {
+    auto [leaf, i] = lowerBound(lo);
+    for (; leaf; leaf = leaf->next, i = 0) {
+      for (; i < leaf->keys.size(); i++) {
+        if (leaf->keys[i] > hi) return;
+        out.push_back(leaf->values[i]);
+      }
+    }
+  }
+
+  // memoryBytes counts the nodes and the capacity of their arrays.
+  size_t memoryBytes(Node *node = nullptr) {
+    if (!node) node = root;
+    size_t bytes = sizeof(Node) + node->keys.capacity() * sizeof(float) +
+                   node->values.capacity() * sizeof(uint32_t) +
+                   node->children.capacity() * sizeof(Node *);
+    for (Node *child : node->children) bytes += memoryBytes(child);
+    return bytes;
+  }
+
   void set(float key, uint32_t value) {
     Node *leaf = findLeaf(key);
     leaf->set(key, value);
@@ -417,7 +452,161 @@ class BPlusTree {
   }
 };
 
-int main() {
+// A PiecewiseLinearIndex is a static alternative to the B+tree for the
+// sorted PCDs of a cluster (a learned index, PGM/RadixSpline-style). The
+// keys are a smooth distribution, so the position of a key is a function of
+// the key that a few lines approximate: the segments are fitted with a
+// shrinking cone (FITing-tree) so that every distinct key is predicted
+// within epsilon of its first position. A radix table over the key range
+// points to the segments of a bucket; a lookup is one bucket, a scan of the
+// segments in it (one or two), one model evaluation and a SIMD count of the
+// keys below the query in a window of 2 * epsilon + 3 keys. Duplicate keys
+// are fitted at their first position; a run of them longer than epsilon
+// can push the answer out of the window, which then falls back to a
+// binary search, so the result is always exact.
+class PiecewiseLinearIndex {
+ public:
+  struct Segment {
+    float key;    // first key of the segment
+    float slope;  // positions per unit of key
+    uint32_t pos;  // position of the first key
+  };
+
+  PiecewiseLinearIndex(int _epsilon = 16) {
+    epsilon = _epsilon > 1 ? _epsilon : 1;
+  }
+
+  int epsilon;
+  vector<float> keys;
+  vector<uint32_t> values;
+  vector<Segment> segments;
+  vector<uint32_t> radix;  // first segment of every bucket, plus the end
+  float minKey = 0;
+  float radixScale = 0;
+
+  // build fits the index over keys (sorted) and their values.
+  void build(const vector<float> &_keys, const vector<uint32_t> &_values) {
+    keys = _keys;
+    values = _values;
+    segments.clear();
+    radix.clear();
+    if (keys.empty()) return;
+
+    // the cone of the slopes through the first point of the segment that
+    // keep every later point within epsilon; a point outside of it starts
+    // the next segment
+    size_t first = 0;
+    double slopeLo = 0, slopeHi = numeric_limits<double>::infinity();
+    auto close = [&]() {
+      double slope = isinf(slopeHi) ? 0 : (slopeLo + slopeHi) / 2;
+      segments.push_back({keys[first], (float)slope, (uint32_t)first});
+    };
+    for (size_t i = 1; i < keys.size(); i++) {
+      if (keys[i] == keys[i - 1]) continue;
+      double dx = (double)keys[i] - keys[first], dy = (double)(i - first);
+      double lo = max(slopeLo, (dy - epsilon) / dx);
+      double hi = min(slopeHi, (dy + epsilon) / dx);
+      if (lo > hi) {
+        close();
+        first = i;
+        slopeLo = 0;
+        slopeHi = numeric_limits<double>::infinity();
+      } else {
+        slopeLo = lo;
+        slopeHi = hi;
+      }
+    }
+    close();
+
+    // one bucket per segment over [min key, max key]
+    size_t buckets = segments.size();
+    minKey = keys.front();
+    float span = keys.back() - minKey;
+    radixScale = span > 0 ? buckets / span : 0;
+    radix.assign(buckets + 1, 0);
+    for (const Segment &segment : segments) radix[bucket(segment.key) + 1]++;
+    for (size_t b = 0; b < buckets; b++) radix[b + 1] += radix[b];
+  }
+
+  // lowerBound returns the position of the first key >= key (keys.size()
+  // when every key is smaller).
+  size_t lowerBound(float key) const {
+    size_t n = keys.size();
+    if (n == 0) return 0;
+
+    // the last segment that starts at or before key: the segments of a
+    // lower bucket all do, those of a higher one do not
+    size_t b = bucket(key);
+    size_t s = radix[b];
+    while (s < radix[b + 1] && segments[s].key <= key) s++;
+    const Segment &segment = segments[s > 0 ? s - 1 : 0];
+    float end = s < segments.size() ? segments[s].pos : n;
+    float pos = segment.pos + segment.slope * (key - segment.key);
+    pos = min(max(pos, (float)segment.pos), end);
+
+    size_t lo = pos > epsilon + 1 ? (size_t)(pos - epsilon - 1) : 0;
+    size_t hi = min(n, (size_t)(pos + epsilon + 2));
+    size_t i = lo + countLess(keys.data() + lo, hi - lo, key);
+    if (i == lo && lo > 0 && keys[lo - 1] >= key)
+      return lower_bound(keys.begin(), keys.begin() + lo, key) - keys.begin();
+    if (i == hi && hi < n && keys[hi] < key)
+      return lower_bound(keys.begin() + hi, keys.end(), key) - keys.begin();
+    return i;
+  }
+
+  // rangeScan appends the values of the keys in [lo, hi], by key.
+  void rangeScan(float lo, float hi, vector<uint32_t> &out) const {
+    for (size_t i = lowerBound(lo); i < keys.size() && keys[i] <= hi; i++) {
+      out.push_back(values[i]);
+    }
+  }
+
+  // indexBytes is the model alone: the segments and the radix table.
+  size_t indexBytes() const {
+    return segments.capacity() * sizeof(Segment) +
+           radix.capacity() * sizeof(uint32_t);
+  }
+
+  size_t memoryBytes() const {
+    return sizeof(*this) + indexBytes() + keys.capacity() * sizeof(float) +
+           values.capacity() * sizeof(uint32_t);
+  }
+
+ private:
+  size_t bucket(float key) const {
+    float b = (key - minKey) * radixScale;
+    if (!(b > 0)) return 0;
+    return min((size_t)b, segments.size() - 1);
+  }
+
+  // countLess counts the n keys of the window below key; they are sorted,
+  // so it is the offset of the lower bound in the window.
+  static size_t countLess(const float *x, size_t n, float key) {
+    size_t count = 0, i = 0;
+#if defined(__AVX512F__)
+    __m512 q = _mm512_set1_ps(key);
+    for (; i < n; i += 16) {
+      __mmask16 valid = n - i >= 16 ? 0xFFFF : (1u << (n - i)) - 1;
+      __m512 v = _mm512_maskz_loadu_ps(valid, x + i);
+      count += __builtin_popcount(
+          _mm512_mask_cmp_ps_mask(valid, v, q, _CMP_LT_OQ));
+    }
+#elif defined(__AVX2__)
+    __m256 q = _mm256_set1_ps(key);
+    for (; i + 8 <= n; i += 8) {
+      __m256 lt = _mm256_cmp_ps(_mm256_loadu_ps(x + i), q, _CMP_LT_OQ);
+      count += __builtin_popcount(_mm256_movemask_ps(lt));
+    }
+    for (; i < n; i++) count += x[i] < key;
+#else
+    for (; i < n; i++) count += x[i] < key;
+#endif
+    return count;
+  }
+};
+
+// demo prints the tree through inserts and removes of a few keys.
+void demo() {
   BPlusTree tree(3);
   vector<float> random_list = {5.1,  9.2,  1.3,  3.1,   4.6,   59.1,  65.0,  45.3,
                              89.4, 29.7, 68.9, 108.10, 165.1, 298.2, 219.3, 569.4,
@@ -455,5 +644,161 @@ int main() {
     }
   }
 
-  return 0;
-}
\ No newline at end of file
+}
+
+// Checks the B+tree and the learned index against std::lower_bound over the
+// PCDs of synthetic clusters (the distance of a Gaussian cloud to its
+// centroid, a chi distribution), then compares their memory and the latency
+// of a lower bound and of a range scan.
+// usage: ./test_bplustree [num_clusters] [keys_per_cluster] [epsilon] [fanout]
+//        ./test_bplustree --demo
+int main(int argc, char **argv) {
+  if (argc > 1 && string(argv[1]) == "--demo") {
+    demo();
+    return 0;
+  }
+  size_t nc = argc > 1 ? atoi(argv[1]) : 1000;  // number of clusters
+  size_t nk = argc > 2 ? atoi(argv[2]) : 1000;  // PCDs per cluster
+  int epsilon = argc > 3 ? atoi(argv[3]) : 16;
+  int fanout = argc > 4 ? atoi(argv[4]) : 64;
+  size_t nq = 1000000;
+  int d = 128;
+
+  mt19937 rng(123);
+  uniform_real_distribution<float> spread(0.5f, 2.0f);
+  chi_squared_distribution<float> chi2(d);
+  auto pcd = [&](float sigma) { return sigma * sqrt(chi2(rng)); };
+
+  vector<float> sigma(nc);
+  vector<vector<float>> keys(nc);
+  vector<vector<uint32_t>> values(nc);
+  vector<BPlusTree *> trees(nc);
+  vector<PiecewiseLinearIndex> learned(nc, PiecewiseLinearIndex(epsilon));
+  size_t num_keys = 0, num_segments = 0;
+  double tree_build_ms = 0, learned_build_ms = 0;
+  for (size_t c = 0; c < nc; c++) {
+    sigma[c] = spread(rng);
+    for (size_t i = 0; i < nk; i++) keys[c].push_back(pcd(sigma[c]));
+    sort(keys[c].begin(), keys[c].end());
+    keys[c].erase(unique(keys[c].begin(), keys[c].end()), keys[c].end());
+    for (size_t i = 0; i < keys[c].size(); i++) values[c].push_back(rng());
+    num_keys += keys[c].size();
+
+    auto start = chrono::high_resolution_clock::now();
+    trees[c] = new BPlusTree(fanout);
+    for (size_t i = 0; i < keys[c].size(); i++) trees[c]->set(keys[c][i], values[c][i]);
+    auto mid = chrono::high_resolution_clock::now();
+    learned[c].build(keys[c], values[c]);
+    auto end = chrono::high_resolution_clock::now();
+    tree_build_ms += chrono::duration<double, milli>(mid - start).count();
+    learned_build_ms += chrono::duration<double, milli>(end - mid).count();
+    num_segments += learned[c].segments.size();
+  }
+
+  // the start of the range of a query: a PCD of the cluster's distribution
+  vector<pair<uint32_t, float>> queries(nq);
+  for (auto &q : queries) {
+    q.first = rng() % nc;
+    q.second = pcd(sigma[q.first]) - 1.0f;
+  }
+
+  size_t tree_bytes = 0, learned_bytes = 0, learned_index_bytes = 0;
+  for (size_t c = 0; c < nc; c++) {
+    tree_bytes += trees[c]->memoryBytes();
+    learned_bytes += learned[c].memoryBytes();
+    learned_index_bytes += learned[c].indexBytes();
+  }
+  size_t payload = num_keys * (sizeof(float) + sizeof(uint32_t));
+  printf(">> %zu clusters, %zu PCDs, b+tree fanout %d, learned index "
+         "epsilon %d: %.1f segments per cluster\n",
+         nc, num_keys, fanout, epsilon, (double)num_segments / nc);
+  printf(">> build  : b+tree %.1f ms, learned %.1f ms\n", tree_build_ms,
+         learned_build_ms);
+  printf(">> memory : b+tree %.2f MB (%.2f MB over the keys and ids), "
+         "learned %.2f MB (%.3f MB over the keys and ids, %.1f%% of the "
+         "b+tree's)\n",
+         tree_bytes / 1048576.0, (tree_bytes - payload) / 1048576.0,
+         learned_bytes / 1048576.0, learned_index_bytes / 1048576.0,
+         100.0 * learned_index_bytes / (tree_bytes - payload));
+
+  int failed = 0;
+
+  // the value at the lower bound, or UINT32_MAX past the end
+  auto reference = [&](uint32_t c, float key) {
+    size_t i = lower_bound(keys[c].begin(), keys[c].end(), key) - keys[c].begin();
+    return i < keys[c].size() ? values[c][i] : UINT32_MAX;
+  };
+  auto tree_lookup = [&](uint32_t c, float key) {
+    auto [leaf, i] = trees[c]->lowerBound(key);
+    return leaf ? leaf->values[i] : UINT32_MAX;
+  };
+  auto learned_lookup = [&](uint32_t c, float key) {
+    size_t i = learned[c].lowerBound(key);
+    return i < keys[c].size() ? values[c][i] : UINT32_MAX;
+  };
+  auto time_lookups = [&](const char *name, auto lookup) {
+    vector<uint32_t> out(nq);
+    auto start = chrono::high_resolution_clock::now();
+    for (size_t q = 0; q < nq; q++) out[q] = lookup(queries[q].first, queries[q].second);
+    auto end = chrono::high_resolution_clock::now();
+    printf("   %-15s: %.1f ns/lookup\n", name,
+           chrono::duration<double, nano>(end - start).count() / nq);
+    return out;
+  };
+  printf(">> lower bound\n");
+  vector<uint32_t> expected = time_lookups("std::lower_bound", reference);
+  if (time_lookups("b+tree", tree_lookup) != expected) {
+    printf("   FAILED: the b+tree lower bound differs\n");
+    failed = 1;
+  }
+  if (time_lookups("learned", learned_lookup) != expected) {
+    printf("   FAILED: the learned lower bound differs\n");
+    failed = 1;
+  }
+
+  // ranges 0.01 sigma wide, about 0.26% of the keys of the cluster on
+  // average (the ids/scan printed below)
+  size_t nr = nq / 10;
+  auto time_scans = [&](const char *name, auto scan) {
+    vector<uint32_t> out;
+    auto start = chrono::high_resolution_clock::now();
+    for (size_t q = 0; q < nr; q++) {
+      float lo = queries[q].second;
+      scan(queries[q].first, lo, lo + 0.01f * sigma[queries[q].first]);
+    }
+    auto end = chrono::high_resolution_clock::now();
+    printf("   %-15s: %.1f ns/scan\n", name,
+           chrono::duration<double, nano>(end - start).count() / nr);
+  };
+  vector<uint32_t> tree_out, learned_out;
+  printf(">> range scan\n");
+  time_scans("b+tree", [&](uint32_t c, float lo, float hi) {
+    trees[c]->rangeScan(lo, hi, tree_out);
+  });
+  time_scans("learned", [&](uint32_t c, float lo, float hi) {
+    learned[c].rangeScan(lo, hi, learned_out);
+  });
+  printf("   %-15s: %.1f ids/scan\n", "results", (double)learned_out.size() / nr);
+  if (tree_out != learned_out) {
+    printf("   FAILED: the range scans differ\n");
+    failed = 1;
+  }
+
+  // long runs of duplicates push the lower bound out of the model's window
+  vector<float> dup_keys;
+  for (int i = 0; i < 5000; i++) dup_keys.push_back((float)(i / (1 + i % 97)));
+  sort(dup_keys.begin(), dup_keys.end());
+  PiecewiseLinearIndex dup(epsilon);
+  dup.build(dup_keys, vector<uint32_t>(dup_keys.size()));
+  for (float key = -1.0f; key <= dup_keys.back() + 1.0f; key += 0.25f) {
+    size_t i = lower_bound(dup_keys.begin(), dup_keys.end(), key) - dup_keys.begin();
+    if (dup.lowerBound(key) != i) {
+      printf("   FAILED: the learned lower bound of %f over duplicates is %zu, "
+             "not %zu\n", key, dup.lowerBound(key), i);
+      failed = 1;
+      break;
+    }
+  }
+
+  return failed;
+}
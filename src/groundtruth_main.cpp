@@ -0,0 +1,291 @@
+#include <algorithm>
+#include <atomic>
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "cores.h"
+#include "kernels.h"
+#include "topk.h"
+#include "vecs.h"
+
+namespace po = boost::program_options;
+
+// sedann_groundtruth computes the exact k nearest base vectors of every
+// query, the ground truth of bench_recall. The base is streamed in chunks
+// (the next chunk is read while the current one is scanned), so its size is
+// not bounded by the memory, and --num_base takes a prefix of it (e.g. the
+// first 10M of bigann) without writing the prefix first.
+//
+// A chunk is cut into work items, a block of queries times a slice of the
+// chunk, picked by the threads in turn. An item scans its slice by blocks of
+// base vectors that stay in the L2 cache, each block against every query of
+// the item with fvec_L2sqr_batch_4 (one query against four base vectors), into
+// one top-k per query; the top-k of the item are then merged into those of
+// its queries. The results are written as ivecs (ids, closest first) and
+// optionally fvecs (distances):
+//     ./sedann_groundtruth -b sift10m_base.bvecs -q sift_query.fvecs -k 100
+//         --gt_ids sift10m_groundtruth.ivecs
+
+// base vectors scanned against the queries of an item at a time, about
+// 128KB at 128 dimensions
+const size_t GT_BASE_BLOCK = 256;
+// queries of a work item
+const size_t GT_QUERY_BLOCK = 64;
+
+struct GroundTruthOptions {
+    size_t k = 100;
+    Metric metric = Metric::l2;
+    size_t num_thread = 1;
+    size_t chunk_size = 256 << 20;  // bytes of base vectors per chunk
+};
+
+// scan_block scores the base vectors [0, n) of block (with the ids from
+// first_id) against the queries and pushes them into their top-k.
+static void scan_block(const DistanceKernel &kernel, const float *queries,
+                       size_t nq, const float *block, size_t n, size_t dim,
+                       uint32_t first_id, TopK *topk) {
+    float dis[4];
+    for (size_t q = 0; q < nq; q++) {
+        const float *query = queries + q * dim;
+        size_t i = 0;
+        if (kernel.metric == Metric::l2) {
+            for (; i + 4 <= n; i += 4) {
+                fvec_L2sqr_batch_4(query, block + i * dim, block + (i + 1) * dim,
+                                   block + (i + 2) * dim, block + (i + 3) * dim,
+                                   dim, dis);
+                for (size_t j = 0; j < 4; j++) topk[q].push(dis[j], first_id + i + j);
+            }
+        }
+        for (; i < n; i++)
+            topk[q].push(kernel.distance(query, block + i * dim, dim), first_id + i);
+    }
+}
+
+// compute_groundtruth fills the k ids and distances of every query with the
+// exact nearest neighbors among the first num_base vectors of the base.
+static bool compute_groundtruth(const VecsReader &base, size_t num_base,
+                                std::vector<float> &queries, size_t nq,
+                                const GroundTruthOptions &opt,
+                                std::vector<uint32_t> *ids,
+                                std::vector<float> *dists) {
+    const size_t dim = base.info.dimension;
+    const VecsInfo &in = base.info;
+    VecsInfo as_float = vecs_info(VecsFormat::npy, ElemType::f32, dim, 1);
+    DistanceKernel kernel = select_kernel(opt.metric, dim, true);
+    if (opt.metric == Metric::cosine)
+        for (size_t q = 0; q < nq; q++) normalize_vector(queries.data() + q * dim, dim);
+
+    size_t per_chunk = std::max<size_t>(
+        GT_BASE_BLOCK, opt.chunk_size / (dim * sizeof(float)) / GT_BASE_BLOCK *
+                           GT_BASE_BLOCK);
+    per_chunk = std::min(per_chunk, std::max<size_t>(1, num_base));
+    size_t num_chunks = (num_base + per_chunk - 1) / per_chunk;
+    auto chunk_vecs = [&](size_t i) { return std::min(per_chunk, num_base - i * per_chunk); };
+
+    std::vector<TopK> topk(nq, TopK(opt.k));
+    size_t num_query_blocks = (nq + GT_QUERY_BLOCK - 1) / GT_QUERY_BLOCK;
+    std::unique_ptr<std::mutex[]> query_block_mu(new std::mutex[num_query_blocks]);
+    std::vector<float> chunk(per_chunk * dim);
+
+    auto start = std::chrono::steady_clock::now();
+    bool ok = pipeline_chunks(
+        num_chunks, per_chunk * in.record_size,
+        [&](size_t i, char *buf) { return base.read_raw(i * per_chunk, chunk_vecs(i), buf); },
+        [&](size_t c, char *buf) {
+            size_t n = chunk_vecs(c);
+            uint32_t first_id = c * per_chunk;
+            // enough slices for every thread to get several items
+            size_t num_blocks = (n + GT_BASE_BLOCK - 1) / GT_BASE_BLOCK;
+            size_t num_slices = std::min(
+                num_blocks, std::max<size_t>(1, (4 * opt.num_thread + num_query_blocks - 1) /
+                                                    num_query_blocks));
+            size_t blocks_per_slice = (num_blocks + num_slices - 1) / num_slices;
+            size_t num_items = num_query_blocks * num_slices;
+
+            std::atomic<size_t> next_convert{0}, next_item{0};
+            auto convert_worker = [&]() {
+                // the chunk is converted to float in parallel first
+                for (size_t b = next_convert++; b < num_blocks; b = next_convert++) {
+                    size_t first = b * GT_BASE_BLOCK;
+                    size_t m = std::min(GT_BASE_BLOCK, n - first);
+                    for (size_t v = first; v < first + m; v++) {
+                        vecs_convert_records(in, buf + v * in.record_size, 1, as_float,
+                                             (char *)(chunk.data() + v * dim));
+                        if (opt.metric == Metric::cosine)
+                            normalize_vector(chunk.data() + v * dim, dim);
+                    }
+                }
+            };
+            auto scan_worker = [&]() {
+                std::vector<TopK> local;
+                for (size_t item = next_item++; item < num_items; item = next_item++) {
+                    size_t qb = item % num_query_blocks, slice = item / num_query_blocks;
+                    size_t q0 = qb * GT_QUERY_BLOCK;
+                    size_t qn = std::min(GT_QUERY_BLOCK, nq - q0);
+                    local.assign(qn, TopK(opt.k));
+                    size_t b_end = std::min(num_blocks, (slice + 1) * blocks_per_slice);
+                    for (size_t b = slice * blocks_per_slice; b < b_end; b++) {
+                        size_t first = b * GT_BASE_BLOCK;
+                        scan_block(kernel, queries.data() + q0 * dim, qn,
+                                   chunk.data() + first * dim,
+                                   std::min(GT_BASE_BLOCK, n - first), dim,
+                                   first_id + first, local.data());
+                    }
+                    std::lock_guard<std::mutex> lock(query_block_mu[qb]);
+                    for (size_t q = 0; q < qn; q++)
+                        for (auto &[d, id] : local[q].sorted()) {
+                            if (d >= topk[q0 + q].threshold()) break;
+                            topk[q0 + q].push(d, id);
+                        }
+                }
+            };
+            for (auto work : {std::function<void()>(convert_worker), std::function<void()>(scan_worker)}) {
+                std::vector<std::thread *> threads;
+                for (size_t t = 0; t < opt.num_thread; t++) threads.push_back(new std::thread(work));
+                for (auto t : threads) {
+                    t->join();
+                    delete t;
+                }
+            }
+
+            double elapsed = std::chrono::duration<double>(
+                                 std::chrono::steady_clock::now() - start)
+                                 .count();
+            size_t done = c * per_chunk + n;
+            fprintf(stderr, "\r%zu / %zu base vectors, %.1f s", done, num_base, elapsed);
+            return true;
+        });
+    fprintf(stderr, "\n");
+    if (!ok) {
+        std::cerr << "failed to read the base vectors" << std::endl;
+        return false;
+    }
+
+    ids->resize(nq * opt.k);
+    dists->resize(nq * opt.k);
+    for (size_t q = 0; q < nq; q++)
+        topk[q].write_sorted(ids->data() + q * opt.k, dists->data() + q * opt.k);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    std::string args_base;
+    std::string args_queries;
+    std::string args_gt_ids;
+    std::string args_gt_dists;
+    std::string args_metric = "l2";
+    size_t args_num_base = SIZE_MAX;
+    uint32_t args_num_query = 0;
+    uint32_t args_num_thread = 0;
+    uint32_t args_chunk_mb = 256;
+    GroundTruthOptions opt;
+
+    {
+        po::options_description desc("Available arguments");
+        desc.add_options()("help,h", "print usage message");
+        desc.add_options()("base,b", po::value<std::string>(&args_base)->required(),
+                           "base vectors (bvecs, fvecs or npy)");
+        desc.add_options()("queries,q", po::value<std::string>(&args_queries)->required(),
+                           "query vectors");
+        desc.add_options()("gt_ids,o", po::value<std::string>(&args_gt_ids)->required(),
+                           "output: the ids of the k nearest base vectors of "
+                           "every query, closest first (ivecs or npy)");
+        desc.add_options()("gt_dists", po::value<std::string>(&args_gt_dists),
+                           "output: their distances (fvecs or npy)");
+        desc.add_options()("k,k", po::value<size_t>(&opt.k),
+                           "number of neighbors (default: 100)");
+        desc.add_options()("metric", po::value<std::string>(&args_metric),
+                           "l2, ip (inner product) or cosine (default: l2)");
+        desc.add_options()("num_base,n", po::value<size_t>(&args_num_base),
+                           "only search the first base vectors (default: all)");
+        desc.add_options()("num_query", po::value<uint32_t>(&args_num_query),
+                           "only the first queries (default: all)");
+        desc.add_options()("num_thread,t", po::value<uint32_t>(&args_num_thread),
+                           "scanning threads (default: one per core)");
+        desc.add_options()("chunk_size", po::value<uint32_t>(&args_chunk_mb),
+                           "base vectors scanned per chunk in mb of floats "
+                           "(default: 256MB)");
+        po::variables_map vm;
+        try {
+            po::store(po::parse_command_line(argc, argv, desc), vm);
+            if (vm.count("help")) {
+                std::cout << desc << "\n";
+                return 0;
+            }
+            po::notify(vm);
+        } catch (std::exception &e) {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+        if (!parse_metric(args_metric, &opt.metric)) {
+            std::cerr << "Error: unknown metric " << args_metric << "\n";
+            return 1;
+        }
+        if (opt.k == 0) {
+            std::cerr << "Error: k must be positive\n";
+            return 1;
+        }
+        opt.num_thread = args_num_thread ? args_num_thread : cores();
+        opt.chunk_size = (size_t)std::max<uint32_t>(1, args_chunk_mb) << 20;
+    }
+
+    VecsReader base, query_reader;
+    if (!base.open(args_base.c_str()) || !query_reader.open(args_queries.c_str()))
+        return -1;
+    size_t dim = base.info.dimension;
+    size_t num_base = std::min(args_num_base, base.info.num_vectors);
+    size_t nq = query_reader.info.num_vectors;
+    if (args_num_query > 0 && args_num_query < nq) nq = args_num_query;
+    if (num_base >= UINT32_MAX) {
+        std::cerr << "the ids are 32 bits, search at most " << UINT32_MAX - 1
+                  << " base vectors" << std::endl;
+        return -1;
+    }
+    std::vector<float> queries(nq * dim);
+    if (query_reader.info.dimension != dim ||
+        !query_reader.read_float(0, nq, queries.data())) {
+        std::cerr << "failed to read the queries, or their dimension is not "
+                  << dim << ": " << args_queries << std::endl;
+        return -1;
+    }
+
+    printf("base         : %s (%zu of %zu vectors)\n", args_base.c_str(),
+           num_base, base.info.num_vectors);
+    printf("dimension    : %zu\n", dim);
+    printf("num queries  : %zu\n", nq);
+    printf("k            : %zu\n", opt.k);
+    printf("metric       : %s\n", metric_name(opt.metric));
+    printf("threads      : %zu\n", opt.num_thread);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<uint32_t> ids;
+    std::vector<float> dists;
+    if (!compute_groundtruth(base, num_base, queries, nq, opt, &ids, &dists))
+        return -1;
+    auto end = std::chrono::high_resolution_clock::now();
+    double seconds = std::chrono::duration<double>(end - start).count();
+    printf("time         : %.3f s\n", seconds);
+    printf("throughput   : %.3e distances/s\n", (double)num_base * nq / seconds);
+
+    VecsWriter ids_writer;
+    if (!ids_writer.open(args_gt_ids.c_str(), opt.k, nq, ElemType::i32) ||
+        !ids_writer.write_int(0, nq, (const int32_t *)ids.data())) {
+        std::cerr << "failed to write " << args_gt_ids << std::endl;
+        return -1;
+    }
+    if (!args_gt_dists.empty()) {
+        VecsWriter dists_writer;
+        if (!dists_writer.open(args_gt_dists.c_str(), opt.k, nq) ||
+            !dists_writer.write_float(0, nq, dists.data())) {
+            std::cerr << "failed to write " << args_gt_dists << std::endl;
+            return -1;
+        }
+    }
+    return 0;
+}
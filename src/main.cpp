@@ -1,30 +1,45 @@
 #include <sys/stat.h>
 
+#include <algorithm>
+#include <atomic>
 #include <boost/program_options.hpp>
 #include <chrono>
+#include <cmath>
 #include <iomanip>
 #include <iostream>
+#include <mutex>
 #include <random>
 #include <thread>
 
-#include "distances.h"
+#include "async_search.h"
+#include "buffer_pool.h"
+#include "collection.h"
+#include "kernels.h"
+#include "latency.h"
+#include "numa.h"
+#include "perf_counters.h"
+#include "search.h"
+#include "topology.h"
 
 namespace po = boost::program_options;
 
 // ================= FUNCTION HEADERS ==========================================
 
 // process_page calculates the distance between query_vector and all the vectors
-// in the page (*vectors).
-void process_page(uint32_t pid, float *vectors, uint32_t dim, uint32_t n,
-                  float *query_vector, bool is_simd, bool debug);
-
-// vector_distance calculates the vector distance between *a and *b, given that
-// both has dim dimension.
-double vector_distance(float *a, float *b, uint32_t dim);
-
-// vector_distance_simd is similar as vector_distance, but it uses vectorized
-// operation with SIMD.
-double vector_distance_simd(float *a, float *b, uint32_t dim);
+// in the page, with the kernel of the collection (see kernels.h).
+void process_page(uint32_t pid, const char *page, uint32_t dim, uint32_t n,
+                  float *query_vector, const DistanceKernel &kernel, bool debug);
+
+// run_search answers the queries of query_filename over the clustered
+// collection with num_thread workers, and reports the throughput and the
+// latency of every stage. The top-k ids are written to result_filename, if
+// not empty.
+int run_search(const Collection &collection, const char *memory,
+               BufferPool *pool, const std::string &centroids_filename,
+               const std::string &query_filename,
+               const std::string &result_filename, uint32_t num_query,
+               uint32_t num_thread, const SearchOptions &opt,
+               LatencyRecorder &latency);
 
 // =============================================================================
 
@@ -36,9 +51,30 @@ int main(int argc, char **argv) {
     bool args_debug = false;
     bool args_write_pages = true;
     bool args_memory_only = false;
-
-    const char *data_filename = "../data/sift1m/sift_base.fvecs";
-    const char *pages_filename = "../data/sift1m/collection";
+    uint32_t args_buffer_pool_mb = 0;
+    double args_skew = 0.0;
+
+    std::string args_data = "../data/sift1m/sift_base.fvecs";
+    std::string args_collection = "../data/sift1m/collection";
+    std::string args_clusters;
+    std::string args_centroids;
+    std::string args_queries;
+    std::string args_results;
+    std::string args_route = "auto";
+    uint32_t args_num_query = 0;
+    std::string args_latency_json;
+    bool args_perf = false;
+    bool args_pin = false;
+    bool args_smt = false;
+    bool args_numa = false;
+    bool args_permute_dims = false;
+    std::string args_metric = "l2";
+    Metric write_metric = Metric::l2;
+    uint32_t args_tile = 0;
+    std::string args_encoding = "f32";
+    Encoding write_encoding = Encoding::f32;
+    std::string args_pca;
+    SearchOptions search_opt;
 
     // read and parse the given arguments, put them into variables
     {
@@ -56,6 +92,113 @@ int main(int argc, char **argv) {
                            "write pages into a file or reuse (default: true)");
         desc.add_options()("memory_only,m", po::value<bool>(&args_memory_only),
                            "read pages from file or from memory");
+        desc.add_options()("buffer_pool,b",
+                           po::value<uint32_t>(&args_buffer_pool_mb),
+                           "cache pages read from file in a buffer pool of "
+                           "this size in mb (default: 0, no pool)");
+        desc.add_options()("skew,z", po::value<double>(&args_skew),
+                           "zipf skew of the page access, 0 is a uniform "
+                           "permutation (default: 0)");
+        desc.add_options()("data", po::value<std::string>(&args_data),
+                           "vectors to write into pages (bvecs, fvecs, npy)");
+        desc.add_options()("collection,c",
+                           po::value<std::string>(&args_collection),
+                           "the paged collection file");
+        desc.add_options()("clusters", po::value<std::string>(&args_clusters),
+                           "cluster id of every data vector, the pages are "
+                           "grouped by cluster when written");
+        desc.add_options()("permute_dims",
+                           po::value<bool>(&args_permute_dims),
+                           "store the highest-variance dimensions first when "
+                           "writing the pages (default: false)");
+        desc.add_options()("metric", po::value<std::string>(&args_metric),
+                           "distance of the collection written: l2, ip "
+                           "(inner product) or cosine (default: l2)");
+        desc.add_options()("tile", po::value<uint32_t>(&args_tile),
+                           "write transposed pages, the vectors interleaved "
+                           "by dimension in tiles of 8 or 16 (default: 0, "
+                           "row-major)");
+        desc.add_options()("encoding", po::value<std::string>(&args_encoding),
+                           "element encoding of the pages written: f32, f16 "
+                           "or bf16, twice the vectors per page (default: "
+                           "f32)");
+        desc.add_options()("pca", po::value<std::string>(&args_pca),
+                           "write reduced pages, the vectors projected by "
+                           "this PCA projection (see tools_train_pca), and "
+                           "the full vectors aside to re-rank");
+        desc.add_options()("queries,q", po::value<std::string>(&args_queries),
+                           "answer the queries of this file instead of "
+                           "scanning all the pages with a single query");
+        desc.add_options()("centroids", po::value<std::string>(&args_centroids),
+                           "cluster centroids, to route the queries");
+        desc.add_options()("num_query", po::value<uint32_t>(&args_num_query),
+                           "only answer the first queries (default: all)");
+        desc.add_options()("k,k", po::value<size_t>(&search_opt.k),
+                           "number of nearest neighbors (default: 10)");
+        desc.add_options()("nprobe,n", po::value<size_t>(&search_opt.nprobe),
+                           "clusters probed per query (default: 8)");
+        desc.add_options()("route", po::value<std::string>(&args_route),
+                           "centroid routing: auto, flat or graph");
+        desc.add_options()("early_abandon",
+                           po::value<bool>(&search_opt.early_abandon),
+                           "stop a distance once it can not enter the top-k "
+                           "(default: true)");
+        desc.add_options()("prune_pages",
+                           po::value<bool>(&search_opt.prune_pages),
+                           "skip the pages whose centroid and radius show they "
+                           "can not enter the top-k (default: true)");
+        desc.add_options()("probe_ratio",
+                           po::value<float>(&search_opt.probe_ratio),
+                           "stop probing once the next centroid is farther "
+                           "than this times the k-th distance, l2 only "
+                           "(default: 0, off)");
+        desc.add_options()("probe_patience",
+                           po::value<size_t>(&search_opt.probe_patience),
+                           "stop probing after this many clusters without a "
+                           "change of the top-k (default: 0, off)");
+        desc.add_options()("rerank", po::value<size_t>(&search_opt.rerank),
+                           "candidates of a reduced collection re-ranked "
+                           "with their full vectors (default: 4 k)");
+        desc.add_options()("prefetch_depth",
+                           po::value<size_t>(&search_opt.prefetch_depth),
+                           "clusters read ahead of the one being scored, 0 "
+                           "reads each page right before scoring it "
+                           "(default: 2)");
+        desc.add_options()("staging_pages",
+                           po::value<size_t>(&search_opt.staging_pages),
+                           "pages read ahead per worker, at most, bounded "
+                           "by the buffer pool (default: 64)");
+        desc.add_options()("io_threads",
+                           po::value<size_t>(&search_opt.io_threads),
+                           "concurrent page reads per worker (default: 2)");
+        desc.add_options()("in_flight",
+                           po::value<size_t>(&search_opt.in_flight),
+                           "run the queries as coroutines, this many in "
+                           "flight per worker, reading the pages from the "
+                           "file, without -m or -b (default: 0, one at a "
+                           "time)");
+        desc.add_options()("read_window",
+                           po::value<size_t>(&search_opt.read_window),
+                           "pages read ahead by each coroutine (default: 4)");
+        desc.add_options()("results", po::value<std::string>(&args_results),
+                           "write the top-k ids of every query (ivecs)");
+        desc.add_options()("latency_json",
+                           po::value<std::string>(&args_latency_json),
+                           "export the latency histograms of every stage "
+                           "(json)");
+        desc.add_options()("pin", po::value<bool>(&args_pin),
+                           "pin the workers one per physical core and the "
+                           "I/O threads off them (default: false)");
+        desc.add_options()("smt", po::value<bool>(&args_smt),
+                           "place workers on the SMT siblings too, once "
+                           "pinned (default: false)");
+        desc.add_options()("numa", po::value<bool>(&args_numa),
+                           "page-scan benchmark: partition the clusters over "
+                           "the NUMA nodes of the pinned workers, each "
+                           "scanning its node's pages (default: false)");
+        desc.add_options()("perf", po::value<bool>(&args_perf),
+                           "count cycles, instructions, LLC, dTLB and branch "
+                           "misses of the page scan (default: false)");
         desc.add_options()("repetition,r",
                            po::value<uint32_t>(&args_num_repetition),
                            "number of repetition in page processing");
@@ -77,100 +220,228 @@ int main(int argc, char **argv) {
             return 1;
         }
 
-        if (!args_write_pages && !args_memory_only) {
+        search_opt.use_simd = args_use_simd;
+        if (!parse_metric(args_metric, &write_metric)) {
+            std::cerr << "Error: unknown metric " << args_metric << "\n";
+            return 1;
+        }
+        if (!parse_encoding(args_encoding, &write_encoding)) {
+            std::cerr << "Error: unknown encoding " << args_encoding << "\n";
+            return 1;
+        }
+        if (args_route == "flat") search_opt.route_mode = RouteMode::flat;
+        else if (args_route == "graph") search_opt.route_mode = RouteMode::graph;
+        if (args_num_thread == 0) args_num_thread = 1;
+        if (args_numa) args_pin = true;
+        if (args_numa && !args_queries.empty()) {
+            std::cerr << "Error: --numa only applies to the page-scan "
+                         "benchmark, sedann_server --numa routes the probes "
+                         "of the queries to their nodes\n";
+            return 1;
+        }
+        if (search_opt.in_flight > 0 &&
+            (args_memory_only || args_buffer_pool_mb > 0)) {
+            std::cerr << "Error: --in_flight reads the pages from the file, "
+                         "it cannot be combined with --memory_only or "
+                         "--buffer_pool\n";
+            return 1;
+        }
+        if (!args_queries.empty() && args_centroids.empty()) {
+            std::cerr << "Error: --queries needs the --centroids\n";
+            return 1;
+        }
+
+        if (!args_write_pages) {
             printf(
                 "WARNING: reusing pages file (%s), ensure the file is exist "
                 "and the page size is correct! You can run the program with "
                 "'--write_pages true' first before running it with "
                 "'--write_pages false'\n\n",
-                pages_filename);
+                args_collection.c_str());
         }
     }
 
-    // begin reading vectors from file =========================================
-    FILE *data_file = fopen(data_filename, "r");
-    int32_t dimension;
+    // begin rewrite into pages ================================================
+    // the pages are written by streaming the data file in chunks, so the
+    // dataset never has to fit in memory
+    size_t page_size_kb = args_page_size_kb;
+    size_t page_size = page_size_kb * 1024;
+    if (args_write_pages) {
+        CollectionWriteOptions opt;
+        opt.base_filename = args_data;
+        opt.clusters_filename = args_clusters;
+        opt.collection_filename = args_collection;
+        opt.page_size = page_size;
+        opt.permute_dims = args_permute_dims;
+        opt.metric = write_metric;
+        opt.tile = args_tile;
+        opt.encoding = write_encoding;
+        opt.pca_filename = args_pca;
+        if (!write_collection(opt)) {
+            return -1;
+        }
+    }
 
-    if (!data_file) {
-        std::cerr << "failed to open data file: " << data_filename << std::endl;
+    Collection collection;
+    if (!collection.open(args_collection)) {
         return -1;
     }
-
-    fread(&dimension, 1, sizeof(int32_t), data_file);
-    fseek(data_file, 0, SEEK_SET);
-    struct stat st {};
-    fstat(fileno(data_file), &st);
-    size_t filesize = st.st_size;
-
-    if (filesize % ((dimension + 1) * 4) != 0) {
-        std::cerr << "invalid fvecs file, weird file size: " << data_filename
+    const CollectionMeta &meta = collection.meta;
+    int32_t dimension = meta.dimension;
+    size_t num_vectors = meta.num_vectors;
+    size_t vectors_per_page = meta.vectors_per_page;
+    size_t num_pages = meta.num_pages;
+    if (meta.page_size != page_size) {
+        std::cerr << "the collection has " << meta.page_size
+                  << " bytes pages, rewrite it with '--write_pages true'"
                   << std::endl;
         return -1;
     }
-    size_t num_vectors = filesize / ((dimension + 1) * 4);
-    printf("reading vectors from %s\n", data_filename);
+    printf("reading vectors from %s\n", args_data.c_str());
     printf("dimension    : %d\n", dimension);
-    printf("filesize     : %zu bytes\n", filesize);
     printf("num vectors  : %zu\n", num_vectors);
-
-    // prepare a query for page processing (distance calculation)
-    std::uint32_t query_vector_id = 313;
-    float *query_vector = new float[dimension];
-    fseek(data_file, (dimension + 1) * query_vector_id, SEEK_SET);
-    fread(query_vector, sizeof(float), dimension, data_file);
-    fseek(data_file, 0, SEEK_SET);
-
-    float *vectors;
-    if (args_write_pages || args_memory_only) {
-        vectors = new float[dimension * num_vectors];
-        auto *buff_vector = new float[dimension + 1];
-        for (size_t i = 0; i < num_vectors; i++) {
-            fread(buff_vector, sizeof(float), dimension + 1, data_file);
-            memcpy(vectors + (i * dimension), buff_vector + 1, dimension);
-        }
-        delete[] buff_vector;
-    }
-    fclose(data_file);
-    // end reading vectors from file ===========================================
-
-    // begin rewrite into pages ================================================
-    size_t page_size_kb = args_page_size_kb;
-    size_t page_size = page_size_kb * 1024;
-    size_t vectors_per_page = page_size / (dimension * sizeof(float));
-    size_t num_pages = num_vectors / vectors_per_page;
     printf("page size    : %zu bytes\n", page_size);
     printf("vector/page  : %zu\n", vectors_per_page);
     size_t wasted_space =
-        page_size - (vectors_per_page * dimension * sizeof(float));
+        page_size - (vectors_per_page * dimension * encoding_size(meta.encoding));
     printf("wasted space : %zu byte\n", wasted_space);
     printf("in a page    \n");
     printf("num. of page : %zu\n", num_pages);
+    printf("num. cluster : %zu\n", meta.clusters.size());
+    if (collection.has_replicas)
+        printf("replication  : %.2f copies per vector (+%.1f%% space)\n",
+               (double)meta.num_copies() / num_vectors,
+               100.0 * (meta.num_copies() - num_vectors) / num_vectors);
+    printf("metric       : %s\n", metric_name(meta.metric));
+    if (meta.tile)
+        printf("layout       : transposed, tiles of %u vectors\n", meta.tile);
+    if (meta.encoding != Encoding::f32)
+        printf("encoding     : %s\n", encoding_name(meta.encoding));
+    if (!collection.permutation.empty())
+        printf("dimensions   : permuted, highest variance first\n");
+    if (collection.reduced())
+        printf("reduction    : pca %zu -> %d dimensions, full vectors "
+               "re-ranked\n",
+               collection.query_dimension(), dimension);
+
+    // with --numa, the clusters are split over the nodes of the workers
+    // (see numa.h), their pages in the memory of their node
+    NumaPartitioning numa;
+    std::vector<size_t> worker_partition(args_num_thread, 0);
+    if (args_pin) {
+        Topology topology;
+        topology.load();
+        ThreadPlacement placement =
+            topology.plan_threads(args_num_thread, args_smt);
+        search_opt.worker_cpus = placement.worker_cpus;
+        search_opt.io_cpus = placement.io_cpus;
+        printf("topology     : %zu nodes, %zu cores, %zu cpus, quota %.2f\n",
+               topology.num_nodes(), topology.num_cores(), topology.num_cpus(),
+               topology.quota());
+        printf("worker cpus  : %s\n",
+               cpu_list_string(placement.worker_cpus).c_str());
+        printf("io cpus      : %s\n", cpu_list_string(placement.io_cpus).c_str());
+
+        std::vector<int> nodes;
+        if (args_numa) {
+            for (int cpu : placement.worker_cpus)
+                nodes.push_back(topology.node_of(cpu));
+            std::sort(nodes.begin(), nodes.end());
+            nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+        }
+        numa.plan(meta, nodes);
+        for (uint32_t i = 0; i < args_num_thread; i++)
+            worker_partition[i] =
+                numa.partition_of_node(topology.node_of(placement.worker_cpus[i]));
+        for (size_t p = 0; args_numa && p < numa.num_partitions(); p++)
+            printf("partition %zu  : node %d, %lu clusters, %lu pages\n", p,
+                   numa.node(p), numa.partition_clusters[p],
+                   numa.partition_pages[p]);
+    } else {
+        numa.plan(meta, {});
+    }
 
-    if (args_write_pages) {
-        FILE *pages_file = fopen(pages_filename, "w+");
-        if (!pages_file) {
-            std::cerr << "failed to open collection file: " << pages_filename
-                      << std::endl;
+    // memory only mode keeps the whole collection in memory
+    char *vectors = nullptr;
+    if (args_memory_only) {
+        vectors = numa.alloc_pages(meta);
+        if (!vectors) {
+            std::cerr << "failed to allocate the collection memory" << std::endl;
             return -1;
         }
-
-        size_t cur_vec_idx = 0;
-        std::uint32_t page_id = 0;
-        while (cur_vec_idx < num_vectors) {
-            size_t file_offset = page_id * page_size;
-            fseek(pages_file, file_offset, SEEK_SET);
-            fwrite(vectors + cur_vec_idx, sizeof(float),
-                   vectors_per_page * dimension, pages_file);
-            cur_vec_idx += vectors_per_page;
-            page_id++;
+        for (size_t pid = 0; pid < num_pages; pid++) {
+            char *page = vectors + numa.page_offset(pid, page_size);
+            if (!collection.read_page(pid, page)) {
+                std::cerr << "failed to read page " << pid << " of "
+                          << args_collection << std::endl;
+                return -1;
+            }
         }
+    }
 
-        fclose(pages_file);
+    BufferPool *pool = nullptr;
+    if (args_buffer_pool_mb > 0 && !args_memory_only) {
+        pool = new BufferPool(collection, (size_t)args_buffer_pool_mb << 20);
+        std::cout << "buffer pool  : " << pool->capacity() << " pages in "
+                  << pool->num_partitions() << " partitions" << std::endl;
     }
     // end rewrite into pages ==================================================
 
+    LatencyRecorder latency;
+    if (!args_queries.empty()) {
+        if (search_opt.prune_pages) {
+            if (collection.load_page_bounds())
+                printf("page bounds  : %zu MB, a centroid and radius per page\n",
+                       collection.page_bounds.size() * sizeof(float) >> 20);
+            else
+                printf("page bounds  : none, rewrite the collection to skip pages\n");
+        }
+        if (pool) {
+            size_t max_staging = max_staging_pages(*pool, args_num_thread);
+            if (max_staging == 0) {
+                std::cerr << "Error: the buffer pool partitions hold "
+                          << pool->partition_capacity() << " pages, fewer than "
+                          << args_num_thread << " workers pin at once; use a "
+                          << "larger --buffer_pool or fewer threads\n";
+                delete pool;
+                return 1;
+            }
+            search_opt.staging_pages = std::min(search_opt.staging_pages, max_staging);
+        }
+        int ret = run_search(collection, vectors, pool, args_centroids,
+                             args_queries, args_results, args_num_query,
+                             args_num_thread, search_opt, latency);
+        if (ret == 0 && !args_latency_json.empty() &&
+            !latency.write_json(args_latency_json))
+            ret = -1;
+        delete pool;
+        numa.free_pages(vectors);
+        return ret;
+    }
+
+    // prepare a query for page processing (distance calculation)
+    // (projected, with the pages of a reduced collection)
+    std::uint32_t query_vector_id = 313;
+    float *query_vector = new float[dimension];
+    {
+        VecsReader data_reader;
+        std::vector<float> original(collection.query_dimension());
+        if (!data_reader.open(args_data.c_str()) ||
+            data_reader.info.dimension != original.size() ||
+            !data_reader.read_float(query_vector_id, 1, original.data())) {
+            std::cerr << "failed to read the query vector from: "
+                      << args_data << std::endl;
+            return -1;
+        }
+        collection.prepare_query(original.data(), query_vector);
+    }
+
     // begin random page processing ============================================
 
+    DistanceKernel kernel =
+        select_kernel(meta.metric, dimension, args_use_simd, meta.tile,
+                      meta.encoding);
+
     // random permutation of page access
     std::vector<uint32_t> page_ids;
     for (int i = 0; i < num_pages; ++i) {
@@ -179,17 +450,40 @@ int main(int argc, char **argv) {
     auto rd = std::random_device{};
     auto rng = std::default_random_engine{rd()};
     std::shuffle(page_ids.begin(), page_ids.end(), rng);
+
+    // with skew, the accesses follow a zipf distribution over the shuffled
+    // pages, like the hot clusters of a production query stream
+    if (args_skew > 0) {
+        std::vector<double> cdf(num_pages);
+        double sum = 0;
+        for (size_t i = 0; i < num_pages; i++) {
+            sum += 1.0 / std::pow(i + 1, args_skew);
+            cdf[i] = sum;
+        }
+        std::uniform_real_distribution<double> uniform(0, sum);
+        std::vector<uint32_t> skewed(num_pages);
+        for (auto &pid : skewed) {
+            size_t rank = std::lower_bound(cdf.begin(), cdf.end(), uniform(rng)) -
+                          cdf.begin();
+            pid = page_ids[std::min(rank, num_pages - 1)];
+        }
+        page_ids = skewed;
+    }
+
     std::cout << "page access  : ";
-    for (int i = 0; i < 5; ++i) {
-        page_ids.push_back(i);
+    for (int i = 0; i < 5 && i < page_ids.size(); ++i) {
         std::cout << page_ids[i] << " ";
     }
     std::cout << " ...\n";
 
-    auto thread_run = [pages_filename, page_size, dimension, vectors_per_page,
-                       query_vector, vectors, page_ids, args_use_simd,
-                       args_num_repetition, args_debug, args_memory_only](
+    auto scan_pages = [&collection, pool, page_size, dimension,
+                       vectors_per_page, query_vector, vectors, &numa, &page_ids,
+                       &latency, &kernel, args_num_repetition,
+                       args_debug, args_memory_only](
                           int thread_id, int pid_start_idx, int pid_end_idx) {
+        using clock = std::chrono::steady_clock;
+        StageHistograms *h = latency.thread_histograms();
+
         // print out thread information
         if (args_debug) {
             printf("thread-%d (", thread_id);
@@ -201,58 +495,137 @@ int main(int argc, char **argv) {
         // using *vectors which is stored in memory
         if (args_memory_only) {
             for (uint32_t r = 0; r < args_num_repetition; r++)
-                for (uint32_t pid = pid_start_idx; pid < pid_end_idx; ++pid) {
+                for (uint32_t idx = pid_start_idx; idx < pid_end_idx; ++idx) {
                     // reading the page from memory
-                    uint32_t page_offset_float = pid * vectors_per_page * dimension;
-                    float *page = vectors + page_offset_float;
+                    uint32_t pid = page_ids[idx];
+                    const char *page = vectors + numa.page_offset(pid, page_size);
 
                     // process the page by doing distance calculation
+                    auto t0 = clock::now();
                     process_page(pid, page, dimension, vectors_per_page,
-                                 query_vector, args_use_simd, args_debug);
+                                 query_vector, kernel, args_debug);
+                    h->record(Stage::distance, elapsed_ns(t0, clock::now()));
                 }
 
             return;
         }
 
-        FILE *f = fopen(pages_filename, "r");
-        if (!f) {
-            std::cerr << "thread-" << thread_id
-                      << " : failed to open collection file: " << pages_filename
-                      << std::endl;
+        // reading the pages through the buffer pool, the page stays pinned
+        // while it is processed
+        if (pool) {
+            for (uint32_t r = 0; r < args_num_repetition; r++)
+                for (uint32_t idx = pid_start_idx; idx < pid_end_idx; ++idx) {
+                    uint32_t pid = page_ids[idx];
+                    auto t0 = clock::now();
+                    BufferPool::PageHandle page = pool->get(pid);
+                    if (!page) {
+                        std::cerr << "thread-" << thread_id
+                                  << " : failed to read page " << pid << std::endl;
+                        return;
+                    }
+                    auto t1 = clock::now();
+                    process_page(pid, page.data(), dimension,
+                                 vectors_per_page, query_vector, kernel,
+                                 args_debug);
+                    h->record(Stage::io_wait, elapsed_ns(t0, t1));
+                    h->record(Stage::distance, elapsed_ns(t1, clock::now()));
+                }
+
             return;
         }
 
         char *page = new char[page_size];
         for (uint32_t r = 0; r < args_num_repetition; r++)
-            for (uint32_t pid = pid_start_idx; pid < pid_end_idx; ++pid) {
+            for (uint32_t idx = pid_start_idx; idx < pid_end_idx; ++idx) {
                 // reading the page from external file
-                uint32_t page_offset = pid * page_size;
-                fseek(f, page_offset, SEEK_SET);
-                fread(page, sizeof(char), page_size, f);
+                uint32_t pid = page_ids[idx];
+                auto t0 = clock::now();
+                if (!collection.read_page(pid, page)) {
+                    std::cerr << "thread-" << thread_id
+                              << " : failed to read page " << pid << std::endl;
+                    break;
+                }
 
                 // process the page by doing distance calculation
-                process_page(pid, (float *)page, dimension, vectors_per_page,
-                             query_vector, args_use_simd, args_debug);
+                auto t1 = clock::now();
+                process_page(pid, page, dimension, vectors_per_page,
+                             query_vector, kernel, args_debug);
+                h->record(Stage::io_wait, elapsed_ns(t0, t1));
+                h->record(Stage::distance, elapsed_ns(t1, clock::now()));
             }
 
-        fclose(f);
         delete[] page;
     };
 
+    // the hardware counters of every worker cover its whole scan loop
+    PerfCounts perf_total;
+    std::mutex perf_mu;
+    auto thread_run = [&scan_pages, &perf_total, &perf_mu, &search_opt,
+                       args_perf](int thread_id, int pid_start_idx,
+                                  int pid_end_idx) {
+        if (!search_opt.worker_cpus.empty())
+            pin_thread(search_opt.worker_cpus[thread_id]);
+        PerfCounters counters;
+        bool counting = args_perf && counters.open();
+        if (counting) counters.start();
+        scan_pages(thread_id, pid_start_idx, pid_end_idx);
+        if (counting) {
+            counters.stop();
+            PerfCounts counts = counters.read_counts();
+            std::lock_guard<std::mutex> lock(perf_mu);
+            perf_total.add(counts);
+        }
+    };
+
+    // the range of page_ids of every worker
+    std::vector<std::pair<size_t, size_t>> worker_range(args_num_thread);
+    uint32_t pages_per_worker = num_pages / args_num_thread;
+    for (uint32_t thread_id = 0; thread_id < args_num_thread; thread_id++) {
+        size_t pid_start_idx = thread_id * pages_per_worker;
+        worker_range[thread_id] = {
+            pid_start_idx, std::min(page_ids.size(), pid_start_idx + pages_per_worker)};
+    }
+    if (numa.num_partitions() > 1) {
+        // every worker only scans pages of its node: the accesses are
+        // grouped by partition and each group is split among the workers
+        // of that partition
+        std::vector<uint32_t> page_partition(num_pages, 0);
+        for (size_t cid = 0; cid < meta.clusters.size(); cid++) {
+            const ClusterInfo &c = meta.clusters[cid];
+            for (uint64_t p = 0; p < c.num_pages; p++)
+                page_partition[c.first_page + p] = numa.partition_of(cid);
+        }
+        std::stable_sort(page_ids.begin(), page_ids.end(),
+                         [&](uint32_t a, uint32_t b) {
+                             return page_partition[a] < page_partition[b];
+                         });
+        size_t group_start = 0;
+        for (size_t p = 0; p < numa.num_partitions(); p++) {
+            size_t group_end = group_start;
+            while (group_end < page_ids.size() &&
+                   page_partition[page_ids[group_end]] == p)
+                group_end++;
+            std::vector<uint32_t> local;
+            for (uint32_t i = 0; i < args_num_thread; i++)
+                if (worker_partition[i] == p) local.push_back(i);
+            for (size_t j = 0; j < local.size(); j++) {
+                size_t len = group_end - group_start;
+                worker_range[local[j]] = {group_start + len * j / local.size(),
+                                          group_start + len * (j + 1) / local.size()};
+            }
+            group_start = group_end;
+        }
+    }
+
     // init and run workers to process multiple pages
     std::vector<std::thread *> workers;
-    uint32_t pages_per_worker = num_pages / args_num_thread;
     std::cout << "num worker   : " << args_num_thread << std::endl;
     std::cout << "pages/worker : " << pages_per_worker << std::endl;
     auto start = std::chrono::high_resolution_clock::now();
     for (int thread_id = 0; thread_id < args_num_thread; thread_id++) {
-        int pid_start_idx = thread_id * pages_per_worker;
-        int pid_end_idx = thread_id * pages_per_worker + pages_per_worker;
-        pid_end_idx =
-            pid_end_idx > page_ids.size() ? page_ids.size() : pid_end_idx;
-
-        auto *t =
-            new std::thread(thread_run, thread_id, pid_start_idx, pid_end_idx);
+        auto *t = new std::thread(thread_run, thread_id,
+                                  (int)worker_range[thread_id].first,
+                                  (int)worker_range[thread_id].second);
         workers.push_back(t);
     }
 
@@ -274,27 +647,62 @@ int main(int argc, char **argv) {
               << std::setprecision(9);
     std::cout << "  calculation/s " << std::endl;
 
-    // end random page processing ==============================================
+    if (args_perf) {
+        uint64_t pages_scanned = 0;
+        for (auto &range : worker_range)
+            pages_scanned += (range.second - range.first) * args_num_repetition;
+        print_perf_counts(perf_total, pages_scanned,
+                          pages_scanned * vectors_per_page);
+    }
+    std::cout << " > per page latency  : " << std::endl;
+    latency.print();
+    if (!args_latency_json.empty() && !latency.write_json(args_latency_json))
+        return -1;
 
-    if (args_write_pages) {
-        delete[] vectors;
+    if (pool) {
+        BufferPoolStats stats = pool->stats();
+        std::cout << " > pool hit rate     : " << std::setprecision(4)
+                  << stats.hit_rate() * 100 << " %" << std::endl;
+        std::cout << " > pool hits/misses  : " << stats.hits << " / "
+                  << stats.misses << std::endl;
+        std::cout << " > pool evictions    : " << stats.evictions
+                  << " (ghost hits: " << stats.ghost_hits << ")" << std::endl;
+        delete pool;
     }
 
+    // end random page processing ==============================================
+
+    numa.free_pages(vectors);
+    delete[] query_vector;
+
     return 0;
 }
 
-void process_page(uint32_t pid, float *vectors, uint32_t dim, uint32_t n,
-                  float *query_vector, bool is_simd, bool debug) {
+void process_page(uint32_t pid, const char *page, uint32_t dim, uint32_t n,
+                  float *query_vector, const DistanceKernel &kernel, bool debug) {
     auto start = std::chrono::high_resolution_clock::now();
     double tmp = 0.0;
-    for (int i = 0; i < n; ++i) {
-        uint32_t target_vector_idx = i;
-        if (is_simd)
-            tmp += vector_distance_simd(
-                query_vector, vectors + (target_vector_idx * dim), dim);
-        else
-            tmp += vector_distance(query_vector,
+    const size_t vector_bytes = (size_t)dim * encoding_size(kernel.encoding);
+    const float *vectors = (const float *)page;
+    if (kernel.tile) {
+        // a transposed page, scored a tile of vectors at a time
+        float distances[16];
+        for (uint32_t i = 0; i < n; i += kernel.tile) {
+            kernel.tile_distance(query_vector, page + i * vector_bytes, dim,
+                                 distances);
+            for (uint32_t l = 0; l < kernel.tile && i + l < n; l++)
+                tmp += distances[l];
+        }
+    } else if (kernel.encoding != Encoding::f32) {
+        // f16 or bf16 elements, widened by the kernel
+        for (uint32_t i = 0; i < n; ++i)
+            tmp += kernel.encoded(query_vector, page + i * vector_bytes, dim);
+    } else {
+        for (int i = 0; i < n; ++i) {
+            uint32_t target_vector_idx = i;
+            tmp += kernel.distance(query_vector,
                                    vectors + (target_vector_idx * dim), dim);
+        }
     }
     if (debug) {
         auto end = std::chrono::high_resolution_clock::now();
@@ -302,7 +710,11 @@ void process_page(uint32_t pid, float *vectors, uint32_t dim, uint32_t n,
             std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
                 .count();
         std::cout << "processing page: " << pid << std::endl;
-        std::cout << "  use simd        : " << is_simd << std::endl;
+        std::cout << "  kernel          : " << metric_name(kernel.metric)
+                  << ", dimension " << (kernel.dim ? "fixed" : "generic")
+                  << (kernel.tile ? ", tiles" : "") << ", "
+                  << encoding_name(kernel.encoding)
+                  << std::endl;
         std::cout << "  time            : " << std::fixed << time_taken * 1e-3
                   << std::setprecision(9);
         std::cout << "  µs " << std::endl;
@@ -312,15 +724,213 @@ void process_page(uint32_t pid, float *vectors, uint32_t dim, uint32_t n,
     }
 }
 
-double vector_distance(float *a, float *b, uint32_t dim) {
-    double dist = 0.0;
-    for (int i = 0; i < dim; ++i) {
-        double tmp = (a[i] - b[i]);
-        dist += tmp * tmp;
+int run_search(const Collection &collection, const char *memory,
+               BufferPool *pool, const std::string &centroids_filename,
+               const std::string &query_filename,
+               const std::string &result_filename, uint32_t num_query,
+               uint32_t num_thread, const SearchOptions &opt,
+               LatencyRecorder &latency) {
+    const CollectionMeta &meta = collection.meta;
+    // the queries and centroids have the full dimension, the pages of a
+    // reduced collection the projected one
+    const size_t dim = collection.query_dimension();
+
+    CentroidRouter router;
+    if (!router.load(centroids_filename)) {
+        return -1;
     }
-    return dist;
-}
+    if (router.size() != meta.clusters.size() || router.dimension() != dim) {
+        std::cerr << "the centroids (" << router.size() << " x "
+                  << router.dimension() << ") do not match the collection ("
+                  << meta.clusters.size() << " clusters x " << dim << ")"
+                  << std::endl;
+        return -1;
+    }
+    bool graph_loaded = false;
+    if (opt.route_mode != RouteMode::flat) {
+        graph_loaded = router.open_graph(centroids_filename);
+    }
+
+    VecsReader query_reader;
+    if (!query_reader.open(query_filename.c_str())) {
+        return -1;
+    }
+    size_t nq = query_reader.info.num_vectors;
+    if (num_query > 0 && num_query < nq) nq = num_query;
+    std::vector<float> queries(nq * dim);
+    if (query_reader.info.dimension != dim ||
+        !query_reader.read_float(0, nq, queries.data())) {
+        std::cerr << "failed to read the queries from: " << query_filename
+                  << std::endl;
+        return -1;
+    }
+
+    std::vector<uint32_t> ids;
+    if (!collection.load_ids(&ids)) {
+        return -1;
+    }
+
+    printf("num queries  : %zu\n", nq);
+    printf("k, nprobe    : %zu, %zu\n", opt.k, opt.nprobe);
+    if (collection.reduced())
+        printf("rerank       : %zu candidates, exact distances\n",
+               Reranker(collection, opt).candidates(opt.k));
+    printf("routing      : %s\n",
+           route_mode_name(opt.route_mode == RouteMode::automatic
+                               ? router.select_mode(1, opt.nprobe)
+                               : opt.route_mode));
+    if (graph_loaded)
+        printf("route graph  : loaded from %s\n",
+               router_graph_filename(centroids_filename).c_str());
+    else if (router.has_graph())
+        printf("route graph  : built at startup\n");
+    if (opt.in_flight > 0) {
+        QueryEventLoop probe(collection, 1);
+        printf("coroutines   : %zu queries in flight per worker, %zu pages "
+               "ahead each (%s)\n",
+               opt.in_flight, opt.read_window,
+               probe.uses_io_uring() ? "io_uring" : "pread");
+    } else {
+        printf("prefetch     : %zu clusters ahead, %zu staging pages, %zu io "
+               "threads\n",
+               opt.prefetch_depth, opt.staging_pages, opt.io_threads);
+    }
+
+    std::vector<uint32_t> result_ids(nq * opt.k);
+    std::vector<float> result_dists(nq * opt.k);
+    std::vector<QueryStats> worker_stats(num_thread);
+    std::vector<uint64_t> worker_io_wait(num_thread, 0);
+    std::atomic<bool> failed{false};
+
+    // coroutine execution: a worker runs opt.in_flight queries at once on
+    // its own event loop, reading the pages directly from the file
+    std::unique_ptr<bool[]> query_ok(new bool[nq]);
+    auto coroutine_worker = [&](uint32_t thread_id, size_t q_start,
+                                size_t q_end) {
+        StageHistograms *h = latency.thread_histograms();
+        size_t window = std::max<size_t>(1, opt.read_window);
+        QueryEventLoop loop(collection,
+                            std::min<size_t>(4096, opt.in_flight * window));
+        loop.run(q_end - q_start, opt.in_flight, [&](size_t i) {
+            size_t q = q_start + i;
+            query_ok[q] = true;
+            return search_coroutine(&loop, &collection, &ids, &router, opt,
+                                    window, queries.data() + q * dim,
+                                    result_ids.data() + q * opt.k,
+                                    result_dists.data() + q * opt.k,
+                                    &query_ok[q], &worker_stats[thread_id], h);
+        });
+        for (size_t q = q_start; q < q_end; q++) {
+            if (!query_ok[q]) {
+                std::cerr << "thread-" << thread_id
+                          << " : failed to read the pages of query " << q
+                          << std::endl;
+                failed = true;
+                return;
+            }
+        }
+        worker_io_wait[thread_id] = (*h)[Stage::io_wait].mean() * (q_end - q_start);
+    };
 
-double vector_distance_simd(float *a, float *b, uint32_t dim) {
-    return fvec_L2sqr_avx(a, b, dim);
-}
\ No newline at end of file
+    auto worker = [&](uint32_t thread_id, size_t q_start, size_t q_end) {
+        if (!opt.worker_cpus.empty()) pin_thread(opt.worker_cpus[thread_id]);
+        if (opt.in_flight > 0) {
+            coroutine_worker(thread_id, q_start, q_end);
+            return;
+        }
+        Searcher searcher(collection, ids, router, opt, pool, memory);
+        searcher.latency = latency.thread_histograms();
+        for (size_t q = q_start; q < q_end; q++) {
+            if (!searcher.search(queries.data() + q * dim,
+                                 result_ids.data() + q * opt.k,
+                                 result_dists.data() + q * opt.k)) {
+                std::cerr << "thread-" << thread_id
+                          << " : failed to read the pages of query " << q
+                          << std::endl;
+                failed = true;
+                return;
+            }
+        }
+        worker_stats[thread_id] = searcher.stats;
+        worker_io_wait[thread_id] = searcher.io_wait_ns();
+    };
+
+    std::vector<std::thread *> workers;
+    size_t queries_per_worker = (nq + num_thread - 1) / num_thread;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (uint32_t thread_id = 0; thread_id < num_thread; thread_id++) {
+        size_t q_start = std::min(nq, thread_id * queries_per_worker);
+        size_t q_end = std::min(nq, q_start + queries_per_worker);
+        workers.push_back(new std::thread(worker, thread_id, q_start, q_end));
+    }
+    for (auto t : workers) {
+        (*t).join();
+        delete t;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    if (failed) {
+        return -1;
+    }
+
+    double time_taken =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+            .count();
+    QueryStats total;
+    uint64_t io_wait_ns = 0;
+    for (uint32_t t = 0; t < num_thread; t++) {
+        total.pages_scanned += worker_stats[t].pages_scanned;
+        total.vectors_scored += worker_stats[t].vectors_scored;
+        total.vectors_abandoned += worker_stats[t].vectors_abandoned;
+        total.pages_skipped += worker_stats[t].pages_skipped;
+        total.clusters_probed += worker_stats[t].clusters_probed;
+        total.vectors_reranked += worker_stats[t].vectors_reranked;
+        io_wait_ns += worker_io_wait[t];
+    }
+
+    std::cout << "\nresults " << std::endl;
+    std::cout << " > time              : " << std::fixed << time_taken * 1e-6
+              << "  ms " << std::endl;
+    std::cout << " > query throughput  : " << nq / (time_taken * 1e-9)
+              << "  query/s " << std::endl;
+    std::cout << " > clusters/query    : " << (double)total.clusters_probed / nq
+              << std::endl;
+    std::cout << " > pages/query       : " << (double)total.pages_scanned / nq
+              << std::endl;
+    std::cout << " > skipped/query     : " << (double)total.pages_skipped / nq
+              << "  pages (page bounds)" << std::endl;
+    std::cout << " > early abandoned   : "
+              << (total.vectors_scored
+                      ? 100.0 * total.vectors_abandoned / total.vectors_scored
+                      : 0.0)
+              << " % of the vectors" << std::endl;
+    std::cout << " > io wait/query     : " << io_wait_ns * 1e-3 / nq << "  µs "
+              << std::endl;
+    if (collection.reduced())
+        std::cout << " > reranked/query    : "
+                  << (double)total.vectors_reranked / nq << "  full vectors"
+                  << std::endl;
+    std::cout << " > per query latency : " << std::endl;
+    latency.print();
+    if (pool) {
+        BufferPoolStats stats = pool->stats();
+        std::cout << " > pool hit rate     : " << stats.hit_rate() * 100
+                  << " %" << std::endl;
+    }
+
+    if (!result_filename.empty()) {
+        FILE *f = fopen(result_filename.c_str(), "w");
+        if (!f) {
+            std::cerr << "failed to open result file: " << result_filename
+                      << std::endl;
+            return -1;
+        }
+        int32_t k = opt.k;
+        for (size_t q = 0; q < nq; q++) {
+            fwrite(&k, sizeof(int32_t), 1, f);
+            fwrite(result_ids.data() + q * opt.k, sizeof(uint32_t), opt.k, f);
+        }
+        fclose(f);
+    }
+
+    return 0;
+}
@@ -1,48 +1,799 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <thread>
+#include <unordered_map>
 #include <vector>
-#include "cores.h"
 
-void initialize();
+#include "buffer_pool.h"
+#include "collection.h"
+#include "latency.h"
+#include "numa.h"
+#include "protocol.h"
+#include "router.h"
+#include "search.h"
+#include "topk.h"
+#include "topology.h"
+
+namespace po = boost::program_options;
+
+// sedann_server keeps a collection open and answers the queries sent over a
+// Unix domain socket or a localhost TCP port (see protocol.h).
+//
+// - the entry thread runs an epoll loop over the listening sockets and the
+//   connections, parses the requests and splits them into queries;
+// - the queries go through a single queue to one worker per CPU core; a
+//   worker takes up to max_batch queries at once, from any request, so many
+//   small requests are routed together (the batched flat routing);
+// - the worker that finishes the last query of a request hands the
+//   response back to the entry thread through an eventfd.
+//
+// With --numa, the clusters are split into one partition per NUMA node of
+// the workers (see numa.h): the pages and the buffer pool of a partition
+// live on its node, and a routed query is scanned by a worker of every node
+// owning some of its probed clusters; the partial top-k are then merged.
+//
+// to run : ./sedann_server -c ../data/sift1m/collection
+//              --centroids ../data/sift1m/centroids.fvecs --listen unix:/tmp/sedann.sock
+
+struct Connection {
+    int fd = -1;
+    std::vector<char> in;
+    std::string out;  // responses not yet sent
+    bool want_write = false;
+};
+
+struct Request {
+    std::shared_ptr<Connection> connection;
+    QueryRequestHeader header;
+    std::vector<float> queries;
+    std::vector<uint32_t> ids;
+    std::vector<float> distances;
+    std::atomic<uint32_t> remaining{0};
+    std::atomic<bool> failed{false};
+    std::chrono::steady_clock::time_point arrival;
+};
+
+struct QueryTask {
+    std::shared_ptr<Request> request;
+    uint32_t index;
+};
+
+// QueryMerge collects the partial top-k of a query scanned by several NUMA
+// partitions.
+struct QueryMerge {
+    std::vector<float> query;
+    std::mutex mu;
+    TopK topk;
+    uint32_t remaining = 0;  // partitions still scanning
+};
+
+// ProbeTask is the part of a routed query owned by one partition: the
+// probed clusters of that partition.
+struct ProbeTask {
+    std::shared_ptr<Request> request;
+    uint32_t index;
+    std::shared_ptr<QueryMerge> merge;
+    std::vector<uint32_t> clusters;
+};
+
+// QueryQueue hands the queries to the workers in batches, and the probes
+// of the routed queries to the workers of their partition.
+class QueryQueue {
+   public:
+    explicit QueryQueue(size_t num_partitions = 1) : probes(num_partitions) {}
+
+    void push(std::shared_ptr<Request> request) {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            for (uint32_t i = 0; i < request->header.num_queries; i++)
+                tasks.push_back({request, i});
+        }
+        cv.notify_all();
+    }
+
+    void push_probe(size_t partition, ProbeTask task) {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            probes[partition].push_back(std::move(task));
+        }
+        cv.notify_all();
+    }
 
-// to compile   : g++ multicore_main.cpp -I ../include/cores.h -std=c++11 -o main
-// to run       : ./main
-int main() {
+    // pop waits for work. The probes of the partition go first, at most
+    // max_batch of them; otherwise it waits up to batch_timeout for more
+    // queries and takes at most max_batch of them. It returns false once
+    // stopped.
+    bool pop(size_t partition, size_t max_batch,
+             std::chrono::microseconds batch_timeout,
+             std::vector<QueryTask> *batch, std::vector<ProbeTask> *probe_batch) {
+        std::unique_lock<std::mutex> lock(mu);
+        std::deque<ProbeTask> &mine = probes[partition];
+        batch->clear();
+        probe_batch->clear();
+        // another worker may empty the queue while this one waits to fill
+        // its batch, then it waits again
+        while (batch->empty() && probe_batch->empty()) {
+            cv.wait(lock, [&]() { return stop || !tasks.empty() || !mine.empty(); });
+            if (stop) return false;
+            if (mine.empty() && tasks.size() < max_batch && batch_timeout.count() > 0)
+                cv.wait_for(lock, batch_timeout, [&]() {
+                    return stop || tasks.size() >= max_batch || !mine.empty();
+                });
+            if (stop) return false;
+            if (!mine.empty()) {
+                while (!mine.empty() && probe_batch->size() < max_batch) {
+                    probe_batch->push_back(std::move(mine.front()));
+                    mine.pop_front();
+                }
+                break;
+            }
+            while (!tasks.empty() && batch->size() < max_batch) {
+                batch->push_back(std::move(tasks.front()));
+                tasks.pop_front();
+            }
+        }
+        return true;
+    }
 
-    initialize();
+    void shutdown() {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            stop = true;
+        }
+        cv.notify_all();
+    }
+
+   private:
+    std::mutex mu;
+    std::condition_variable cv;
+    std::deque<QueryTask> tasks;
+    std::vector<std::deque<ProbeTask>> probes;
+    bool stop = false;
+};
 
-    // get number of physical CPU core
-    uint32_t num_cpus = cores();
-    std::cout << "Launching " << num_cpus << " threads\n";
+// CompletionQueue passes the finished requests back to the entry thread.
+class CompletionQueue {
+   public:
+    CompletionQueue() { fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); }
+    ~CompletionQueue() { close(fd); }
+
+    void push(std::shared_ptr<Request> request) {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            done.push_back(std::move(request));
+        }
+        uint64_t one = 1;
+        (void)!write(fd, &one, sizeof(one));
+    }
+
+    std::vector<std::shared_ptr<Request>> take() {
+        uint64_t count;
+        (void)!read(fd, &count, sizeof(count));
+        std::lock_guard<std::mutex> lock(mu);
+        std::vector<std::shared_ptr<Request>> out;
+        out.swap(done);
+        return out;
+    }
+
+    int fd;
+
+   private:
+    std::mutex mu;
+    std::vector<std::shared_ptr<Request>> done;
+};
+
+void append_response(Connection &c, const QueryResponseHeader &h,
+                     const uint32_t *ids, const float *distances);
+bool flush_connection(int epoll_fd, Connection &c);
+
+int main(int argc, char **argv) {
+    std::string args_collection = "../data/sift1m/collection";
+    std::string args_centroids;
+    std::vector<std::string> args_listen;
+    std::string args_route = "auto";
+    std::string args_latency_json;
+    uint32_t args_num_thread = 0;
+    uint32_t args_max_batch = 32;
+    uint32_t args_batch_timeout_us = 200;
+    uint32_t args_buffer_pool_mb = 0;
+    bool args_memory_only = false;
+    bool args_pin = true;
+    bool args_smt = false;
+    bool args_numa = false;
+    SearchOptions search_opt;
+
+    {
+        po::options_description desc("Available arguments");
+        desc.add_options()("help,h", "print usage message");
+        desc.add_options()("collection,c",
+                           po::value<std::string>(&args_collection),
+                           "the paged collection file");
+        desc.add_options()("centroids",
+                           po::value<std::string>(&args_centroids)->required(),
+                           "cluster centroids, to route the queries");
+        desc.add_options()("listen,l",
+                           po::value<std::vector<std::string>>(&args_listen),
+                           "unix:<path> or a localhost tcp port, can be "
+                           "repeated (default: unix:/tmp/sedann.sock)");
+        desc.add_options()("num_thread,t", po::value<uint32_t>(&args_num_thread),
+                           "number of query workers (default: one per core)");
+        desc.add_options()("pin", po::value<bool>(&args_pin),
+                           "pin the workers one per physical core and the "
+                           "I/O threads off them (default: true)");
+        desc.add_options()("smt", po::value<bool>(&args_smt),
+                           "also run workers on the SMT siblings "
+                           "(default: false)");
+        desc.add_options()("numa", po::value<bool>(&args_numa),
+                           "partition the clusters over the NUMA nodes of "
+                           "the workers, pinned (default: false)");
+        desc.add_options()("max_batch", po::value<uint32_t>(&args_max_batch),
+                           "queries a worker takes at once (default: 32)");
+        desc.add_options()("batch_timeout",
+                           po::value<uint32_t>(&args_batch_timeout_us),
+                           "time a worker waits to fill a batch in us "
+                           "(default: 200)");
+        desc.add_options()("memory_only,m", po::value<bool>(&args_memory_only),
+                           "keep the whole collection in memory");
+        desc.add_options()("buffer_pool,b", po::value<uint32_t>(&args_buffer_pool_mb),
+                           "cache the pages in a buffer pool of this size in mb");
+        desc.add_options()("route", po::value<std::string>(&args_route),
+                           "centroid routing: auto, flat or graph");
+        desc.add_options()("prefetch_depth",
+                           po::value<size_t>(&search_opt.prefetch_depth),
+                           "clusters read ahead of the one being scored "
+                           "(default: 2)");
+        desc.add_options()("probe_ratio",
+                           po::value<float>(&search_opt.probe_ratio),
+                           "stop probing once the next centroid is farther "
+                           "than this times the k-th distance, l2 only, when "
+                           "the clusters of a query are local (default: 0)");
+        desc.add_options()("probe_patience",
+                           po::value<size_t>(&search_opt.probe_patience),
+                           "stop probing after this many clusters without a "
+                           "change of the top-k (default: 0, off)");
+        desc.add_options()("rerank", po::value<size_t>(&search_opt.rerank),
+                           "candidates of a reduced collection re-ranked "
+                           "with their full vectors (default: 4 k)");
+        desc.add_options()("io_threads",
+                           po::value<size_t>(&search_opt.io_threads),
+                           "concurrent page reads per worker (default: 2)");
+        desc.add_options()("latency_json",
+                           po::value<std::string>(&args_latency_json),
+                           "export the latency histograms on exit (json)");
+        po::variables_map vm;
+        try {
+            po::store(po::parse_command_line(argc, argv, desc), vm);
+            if (vm.count("help")) {
+                std::cout << desc << "\n";
+                return 0;
+            }
+            po::notify(vm);
+        } catch (std::exception &e) {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+        if (args_route == "flat") search_opt.route_mode = RouteMode::flat;
+        else if (args_route == "graph") search_opt.route_mode = RouteMode::graph;
+        if (args_listen.empty()) args_listen.push_back("unix:/tmp/sedann.sock");
+        if (args_max_batch == 0) args_max_batch = 1;
+        if (args_numa) args_pin = true;
+    }
+
+    Topology topology;
+    topology.load();
+    ThreadPlacement placement = topology.plan_threads(args_num_thread, args_smt);
+    args_num_thread = placement.worker_cpus.size();
+    if (args_pin) search_opt.io_cpus = placement.io_cpus;
+
+    // open the collection and the router ======================================
+    Collection collection;
+    std::vector<uint32_t> ids;
+    if (!collection.open(args_collection) || !collection.load_ids(&ids)) {
+        return -1;
+    }
+    const CollectionMeta &meta = collection.meta;
+    // the queries of a reduced collection have the full dimension
+    const size_t dim = collection.query_dimension();
+    // the page bounds let the workers skip pages, collections written before
+    // them are scanned in full
+    bool has_page_bounds = collection.load_page_bounds();
+
+    CentroidRouter router;
+    if (!router.load(args_centroids)) {
+        return -1;
+    }
+    if (router.size() != meta.clusters.size() ||
+        router.dimension() != dim) {
+        std::cerr << "the centroids do not match the collection" << std::endl;
+        return -1;
+    }
+    bool graph_loaded = false;
+    if (search_opt.route_mode != RouteMode::flat) {
+        graph_loaded = router.open_graph(args_centroids, args_num_thread);
+    }
+
+    // one partition per node of the workers, a single one without --numa
+    NumaPartitioning numa;
+    {
+        std::vector<int> nodes;
+        if (args_numa) {
+            for (int cpu : placement.worker_cpus)
+                nodes.push_back(topology.node_of(cpu));
+            std::sort(nodes.begin(), nodes.end());
+            nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+        }
+        numa.plan(meta, nodes);
+    }
+    std::vector<size_t> worker_partition(args_num_thread, 0);
+    if (numa.num_partitions() > 1) {
+        for (uint32_t i = 0; i < args_num_thread; i++)
+            worker_partition[i] =
+                numa.partition_of_node(topology.node_of(placement.worker_cpus[i]));
+    }
 
-    // worker in each CPU core
-    auto core_worker = [](uint32_t cid) {
-        while (true) {
-            printf("thread-%d: i'm alive ...\n ", cid);
+    char *memory = nullptr;
+    if (args_memory_only) {
+        memory = numa.alloc_pages(meta);
+        if (!memory) {
+            std::cerr << "failed to allocate the collection memory" << std::endl;
+            return -1;
         }
+        for (size_t pid = 0; pid < meta.num_pages; pid++) {
+            char *page = memory + numa.page_offset(pid, meta.page_size);
+            if (!collection.read_page(pid, page)) {
+                std::cerr << "failed to read page " << pid << std::endl;
+                return -1;
+            }
+        }
+    }
+    // a buffer pool per partition, on its node
+    std::vector<BufferPool *> pools(numa.num_partitions(), nullptr);
+    if (args_buffer_pool_mb > 0 && !args_memory_only) {
+        size_t bytes = ((size_t)args_buffer_pool_mb << 20) / pools.size();
+        for (size_t p = 0; p < pools.size(); p++)
+            pools[p] = new BufferPool(collection, bytes, 0,
+                                      pools.size() > 1 ? numa.node(p) : -1);
+    }
+    // the workers of a partition share its pool, their staged pages must
+    // fit in it
+    for (size_t p = 0; p < pools.size(); p++) {
+        if (!pools[p]) continue;
+        size_t workers = std::count(worker_partition.begin(),
+                                    worker_partition.end(), p);
+        size_t max_staging = max_staging_pages(*pools[p], workers);
+        if (max_staging == 0) {
+            std::cerr << "Error: the buffer pool partitions hold "
+                      << pools[p]->partition_capacity() << " pages, fewer than "
+                      << workers << " workers pin at once; use a larger "
+                      << "--buffer_pool or fewer threads\n";
+            return 1;
+        }
+        search_opt.staging_pages = std::min(search_opt.staging_pages, max_staging);
+    }
+
+    printf("dimension    : %u\n", meta.dimension);
+    printf("num vectors  : %lu\n", meta.num_vectors);
+    printf("num. cluster : %zu\n", meta.clusters.size());
+    if (collection.has_replicas)
+        printf("replication  : %.2f copies per vector (+%.1f%% space)\n",
+               (double)meta.num_copies() / meta.num_vectors,
+               100.0 * (meta.num_copies() - meta.num_vectors) / meta.num_vectors);
+    printf("metric       : %s\n", metric_name(meta.metric));
+    if (collection.reduced())
+        printf("reduction    : pca %zu -> %u dimensions, full vectors "
+               "re-ranked\n",
+               dim, meta.dimension);
+    printf("page bounds  : %s\n", has_page_bounds ? "loaded, pages are skipped"
+                                                  : "none, pages are all scanned");
+    if (meta.tile)
+        printf("layout       : transposed, tiles of %u vectors\n", meta.tile);
+    printf("topology     : %zu nodes, %zu cores, %zu cpus, quota %.2f\n",
+           topology.num_nodes(), topology.num_cores(), topology.num_cpus(),
+           topology.quota());
+    printf("num worker   : %u\n", args_num_thread);
+    if (args_pin) {
+        printf("worker cpus  : %s\n",
+               cpu_list_string(placement.worker_cpus).c_str());
+        printf("io cpus      : %s\n", cpu_list_string(placement.io_cpus).c_str());
+    }
+    if (args_numa) {
+        for (size_t p = 0; p < numa.num_partitions(); p++)
+            printf("partition %zu  : node %d, %lu clusters, %lu pages\n", p,
+                   numa.node(p), numa.partition_clusters[p],
+                   numa.partition_pages[p]);
+    }
+    printf("batching     : up to %u queries, %u us\n", args_max_batch,
+           args_batch_timeout_us);
+    if (graph_loaded)
+        printf("route graph  : loaded from %s\n",
+               router_graph_filename(args_centroids).c_str());
+    else if (router.has_graph())
+        printf("route graph  : built at startup\n");
+
+    // per-core workers ========================================================
+    QueryQueue queue(numa.num_partitions());
+    CompletionQueue completions;
+    LatencyRecorder latency;
+    std::atomic<uint64_t> queries_served{0};
+    std::atomic<uint64_t> batches_served{0};
+
+    auto core_worker = [&](uint32_t cid) {
+        using clock = std::chrono::steady_clock;
+        size_t partition = worker_partition[cid];
+        SearchOptions opt = search_opt;
+        if (args_pin) {
+            pin_thread(placement.worker_cpus[cid]);
+            // the I/O threads stay on the node of the worker, if they can
+            if (numa.num_partitions() > 1) {
+                std::vector<int> local;
+                for (int cpu : placement.io_cpus)
+                    if (topology.node_of(cpu) == numa.node(partition))
+                        local.push_back(cpu);
+                if (!local.empty()) opt.io_cpus = local;
+            }
+        }
+        Searcher searcher(collection, ids, router, opt, pools[partition], memory);
+        StageHistograms *h = latency.thread_histograms();
+        searcher.latency = h;
+        if (!numa.page_offsets.empty())
+            searcher.page_offsets = numa.page_offsets.data();
+
+        // finish records a query as answered, the last one of a request
+        // hands the request back
+        auto finish = [&](const std::shared_ptr<Request> &r) {
+            h->record(Stage::total, elapsed_ns(r->arrival, clock::now()));
+            if (r->remaining.fetch_sub(1) == 1) completions.push(r);
+        };
+        // scan_part scans the clusters of a query owned by this partition
+        // and merges the result; the last partition writes the answer
+        std::vector<uint32_t> part_ids;
+        std::vector<float> part_dists;
+        auto scan_part = [&](const ProbeTask &t) {
+            const QueryRequestHeader &rh = t.request->header;
+            part_ids.resize(rh.k);
+            part_dists.resize(rh.k);
+            if (!searcher.scan(t.merge->query.data(), t.clusters.data(),
+                               t.clusters.size(), rh.k, part_ids.data(),
+                               part_dists.data()))
+                t.request->failed = true;
+            std::lock_guard<std::mutex> lock(t.merge->mu);
+            for (uint32_t j = 0; j < rh.k; j++)
+                if (part_ids[j] != UINT32_MAX)
+                    t.merge->topk.push(part_dists[j], part_ids[j]);
+            if (--t.merge->remaining > 0) return;
+            size_t q = t.index;
+            t.merge->topk.write_sorted(t.request->ids.data() + q * rh.k,
+                                       t.request->distances.data() + q * rh.k);
+            finish(t.request);
+        };
+
+        std::vector<QueryTask> batch;
+        std::vector<ProbeTask> probes;
+        std::vector<float> batch_queries;
+        std::vector<uint32_t> batch_clusters;
+        std::vector<float> batch_dists;
+        std::vector<std::vector<uint32_t>> parts;
+        while (queue.pop(partition, args_max_batch,
+                         std::chrono::microseconds(args_batch_timeout_us),
+                         &batch, &probes)) {
+            for (auto &t : probes) scan_part(t);
+            if (batch.empty()) continue;
+
+            auto start = clock::now();
+            size_t nb = batch.size();
+            size_t max_nprobe = 1;
+            batch_queries.resize(nb * dim);
+            for (size_t i = 0; i < nb; i++) {
+                Request &r = *batch[i].request;
+                h->record(Stage::queue_wait, elapsed_ns(r.arrival, start));
+                memcpy(batch_queries.data() + i * dim,
+                       r.queries.data() + (size_t)batch[i].index * dim,
+                       dim * sizeof(float));
+                max_nprobe = std::max<size_t>(max_nprobe, r.header.nprobe);
+            }
+            max_nprobe = std::min(max_nprobe, meta.clusters.size());
+
+            // the closest max_nprobe clusters, sorted, are also the closest
+            // nprobe ones for every query of the batch
+            batch_clusters.resize(nb * max_nprobe);
+            batch_dists.resize(nb * max_nprobe);
+            router.route(nb, batch_queries.data(), max_nprobe,
+                         batch_clusters.data(), batch_dists.data(),
+                         search_opt.route_mode);
+            uint64_t routing_ns = elapsed_ns(start, clock::now());
+
+            for (size_t i = 0; i < nb; i++) {
+                std::shared_ptr<Request> &r = batch[i].request;
+                const QueryRequestHeader &rh = r->header;
+                size_t q = batch[i].index;
+                const float *query = batch_queries.data() + i * dim;
+                const uint32_t *clusters = batch_clusters.data() + i * max_nprobe;
+                size_t nprobe = std::min<size_t>(rh.nprobe, max_nprobe);
+                h->record(Stage::routing, routing_ns);
+
+                size_t owners = 0;
+                if (numa.num_partitions() > 1) {
+                    numa.split(clusters, nprobe, &parts);
+                    for (auto &part : parts) owners += !part.empty();
+                }
+                if (owners <= 1 && (owners == 0 || !parts[partition].empty())) {
+                    // all the probed clusters are local
+                    bool ok = searcher.scan(query, clusters, nprobe, rh.k,
+                                            r->ids.data() + q * rh.k,
+                                            r->distances.data() + q * rh.k,
+                                            batch_dists.data() + i * max_nprobe);
+                    if (!ok) r->failed = true;
+                    finish(r);
+                    continue;
+                }
+
+                auto merge = std::make_shared<QueryMerge>();
+                merge->query.assign(query, query + dim);
+                merge->topk.reset(rh.k, collection.has_replicas);
+                merge->remaining = owners;
+                for (size_t p = 0; p < parts.size(); p++) {
+                    if (p == partition || parts[p].empty()) continue;
+                    queue.push_probe(p, {r, (uint32_t)q, merge, std::move(parts[p])});
+                }
+                if (!parts[partition].empty())
+                    scan_part({r, (uint32_t)q, merge, std::move(parts[partition])});
+            }
+            queries_served += nb;
+            batches_served++;
+        }
+    };
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    std::vector<std::thread *> workers;
+    for (uint32_t i = 0; i < args_num_thread; i++) {
+        workers.push_back(new std::thread(core_worker, i));
+    }
+
+    // entry worker: epoll loop ================================================
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    std::vector<int> listen_fds;
+    for (auto &address : args_listen) {
+        int fd = listen_socket(address);
+        if (fd < 0) return -1;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+        listen_fds.push_back(fd);
+        std::cout << "listening on " << address << std::endl;
+    }
+    {
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = completions.fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, completions.fd, &ev);
+    }
+
+    // SIGINT and SIGTERM stop the server through a signalfd (blocked
+    // before the workers start, so they inherit the mask)
+    int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+    {
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = signal_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev);
+    }
+
+    std::unordered_map<int, std::shared_ptr<Connection>> connections;
+    auto close_connection = [&](int fd) {
+        auto it = connections.find(fd);
+        if (it == connections.end()) return;
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        it->second->fd = -1;  // pending requests are dropped
+        connections.erase(it);
     };
 
-    // TODO: pair of queue for entry worker to all cpu worker
+    // parse the complete requests of the connection input buffer
+    auto parse_requests = [&](const std::shared_ptr<Connection> &c) -> bool {
+        size_t pos = 0;
+        while (c->in.size() - pos >= sizeof(QueryRequestHeader)) {
+            QueryRequestHeader rh;
+            memcpy(&rh, c->in.data() + pos, sizeof(rh));
+            if (rh.magic != QUERY_REQUEST_MAGIC) return false;
+            if (rh.num_queries > QUERY_MAX_BATCH) return false;
+            if (rh.num_queries > 0 && rh.dimension != dim) {
+                // the size of the body comes from the bad dimension and may
+                // never fit in memory: answer without reading it and close
+                QueryResponseHeader response;
+                response.status = query_bad_request;
+                response.request_id = rh.request_id;
+                response.num_queries = rh.num_queries;
+                response.k = rh.k;
+                append_response(*c, response, nullptr, nullptr);
+                flush_connection(epoll_fd, *c);
+                return false;
+            }
+            size_t payload = request_payload_size(rh);
+            if (c->in.size() - pos < sizeof(rh) + payload) break;
+            const float *queries =
+                (const float *)(c->in.data() + pos + sizeof(rh));
+            pos += sizeof(rh) + payload;
+
+            QueryResponseHeader response;
+            response.request_id = rh.request_id;
+            response.num_queries = rh.num_queries;
+            response.k = rh.k;
+            if (rh.dimension != dim || rh.k == 0 ||
+                rh.k > QUERY_MAX_K || rh.nprobe == 0) {
+                response.status = query_bad_request;
+                append_response(*c, response, nullptr, nullptr);
+                continue;
+            }
+            if (rh.num_queries == 0) {
+                append_response(*c, response, nullptr, nullptr);
+                continue;
+            }
 
-    // run all workers in each cpu
-    std::vector<std::thread*> workers;
-    for (int i = 0; i < num_cpus; i++) {
-        auto *t =
-            new std::thread(core_worker, i);
-        workers.push_back(t);
+            auto r = std::make_shared<Request>();
+            r->connection = c;
+            r->header = rh;
+            r->queries.assign(queries, queries + rh.num_queries * rh.dimension);
+            r->ids.resize((size_t)rh.num_queries * rh.k);
+            r->distances.resize((size_t)rh.num_queries * rh.k);
+            r->remaining = rh.num_queries;
+            r->arrival = std::chrono::steady_clock::now();
+            queue.push(std::move(r));
+        }
+        c->in.erase(c->in.begin(), c->in.begin() + pos);
+        return true;
+    };
+
+    bool running = true;
+    std::vector<epoll_event> events(256);
+    while (running) {
+        int n = epoll_wait(epoll_fd, events.data(), events.size(), -1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) break;
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == signal_fd) {
+                running = false;
+            } else if (std::find(listen_fds.begin(), listen_fds.end(), fd) !=
+                       listen_fds.end()) {
+                int cfd;
+                while ((cfd = accept4(fd, nullptr, nullptr,
+                                      SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    int one = 1;
+                    setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    auto c = std::make_shared<Connection>();
+                    c->fd = cfd;
+                    connections[cfd] = c;
+                    epoll_event ev = {};
+                    ev.events = EPOLLIN | EPOLLRDHUP;
+                    ev.data.fd = cfd;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cfd, &ev);
+                }
+            } else if (fd == completions.fd) {
+                for (auto &r : completions.take()) {
+                    Connection &c = *r->connection;
+                    if (c.fd < 0) continue;  // the client left
+                    QueryResponseHeader response;
+                    response.request_id = r->header.request_id;
+                    response.num_queries = r->header.num_queries;
+                    response.k = r->header.k;
+                    response.status = r->failed ? query_io_error : query_ok;
+                    append_response(c, response, r->ids.data(),
+                                    r->distances.data());
+                    if (!flush_connection(epoll_fd, c)) close_connection(c.fd);
+                }
+            } else {
+                auto it = connections.find(fd);
+                if (it == connections.end()) continue;
+                std::shared_ptr<Connection> c = it->second;
+                bool ok = true;
+                if (events[i].events & EPOLLIN) {
+                    char buf[64 << 10];
+                    while (true) {
+                        ssize_t len = read(fd, buf, sizeof(buf));
+                        if (len > 0) {
+                            c->in.insert(c->in.end(), buf, buf + len);
+                            continue;
+                        }
+                        if (len == 0 || (errno != EAGAIN && errno != EINTR))
+                            ok = false;
+                        if (len < 0 && errno == EINTR) continue;
+                        break;
+                    }
+                    // a malformed request closes the connection
+                    if (!parse_requests(c)) ok = false;
+                }
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) ok = false;
+                if (ok && !c->out.empty()) ok = flush_connection(epoll_fd, *c);
+                if (!ok) close_connection(fd);
+            }
+        }
     }
 
-    // forever loop, until terminated
+    // shutdown ================================================================
+    std::cout << "\nstopping" << std::endl;
+    queue.shutdown();
     for (auto t : workers) {
         (*t).join();
         delete t;
     }
+    for (auto &c : connections) close(c.first);
+    for (int fd : listen_fds) close(fd);
+    for (auto &address : args_listen) {
+        if (address.rfind("unix:", 0) == 0) unlink(address.substr(5).c_str());
+    }
+
+    std::cout << " > queries served    : " << queries_served << std::endl;
+    std::cout << " > mean batch size   : "
+              << (batches_served ? (double)queries_served / batches_served : 0.0)
+              << std::endl;
+    std::cout << " > per query latency : " << std::endl;
+    latency.print();
+    if (!args_latency_json.empty()) latency.write_json(args_latency_json);
 
+    for (auto pool : pools) delete pool;
+    numa.free_pages(memory);
+    close(signal_fd);
+    close(epoll_fd);
     return 0;
 }
 
+// append_response queues a response on the connection.
+void append_response(Connection &c, const QueryResponseHeader &h,
+                     const uint32_t *ids, const float *distances) {
+    c.out.append((const char *)&h, sizeof(h));
+    if (h.status != query_ok) return;
+    size_t n = (size_t)h.num_queries * h.k;
+    c.out.append((const char *)ids, n * sizeof(uint32_t));
+    c.out.append((const char *)distances, n * sizeof(float));
+}
 
-// 
-void initialize() {
+// flush_connection writes as much of the pending responses as the socket
+// takes, and waits for EPOLLOUT when it is full. It returns false when the
+// connection is broken.
+bool flush_connection(int epoll_fd, Connection &c) {
+    size_t sent = 0;
+    while (sent < c.out.size()) {
+        ssize_t n = send(c.fd, c.out.data() + sent, c.out.size() - sent,
+                         MSG_NOSIGNAL);
+        if (n > 0) {
+            sent += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) break;
+        return false;
+    }
+    c.out.erase(0, sent);
 
-}
\ No newline at end of file
+    bool want_write = !c.out.empty();
+    if (want_write != c.want_write) {
+        epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLRDHUP | (want_write ? (uint32_t)EPOLLOUT : 0u);
+        ev.data.fd = c.fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c.fd, &ev);
+        c.want_write = want_write;
+    }
+    return true;
+}
@@ -0,0 +1,113 @@
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "buffer_pool.h"
+
+// Writes a small collection where every float of page p equals p, then
+// checks the buffer pool content, its counters, and that a scan does not
+// flush the hot pages.
+int main() {
+    const size_t dim = 16, num_vectors = 64 * 100;  // 100 pages of 4KB
+    std::string dir = "/tmp/sedann_test_buffer_pool_" + std::to_string(getpid());
+    std::string base_filename = dir + ".fvecs";
+    std::string collection_filename = dir + ".collection";
+
+    {
+        FILE *f = fopen(base_filename.c_str(), "w");
+        int32_t d = dim;
+        for (size_t i = 0; i < num_vectors; i++) {
+            float v = i / 64;
+            fwrite(&d, sizeof(d), 1, f);
+            for (size_t j = 0; j < dim; j++) fwrite(&v, sizeof(v), 1, f);
+        }
+        fclose(f);
+    }
+    CollectionWriteOptions opt;
+    opt.base_filename = base_filename;
+    opt.collection_filename = collection_filename;
+    opt.page_size = 4096;
+    Collection collection;
+    if (!write_collection(opt) || !collection.open(collection_filename)) {
+        printf("FAILED: can not write the collection\n");
+        return 1;
+    }
+
+    int failed = 0;
+    auto check = [&](bool ok, const char *what) {
+        printf("%s %s\n", ok ? ">> ok    :" : ">> FAILED:", what);
+        if (!ok) failed = 1;
+    };
+
+    // a single partition of 8 frames
+    {
+        BufferPool pool(collection, 8 * 4096, 1);
+        bool content_ok = true;
+        for (uint64_t pid = 0; pid < 100; pid++) {
+            BufferPool::PageHandle page = pool.get(pid);
+            content_ok &= page && ((const float *)page.data())[0] == pid;
+        }
+        check(content_ok, "pages read through the pool have the right content");
+        BufferPoolStats stats = pool.stats();
+        check(stats.misses == 100 && stats.hits == 0 && stats.evictions == 92,
+              "a cold scan only misses");
+    }
+
+    // 32 frames: A1in takes 8 pages, A1out remembers 16, Am the rest
+    {
+        BufferPool pool(collection, 32 * 4096, 1);
+
+        // pages 0..3 are hot: they come back after they left A1in, so they
+        // are promoted to Am through the A1out ghosts
+        for (uint64_t r = 0; r < 10; r++) {
+            for (uint64_t pid = 0; pid < 4; pid++) pool.get(pid);
+            for (uint64_t pid = 10 + r * 6; pid < 16 + r * 6; pid++) pool.get(pid);
+        }
+        // a scan over pages never seen before, longer than A1in
+        for (uint64_t pid = 70; pid < 100; pid++) pool.get(pid);
+        BufferPoolStats before = pool.stats();
+        for (uint64_t pid = 0; pid < 4; pid++) pool.get(pid);
+        BufferPoolStats after = pool.stats();
+        check(after.hits - before.hits == 4, "hot pages survive a scan");
+
+        // a pinned page is not evicted, even by a scan
+        BufferPool::PageHandle pinned = pool.get(70);
+        for (uint64_t pid = 10; pid < 40; pid++) pool.get(pid);
+        check(((const float *)pinned.data())[0] == 70, "a pinned page stays valid");
+    }
+
+    // concurrent readers over a skewed access pattern
+    {
+        BufferPool pool(collection, 32 * 4096, 4);
+        std::atomic<bool> content_ok{true};
+        std::vector<std::thread> workers;
+        for (int t = 0; t < 8; t++) {
+            workers.emplace_back([&, t]() {
+                std::mt19937 rng(t);
+                std::geometric_distribution<int> skewed(0.05);
+                for (int i = 0; i < 20000; i++) {
+                    uint64_t pid = std::min(99, skewed(rng));
+                    BufferPool::PageHandle page = pool.get(pid);
+                    if (!page || ((const float *)page.data())[dim - 1] != pid)
+                        content_ok = false;
+                }
+            });
+        }
+        for (auto &w : workers) w.join();
+        BufferPoolStats stats = pool.stats();
+        check(content_ok, "concurrent readers see the right pages");
+        check(stats.hits + stats.misses == 8 * 20000, "every access is counted");
+        printf("   skewed access with a pool of 32/100 pages: hit rate %.1f %%, "
+               "%lu evictions\n",
+               stats.hit_rate() * 100, stats.evictions);
+    }
+
+    unlink(base_filename.c_str());
+    remove_collection(collection_filename);
+    return failed;
+}
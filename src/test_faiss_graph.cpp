@@ -3,7 +3,10 @@
 #include <random>
 #include <fstream>
 
-#include <faiss/IndexNSG.h>
+#include <chrono>
+#include <thread>
+
+#include "centroid_index.h"
 
 // 64-bit int
 using idx_t = faiss::idx_t;
@@ -67,10 +70,12 @@ float* read_bvecs(const char *filename) {
     return data;
 }
 
-int main() {
-    int d = 128;    // dimension
-    int nb = 10000; // database size (number of centroids)
+// usage: ./test_faiss_graph [nprobe] [num_thread]
+// the centroid index must be built first with tools_build_centroid_index.
+int main(int argc, char **argv) {
     int nq = 10000;    // number of search queries
+    int k = argc > 1 ? atoi(argv[1]) : 8;  // nprobe, clusters per query
+    uint32_t num_thread = argc > 2 ? atoi(argv[2]) : std::thread::hardware_concurrency();
 
     // read the centroids
     const char* centroid_filename = "../data/centroids_10k_sift10m.fvecs";
@@ -83,19 +88,25 @@ int main() {
     float* xb = centroids;
     float* xq = queries;
 
-    printf(">> creating the index\n");
-    faiss::IndexNSGFlat index(d, 32);
-    index.build_type = 1;   // no need for training
-    index.verbose = 1;      // see progress
-    index.add(nb, xb);
+    std::string index_filename = centroid_index_filename(centroid_filename);
+    printf(">> loading the index from %s\n", index_filename.c_str());
+    auto load_start = std::chrono::high_resolution_clock::now();
+    faiss::IndexNSGFlat* loaded = load_centroid_index(index_filename);
+    if (!loaded) {
+        printf("   build it first: ./tools_build_centroid_index %s\n", centroid_filename);
+        return -1;
+    }
+    faiss::IndexNSGFlat& index = *loaded;
+    auto load_end = std::chrono::high_resolution_clock::now();
+    printf(">> index with %zd centroids is loaded in %.2f ms\n", index.ntotal,
+           std::chrono::duration<double, std::milli>(load_end - load_start).count());
 
-    int k = 8;
     printf(">> sanity checking, searching 5 first vectors in the dataset\n");
     {
         idx_t* I = new idx_t[k * 5];
         float* D = new float[k * 5];
 
-        index.search(5, xb, k, D, I);
+        search_centroids(index, 5, xb, k, 1, I, D);
 
         // print out results
         printf("Q (5 first query)=\n");
@@ -127,7 +138,12 @@ int main() {
         idx_t* I = new idx_t[k * nq]; // place to store the results (vector id)
         float* D = new float[k * nq]; // place to store the distances
 
-        index.search(nq, xq, k, D, I);
+        auto start = std::chrono::high_resolution_clock::now();
+        search_centroids(index, nq, xq, k, num_thread, I, D);
+        auto end = std::chrono::high_resolution_clock::now();
+        double time_taken = std::chrono::duration<double, std::micro>(end - start).count();
+        printf(">> %d queries, nprobe=%d, %u threads: %.2f ms (%.2f us/query)\n",
+               nq, k, num_thread, time_taken * 1e-3, time_taken / nq);
 
         // print out results
         printf("I (100 first results)=\n");
@@ -147,5 +163,6 @@ int main() {
     }
 
 
+    delete loaded;
     return 0;
 }
\ No newline at end of file
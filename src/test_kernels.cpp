@@ -0,0 +1,235 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "kernels.h"
+
+// Checks the distance kernels against the scalar references, at dimensions
+// that leave every tail of their loops: the bounded row kernels, the
+// kernels of the f16/bf16 pages, and the tile kernels of the transposed
+// pages on tiles of 8 and 16 vectors. A bounded kernel must return the
+// unbounded value below the bound, and at least the bound when it stops
+// early (a lane of a tile likewise).
+// usage: ./test_kernels [seed]
+
+// close compares a kernel to a reference summed in another order, scale is
+// the magnitude of the terms of the sum
+static bool close(float got, float want, float scale) {
+    return std::fabs(got - want) <= 1e-4f * std::max(1.0f, scale);
+}
+
+int main(int argc, char **argv) {
+    unsigned seed = argc > 1 ? atoi(argv[1]) : 123;
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> value(-1.0f, 1.0f);
+    const float inf = std::numeric_limits<float>::infinity();
+    int failed = 0;
+
+    // the tile of B vectors of dimension d, transposed, and their distances
+    // to the query with the scalar references
+    auto check_tile = [&](auto tile_size, size_t d) {
+        constexpr size_t B = decltype(tile_size)::value;
+        std::vector<float> query(d), rows(B * d), tile(B * d);
+        for (auto &v : query) v = value(rng);
+        for (auto &v : rows) v = value(rng);
+        for (size_t l = 0; l < B; l++)
+            for (size_t j = 0; j < d; j++) tile[j * B + l] = rows[l * d + j];
+
+        float l2[B], ip[B], scale_ip[B];
+        for (size_t l = 0; l < B; l++) {
+            l2[l] = fvec_L2sqr_ref(query.data(), rows.data() + l * d, d);
+            ip[l] = -fvec_inner_product_ref(query.data(), rows.data() + l * d, d);
+            scale_ip[l] = 0;
+            for (size_t j = 0; j < d; j++)
+                scale_ip[l] += std::fabs(query[j] * rows[l * d + j]);
+        }
+
+        int errors = 0;
+        float out[B];
+        auto expect = [&](const char *kernel, const float *want,
+                          const float *scale) {
+            for (size_t l = 0; l < B; l++)
+                if (!close(out[l], want[l], scale[l])) {
+                    if (errors++ < 4)
+                        printf("   FAILED: %s, tile %zu, d=%zu, lane %zu: %f "
+                               "instead of %f\n",
+                               kernel, B, d, l, out[l], want[l]);
+                }
+        };
+
+        tile_avx_impl<B, false, false>(query.data(), tile.data(), d, out, 0);
+        expect("tile_avx_impl l2", l2, l2);
+        tile_avx_impl<B, true, false>(query.data(), tile.data(), d, out, 0);
+        expect("tile_avx_impl ip", ip, scale_ip);
+#ifdef __AVX512F__
+        if (B == 16) {
+            tile16_avx512_impl<false, false>(query.data(), tile.data(), d, out, 0);
+            expect("tile16_avx512_impl l2", l2, l2);
+            tile16_avx512_impl<true, false>(query.data(), tile.data(), d, out, 0);
+            expect("tile16_avx512_impl ip", ip, scale_ip);
+        }
+#endif
+        tile_distances<B, false>(query.data(), tile.data(), d, out);
+        expect("tile_distances l2", l2, l2);
+        tile_distances<B, true>(query.data(), tile.data(), d, out);
+        expect("tile_distances ip", ip, scale_ip);
+
+        // the bounded kernels against their unbounded version: no bound, a
+        // bound between the lanes and one below all of them (abandoned at
+        // the first check)
+        size_t abandoned = 0;
+        auto expect_bounded = [&](const char *kernel, auto unbounded_kernel,
+                                  auto bounded_kernel) {
+            float unbounded[B];
+            unbounded_kernel(unbounded);
+            std::vector<float> sorted(unbounded, unbounded + B);
+            std::sort(sorted.begin(), sorted.end());
+            for (float bound : {inf, sorted[B / 2], sorted[0] / 8}) {
+                bounded_kernel(out, bound);
+                for (size_t l = 0; l < B; l++) {
+                    // a lane abandoned early holds a partial sum >= bound
+                    bool early = out[l] != unbounded[l];
+                    abandoned += early;
+                    if (!early || out[l] >= bound) continue;
+                    if (errors++ < 4)
+                        printf("   FAILED: %s, tile %zu, d=%zu, bound %f, lane "
+                               "%zu: %f, unbounded %f\n",
+                               kernel, B, d, bound, l, out[l], unbounded[l]);
+                }
+            }
+        };
+        const float *q = query.data(), *t = tile.data();
+        expect_bounded(
+            "tile_avx_impl bounded",
+            [&](float *o) { tile_avx_impl<B, false, false>(q, t, d, o, 0); },
+            [&](float *o, float b) { tile_avx_impl<B, false, true>(q, t, d, o, b); });
+#ifdef __AVX512F__
+        if (B == 16)
+            expect_bounded(
+                "tile16_avx512_impl bounded",
+                [&](float *o) { tile16_avx512_impl<false, false>(q, t, d, o, 0); },
+                [&](float *o, float b) {
+                    tile16_avx512_impl<false, true>(q, t, d, o, b);
+                });
+#endif
+        expect_bounded(
+            "tile_L2sqr_bounded",
+            [&](float *o) { tile_distances<B, false>(q, t, d, o); },
+            [&](float *o, float b) { tile_L2sqr_bounded<B>(q, t, d, o, b); });
+
+        printf(">> tile %2zu, d=%3zu : %s, %zu lanes abandoned early\n", B, d,
+               errors ? "FAILED" : "ok", abandoned);
+        if (errors) failed = 1;
+    };
+
+    // the bounded row kernels stop at a multiple of L2SQR_CHECK_DIMS: with
+    // a bound below every distance, after the first block
+    using RowKernel = float (*)(const float *, const float *, size_t);
+    using BoundedKernel = float (*)(const float *, const float *, size_t, float);
+    auto check_bounded_row = [&](const char *kernel, RowKernel unbounded_kernel,
+                                 BoundedKernel bounded_kernel, size_t d) {
+        std::vector<float> x(d), y(d);
+        for (auto &v : x) v = value(rng);
+        for (auto &v : y) v = value(rng);
+        float full = unbounded_kernel(x.data(), y.data(), d);
+        float first_block = fvec_L2sqr_ref(x.data(), y.data(),
+                                           std::min(d, L2SQR_CHECK_DIMS));
+        int errors = 0;
+        for (float bound : {inf, full * 1.01f, full * 0.99f, first_block / 8}) {
+            float got = bounded_kernel(x.data(), y.data(), d, bound);
+            // no check before the end of a single block
+            bool ok = got < bound || d <= L2SQR_CHECK_DIMS ? got == full
+                                                           : true;
+            if (bound == first_block / 8 && d > L2SQR_CHECK_DIMS)
+                ok = close(got, first_block, first_block);
+            if (!ok && errors++ < 4)
+                printf("   FAILED: %s, d=%zu, bound %f: %f, unbounded %f\n",
+                       kernel, d, bound, got, full);
+        }
+        if (errors) failed = 1;
+        return errors == 0;
+    };
+    for (size_t d : {3, 17, 32, 33, 96, 100, 128, 960}) {
+        bool ok = check_bounded_row("fvec_L2sqr_ref_bounded", fvec_L2sqr_ref,
+                                    fvec_L2sqr_ref_bounded, d);
+        ok &= check_bounded_row("fvec_L2sqr_avx_bounded", fvec_L2sqr_avx,
+                                fvec_L2sqr_avx_bounded, d);
+#ifdef __AVX512F__
+        ok &= check_bounded_row("fvec_L2sqr_avx512_bounded", fvec_L2sqr_avx512,
+                                fvec_L2sqr_avx512_bounded, d);
+#endif
+        printf(">> bounded rows, d=%3zu : %s\n", d, ok ? "ok" : "FAILED");
+    }
+
+    // the encoded row kernels against encoded_ref, on dimensions that leave
+    // a tail after the blocks of 32, of 16 (avx512) or 8 (avx2), and scalar
+    auto check_encoded = [&](auto type, Encoding encoding, size_t d) {
+        using T = decltype(type);
+        std::vector<float> query(d), x(d);
+        for (auto &v : query) v = value(rng);
+        for (auto &v : x) v = value(rng);
+        std::vector<T> encoded(d);
+        encode_vector(x.data(), d, encoding, encoded.data());
+        float l2 = encoded_ref<T, false>(query.data(), encoded.data(), d);
+        float ip = encoded_ref<T, true>(query.data(), encoded.data(), d);
+        float scale_ip = 0;
+        for (size_t j = 0; j < d; j++)
+            scale_ip += std::fabs(query[j] * to_float(encoded[j]));
+
+        int errors = 0;
+        auto expect = [&](const char *kernel, float got, float want, float scale) {
+            if (!close(got, want, scale) && errors++ < 4)
+                printf("   FAILED: %s<%s>, d=%zu: %f instead of %f\n", kernel,
+                       encoding_name(encoding), d, got, want);
+        };
+        float unbounded = encoded_distance<T, false>(query.data(), encoded.data(), d);
+        expect("encoded_distance l2", unbounded, l2, l2);
+        expect("encoded_distance ip",
+               encoded_distance<T, true>(query.data(), encoded.data(), d), ip,
+               scale_ip);
+        float first_block = encoded_ref<T, false>(query.data(), encoded.data(),
+                                                  std::min<size_t>(d, 32));
+        for (float bound : {inf, l2 * 1.01f, l2 * 0.99f, first_block / 8}) {
+            float got = encoded_L2sqr_bounded<T>(query.data(), encoded.data(), d,
+                                                 bound);
+            bool ok = got < bound || d <= 32 ? got == unbounded : true;
+            if (bound == first_block / 8 && d > 32)
+                ok = close(got, first_block, first_block);
+            if (!ok && errors++ < 4)
+                printf("   FAILED: encoded_L2sqr_bounded<%s>, d=%zu, bound %f: "
+                       "%f, unbounded %f\n",
+                       encoding_name(encoding), d, bound, got, unbounded);
+        }
+        if (errors) failed = 1;
+        return errors == 0;
+    };
+    for (size_t d : {3, 17, 32, 57, 96, 100, 128, 960}) {
+        bool ok = check_encoded(f16_t(), Encoding::f16, d);
+        ok &= check_encoded(bf16_t(), Encoding::bf16, d);
+        printf(">> f16/bf16 rows, d=%3zu : %s\n", d, ok ? "ok" : "FAILED");
+    }
+
+    // a value out of the f16 range does not fit, any float fits in bf16
+    {
+        float in_range[] = {1.0f, -F16_MAX}, out_of_range[] = {1.0f, 2 * F16_MAX};
+        float large[] = {1e30f, -1e30f};
+        bool ok = round_to_encoding(in_range, 2, Encoding::f16) &&
+                  !round_to_encoding(out_of_range, 2, Encoding::f16) &&
+                  round_to_encoding(large, 2, Encoding::bf16);
+        printf(">> round_to_encoding : %s\n", ok ? "ok" : "FAILED");
+        if (!ok) {
+            printf("   FAILED: a value above F16_MAX must not fit in f16\n");
+            failed = 1;
+        }
+    }
+
+    for (size_t d : {3, 17, 96, 100, 128, 960}) {
+        check_tile(std::integral_constant<size_t, 8>(), d);
+        check_tile(std::integral_constant<size_t, 16>(), d);
+    }
+
+    return failed;
+}
@@ -0,0 +1,142 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include <unistd.h>
+
+#include "router.h"
+
+// Checks the in-tree centroid router against a naive scan and compares the
+// routing latency of the flat scan and the graph search. The graph is also
+// saved and loaded back, then checked stale against other centroids.
+// usage: ./test_router [num_centroids] [nprobe]
+int main(int argc, char **argv) {
+    size_t nc = argc > 1 ? atoi(argv[1]) : 10000;  // number of centroids
+    size_t nprobe = argc > 2 ? atoi(argv[2]) : 8;
+    size_t d = 128;
+    size_t nq = 1000;
+
+    // centroids spread over a 24-dimensional subspace (like k-means centroids
+    // of real data, low intrinsic dimension), queries near random centroids
+    std::mt19937 rng(123);
+    std::normal_distribution<float> noise(0.0f, 1.0f);
+    size_t latent = 24;
+    std::vector<float> basis(latent * d);
+    for (auto &v : basis) v = noise(rng);
+    std::vector<float> xb(nc * d), xq(nq * d);
+    for (size_t i = 0; i < nc; i++) {
+        std::vector<float> z(latent);
+        for (auto &v : z) v = noise(rng) * 10.0f;
+        for (size_t j = 0; j < d; j++) {
+            float v = noise(rng);
+            for (size_t l = 0; l < latent; l++) v += z[l] * basis[l * d + j];
+            xb[i * d + j] = v;
+        }
+    }
+    for (size_t i = 0; i < nq; i++)
+        for (size_t j = 0; j < d; j++)
+            xq[i * d + j] = xb[(rng() % nc) * d + j] + noise(rng) * 5.0f;
+
+    CentroidRouter router;
+    router.init(xb.data(), nc, d);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    router.build_graph();
+    auto end = std::chrono::high_resolution_clock::now();
+    printf(">> graph over %zu centroids built in %.2f ms, avg degree %.1f\n", nc,
+           std::chrono::duration<double, std::milli>(end - start).count(),
+           router.graph_average_degree());
+
+    // reference: naive scan
+    std::vector<uint32_t> ref(nq * nprobe);
+    for (size_t q = 0; q < nq; q++) {
+        TopK topk(nprobe);
+        for (size_t c = 0; c < nc; c++)
+            topk.push(fvec_L2sqr_ref(xq.data() + q * d, xb.data() + c * d, d), c);
+        topk.write_sorted(ref.data() + q * nprobe, nullptr);
+    }
+
+    auto recall = [&](const std::vector<uint32_t> &ids) {
+        size_t hit = 0;
+        for (size_t q = 0; q < nq; q++)
+            for (size_t i = 0; i < nprobe; i++)
+                for (size_t j = 0; j < nprobe; j++)
+                    hit += ids[q * nprobe + i] == ref[q * nprobe + j];
+        return (double)hit / (nq * nprobe);
+    };
+
+    int failed = 0;
+    for (RouteMode mode : {RouteMode::flat, RouteMode::graph}) {
+        std::vector<uint32_t> ids(nq * nprobe);
+
+        // one query at a time, the latency of an online query
+        start = std::chrono::high_resolution_clock::now();
+        for (size_t q = 0; q < nq; q++)
+            router.route(1, xq.data() + q * d, nprobe, ids.data() + q * nprobe,
+                         nullptr, mode);
+        end = std::chrono::high_resolution_clock::now();
+        double single_us =
+            std::chrono::duration<double, std::micro>(end - start).count() / nq;
+        double single_recall = recall(ids);
+
+        // the whole batch at once
+        start = std::chrono::high_resolution_clock::now();
+        router.route(nq, xq.data(), nprobe, ids.data(), nullptr, mode);
+        end = std::chrono::high_resolution_clock::now();
+        double batch_us =
+            std::chrono::duration<double, std::micro>(end - start).count() / nq;
+
+        printf(">> %-5s : %.2f us/query single, %.2f us/query batched, "
+               "recall@%zu %.4f\n",
+               route_mode_name(mode), single_us, batch_us, nprobe, single_recall);
+
+        if (mode == RouteMode::flat && (single_recall < 0.999 || recall(ids) < 0.999)) {
+            printf("   FAILED: the flat scan must be exact\n");
+            failed = 1;
+        }
+        if (mode == RouteMode::graph && single_recall < 0.9) {
+            printf("   FAILED: the graph search recall is too low\n");
+            failed = 1;
+        }
+    }
+
+    printf(">> automatic mode: single query -> %s, batch of %zu -> %s\n",
+           route_mode_name(router.select_mode(1, nprobe)), nq,
+           route_mode_name(router.select_mode(nq, nprobe)));
+
+    // the saved graph routes like the built one, and is rejected once the
+    // centroids or the degree change
+    std::string graph_filename = router_graph_filename(
+        "/tmp/test_router_" + std::to_string(getpid()) + ".fvecs");
+    std::vector<uint32_t> built(nq * nprobe), loaded(nq * nprobe);
+    router.route(nq, xq.data(), nprobe, built.data(), nullptr, RouteMode::graph);
+    CentroidRouter reopened;
+    reopened.init(xb.data(), nc, d);
+    bool saved = router.save_graph(graph_filename);
+    bool same = saved && reopened.load_graph(graph_filename);
+    if (same)
+        reopened.route(nq, xq.data(), nprobe, loaded.data(), nullptr,
+                       RouteMode::graph);
+    printf(">> saved graph: %s\n", !saved ? "not written"
+                                    : !same ? "not loaded"
+                                            : "loaded");
+    if (!same || loaded != built) {
+        printf("   FAILED: the loaded graph must route as the built one\n");
+        failed = 1;
+    }
+    CentroidRouter other_degree;
+    other_degree.graph_degree = router.graph_degree + 1;
+    other_degree.init(xb.data(), nc, d);
+    xb[0] += 1.0f;
+    CentroidRouter moved;
+    moved.init(xb.data(), nc, d);
+    if (moved.load_graph(graph_filename) || other_degree.load_graph(graph_filename)) {
+        printf("   FAILED: a stale graph must not be loaded\n");
+        failed = 1;
+    }
+    unlink(graph_filename.c_str());
+
+    return failed;
+}
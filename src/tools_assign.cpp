@@ -0,0 +1,160 @@
+#include <algorithm>
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "cores.h"
+#include "router.h"
+#include "vecs.h"
+
+namespace po = boost::program_options;
+
+// tools_assign assigns every base vector to the cluster of its nearest
+// centroid, the clusters file of write_collection. With --replicas R > 1 it
+// makes a closure assignment (as in SPANN): a vector is also replicated in
+// the next nearest clusters, up to R in all, whose centroid is within
+// (1 + epsilon) times the distance of the nearest one. A vector near a
+// cluster boundary is then found from either side with fewer probes, at the
+// cost of the space of its copies. The assignment has R ids per vector, the
+// nearest first, padded with -1:
+//     ./tools_assign --data sift10m_base.bvecs --centroids centroids_10k_sift10m.fvecs
+//         --replicas 4 --epsilon 0.1 -o clusters_sift10m_closure.ivecs
+
+struct AssignOptions {
+    size_t replicas = 1;
+    double epsilon = 0.0;
+    size_t num_thread = 1;
+    size_t chunk_size = 64 << 20;
+};
+
+// closure keeps the nearest cluster of a vector and the next ones within the
+// factor (the distances are squared, sorted from the nearest), pads the rest
+// with -1 and returns how many were kept.
+static size_t closure(const uint32_t *cids, const float *dists, size_t replicas,
+                      double epsilon, int32_t *out) {
+    const double limit = dists[0] * (1.0 + epsilon) * (1.0 + epsilon);
+    size_t n = 1;
+    out[0] = cids[0];
+    for (size_t r = 1; r < replicas; r++) {
+        bool kept = n == r && cids[r] != UINT32_MAX && dists[r] <= limit;
+        out[r] = kept ? (int32_t)cids[r] : -1;
+        n += kept;
+    }
+    return n;
+}
+
+int main(int argc, char **argv) {
+    std::string args_data;
+    std::string args_centroids;
+    std::string args_output;
+    uint32_t args_num_thread = 0;
+    uint32_t args_chunk_mb = 64;
+    AssignOptions opt;
+
+    {
+        po::options_description desc("Available arguments");
+        desc.add_options()("help,h", "print usage message");
+        desc.add_options()("data", po::value<std::string>(&args_data)->required(),
+                           "base vectors (bvecs, fvecs or npy)");
+        desc.add_options()("centroids", po::value<std::string>(&args_centroids)->required(),
+                           "the centroids of the clusters (fvecs or npy)");
+        desc.add_options()("output,o", po::value<std::string>(&args_output)->required(),
+                           "output: the clusters of every base vector (ivecs or npy)");
+        desc.add_options()("replicas,r", po::value<size_t>(&opt.replicas),
+                           "clusters a vector is stored in, at most (default: 1)");
+        desc.add_options()("epsilon", po::value<double>(&opt.epsilon),
+                           "a vector is replicated in the clusters within (1 + "
+                           "epsilon) times the distance of its nearest "
+                           "centroid (default: 0)");
+        desc.add_options()("num_thread,t", po::value<uint32_t>(&args_num_thread),
+                           "routing threads (default: one per core)");
+        desc.add_options()("chunk_size", po::value<uint32_t>(&args_chunk_mb),
+                           "base vectors read per chunk in mb (default: 64MB)");
+        po::variables_map vm;
+        try {
+            po::store(po::parse_command_line(argc, argv, desc), vm);
+            if (vm.count("help")) {
+                std::cout << desc << "\n";
+                return 0;
+            }
+            po::notify(vm);
+        } catch (std::exception &e) {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+        if (opt.replicas == 0 || opt.epsilon < 0) {
+            std::cerr << "Error: the replicas must be positive and epsilon not "
+                         "negative\n";
+            return 1;
+        }
+        opt.num_thread = args_num_thread ? args_num_thread : cores();
+        opt.chunk_size = (size_t)std::max<uint32_t>(1, args_chunk_mb) << 20;
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    CentroidRouter router;
+    VecsReader base;
+    if (!router.load(args_centroids) || !base.open(args_data.c_str())) return -1;
+    const VecsInfo &in = base.info;
+    const size_t dim = in.dimension, num_vectors = in.num_vectors;
+    if (router.dimension() != dim) {
+        std::cerr << "the centroids have dimension " << router.dimension()
+                  << ", the base vectors " << dim << std::endl;
+        return -1;
+    }
+    opt.replicas = std::min(opt.replicas, router.size());
+
+    VecsWriter writer;
+    if (!writer.open(args_output.c_str(), opt.replicas, num_vectors, ElemType::i32)) {
+        std::cerr << "failed to write " << args_output << std::endl;
+        return -1;
+    }
+
+    size_t per_chunk = std::min<size_t>(std::max<size_t>(1, num_vectors),
+                                        std::max<size_t>(1, opt.chunk_size / in.record_size));
+    size_t num_chunks = (num_vectors + per_chunk - 1) / per_chunk;
+    auto chunk_vecs = [&](size_t i) { return std::min(per_chunk, num_vectors - i * per_chunk); };
+    VecsInfo as_float = vecs_info(VecsFormat::npy, ElemType::f32, dim, 1);
+    std::vector<float> vectors(per_chunk * dim), dists(per_chunk * opt.replicas);
+    std::vector<uint32_t> cids(per_chunk * opt.replicas);
+    std::vector<int32_t> assignment(per_chunk * opt.replicas);
+    // vectors with 1, 2, ... replicas copies
+    std::vector<uint64_t> histogram(opt.replicas + 1, 0);
+    uint64_t num_copies = 0;
+
+    bool ok = pipeline_chunks(
+        num_chunks, per_chunk * in.record_size,
+        [&](size_t i, char *buf) { return base.read_raw(i * per_chunk, chunk_vecs(i), buf); },
+        [&](size_t i, char *buf) {
+            size_t n = chunk_vecs(i);
+            vecs_convert_records(in, buf, n, as_float, (char *)vectors.data());
+            router.route(n, vectors.data(), opt.replicas, cids.data(), dists.data(),
+                         RouteMode::flat, opt.num_thread);
+            for (size_t v = 0; v < n; v++) {
+                size_t copies = closure(cids.data() + v * opt.replicas,
+                                        dists.data() + v * opt.replicas, opt.replicas,
+                                        opt.epsilon, assignment.data() + v * opt.replicas);
+                histogram[copies]++;
+                num_copies += copies;
+            }
+            return writer.write_int(i * per_chunk, n, assignment.data());
+        });
+    if (!ok) {
+        std::cerr << "failed to assign the vectors of " << args_data << std::endl;
+        return -1;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    printf("base         : %s (%zu x %zu)\n", args_data.c_str(), num_vectors, dim);
+    printf("clusters     : %zu\n", router.size());
+    printf("replicas     : at most %zu, epsilon %.3f\n", opt.replicas, opt.epsilon);
+    printf("copies       : %.3f per vector (+%.1f%% space)\n",
+           (double)num_copies / std::max<size_t>(1, num_vectors),
+           100.0 * (num_copies - num_vectors) / std::max<size_t>(1, num_vectors));
+    for (size_t r = 1; r <= opt.replicas; r++)
+        printf("%2zu copies    : %.2f%% of the vectors\n", r,
+               100.0 * histogram[r] / std::max<size_t>(1, num_vectors));
+    printf("time         : %.3f s\n", std::chrono::duration<double>(end - start).count());
+    return 0;
+}
@@ -0,0 +1,68 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include "centroid_index.h"
+#include "router.h"
+#include "vecs.h"
+
+// Builds the graphs over the centroids once and saves them next to the
+// centroid file: the faiss NSG (.nsg, for test_faiss_graph) and the graph of
+// the in-tree router (.graph), loaded by the search processes at startup.
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 4) {
+        std::cout << "usage: " << argv[0] << " centroids_fvecs [output_index] [R]" << std::endl;
+        std::cout << "   output_index defaults to the centroid file with .nsg extension," << std::endl;
+        std::cout << "   R is the maximum degree of the graph (default: 32)." << std::endl;
+        exit(-1);
+    }
+    std::string centroids_filename = argv[1];
+    std::string index_filename =
+        argc > 2 ? argv[2] : centroid_index_filename(centroids_filename);
+    int R = argc > 3 ? atoi(argv[3]) : 32;
+
+    VecsReader reader;
+    if (!reader.open(centroids_filename.c_str())) {
+        return -1;
+    }
+    size_t d = reader.info.dimension;
+    size_t nb = reader.info.num_vectors;
+    std::cout << ">> Centroids (" << centroids_filename << "): #vector = " << nb << ", #dims = " << d << std::endl;
+
+    std::vector<float> centroids(nb * d);
+    if (!reader.read_float(0, nb, centroids.data())) {
+        std::cerr << "failed to read centroids: " << centroids_filename << std::endl;
+        return -1;
+    }
+
+    printf(">> creating the index\n");
+    auto start = std::chrono::high_resolution_clock::now();
+    faiss::IndexNSGFlat index(d, R);
+    index.build_type = 1;   // no need for training
+    index.verbose = 1;      // see progress
+    index.add(nb, centroids.data());
+    auto end = std::chrono::high_resolution_clock::now();
+    printf(">> index is built in %.2f s\n",
+           std::chrono::duration<double>(end - start).count());
+
+    if (!save_centroid_index(index, index_filename)) {
+        return -1;
+    }
+    printf(">> index is saved in %s\n", index_filename.c_str());
+
+    CentroidRouter router;
+    router.init(centroids.data(), nb, d);
+    start = std::chrono::high_resolution_clock::now();
+    router.build_graph();
+    end = std::chrono::high_resolution_clock::now();
+    std::string graph_filename = router_graph_filename(centroids_filename);
+    if (!router.save_graph(graph_filename)) {
+        return -1;
+    }
+    printf(">> router graph is built in %.2f s, saved in %s\n",
+           std::chrono::duration<double>(end - start).count(),
+           graph_filename.c_str());
+
+    return 0;
+}
@@ -0,0 +1,170 @@
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <iostream>
+
+#include "collection.h"
+#include "vecs.h"
+
+namespace po = boost::program_options;
+
+// tools_convert prepares vector files with bounded memory. It either
+// - slices and converts between bvecs, fvecs, ivecs and npy, e.g. the first
+//   10M vectors of bigann as fvecs:
+//     ./tools_convert -i bigann_base.bvecs -o sift10m_base.fvecs -n 10000000
+// - or writes a paged collection, optionally grouped by cluster:
+//     ./tools_convert -i sift10m_base.bvecs --collection collection
+//         --clusters clusters_10k_sift10m.ivecs --page_size 4
+int main(int argc, char **argv) {
+    std::string args_input;
+    std::string args_output;
+    std::string args_output_format;
+    std::string args_output_type;
+    std::string args_collection;
+    std::string args_clusters;
+    size_t args_begin = 0;
+    size_t args_count = SIZE_MAX;
+    uint32_t args_page_size_kb = 4;
+    uint32_t args_chunk_mb = 64;
+    bool args_permute_dims = false;
+    std::string args_metric = "l2";
+    uint32_t args_tile = 0;
+    std::string args_encoding = "f32";
+    std::string args_pca;
+
+    {
+        po::options_description desc("Available arguments");
+        desc.add_options()("help,h", "print usage message");
+        desc.add_options()("input,i", po::value<std::string>(&args_input)->required(),
+                           "input file (bvecs, fvecs, ivecs or npy)");
+        desc.add_options()("output,o", po::value<std::string>(&args_output),
+                           "output vector file");
+        desc.add_options()("format,f", po::value<std::string>(&args_output_format),
+                           "output format (default: from the output extension)");
+        desc.add_options()("type", po::value<std::string>(&args_output_type),
+                           "element type for npy output: u8, f32, i32, i64 "
+                           "(default: the input element type)");
+        desc.add_options()("begin,b", po::value<size_t>(&args_begin),
+                           "index of the first vector (default: 0)");
+        desc.add_options()("count,n", po::value<size_t>(&args_count),
+                           "number of vectors (default: until the end)");
+        desc.add_options()("collection,c", po::value<std::string>(&args_collection),
+                           "write a paged collection instead of a vector file");
+        desc.add_options()("clusters", po::value<std::string>(&args_clusters),
+                           "cluster id of every input vector (ivecs/npy), "
+                           "the collection pages are grouped by cluster");
+        desc.add_options()("page_size,p", po::value<uint32_t>(&args_page_size_kb),
+                           "page size of the collection in kb (default: 4KB)");
+        desc.add_options()("chunk_size", po::value<uint32_t>(&args_chunk_mb),
+                           "size of each read/write chunk in mb (default: 64MB)");
+        desc.add_options()("permute_dims", po::value<bool>(&args_permute_dims),
+                           "store the collection dimensions by decreasing "
+                           "variance (default: false)");
+        desc.add_options()("metric", po::value<std::string>(&args_metric),
+                           "distance of the collection: l2, ip (inner product) "
+                           "or cosine (default: l2)");
+        desc.add_options()("tile", po::value<uint32_t>(&args_tile),
+                           "transposed pages, the vectors interleaved by "
+                           "dimension in tiles of 8 or 16 (default: 0)");
+        desc.add_options()("encoding", po::value<std::string>(&args_encoding),
+                           "element encoding of the collection pages: f32, "
+                           "f16 or bf16 (default: f32)");
+        desc.add_options()("pca", po::value<std::string>(&args_pca),
+                           "reduce the collection pages with this PCA "
+                           "projection (see tools_train_pca), the full "
+                           "vectors kept aside to re-rank");
+        po::variables_map vm;
+        try {
+            po::store(po::parse_command_line(argc, argv, desc), vm);
+            if (vm.count("help")) {
+                std::cout << desc << "\n";
+                return 0;
+            }
+            po::notify(vm);
+        } catch (std::exception &e) {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+        if (args_output.empty() == args_collection.empty()) {
+            std::cerr << "Error: exactly one of --output or --collection is "
+                         "required\n";
+            return 1;
+        }
+    }
+
+    size_t chunk_size = (size_t)args_chunk_mb << 20;
+    auto start = std::chrono::high_resolution_clock::now();
+
+    if (!args_collection.empty()) {
+        if (args_begin != 0 || args_count != SIZE_MAX) {
+            std::cerr << "Error: slice the input before writing a collection\n";
+            return 1;
+        }
+        CollectionWriteOptions opt;
+        opt.base_filename = args_input;
+        opt.clusters_filename = args_clusters;
+        opt.collection_filename = args_collection;
+        opt.page_size = (size_t)args_page_size_kb * 1024;
+        opt.chunk_size = chunk_size;
+        opt.permute_dims = args_permute_dims;
+        opt.tile = args_tile;
+        opt.pca_filename = args_pca;
+        if (!parse_metric(args_metric, &opt.metric)) {
+            std::cerr << "Error: unknown metric: " << args_metric << "\n";
+            return 1;
+        }
+        if (!parse_encoding(args_encoding, &opt.encoding)) {
+            std::cerr << "Error: unknown encoding: " << args_encoding << "\n";
+            return 1;
+        }
+
+        CollectionMeta meta;
+        if (!write_collection(opt, &meta)) return -1;
+        printf("collection   : %s\n", args_collection.c_str());
+        printf("dimension    : %u\n", meta.dimension);
+        if (!args_pca.empty()) printf("reduced by   : %s\n", args_pca.c_str());
+        printf("metric       : %s\n", metric_name(meta.metric));
+        if (meta.tile) printf("tile         : %u vectors\n", meta.tile);
+        printf("encoding     : %s\n", encoding_name(meta.encoding));
+        printf("num vectors  : %lu\n", meta.num_vectors);
+        printf("vector/page  : %u\n", meta.vectors_per_page);
+        printf("num. of page : %lu\n", meta.num_pages);
+        printf("num. cluster : %zu\n", meta.clusters.size());
+        if (meta.replicated())
+            printf("replication  : %.2f copies per vector (+%.1f%% space)\n",
+                   (double)meta.num_copies() / meta.num_vectors,
+                   100.0 * (meta.num_copies() - meta.num_vectors) / meta.num_vectors);
+    } else {
+        VecsInfo in;
+        if (!vecs_probe(args_input.c_str(), &in)) return -1;
+
+        VecsFormat format;
+        if (!(args_output_format.empty()
+                  ? vecs_format_from_filename(args_output, &format)
+                  : parse_vecs_format(args_output_format, &format))) {
+            std::cerr << "Error: unknown output format\n";
+            return 1;
+        }
+        ElemType type = format == VecsFormat::npy ? in.elem_type
+                                                   : vecs_default_elem_type(format);
+        if (!args_output_type.empty() && !parse_elem_type(args_output_type, &type)) {
+            std::cerr << "Error: unknown element type: " << args_output_type << "\n";
+            return 1;
+        }
+
+        printf("input        : %s (%s, %zu x %zu)\n", args_input.c_str(),
+               vecs_format_name(in.format), in.num_vectors, in.dimension);
+        if (!vecs_convert(args_input.c_str(), args_output.c_str(), format, type,
+                          args_begin, args_count, chunk_size))
+            return -1;
+        VecsInfo out;
+        if (!vecs_probe(args_output.c_str(), &out)) return -1;
+        printf("output       : %s (%s, %zu x %zu)\n", args_output.c_str(),
+               vecs_format_name(out.format), out.num_vectors, out.dimension);
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    double time_taken =
+        std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+    printf("time         : %.0f ms\n", time_taken);
+    return 0;
+}
@@ -0,0 +1,235 @@
+#include <algorithm>
+#include <atomic>
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "cores.h"
+#include "vecs.h"
+
+namespace po = boost::program_options;
+
+// tools_generate writes a synthetic clustered dataset, so the whole
+// pipeline can run without downloading bigann: a mixture of gaussians with
+// - num_clusters centers drawn uniformly in [64, 192)^dim (the value range
+//   of SIFT, so the vectors also fit in bvecs),
+// - a standard deviation per cluster, spread * U(0.5, 1.5),
+// - zipf cluster weights, the cluster of rank r weighs 1 / (r + 1)^skew
+//   (skew 0: equal sizes), the ranks shuffled over the cluster ids.
+// It writes the base and the query vectors (bvecs, fvecs or npy, from the
+// extension), the cluster of every base vector (ivecs, one id per vector,
+// what write_collection takes as --clusters) and the centers (fvecs, the
+// --centroids of the router). It is written a chunk at a time, and depends
+// on the seed only, not on the number of threads or the chunk size:
+//     ./tools_generate -n 10000000 -d 128 -k 10000 --skew 0.5
+//         --base synth10m_base.bvecs --queries synth10m_query.fvecs
+//         --assignment synth10m_clusters.ivecs --centroids synth10m_centroids.fvecs
+
+// vectors generated from the same random stream
+const size_t GENERATE_BLOCK = 4096;
+
+struct Mixture {
+    size_t dim;
+    std::vector<float> centers;  // num_clusters * dim
+    std::vector<float> stddev;
+    std::vector<double> weights;
+};
+
+static Mixture make_mixture(size_t dim, size_t num_clusters, double spread,
+                            double skew, uint64_t seed) {
+    Mixture m;
+    m.dim = dim;
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<float> center(64.0f, 192.0f);
+    std::uniform_real_distribution<double> scale(0.5, 1.5);
+    m.centers.resize(num_clusters * dim);
+    for (auto &v : m.centers) v = center(rng);
+    m.stddev.resize(num_clusters);
+    for (auto &s : m.stddev) s = spread * scale(rng);
+    std::vector<size_t> rank(num_clusters);
+    std::iota(rank.begin(), rank.end(), 0);
+    std::shuffle(rank.begin(), rank.end(), rng);
+    m.weights.resize(num_clusters);
+    for (size_t c = 0; c < num_clusters; c++)
+        m.weights[c] = 1.0 / std::pow(rank[c] + 1.0, skew);
+    return m;
+}
+
+// generate fills vectors [first, first + n) of the stream, first a multiple
+// of GENERATE_BLOCK, with num_thread threads; every block has its own
+// random stream, seeded by (seed, block).
+static void generate(const Mixture &m, uint64_t seed, size_t first, size_t n,
+                     size_t num_thread, float *vectors, int32_t *clusters) {
+    size_t num_blocks = (n + GENERATE_BLOCK - 1) / GENERATE_BLOCK;
+    std::atomic<size_t> next{0};
+    auto worker = [&]() {
+        std::discrete_distribution<int32_t> pick(m.weights.begin(), m.weights.end());
+        std::normal_distribution<float> noise(0.0f, 1.0f);
+        for (size_t b = next++; b < num_blocks; b = next++) {
+            std::seed_seq seq{seed, (uint64_t)(first / GENERATE_BLOCK + b)};
+            std::mt19937_64 rng(seq);
+            noise.reset();
+            size_t end = std::min(n, (b + 1) * GENERATE_BLOCK);
+            for (size_t i = b * GENERATE_BLOCK; i < end; i++) {
+                int32_t c = pick(rng);
+                const float *center = m.centers.data() + (size_t)c * m.dim;
+                float *v = vectors + i * m.dim;
+                for (size_t j = 0; j < m.dim; j++)
+                    v[j] = center[j] + m.stddev[c] * noise(rng);
+                clusters[i] = c;
+            }
+        }
+    };
+    std::vector<std::thread *> workers;
+    for (size_t t = 0; t < num_thread; t++) workers.push_back(new std::thread(worker));
+    for (auto t : workers) {
+        t->join();
+        delete t;
+    }
+}
+
+// write_set generates count vectors of the stream into the files (the
+// assignment one is optional), chunk_vectors at a time. Generating the next
+// chunk and writing the current one are overlapped.
+static bool write_set(const Mixture &m, uint64_t seed, size_t count,
+                      size_t chunk_vectors, size_t num_thread,
+                      const std::string &vectors_filename,
+                      const std::string &clusters_filename) {
+    VecsWriter vectors, clusters;
+    if (!vectors.open(vectors_filename.c_str(), m.dim, count)) return false;
+    if (!clusters_filename.empty() &&
+        !clusters.open(clusters_filename.c_str(), 1, count, ElemType::i32))
+        return false;
+
+    chunk_vectors = std::max<size_t>(GENERATE_BLOCK, chunk_vectors / GENERATE_BLOCK *
+                                                         GENERATE_BLOCK);
+    size_t num_chunks = (count + chunk_vectors - 1) / chunk_vectors;
+    size_t vector_bytes = chunk_vectors * m.dim * sizeof(float);
+    auto chunk_vecs = [&](size_t i) {
+        return std::min(chunk_vectors, count - i * chunk_vectors);
+    };
+    bool ok = pipeline_chunks(
+        num_chunks, vector_bytes + chunk_vectors * sizeof(int32_t),
+        [&](size_t i, char *buf) {
+            generate(m, seed, i * chunk_vectors, chunk_vecs(i), num_thread,
+                     (float *)buf, (int32_t *)(buf + vector_bytes));
+            return true;
+        },
+        [&](size_t i, char *buf) {
+            size_t first = i * chunk_vectors, n = chunk_vecs(i);
+            return vectors.write_float(first, n, (const float *)buf) &&
+                   (clusters_filename.empty() ||
+                    clusters.write_int(first, n, (const int32_t *)(buf + vector_bytes)));
+        });
+    if (!ok) std::cerr << "failed to write " << vectors_filename << std::endl;
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    size_t args_num = 1000000;
+    size_t args_dim = 128;
+    size_t args_num_clusters = 1000;
+    size_t args_num_query = 10000;
+    double args_skew = 0.0;
+    double args_spread = 16.0;
+    uint64_t args_seed = 42;
+    uint32_t args_num_thread = 0;
+    uint32_t args_chunk_mb = 64;
+    std::string args_base;
+    std::string args_queries;
+    std::string args_assignment;
+    std::string args_query_assignment;
+    std::string args_centroids;
+
+    {
+        po::options_description desc("Available arguments");
+        desc.add_options()("help,h", "print usage message");
+        desc.add_options()("num,n", po::value<size_t>(&args_num),
+                           "number of base vectors (default: 1M)");
+        desc.add_options()("dim,d", po::value<size_t>(&args_dim),
+                           "dimension (default: 128)");
+        desc.add_options()("num_clusters,k", po::value<size_t>(&args_num_clusters),
+                           "number of gaussians (default: 1000)");
+        desc.add_options()("skew", po::value<double>(&args_skew),
+                           "zipf exponent of the cluster sizes, 0 for equal "
+                           "sizes (default: 0)");
+        desc.add_options()("spread", po::value<double>(&args_spread),
+                           "mean standard deviation of a cluster, the centers "
+                           "span [64, 192) (default: 16)");
+        desc.add_options()("num_query", po::value<size_t>(&args_num_query),
+                           "number of queries (default: 10000)");
+        desc.add_options()("seed", po::value<uint64_t>(&args_seed),
+                           "random seed (default: 42)");
+        desc.add_options()("num_thread,t", po::value<uint32_t>(&args_num_thread),
+                           "generating threads (default: one per core)");
+        desc.add_options()("chunk_size", po::value<uint32_t>(&args_chunk_mb),
+                           "vectors generated per chunk in mb (default: 64MB)");
+        desc.add_options()("base,b", po::value<std::string>(&args_base)->required(),
+                           "base vectors (bvecs, fvecs or npy)");
+        desc.add_options()("queries,q", po::value<std::string>(&args_queries),
+                           "query vectors, drawn from the same mixture");
+        desc.add_options()("assignment,a", po::value<std::string>(&args_assignment),
+                           "cluster of every base vector (ivecs or npy)");
+        desc.add_options()("query_assignment",
+                           po::value<std::string>(&args_query_assignment),
+                           "cluster of every query (ivecs or npy)");
+        desc.add_options()("centroids,c", po::value<std::string>(&args_centroids),
+                           "the centers of the clusters (fvecs or npy)");
+        po::variables_map vm;
+        try {
+            po::store(po::parse_command_line(argc, argv, desc), vm);
+            if (vm.count("help")) {
+                std::cout << desc << "\n";
+                return 0;
+            }
+            po::notify(vm);
+        } catch (std::exception &e) {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+        if (args_dim == 0 || args_num_clusters == 0 || args_skew < 0 ||
+            args_spread < 0) {
+            std::cerr << "Error: the dimension and the number of clusters must "
+                         "be positive, the skew and the spread not negative\n";
+            return 1;
+        }
+        if (args_num_thread == 0) args_num_thread = cores();
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    Mixture mixture =
+        make_mixture(args_dim, args_num_clusters, args_spread, args_skew, args_seed);
+    size_t chunk_vectors = ((size_t)args_chunk_mb << 20) / (args_dim * sizeof(float));
+
+    printf("base         : %s (%zu x %zu)\n", args_base.c_str(), args_num, args_dim);
+    printf("clusters     : %zu, skew %.2f, spread %.2f\n", args_num_clusters,
+           args_skew, args_spread);
+    if (!write_set(mixture, args_seed + 1, args_num, chunk_vectors,
+                   args_num_thread, args_base, args_assignment))
+        return -1;
+    if (!args_queries.empty()) {
+        printf("queries      : %s (%zu)\n", args_queries.c_str(), args_num_query);
+        if (!write_set(mixture, args_seed + 2, args_num_query, chunk_vectors,
+                       args_num_thread, args_queries, args_query_assignment))
+            return -1;
+    }
+    if (!args_centroids.empty()) {
+        VecsWriter centroids;
+        if (!centroids.open(args_centroids.c_str(), args_dim, args_num_clusters) ||
+            !centroids.write_float(0, args_num_clusters, mixture.centers.data())) {
+            std::cerr << "failed to write " << args_centroids << std::endl;
+            return -1;
+        }
+        printf("centroids    : %s\n", args_centroids.c_str());
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    printf("time         : %.3f s\n",
+           std::chrono::duration<double>(end - start).count());
+    return 0;
+}
@@ -1,39 +1,34 @@
 #include <iostream>
-#include <fstream>
 #include <cstdlib>
 
+#include "vecs.h"
+
 int main(int argc, char **argv) {
     if (argc != 4) {
-        std::cout << "usage: " << argv[0] << "input_bvecs output_smaller_bvecs N" << std::endl; 
-        std::cout << "   where N is the prefix size, the first N vectors." << std::endl; 
+        std::cout << "usage: " << argv[0] << "input_bvecs output_smaller_bvecs N" << std::endl;
+        std::cout << "   where N is the prefix size, the first N vectors." << std::endl;
         exit(-1);
     }
 
-    std::ifstream reader(argv[1], std::ios::binary | std::ios::ate);
-    size_t fsize = reader.tellg();
-    reader.seekg(0, std::ios::beg);
+    VecsInfo info;
+    if (!vecs_probe(argv[1], &info)) {
+        return -1;
+    }
+    std::cout << ">> Dataset (" << argv[1] <<"): #vector = " << info.num_vectors << ", #dims = " << info.dimension << std::endl;
 
-    uint32_t ndims_u32;
-    reader.read((char *)&ndims_u32, sizeof(uint32_t));
-    reader.seekg(0, std::ios::beg);
-    size_t ndims = (size_t) ndims_u32;
-    size_t nvecs = fsize / ((ndims + 4) * sizeof(uint8_t));
-    std::cout << ">> Dataset (" << argv[1] <<"): #vector = " << nvecs << ", #dims = " << ndims << std::endl;
-    
-    size_t nvecs_prefix = atoi(argv[3]);
+    size_t nvecs_prefix = strtoull(argv[3], nullptr, 10);
     std::cout << ">> Getting the first N=" << nvecs_prefix << " vectors ..." << std::endl;
 
     if (nvecs_prefix == 0) {
         return 0;
     }
 
-    std::ofstream writer(argv[2], std::ios::binary);
-    auto read_buf = new uint8_t[nvecs_prefix * (ndims + 4)];
-    reader.read((char*) read_buf, nvecs_prefix * (sizeof(uint32_t) + ndims * sizeof(uint8_t)));
-    writer.write((char*) read_buf, nvecs_prefix * (4 + ndims * 1));
-
-    reader.close();
-    writer.close();
+    // same format in and out, so the prefix is copied by the kernel
+    // (copy_file_range) without going through our memory
+    if (!vecs_convert(argv[1], argv[2], info.format, info.elem_type, 0,
+                      nvecs_prefix, 64 << 20)) {
+        return -1;
+    }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,199 @@
+#include <algorithm>
+#include <atomic>
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "latency.h"
+#include "protocol.h"
+#include "vecs.h"
+
+namespace po = boost::program_options;
+
+// tools_query_client load-tests a running sedann_server: it sends the
+// queries of a file over several connections, in requests of --batch
+// queries with up to --pipeline requests in flight per connection, and
+// reports the throughput and the request latency.
+//   ./tools_query_client -s unix:/tmp/sedann.sock -q sift_query.fvecs
+//       --connections 8 --batch 4 --results results.ivecs
+int main(int argc, char **argv) {
+    std::string args_server = "unix:/tmp/sedann.sock";
+    std::string args_queries;
+    std::string args_results;
+    uint32_t args_num_query = 0;
+    uint32_t args_batch = 1;
+    uint32_t args_connections = 4;
+    uint32_t args_pipeline = 1;
+    uint32_t args_k = 10;
+    uint32_t args_nprobe = 8;
+
+    {
+        po::options_description desc("Available arguments");
+        desc.add_options()("help,h", "print usage message");
+        desc.add_options()("server,s", po::value<std::string>(&args_server),
+                           "unix:<path> or a localhost tcp port "
+                           "(default: unix:/tmp/sedann.sock)");
+        desc.add_options()("queries,q",
+                           po::value<std::string>(&args_queries)->required(),
+                           "query vectors (bvecs, fvecs or npy)");
+        desc.add_options()("num_query", po::value<uint32_t>(&args_num_query),
+                           "only send the first queries (default: all)");
+        desc.add_options()("batch", po::value<uint32_t>(&args_batch),
+                           "queries per request (default: 1)");
+        desc.add_options()("connections", po::value<uint32_t>(&args_connections),
+                           "concurrent connections (default: 4)");
+        desc.add_options()("pipeline", po::value<uint32_t>(&args_pipeline),
+                           "requests in flight per connection (default: 1)");
+        desc.add_options()("k,k", po::value<uint32_t>(&args_k),
+                           "number of nearest neighbors (default: 10)");
+        desc.add_options()("nprobe,n", po::value<uint32_t>(&args_nprobe),
+                           "clusters probed per query (default: 8)");
+        desc.add_options()("results", po::value<std::string>(&args_results),
+                           "write the top-k ids of every query (ivecs)");
+        po::variables_map vm;
+        try {
+            po::store(po::parse_command_line(argc, argv, desc), vm);
+            if (vm.count("help")) {
+                std::cout << desc << "\n";
+                return 0;
+            }
+            po::notify(vm);
+        } catch (std::exception &e) {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+        args_batch = std::max(1u, std::min(args_batch, QUERY_MAX_BATCH));
+        args_connections = std::max(1u, args_connections);
+        args_pipeline = std::max(1u, args_pipeline);
+    }
+
+    VecsReader reader;
+    if (!reader.open(args_queries.c_str())) {
+        return -1;
+    }
+    size_t dim = reader.info.dimension;
+    size_t nq = reader.info.num_vectors;
+    if (args_num_query > 0 && args_num_query < nq) nq = args_num_query;
+    std::vector<float> queries(nq * dim);
+    if (!reader.read_float(0, nq, queries.data())) {
+        std::cerr << "failed to read the queries from: " << args_queries
+                  << std::endl;
+        return -1;
+    }
+
+    size_t num_requests = (nq + args_batch - 1) / args_batch;
+    std::vector<uint32_t> result_ids(nq * args_k);
+    LatencyRecorder latency;
+    std::atomic<bool> failed{false};
+
+    // connection c sends the requests c, c + connections, ...
+    auto connection_run = [&](uint32_t c) {
+        StageHistograms *h = latency.thread_histograms();
+        int fd = connect_socket(args_server);
+        if (fd < 0) {
+            failed = true;
+            return;
+        }
+        std::unordered_map<uint64_t, std::chrono::steady_clock::time_point> sent;
+        std::vector<char> payload;
+        size_t next = c;
+        while (next < num_requests || !sent.empty()) {
+            // keep the pipeline full
+            while (next < num_requests && sent.size() < args_pipeline) {
+                size_t first = next * args_batch;
+                QueryRequestHeader rh;
+                rh.num_queries = std::min<size_t>(args_batch, nq - first);
+                rh.dimension = dim;
+                rh.k = args_k;
+                rh.nprobe = args_nprobe;
+                rh.request_id = next;
+                sent[next] = std::chrono::steady_clock::now();
+                if (!send_all(fd, &rh, sizeof(rh)) ||
+                    !send_all(fd, queries.data() + first * dim,
+                              request_payload_size(rh))) {
+                    failed = true;
+                    close(fd);
+                    return;
+                }
+                next += args_connections;
+            }
+
+            QueryResponseHeader response;
+            if (!recv_all(fd, &response, sizeof(response)) ||
+                response.magic != QUERY_RESPONSE_MAGIC ||
+                sent.count(response.request_id) == 0) {
+                std::cerr << "connection-" << c << " : bad response" << std::endl;
+                failed = true;
+                break;
+            }
+            payload.resize(response_payload_size(response));
+            if (!recv_all(fd, payload.data(), payload.size())) {
+                failed = true;
+                break;
+            }
+            h->record(Stage::total, elapsed_ns(sent[response.request_id],
+                                               std::chrono::steady_clock::now()));
+            sent.erase(response.request_id);
+            if (response.status != query_ok) {
+                std::cerr << "connection-" << c << " : request "
+                          << response.request_id << " failed with status "
+                          << response.status << std::endl;
+                failed = true;
+                continue;
+            }
+            memcpy(result_ids.data() + response.request_id * args_batch * args_k,
+                   payload.data(),
+                   (size_t)response.num_queries * args_k * sizeof(uint32_t));
+        }
+        close(fd);
+    };
+
+    std::vector<std::thread *> workers;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (uint32_t c = 0; c < args_connections; c++) {
+        workers.push_back(new std::thread(connection_run, c));
+    }
+    for (auto t : workers) {
+        (*t).join();
+        delete t;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    if (failed) {
+        return -1;
+    }
+
+    double time_taken =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+            .count();
+    printf("num queries  : %zu in %zu requests of %u\n", nq, num_requests,
+           args_batch);
+    printf("connections  : %u, %u requests in flight each\n", args_connections,
+           args_pipeline);
+    std::cout << "\nresults " << std::endl;
+    std::cout << " > time              : " << std::fixed << time_taken * 1e-6
+              << "  ms " << std::endl;
+    std::cout << " > query throughput  : " << nq / (time_taken * 1e-9)
+              << "  query/s " << std::endl;
+    std::cout << " > request latency   : " << std::endl;
+    latency.print();
+
+    if (!args_results.empty()) {
+        FILE *f = fopen(args_results.c_str(), "w");
+        if (!f) {
+            std::cerr << "failed to open result file: " << args_results
+                      << std::endl;
+            return -1;
+        }
+        int32_t k = args_k;
+        for (size_t q = 0; q < nq; q++) {
+            fwrite(&k, sizeof(int32_t), 1, f);
+            fwrite(result_ids.data() + q * args_k, sizeof(uint32_t), args_k, f);
+        }
+        fclose(f);
+    }
+
+    return 0;
+}
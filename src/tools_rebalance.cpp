@@ -0,0 +1,505 @@
+#include <algorithm>
+#include <atomic>
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "collection.h"
+#include "cores.h"
+#include "kernels.h"
+#include "vecs.h"
+
+namespace po = boost::program_options;
+
+// tools_rebalance evens out the cluster sizes of a k-means clustering (the
+// centroids and clusters files of script/cluster_dataset.py or
+// tools_generate), so that probing a cluster reads a bounded number of pages:
+// - a cluster larger than --max_pages pages is bisected with 2-means, again
+//   and again, until every part fits in the budget,
+// - a cluster filling less than --min_fill of a page is merged into the
+//   cluster of the nearest centroid that still fits in the budget once
+//   merged, the smallest clusters first; empty clusters are dropped.
+// The clusters are renumbered, the parts of a split cluster next to each
+// other, and the centroids of the split and merged clusters are set to the
+// mean of their vectors; the other centroids are kept as they are. The
+// pages are sized like the collection's (--page_size, --tile, --encoding,
+// and --page_dim for a collection reduced by a PCA projection).
+// The vectors of the oversized clusters are held in memory while they are
+// split, the base is otherwise streamed:
+//     ./tools_rebalance --data sift10m_base.bvecs --clusters clusters_10k_sift10m.ivecs
+//         --centroids centroids_10k_sift10m.fvecs -p 4 --max_pages 32
+//         --out_clusters clusters_sift10m_balanced.ivecs
+//         --out_centroids centroids_sift10m_balanced.fvecs
+
+// Lloyd iterations of a bisection
+const size_t BISECT_ITERATIONS = 10;
+
+struct RebalanceOptions {
+    size_t vectors_per_page = 0;
+    size_t max_pages = 32;
+    double min_fill = 0.5;
+    uint64_t seed = 42;
+    size_t num_thread = 1;
+    size_t chunk_size = 64 << 20;
+};
+
+// The clusters, the input ones first and the parts of the split ones after
+// them. A merged cluster points to the cluster it went into.
+struct Clusters {
+    size_t dim = 0;
+    std::vector<float> centroids;
+    std::vector<uint64_t> sizes;
+    std::vector<uint32_t> parent;
+    std::vector<char> touched;  // the centroid is recomputed
+
+    size_t size() const { return sizes.size(); }
+    float *centroid(size_t c) { return centroids.data() + c * dim; }
+    uint32_t add(const float *centroid, uint64_t size) {
+        uint32_t c = sizes.size();
+        centroids.insert(centroids.end(), centroid, centroid + dim);
+        sizes.push_back(size);
+        parent.push_back(c);
+        touched.push_back(1);
+        return c;
+    }
+    uint32_t find(uint32_t c) const {
+        while (parent[c] != c) c = parent[c];
+        return c;
+    }
+};
+
+static size_t pages_of(uint64_t size, size_t vpp) { return (size + vpp - 1) / vpp; }
+
+// for_each_chunk calls fn(first, n, vectors) over the base, n * dim floats
+// at a time, reading the next chunk while fn runs.
+template <typename Fn>
+static bool for_each_chunk(const VecsReader &base, size_t chunk_size, Fn fn) {
+    const VecsInfo &in = base.info;
+    const size_t dim = in.dimension, num_vectors = in.num_vectors;
+    VecsInfo as_float = vecs_info(VecsFormat::npy, ElemType::f32, dim, 1);
+    size_t per_chunk = std::min<size_t>(std::max<size_t>(1, num_vectors),
+                                        std::max<size_t>(1, chunk_size / in.record_size));
+    size_t num_chunks = (num_vectors + per_chunk - 1) / per_chunk;
+    auto chunk_vecs = [&](size_t i) { return std::min(per_chunk, num_vectors - i * per_chunk); };
+    std::vector<float> vectors(per_chunk * dim);
+    return pipeline_chunks(
+        num_chunks, per_chunk * in.record_size,
+        [&](size_t i, char *buf) { return base.read_raw(i * per_chunk, chunk_vecs(i), buf); },
+        [&](size_t i, char *buf) {
+            vecs_convert_records(in, buf, chunk_vecs(i), as_float, (char *)vectors.data());
+            fn(i * per_chunk, chunk_vecs(i), vectors.data());
+            return true;
+        });
+}
+
+static void mean_of(const float *vectors, const uint32_t *rows, size_t n,
+                    size_t dim, float *out) {
+    std::vector<double> sum(dim, 0.0);
+    for (size_t i = 0; i < n; i++)
+        for (size_t j = 0; j < dim; j++) sum[j] += vectors[rows[i] * dim + j];
+    for (size_t j = 0; j < dim; j++) out[j] = sum[j] / std::max<size_t>(1, n);
+}
+
+// bisect splits the rows of a cluster (vectors holds the cluster, row-major)
+// into parts of at most max_size rows. Each 2-means starts from a random row
+// and the row farthest from it; rows that 2-means cannot separate (all equal)
+// are cut in halves.
+static void bisect(const DistanceKernel &kernel, const float *vectors,
+                   size_t num_rows, size_t dim, size_t max_size,
+                   std::mt19937_64 &rng, std::vector<std::vector<uint32_t>> *parts) {
+    std::vector<std::vector<uint32_t>> pending(1);
+    pending[0].resize(num_rows);
+    std::iota(pending[0].begin(), pending[0].end(), 0);
+    std::vector<float> a(dim), b(dim);
+    std::vector<char> side;
+    while (!pending.empty()) {
+        std::vector<uint32_t> rows = std::move(pending.back());
+        pending.pop_back();
+        if (rows.size() <= max_size) {
+            parts->push_back(std::move(rows));
+            continue;
+        }
+        const size_t n = rows.size();
+        auto row = [&](size_t i) { return vectors + (size_t)rows[i] * dim; };
+        size_t first = rng() % n, farthest = first;
+        float far = -1.0f;
+        for (size_t i = 0; i < n; i++) {
+            float d = kernel.distance(row(first), row(i), dim);
+            if (d > far) far = d, farthest = i;
+        }
+        std::copy(row(first), row(first) + dim, a.begin());
+        std::copy(row(farthest), row(farthest) + dim, b.begin());
+        side.assign(n, 0);
+        size_t num_b = 0;
+        for (size_t it = 0; it < BISECT_ITERATIONS && far > 0; it++) {
+            num_b = 0;
+            for (size_t i = 0; i < n; i++) {
+                side[i] = kernel.distance(row(i), b.data(), dim) <
+                          kernel.distance(row(i), a.data(), dim);
+                num_b += side[i];
+            }
+            if (num_b == 0 || num_b == n) break;
+            std::vector<double> sum_a(dim, 0.0), sum_b(dim, 0.0);
+            for (size_t i = 0; i < n; i++) {
+                auto &sum = side[i] ? sum_b : sum_a;
+                for (size_t j = 0; j < dim; j++) sum[j] += row(i)[j];
+            }
+            for (size_t j = 0; j < dim; j++) {
+                a[j] = sum_a[j] / (n - num_b);
+                b[j] = sum_b[j] / num_b;
+            }
+        }
+        std::vector<uint32_t> rows_a, rows_b;
+        if (num_b == 0 || num_b == n) {
+            rows_a.assign(rows.begin(), rows.begin() + n / 2);
+            rows_b.assign(rows.begin() + n / 2, rows.end());
+        } else {
+            for (size_t i = 0; i < n; i++) (side[i] ? rows_b : rows_a).push_back(rows[i]);
+        }
+        pending.push_back(std::move(rows_a));
+        pending.push_back(std::move(rows_b));
+    }
+}
+
+// split_oversized replaces every cluster larger than the budget by its parts,
+// and moves the assignment of their vectors to the parts. It returns the
+// number of clusters split.
+static bool split_oversized(const VecsReader &base, const RebalanceOptions &opt,
+                            std::vector<uint32_t> &assignment, Clusters &clusters,
+                            size_t *num_split) {
+    const size_t dim = clusters.dim;
+    const size_t max_size = opt.max_pages * opt.vectors_per_page;
+    std::vector<uint32_t> oversized;
+    std::vector<int64_t> slot(clusters.size(), -1);
+    for (size_t c = 0; c < clusters.size(); c++)
+        if (clusters.sizes[c] > max_size) {
+            slot[c] = oversized.size();
+            oversized.push_back(c);
+        }
+    *num_split = oversized.size();
+    if (oversized.empty()) return true;
+
+    // gather the vectors (and ids) of the oversized clusters
+    std::vector<std::vector<float>> vectors(oversized.size());
+    std::vector<std::vector<uint32_t>> ids(oversized.size());
+    for (size_t s = 0; s < oversized.size(); s++) {
+        vectors[s].reserve(clusters.sizes[oversized[s]] * dim);
+        ids[s].reserve(clusters.sizes[oversized[s]]);
+    }
+    bool ok = for_each_chunk(base, opt.chunk_size, [&](size_t first, size_t n, const float *v) {
+        for (size_t i = 0; i < n; i++) {
+            int64_t s = slot[assignment[first + i]];
+            if (s < 0) continue;
+            vectors[s].insert(vectors[s].end(), v + i * dim, v + (i + 1) * dim);
+            ids[s].push_back(first + i);
+        }
+    });
+    if (!ok) {
+        std::cerr << "failed to read the base vectors" << std::endl;
+        return false;
+    }
+
+    // split them on all the threads, each with its own random stream
+    DistanceKernel kernel = select_kernel(Metric::l2, dim, true);
+    std::vector<std::vector<std::vector<uint32_t>>> parts(oversized.size());
+    std::atomic<size_t> next{0};
+    auto worker = [&]() {
+        for (size_t s = next++; s < oversized.size(); s = next++) {
+            std::mt19937_64 rng(opt.seed + oversized[s]);
+            bisect(kernel, vectors[s].data(), ids[s].size(), dim, max_size, rng, &parts[s]);
+        }
+    };
+    std::vector<std::thread *> workers;
+    for (size_t t = 0; t < opt.num_thread; t++) workers.push_back(new std::thread(worker));
+    for (auto t : workers) {
+        t->join();
+        delete t;
+    }
+
+    std::vector<float> centroid(dim);
+    for (size_t s = 0; s < oversized.size(); s++) {
+        clusters.sizes[oversized[s]] = 0;
+        for (auto &rows : parts[s]) {
+            mean_of(vectors[s].data(), rows.data(), rows.size(), dim, centroid.data());
+            uint32_t c = clusters.add(centroid.data(), rows.size());
+            for (uint32_t r : rows) assignment[ids[s][r]] = c;
+        }
+    }
+    return true;
+}
+
+// merge_tiny merges the clusters below the fill into their nearest neighbor
+// that stays within the budget, and returns the number of clusters merged.
+static size_t merge_tiny(const RebalanceOptions &opt, Clusters &clusters) {
+    const size_t dim = clusters.dim;
+    const size_t max_size = opt.max_pages * opt.vectors_per_page;
+    const double min_size = opt.min_fill * opt.vectors_per_page;
+    DistanceKernel kernel = select_kernel(Metric::l2, dim, true);
+    std::vector<uint32_t> tiny;
+    for (size_t c = 0; c < clusters.size(); c++)
+        if (clusters.sizes[c] > 0 && clusters.sizes[c] < min_size) tiny.push_back(c);
+    std::stable_sort(tiny.begin(), tiny.end(), [&](uint32_t a, uint32_t b) {
+        return clusters.sizes[a] < clusters.sizes[b];
+    });
+
+    size_t merged = 0;
+    for (uint32_t t : tiny) {
+        // merged into another one already, or grown past the fill
+        if (clusters.parent[t] != t || clusters.sizes[t] >= min_size) continue;
+        int64_t nearest = -1;
+        float nearest_distance = 0;
+        for (size_t c = 0; c < clusters.size(); c++) {
+            if (c == t || clusters.sizes[c] == 0 || clusters.parent[c] != c ||
+                clusters.sizes[c] + clusters.sizes[t] > max_size)
+                continue;
+            float d = kernel.distance(clusters.centroid(t), clusters.centroid(c), dim);
+            if (nearest < 0 || d < nearest_distance) nearest = c, nearest_distance = d;
+        }
+        if (nearest < 0) continue;
+        // the size-weighted mean, until the final pass sets the exact one
+        double wt = clusters.sizes[t], wc = clusters.sizes[nearest];
+        float *to = clusters.centroid(nearest);
+        const float *from = clusters.centroid(t);
+        for (size_t j = 0; j < dim; j++) to[j] = (to[j] * wc + from[j] * wt) / (wc + wt);
+        clusters.sizes[nearest] += clusters.sizes[t];
+        clusters.sizes[t] = 0;
+        clusters.parent[t] = nearest;
+        clusters.touched[nearest] = 1;
+        merged++;
+    }
+    return merged;
+}
+
+struct SizeStats {
+    size_t num_clusters = 0;
+    size_t max_pages = 0;
+    size_t total_pages = 0;
+    double pages_per_probe = 0;  // mean pages of the cluster of a vector
+};
+
+static SizeStats size_stats(const std::vector<uint64_t> &sizes, size_t vpp) {
+    SizeStats s;
+    uint64_t num_vectors = 0;
+    for (uint64_t size : sizes) {
+        if (size == 0) continue;
+        size_t pages = pages_of(size, vpp);
+        s.num_clusters++;
+        s.max_pages = std::max(s.max_pages, pages);
+        s.total_pages += pages;
+        s.pages_per_probe += (double)size * pages;
+        num_vectors += size;
+    }
+    s.pages_per_probe /= std::max<uint64_t>(1, num_vectors);
+    return s;
+}
+
+int main(int argc, char **argv) {
+    std::string args_data;
+    std::string args_clusters;
+    std::string args_centroids;
+    std::string args_out_clusters;
+    std::string args_out_centroids;
+    uint32_t args_page_size_kb = 4;
+    uint32_t args_tile = 0;
+    std::string args_encoding = "f32";
+    Encoding encoding = Encoding::f32;
+    uint32_t args_page_dim = 0;
+    uint32_t args_num_thread = 0;
+    uint32_t args_chunk_mb = 64;
+    RebalanceOptions opt;
+
+    {
+        po::options_description desc("Available arguments");
+        desc.add_options()("help,h", "print usage message");
+        desc.add_options()("data", po::value<std::string>(&args_data)->required(),
+                           "base vectors (bvecs, fvecs or npy)");
+        desc.add_options()("clusters", po::value<std::string>(&args_clusters)->required(),
+                           "cluster of every base vector (ivecs or npy)");
+        desc.add_options()("centroids", po::value<std::string>(&args_centroids)->required(),
+                           "the centroids of the clusters (fvecs or npy)");
+        desc.add_options()("out_clusters",
+                           po::value<std::string>(&args_out_clusters)->required(),
+                           "output: the rebalanced cluster of every base vector");
+        desc.add_options()("out_centroids",
+                           po::value<std::string>(&args_out_centroids)->required(),
+                           "output: the rebalanced centroids");
+        desc.add_options()("page_size,p", po::value<uint32_t>(&args_page_size_kb),
+                           "page size of the collection in kb (default: 4)");
+        desc.add_options()("tile", po::value<uint32_t>(&args_tile),
+                           "tile of the collection, 0, 8 or 16 (default: 0)");
+        desc.add_options()("encoding", po::value<std::string>(&args_encoding),
+                           "element encoding of the collection, f32, f16 or "
+                           "bf16 (default: f32)");
+        desc.add_options()("page_dim", po::value<uint32_t>(&args_page_dim),
+                           "dimension of the vectors in the pages, the "
+                           "reduced one of a PCA collection (default: the "
+                           "base's)");
+        desc.add_options()("max_pages", po::value<size_t>(&opt.max_pages),
+                           "page budget of a cluster, larger ones are split "
+                           "(default: 32)");
+        desc.add_options()("min_fill", po::value<double>(&opt.min_fill),
+                           "clusters filling less of a page are merged into "
+                           "their nearest neighbor (default: 0.5)");
+        desc.add_options()("seed", po::value<uint64_t>(&opt.seed),
+                           "random seed of the splits (default: 42)");
+        desc.add_options()("num_thread,t", po::value<uint32_t>(&args_num_thread),
+                           "splitting threads (default: one per core)");
+        desc.add_options()("chunk_size", po::value<uint32_t>(&args_chunk_mb),
+                           "base vectors read per chunk in mb (default: 64MB)");
+        po::variables_map vm;
+        try {
+            po::store(po::parse_command_line(argc, argv, desc), vm);
+            if (vm.count("help")) {
+                std::cout << desc << "\n";
+                return 0;
+            }
+            po::notify(vm);
+        } catch (std::exception &e) {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+        if (opt.max_pages == 0 || opt.min_fill < 0 || !valid_tile(args_tile)) {
+            std::cerr << "Error: the page budget must be positive, the fill not "
+                         "negative and the tile 0, 8 or 16\n";
+            return 1;
+        }
+        if (!parse_encoding(args_encoding, &encoding)) {
+            std::cerr << "Error: unknown encoding " << args_encoding << "\n";
+            return 1;
+        }
+        opt.num_thread = args_num_thread ? args_num_thread : cores();
+        opt.chunk_size = (size_t)std::max<uint32_t>(1, args_chunk_mb) << 20;
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    VecsReader base, assignment_reader, centroids_reader;
+    if (!base.open(args_data.c_str()) || !assignment_reader.open(args_clusters.c_str()) ||
+        !centroids_reader.open(args_centroids.c_str()))
+        return -1;
+    const size_t dim = base.info.dimension;
+    const size_t num_vectors = base.info.num_vectors;
+    const size_t page_dim = args_page_dim ? args_page_dim : dim;
+    opt.vectors_per_page = collection_vectors_per_page(args_page_size_kb * 1024,
+                                                       page_dim, args_tile, encoding);
+    if (opt.vectors_per_page == 0) {
+        std::cerr << "page size " << args_page_size_kb << "kb is too small for dimension "
+                  << page_dim << std::endl;
+        return -1;
+    }
+
+    Clusters clusters;
+    clusters.dim = dim;
+    size_t num_input_clusters = centroids_reader.info.num_vectors;
+    clusters.centroids.resize(num_input_clusters * dim);
+    if (centroids_reader.info.dimension != dim ||
+        !centroids_reader.read_float(0, num_input_clusters, clusters.centroids.data())) {
+        std::cerr << "failed to read the centroids, or their dimension is not " << dim
+                  << ": " << args_centroids << std::endl;
+        return -1;
+    }
+    clusters.sizes.assign(num_input_clusters, 0);
+    clusters.parent.resize(num_input_clusters);
+    std::iota(clusters.parent.begin(), clusters.parent.end(), 0);
+    clusters.touched.assign(num_input_clusters, 0);
+
+    // the assignment, checked against the centroids
+    const VecsInfo &ai = assignment_reader.info;
+    if (ai.num_vectors != num_vectors || ai.dimension < 1 || ai.elem_type == ElemType::u8 ||
+        ai.elem_type == ElemType::f32) {
+        std::cerr << "cluster file must have one integer id per base vector: "
+                  << args_clusters << std::endl;
+        return -1;
+    }
+    std::vector<uint32_t> assignment(num_vectors);
+    {
+        std::vector<char> records(num_vectors * ai.record_size);
+        if (!assignment_reader.read_raw(0, num_vectors, records.data())) {
+            std::cerr << "failed to read " << args_clusters << std::endl;
+            return -1;
+        }
+        for (size_t v = 0; v < num_vectors; v++) {
+            double id = load_elem(ai.elem_type, records.data() + v * ai.record_size +
+                                                    ai.prefix_size);
+            if (id < 0 || id >= num_input_clusters) {
+                std::cerr << "vector " << v << " is in cluster " << id << ", there are "
+                          << num_input_clusters << " centroids" << std::endl;
+                return -1;
+            }
+            assignment[v] = id;
+            clusters.sizes[assignment[v]]++;
+        }
+    }
+    SizeStats before = size_stats(clusters.sizes, opt.vectors_per_page);
+
+    size_t num_split = 0;
+    if (!split_oversized(base, opt, assignment, clusters, &num_split)) return -1;
+    size_t num_parts = clusters.size() - num_input_clusters;
+    size_t num_merged = merge_tiny(opt, clusters);
+
+    // renumber the remaining clusters, then set the centroids of the split and
+    // merged ones to the mean of their vectors
+    std::vector<int64_t> new_id(clusters.size(), -1);
+    std::vector<uint32_t> old_of;
+    for (size_t c = 0; c < clusters.size(); c++)
+        if (clusters.parent[c] == c && clusters.sizes[c] > 0) {
+            new_id[c] = old_of.size();
+            old_of.push_back(c);
+        }
+    for (size_t v = 0; v < num_vectors; v++)
+        assignment[v] = new_id[clusters.find(assignment[v])];
+    const size_t num_output = old_of.size();
+    std::vector<double> sums(num_output * dim, 0.0);
+    bool ok = for_each_chunk(base, opt.chunk_size, [&](size_t first, size_t n, const float *v) {
+        for (size_t i = 0; i < n; i++) {
+            uint32_t c = assignment[first + i];
+            if (!clusters.touched[old_of[c]]) continue;
+            double *sum = sums.data() + c * dim;
+            for (size_t j = 0; j < dim; j++) sum[j] += v[i * dim + j];
+        }
+    });
+    if (!ok) {
+        std::cerr << "failed to read the base vectors" << std::endl;
+        return -1;
+    }
+    std::vector<float> centroids(num_output * dim);
+    std::vector<uint64_t> sizes(num_output);
+    for (size_t c = 0; c < num_output; c++) {
+        uint32_t old = old_of[c];
+        sizes[c] = clusters.sizes[old];
+        for (size_t j = 0; j < dim; j++)
+            centroids[c * dim + j] = clusters.touched[old]
+                                         ? sums[c * dim + j] / sizes[c]
+                                         : clusters.centroid(old)[j];
+    }
+    SizeStats after = size_stats(sizes, opt.vectors_per_page);
+
+    VecsWriter clusters_writer, centroids_writer;
+    if (!clusters_writer.open(args_out_clusters.c_str(), 1, num_vectors, ElemType::i32) ||
+        !clusters_writer.write_int(0, num_vectors, (const int32_t *)assignment.data())) {
+        std::cerr << "failed to write " << args_out_clusters << std::endl;
+        return -1;
+    }
+    if (!centroids_writer.open(args_out_centroids.c_str(), dim, num_output) ||
+        !centroids_writer.write_float(0, num_output, centroids.data())) {
+        std::cerr << "failed to write " << args_out_centroids << std::endl;
+        return -1;
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    printf("vectors/page : %zu, budget %zu pages per cluster\n", opt.vectors_per_page,
+           opt.max_pages);
+    printf("split        : %zu clusters into %zu\n", num_split, num_parts);
+    printf("merged       : %zu clusters\n", num_merged);
+    printf("clusters     : %zu -> %zu\n", before.num_clusters, after.num_clusters);
+    printf("max pages    : %zu -> %zu\n", before.max_pages, after.max_pages);
+    printf("pages/probe  : %.2f -> %.2f (mean pages of the cluster of a vector)\n",
+           before.pages_per_probe, after.pages_per_probe);
+    printf("total pages  : %zu -> %zu\n", before.total_pages, after.total_pages);
+    printf("time         : %.3f s\n", std::chrono::duration<double>(end - start).count());
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include <algorithm>
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "cores.h"
+#include "pca.h"
+#include "vecs.h"
+
+namespace po = boost::program_options;
+
+// tools_train_pca trains the PCA projection of a reduced collection (see
+// pca.h) on an evenly spaced sample of the base: the top --dimension
+// principal components, written as a vector file of one component per row
+// next to the centroids. write_collection (--pca) pages the projected
+// vectors and keeps the full ones aside to re-rank the candidates:
+//     ./tools_train_pca --data gist_base.fvecs --dimension 128 --sample 100000
+//         -o pca_128_gist.fvecs
+
+int main(int argc, char **argv) {
+    std::string args_data;
+    std::string args_output;
+    size_t args_dimension = 0;
+    size_t args_sample = 100000;
+    size_t args_iterations = 30;
+    uint32_t args_num_thread = 0;
+
+    {
+        po::options_description desc("Available arguments");
+        desc.add_options()("help,h", "print usage message");
+        desc.add_options()("data", po::value<std::string>(&args_data)->required(),
+                           "base vectors (bvecs, fvecs or npy)");
+        desc.add_options()("output,o", po::value<std::string>(&args_output)->required(),
+                           "output: the components, one per row (fvecs or npy)");
+        desc.add_options()("dimension,d", po::value<size_t>(&args_dimension)->required(),
+                           "dimension of the projected vectors");
+        desc.add_options()("sample", po::value<size_t>(&args_sample),
+                           "base vectors sampled to train on (default: 100000)");
+        desc.add_options()("iterations", po::value<size_t>(&args_iterations),
+                           "subspace iterations (default: 30)");
+        desc.add_options()("num_thread,t", po::value<uint32_t>(&args_num_thread),
+                           "training threads (default: one per core)");
+        po::variables_map vm;
+        try {
+            po::store(po::parse_command_line(argc, argv, desc), vm);
+            if (vm.count("help")) {
+                std::cout << desc << "\n";
+                return 0;
+            }
+            po::notify(vm);
+        } catch (std::exception &e) {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+        if (args_dimension == 0 || args_sample == 0) {
+            std::cerr << "Error: the dimension and the sample must be positive\n";
+            return 1;
+        }
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    VecsReader base;
+    if (!base.open(args_data.c_str())) return -1;
+    const size_t dim = base.info.dimension, num_vectors = base.info.num_vectors;
+    if (args_dimension > dim) {
+        std::cerr << "Error: the base vectors have " << dim << " dimensions, "
+                  << "fewer than " << args_dimension << std::endl;
+        return 1;
+    }
+
+    // every (num_vectors / sample)-th vector
+    size_t n = std::min(args_sample, num_vectors);
+    std::vector<float> sample(n * dim);
+    for (size_t i = 0; i < n; i++) {
+        if (!base.read_float(i * num_vectors / n, 1, sample.data() + i * dim)) {
+            std::cerr << "failed to read the sample of " << args_data << std::endl;
+            return -1;
+        }
+    }
+    auto sampled = std::chrono::high_resolution_clock::now();
+
+    PcaProjection pca;
+    pca.train(sample.data(), n, dim, args_dimension, args_iterations,
+              args_num_thread ? args_num_thread : cores());
+    if (!pca.save(args_output)) {
+        std::cerr << "failed to write " << args_output << std::endl;
+        return -1;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    printf("base         : %s (%zu x %zu)\n", args_data.c_str(), num_vectors, dim);
+    printf("sample       : %zu vectors\n", n);
+    printf("projection   : %zu -> %zu dimensions\n", dim, pca.output_dim);
+    printf("variance     : %.2f%% of the sample kept\n", 100.0 * pca.explained_variance);
+    printf("page space   : %.1fx the vectors per page\n", (double)dim / pca.output_dim);
+    printf("time         : %.3f s (sample %.3f s)\n",
+           std::chrono::duration<double>(end - start).count(),
+           std::chrono::duration<double>(sampled - start).count());
+    return 0;
+}